@@ -29,4 +29,12 @@
  */
 typedef protocol_binary_request_no_extras protocol_binary_request_get_keys;
 
+/**
+ * Set in the 32 bit flags a CMD_GET_KEYS response carries as its extras
+ * when the page filled up before the requested number of keys was
+ * reached. The client continues from the last key of the page. Responses
+ * that aren't truncated carry no extras.
+ */
+#define GET_KEYS_PAGE_TRUNCATED 0x01
+
 #endif /* EP_ENGINE_COMMAND_IDS_H */
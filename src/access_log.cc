@@ -0,0 +1,351 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "access_log.h"
+extern "C" {
+#include "crc32.h"
+}
+
+/* magic, version, block size, reserved */
+static const size_t HEADER_SIZE = 4 + 4 + 4 + 4;
+/* vbucket, nru, number of keys, offset, length */
+static const size_t INDEX_ENTRY_SIZE = 2 + 1 + 4 + 8 + 8;
+/* index offset, number of sections, index crc32, magic */
+static const size_t TRAILER_SIZE = 8 + 4 + 4 + 4;
+/* length and crc32 of the payload */
+static const size_t BLOCK_HEADER_SIZE = 4 + 4;
+
+static const size_t MIN_BLOCK_SIZE = 512;
+/* the lengths in an entry are single bytes */
+static const size_t MAX_KEY_LENGTH = 255;
+
+static void putUint16(std::string &buf, uint16_t val) {
+    val = htons(val);
+    buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+static void putUint32(std::string &buf, uint32_t val) {
+    val = htonl(val);
+    buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+static void putUint64(std::string &buf, uint64_t val) {
+    val = htonll(val);
+    buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+static uint16_t getUint16(const uint8_t *p) {
+    uint16_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohs(val);
+}
+
+static uint32_t getUint32(const uint8_t *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohl(val);
+}
+
+static uint64_t getUint64(const uint8_t *p) {
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohll(val);
+}
+
+AccessLogWriter::AccessLogWriter(const std::string &p, size_t bs) :
+    path(p), blockSize(std::max(bs, MIN_BLOCK_SIZE)), file(NULL), offset(0),
+    failed(false), numKeys(0) {
+}
+
+AccessLogWriter::~AccessLogWriter() {
+    if (file != NULL) {
+        fclose(file);
+    }
+}
+
+void AccessLogWriter::open() {
+    file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        return;
+    }
+    std::string header;
+    putUint32(header, ACCESS_LOG_MAGIC);
+    putUint32(header, ACCESS_LOG_VERSION);
+    putUint32(header, static_cast<uint32_t>(blockSize));
+    putUint32(header, 0);
+    write(header.data(), header.size());
+}
+
+void AccessLogWriter::addVBucket(uint16_t vbid, uint8_t nru,
+                                 std::vector<std::string> &keys) {
+    // std::string compares bytes as unsigned and then the lengths, the
+    // order couchstore keeps the by-id tree in
+    std::sort(keys.begin(), keys.end());
+
+    AccessLogSection section;
+    section.vbid = vbid;
+    section.nru = nru;
+    section.numKeys = 0;
+    section.offset = offset;
+    block.clear();
+    lastKey.clear();
+
+    std::vector<std::string>::iterator it = keys.begin();
+    for (; it != keys.end(); ++it) {
+        const std::string &key = *it;
+        if (key.length() > MAX_KEY_LENGTH ||
+            (it != keys.begin() && key == *(it - 1))) {
+            continue;
+        }
+
+        size_t shared = 0;
+        size_t limit = std::min(key.length(), lastKey.length());
+        while (shared < limit && key[shared] == lastKey[shared]) {
+            ++shared;
+        }
+        if (!block.empty() &&
+            block.size() + 2 + key.length() - shared > blockSize) {
+            flushBlock();
+            shared = 0;
+        }
+
+        block.push_back(static_cast<char>(shared));
+        block.push_back(static_cast<char>(key.length() - shared));
+        block.append(key, shared, std::string::npos);
+        lastKey = key;
+        ++section.numKeys;
+    }
+    flushBlock();
+
+    section.length = offset - section.offset;
+    sections.push_back(section);
+    numKeys += section.numKeys;
+}
+
+void AccessLogWriter::flushBlock() {
+    if (!block.empty()) {
+        std::string header;
+        putUint32(header, static_cast<uint32_t>(block.size()));
+        putUint32(header, crc32buf(reinterpret_cast<uint8_t *>(&block[0]),
+                                   block.size()));
+        write(header.data(), header.size());
+        write(block.data(), block.size());
+    }
+    block.clear();
+    lastKey.clear();
+}
+
+void AccessLogWriter::write(const void *data, size_t size) {
+    if (file == NULL || failed) {
+        return;
+    }
+    if (fwrite(data, size, 1, file) != 1) {
+        failed = true;
+    }
+    offset += size;
+}
+
+bool AccessLogWriter::commit() {
+    if (file == NULL) {
+        return false;
+    }
+
+    uint64_t indexOffset = offset;
+    std::string index;
+    std::vector<AccessLogSection>::iterator it = sections.begin();
+    for (; it != sections.end(); ++it) {
+        putUint16(index, it->vbid);
+        index.push_back(static_cast<char>(it->nru));
+        putUint32(index, it->numKeys);
+        putUint64(index, it->offset);
+        putUint64(index, it->length);
+    }
+    write(index.data(), index.size());
+
+    std::string trailer;
+    putUint64(trailer, indexOffset);
+    putUint32(trailer, static_cast<uint32_t>(sections.size()));
+    putUint32(trailer, index.empty() ? 0 :
+              crc32buf(reinterpret_cast<uint8_t *>(&index[0]), index.size()));
+    putUint32(trailer, ACCESS_LOG_MAGIC);
+    write(trailer.data(), trailer.size());
+
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        failed = true;
+    }
+    if (fclose(file) != 0) {
+        failed = true;
+    }
+    file = NULL;
+    return !failed;
+}
+
+AccessLogReader::AccessLogReader(const std::string &p) :
+    path(p), addr(NULL), size(0) {
+}
+
+AccessLogReader::~AccessLogReader() {
+    if (addr != NULL) {
+        munmap(addr, size);
+    }
+}
+
+bool AccessLogReader::isAccessLog(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    uint8_t buf[8];
+    bool rv = fread(buf, sizeof(buf), 1, fp) == 1 &&
+              getUint32(buf) == ACCESS_LOG_MAGIC &&
+              getUint32(buf + 4) == ACCESS_LOG_VERSION;
+    fclose(fp);
+    return rv;
+}
+
+bool AccessLogReader::open() {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        static_cast<size_t>(st.st_size) < HEADER_SIZE + TRAILER_SIZE) {
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        size = 0;
+        return false;
+    }
+    addr = static_cast<uint8_t *>(p);
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    const uint8_t *trailer = addr + size - TRAILER_SIZE;
+    uint64_t indexOffset = getUint64(trailer);
+    uint32_t numSections = getUint32(trailer + 8);
+    uint32_t indexCrc = getUint32(trailer + 12);
+    size_t indexEnd = size - TRAILER_SIZE;
+    bool sound = getUint32(addr) == ACCESS_LOG_MAGIC &&
+                 getUint32(addr + 4) == ACCESS_LOG_VERSION &&
+                 getUint32(trailer + 16) == ACCESS_LOG_MAGIC &&
+                 indexOffset >= HEADER_SIZE && indexOffset <= indexEnd &&
+                 indexEnd - indexOffset ==
+                     static_cast<uint64_t>(numSections) * INDEX_ENTRY_SIZE;
+    if (sound && numSections > 0) {
+        sound = crc32buf(addr + indexOffset, indexEnd - indexOffset) ==
+                indexCrc;
+    }
+
+    for (uint32_t i = 0; sound && i < numSections; ++i) {
+        const uint8_t *entry = addr + indexOffset + i * INDEX_ENTRY_SIZE;
+        AccessLogSection section;
+        section.vbid = getUint16(entry);
+        section.nru = entry[2];
+        section.numKeys = getUint32(entry + 3);
+        section.offset = getUint64(entry + 7);
+        section.length = getUint64(entry + 15);
+        if (section.offset < HEADER_SIZE || section.offset > indexOffset ||
+            section.length > indexOffset - section.offset) {
+            sound = false;
+        } else {
+            sections.push_back(section);
+        }
+    }
+
+    if (!sound) {
+        sections.clear();
+        munmap(addr, size);
+        addr = NULL;
+        size = 0;
+    }
+    return sound;
+}
+
+const AccessLogSection *AccessLogReader::getSection(uint16_t vbid,
+                                                    uint8_t nru) const {
+    std::vector<AccessLogSection>::const_iterator it = sections.begin();
+    for (; it != sections.end(); ++it) {
+        if (it->vbid == vbid && it->nru == nru) {
+            return &(*it);
+        }
+    }
+    return NULL;
+}
+
+AccessLogReader::Cursor::Cursor(const AccessLogReader &reader,
+                                const AccessLogSection &section) :
+    pos(reader.addr + section.offset), end(pos + section.length),
+    blockEnd(pos), corrupt(false) {
+}
+
+bool AccessLogReader::Cursor::next(std::string &key) {
+    if (corrupt || (pos == blockEnd && !nextBlock())) {
+        return false;
+    }
+    if (blockEnd - pos < 2) {
+        corrupt = true;
+        return false;
+    }
+    size_t shared = pos[0];
+    size_t rest = pos[1];
+    pos += 2;
+    if (shared > current.length() ||
+        static_cast<size_t>(blockEnd - pos) < rest) {
+        corrupt = true;
+        return false;
+    }
+    current.resize(shared);
+    current.append(reinterpret_cast<const char *>(pos), rest);
+    pos += rest;
+    key.assign(current);
+    return true;
+}
+
+bool AccessLogReader::Cursor::nextBlock() {
+    if (pos == end) {
+        return false;
+    }
+    if (static_cast<size_t>(end - pos) < BLOCK_HEADER_SIZE) {
+        corrupt = true;
+        return false;
+    }
+    uint32_t length = getUint32(pos);
+    uint32_t crc = getUint32(pos + 4);
+    pos += BLOCK_HEADER_SIZE;
+    if (length == 0 || static_cast<size_t>(end - pos) < length ||
+        crc32buf(const_cast<uint8_t *>(pos), length) != crc) {
+        corrupt = true;
+        return false;
+    }
+    blockEnd = pos + length;
+    current.clear();
+    return true;
+}
@@ -0,0 +1,185 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_ACCESS_LOG_H_
+#define SRC_ACCESS_LOG_H_ 1
+
+#include "config.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+const uint32_t ACCESS_LOG_MAGIC(0x414c4f47);  // ALOG
+const uint32_t ACCESS_LOG_VERSION(2);
+
+/**
+ * Where the keys of a vbucket are in a v2 access log. A vbucket has a
+ * section per NRU value its resident keys had when the log was written.
+ */
+struct AccessLogSection {
+    uint16_t vbid;
+    uint8_t nru;
+    uint32_t numKeys;
+    uint64_t offset;
+    uint64_t length;
+};
+
+/**
+ * The v2 access log: the resident keys of the vbuckets of a shard, in
+ * sections of their own per vbucket and NRU value, each sorted in the order
+ * of the by-id tree of the vbucket so that warmup reads the data file front
+ * to back. Warmup loads the sections of the hottest keys first.
+ *
+ * The file is a header, the sections, an index of the sections and a
+ * trailer pointing at the index. A section is a run of blocks, each a
+ * length, the crc32 of its payload and the payload: the keys, each stored
+ * as the length of the prefix it shares with the key before it in the
+ * block and the rest of the key. The first key of a block shares nothing,
+ * so that every block can be checked and decoded on its own.
+ *
+ * (v1 access logs are MutationLogs of ML_NEW entries, read back through
+ * MutationLogHarvester.)
+ */
+class AccessLogWriter {
+public:
+    AccessLogWriter(const std::string &path, size_t blockSize);
+
+    ~AccessLogWriter();
+
+    void open();
+
+    bool isOpen() const {
+        return file != NULL;
+    }
+
+    /**
+     * Write a section of a vbucket.
+     *
+     * @param nru the NRU value of the keys
+     * @param keys the resident keys of the vbucket with that NRU value,
+     *             sorted in place
+     */
+    void addVBucket(uint16_t vbid, uint8_t nru,
+                    std::vector<std::string> &keys);
+
+    /**
+     * Write the index and close the file.
+     *
+     * @return false if any write failed, the file is then unusable
+     */
+    bool commit();
+
+    size_t getNumKeys() const {
+        return numKeys;
+    }
+
+private:
+    void write(const void *data, size_t size);
+    void flushBlock();
+
+    const std::string path;
+    const size_t blockSize;
+    FILE *file;
+    uint64_t offset;
+    bool failed;
+    size_t numKeys;
+    std::string block;
+    std::string lastKey;
+    std::vector<AccessLogSection> sections;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLogWriter);
+};
+
+/**
+ * Reads a v2 access log mapped in. The sections can be read by several
+ * threads at once, each through a Cursor of its own.
+ */
+class AccessLogReader {
+public:
+    /**
+     * Iterates over the keys of a section. Every block is checked against
+     * its crc32 before any of its keys is returned.
+     */
+    class Cursor {
+    public:
+        Cursor(const AccessLogReader &reader,
+               const AccessLogSection &section);
+
+        /**
+         * Read the next key.
+         *
+         * @return false at the end of the section or at a damaged block
+         */
+        bool next(std::string &key);
+
+        bool isCorrupt() const {
+            return corrupt;
+        }
+
+    private:
+        bool nextBlock();
+
+        const uint8_t *pos;
+        const uint8_t *end;
+        const uint8_t *blockEnd;
+        std::string current;
+        bool corrupt;
+    };
+
+    AccessLogReader(const std::string &path);
+
+    ~AccessLogReader();
+
+    /**
+     * Map the file in and read its index.
+     *
+     * @return false if the file can't be read or is not a sound v2 log
+     */
+    bool open();
+
+    /**
+     * Check whether a file starts like a v2 access log.
+     */
+    static bool isAccessLog(const std::string &path);
+
+    const std::vector<AccessLogSection> &getSections() const {
+        return sections;
+    }
+
+    /**
+     * Get the section of the keys of a vbucket with the given NRU value,
+     * NULL if the log has none.
+     */
+    const AccessLogSection *getSection(uint16_t vbid, uint8_t nru) const;
+
+    const std::string &getPath() const {
+        return path;
+    }
+
+private:
+    const std::string path;
+    uint8_t *addr;
+    size_t size;
+    std::vector<AccessLogSection> sections;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLogReader);
+};
+
+#endif  // SRC_ACCESS_LOG_H_
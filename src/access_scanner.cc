@@ -17,11 +17,14 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <vector>
 
+#include "access_log.h"
 #include "access_scanner.h"
 #include "ep_engine.h"
-#include "mutation_log.h"
 
 class ItemAccessVisitor : public VBucketVisitor {
 public:
@@ -38,7 +41,7 @@ public:
         prev = name + ".old";
         next = name + ".next";
 
-        log = new MutationLog(next, conf.getAlogBlockSize());
+        log = new AccessLogWriter(next, conf.getAlogBlockSize());
         cb_assert(log != NULL);
         log->open();
         if (!log->isOpen()) {
@@ -55,8 +58,9 @@ public:
                 LOG(EXTENSION_LOG_INFO,
                 "INFO: Skipping expired/deleted item: %s",v->getKey().c_str());
             } else {
-                log->newItem(currentBucket->getId(), v->getKey(),
-                             v->getBySeqno());
+                uint8_t nru = std::min(v->getNRUValue(),
+                                       static_cast<uint8_t>(MAX_NRU_VALUE));
+                keys[nru].push_back(v->getKey());
             }
         }
     }
@@ -66,6 +70,7 @@ public:
             return false;
         }
 
+        addSection();
         return VBucketVisitor::visitBucket(vb);
     }
 
@@ -77,15 +82,22 @@ public:
         }
 
         if (log != NULL) {
-            size_t num_items = log->itemsLogged[ML_NEW];
-            log->commit1();
-            log->commit2();
+            addSection();
+            bool committed = log->commit();
+            size_t num_items = log->getNumKeys();
             delete log;
             log = NULL;
             ++stats.alogRuns;
             stats.alogRuntime.store(ep_real_time() - startTime);
             stats.alogNumItems.store(num_items);
 
+            if (!committed) {
+                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to write access "
+                    "log: %s", next.c_str());
+                remove(next.c_str());
+                return;
+            }
+
             if (num_items == 0) {
                 LOG(EXTENSION_LOG_INFO, "The new access log is empty. "
                     "Delete it without replacing the current access log...\n");
@@ -113,6 +125,20 @@ public:
     }
 
 private:
+    /* The keys of a vbucket are written out once they are all known, in a
+       section per NRU value, the hottest first */
+    void addSection() {
+        if (currentBucket) {
+            for (uint8_t nru = 0; nru <= MAX_NRU_VALUE; ++nru) {
+                if (!keys[nru].empty()) {
+                    log->addVBucket(currentBucket->getId(), nru, keys[nru]);
+                    keys[nru].clear();
+                }
+            }
+            currentBucket.reset();
+        }
+    }
+
     EventuallyPersistentStore &store;
     EPStats &stats;
     rel_time_t startTime;
@@ -121,7 +147,8 @@ private:
     std::string name;
     uint16_t shardID;
 
-    MutationLog *log;
+    AccessLogWriter *log;
+    std::vector<std::string> keys[MAX_NRU_VALUE + 1];
     bool *stateFinalizer;
     AccessScanner *as;
 };
@@ -0,0 +1,96 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+
+#include "bgfetch_scheduler.h"
+#include "configuration.h"
+#include "locks.h"
+
+const double BgFetchScheduler::retryInterval = 0.001;
+
+/* what a read adds to the virtual time of a class of weight 1 */
+static const uint64_t VTIME_PER_READ = 1 << 16;
+
+BgFetchScheduler::BgFetchScheduler(EPStats &st, Configuration &config) :
+    stats(st), lastVtime(0) {
+    weights[BG_FETCH_FRONTEND] = config.getBgFetchWeightFrontend();
+    weights[BG_FETCH_GET_META] = config.getBgFetchWeightGetMeta();
+    weights[BG_FETCH_BACKFILL] = config.getBgFetchWeightBackfill();
+    weights[BG_FETCH_STATS] = config.getBgFetchWeightStats();
+    deadlines[BG_FETCH_FRONTEND] = config.getBgFetchDeadlineFrontend();
+    deadlines[BG_FETCH_GET_META] = config.getBgFetchDeadlineGetMeta();
+    deadlines[BG_FETCH_BACKFILL] = config.getBgFetchDeadlineBackfill();
+    deadlines[BG_FETCH_STATS] = config.getBgFetchDeadlineStats();
+    for (int i = 0; i < BG_FETCH_NUM_CLASSES; ++i) {
+        weights[i] = std::max(weights[i], static_cast<size_t>(1));
+        // the deadlines are configured in msec
+        deadlines[i] *= 1000000;
+        vtimes[i] = 0;
+    }
+}
+
+void BgFetchScheduler::enqueue(bg_fetch_class_t cls) {
+    LockHolder lh(mutex);
+    if (stats.bgClassWaiting[cls].load() == 0) {
+        // A class doesn't save up the share it didn't use while it had
+        // nothing to read
+        vtimes[cls] = std::max(vtimes[cls], lastVtime);
+    }
+    ++stats.bgClassWaiting[cls];
+}
+
+void BgFetchScheduler::dequeue(bg_fetch_class_t cls) {
+    --stats.bgClassWaiting[cls];
+}
+
+bool BgFetchScheduler::admit(bg_fetch_class_t cls, hrtime_t queued) {
+    hrtime_t now = gethrtime();
+    LockHolder lh(mutex);
+    if (now > queued && now - queued >= deadlines[cls]) {
+        ++stats.bgClassOverdue[cls];
+    } else {
+        for (int i = 0; i < BG_FETCH_NUM_CLASSES; ++i) {
+            if (i != cls && stats.bgClassWaiting[i].load() > 0 &&
+                vtimes[i] < vtimes[cls]) {
+                ++stats.bgClassDeferred[cls];
+                return false;
+            }
+        }
+    }
+    lastVtime = vtimes[cls];
+    vtimes[cls] += VTIME_PER_READ / weights[cls];
+    --stats.bgClassWaiting[cls];
+    return true;
+}
+
+const char *BgFetchScheduler::getClassName(bg_fetch_class_t cls) {
+    switch (cls) {
+    case BG_FETCH_FRONTEND:
+        return "frontend";
+    case BG_FETCH_GET_META:
+        return "get_meta";
+    case BG_FETCH_BACKFILL:
+        return "backfill";
+    case BG_FETCH_STATS:
+        return "stats";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,77 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_BGFETCH_SCHEDULER_H_
+#define SRC_BGFETCH_SCHEDULER_H_ 1
+
+#include "config.h"
+
+#include "common.h"
+#include "mutex.h"
+#include "stats.h"
+
+class Configuration;
+
+/**
+ * Weighted fair admission of the background reads of the different
+ * classes to the disk. A read asks for admission when it is about to go to
+ * the store, and gets it unless another class with reads waiting has had
+ * less than its share of the reads by the class weights. A read that has
+ * waited past the deadline of its class gets in regardless. A read held
+ * back asks again retryInterval seconds later.
+ */
+class BgFetchScheduler {
+public:
+    static const double retryInterval;
+
+    BgFetchScheduler(EPStats &st, Configuration &config);
+
+    /**
+     * A read of the class got queued.
+     */
+    void enqueue(bg_fetch_class_t cls);
+
+    /**
+     * A queued read of the class was dropped, or another read served it.
+     */
+    void dequeue(bg_fetch_class_t cls);
+
+    /**
+     * Let a read of the class go to disk now, and charge it to its class.
+     *
+     * @param cls the class of the read
+     * @param queued when the read got queued
+     * @return false if the read has to wait for the other classes
+     */
+    bool admit(bg_fetch_class_t cls, hrtime_t queued);
+
+    static const char *getClassName(bg_fetch_class_t cls);
+
+private:
+    EPStats &stats;
+    Mutex mutex;
+    size_t weights[BG_FETCH_NUM_CLASSES];
+    hrtime_t deadlines[BG_FETCH_NUM_CLASSES];
+    /* the reads charged to every class, scaled down by its weight */
+    uint64_t vtimes[BG_FETCH_NUM_CLASSES];
+    /* the virtual time of the last read let through */
+    uint64_t lastVtime;
+
+    DISALLOW_COPY_AND_ASSIGN(BgFetchScheduler);
+};
+
+#endif  // SRC_BGFETCH_SCHEDULER_H_
@@ -26,7 +26,6 @@
 #include "executorthread.h"
 
 const double BgFetcher::sleepInterval = MIN_SLEEP_TIME;
-
 void BgFetcher::start() {
     bool inverse = false;
     pendingFetch.compare_exchange_strong(inverse, true);
@@ -54,14 +53,33 @@ void BgFetcher::notifyBGEvent(void) {
     }
 }
 
-size_t BgFetcher::doFetch(uint16_t vbId) {
+size_t BgFetcher::doFetch(vb_bgfetch_plan_t &plan) {
     hrtime_t startTime(gethrtime());
-    LOG(EXTENSION_LOG_DEBUG, "BgFetcher is fetching data, vBucket = %d "
-        "numDocs = %d, startTime = %lld\n", vbId, items2fetch.size(),
+    size_t numKeys = 0;
+    vb_bgfetch_plan_t::iterator it = plan.begin();
+    for (; it != plan.end(); ++it) {
+        numKeys += it->second.size();
+    }
+    LOG(EXTENSION_LOG_DEBUG, "BgFetcher is fetching data, numVBuckets = %d "
+        "numDocs = %d, startTime = %lld\n", plan.size(), numKeys,
         startTime/1000000);
 
-    shard->getROUnderlying()->getMulti(vbId, items2fetch);
+    // The keys of all the pending vbuckets of the shard go down together,
+    // so the store can overlap the reads of the different files
+    kvstore->getMultiVBuckets(plan);
+    stats.bgFetchBatchHisto.add((gethrtime() - startTime) / 1000);
+    stats.bgFetchBatchSizeHisto.add(numKeys);
+
+    size_t totalfetches = 0;
+    for (it = plan.begin(); it != plan.end(); ++it) {
+        totalfetches += completeFetches(it->first, it->second, startTime);
+    }
+    return totalfetches;
+}
 
+size_t BgFetcher::completeFetches(uint16_t vbId,
+                                  vb_bgfetch_queue_t &items2fetch,
+                                  hrtime_t startTime) {
     size_t totalfetches = 0;
     std::vector<bgfetched_item_t> fetchedItems;
     vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
@@ -71,7 +89,7 @@ size_t BgFetcher::doFetch(uint16_t vbId) {
         std::list<VBucketBGFetchItem *>::iterator itm = requestedItems.begin();
         for(; itm != requestedItems.end(); ++itm) {
             if ((*itm)->value.getStatus() == ENGINE_TMPFAIL &&
-                (*itm)->canRetry()) {
+                (*itm)->canRetry() && !(*itm)->isPrefetch) {
                 // underlying kvstore failed to fetch requested data
                 // don't return the failed request yet. Will requeue
                 // it for retry later
@@ -82,21 +100,24 @@ size_t BgFetcher::doFetch(uint16_t vbId) {
                 continue;
             }
             fetchedItems.push_back(std::make_pair(key, *itm));
-            ++totalfetches;
+            if (!(*itm)->isPrefetch) {
+                ++totalfetches;
+            }
         }
     }
 
-    if (totalfetches > 0) {
+    if (!fetchedItems.empty()) {
         store->completeBGFetchMulti(vbId, fetchedItems, startTime);
-        stats.getMultiHisto.add((gethrtime()-startTime)/1000, totalfetches);
+        stats.getMultiHisto.add((gethrtime()-startTime)/1000,
+                                fetchedItems.size());
     }
 
     // failed requests will get requeued for retry within clearItems()
-    clearItems(vbId);
+    clearItems(vbId, items2fetch);
     return totalfetches;
 }
 
-void BgFetcher::clearItems(uint16_t vbId) {
+void BgFetcher::clearItems(uint16_t vbId, vb_bgfetch_queue_t &items2fetch) {
     vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
 
     for(; itr != items2fetch.end(); ++itr) {
@@ -109,7 +130,7 @@ void BgFetcher::clearItems(uint16_t vbId) {
         std::list<VBucketBGFetchItem *>::iterator dItr = doneItems.begin();
         for (; dItr != doneItems.end(); ++dItr) {
             if ((*dItr)->value.getStatus() != ENGINE_TMPFAIL ||
-                !(*dItr)->canRetry()) {
+                !(*dItr)->canRetry() || (*dItr)->isPrefetch) {
                 delete *dItr;
             } else {
                 RCPtr<VBucket> vb = store->getVBuckets().getBucket(vbId);
@@ -118,12 +139,112 @@ void BgFetcher::clearItems(uint16_t vbId) {
                 LOG(EXTENSION_LOG_DEBUG, "BgFetcher is re-queueing failed "
                     "request for vb = %d key = %s retry = %d\n",
                     vbId, (*itr).first.c_str(), (*dItr)->getRetryCount());
+                store->getBgFetchScheduler().enqueue((*dItr)->fetchClass);
                 vb->queueBGFetchItem((*itr).first, *dItr, this);
             }
         }
     }
 }
 
+bool BgFetcher::admitFetches(vb_bgfetch_plan_t &plan) {
+    BgFetchScheduler &scheduler = store->getBgFetchScheduler();
+    bool deferred = false;
+    vb_bgfetch_plan_t::iterator it = plan.begin();
+    while (it != plan.end()) {
+        RCPtr<VBucket> vb = shard->getBucket(it->first);
+        vb_bgfetch_queue_t &items = it->second;
+        vb_bgfetch_queue_t::iterator itr = items.begin();
+        while (itr != items.end()) {
+            std::list<VBucketBGFetchItem *> &requested = itr->second;
+            std::list<VBucketBGFetchItem *>::iterator dItr;
+
+            // The read of a key is as urgent as its most urgent request
+            bg_fetch_class_t cls = BG_FETCH_NUM_CLASSES;
+            hrtime_t queued = gethrtime();
+            for (dItr = requested.begin(); dItr != requested.end(); ++dItr) {
+                cls = std::min(cls, (*dItr)->fetchClass);
+                queued = std::min(queued, (*dItr)->initTime);
+            }
+
+            bool admitted = scheduler.admit(cls, queued);
+            if (!admitted && vb) {
+                // Put the requests back for the next run
+                for (dItr = requested.begin(); dItr != requested.end();
+                     ++dItr) {
+                    vb->queueBGFetchItem(itr->first, *dItr, this);
+                }
+                items.erase(itr++);
+                deferred = true;
+                continue;
+            }
+
+            // The other requests of the key ride along with the read
+            bool charged = !admitted;
+            for (dItr = requested.begin(); dItr != requested.end(); ++dItr) {
+                if (!charged && (*dItr)->fetchClass == cls) {
+                    charged = true;
+                } else {
+                    scheduler.dequeue((*dItr)->fetchClass);
+                }
+            }
+            ++itr;
+        }
+
+        if (items.empty()) {
+            plan.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    return deferred;
+}
+
+void BgFetcher::addPrefetches(vb_bgfetch_plan_t &plan) {
+    CoAccessTracker *tracker = store->getCoAccessTracker();
+    std::vector<vb_key_t> wanted;
+    vb_bgfetch_plan_t::iterator it = plan.begin();
+    for (; it != plan.end(); ++it) {
+        vb_bgfetch_queue_t::iterator itr = it->second.begin();
+        for (; itr != it->second.end(); ++itr) {
+            if (!itr->second.front()->metaDataOnly) {
+                tracker->getPeers(it->first, itr->first, prefetchLimit,
+                                  wanted);
+            }
+        }
+    }
+
+    std::vector<vb_key_t>::iterator pit = wanted.begin();
+    for (; pit != wanted.end(); ++pit) {
+        uint16_t vbid = pit->first;
+        const std::string &key = pit->second;
+        // Only the keys this fetcher reads, through the same store
+        if (shard->getBgFetcher(vbid) != this) {
+            continue;
+        }
+        vb_bgfetch_plan_t::iterator vit = plan.find(vbid);
+        if (vit != plan.end() && vit->second.find(key) != vit->second.end()) {
+            continue;
+        }
+        RCPtr<VBucket> vb = shard->getBucket(vbid);
+        if (!vb) {
+            continue;
+        }
+
+        int bucket_num(0);
+        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, false, false);
+        if (!v || v->isResident() || v->isTempItem()) {
+            continue;
+        }
+        lh.unlock();
+
+        plan[vbid][key].push_back(new VBucketBGFetchItem(NULL, false,
+                                                         BG_FETCH_FRONTEND,
+                                                         true));
+        ++stats.bgPrefetchIssued;
+    }
+}
+
 bool BgFetcher::run(GlobalTask *task) {
     size_t num_fetched_items = 0;
     bool inverse = true;
@@ -138,6 +259,7 @@ bool BgFetcher::run(GlobalTask *task) {
     pendingVbs.clear();
     lh.unlock();
 
+    vb_bgfetch_plan_t plan;
     std::vector<uint16_t>::iterator ita = bg_vbs.begin();
     for (; ita != bg_vbs.end(); ++ita) {
         uint16_t vbId = *ita;
@@ -152,17 +274,31 @@ bool BgFetcher::run(GlobalTask *task) {
             continue;
         }
         RCPtr<VBucket> vb = shard->getBucket(vbId);
-        if (vb && vb->getBGFetchItems(items2fetch)) {
-            num_fetched_items += doFetch(vbId);
-            items2fetch.clear();
+        if (vb && !vb->getBGFetchItems(plan[vbId])) {
+            plan.erase(vbId);
         }
     }
 
+    bool deferred = false;
+    if (!plan.empty()) {
+        deferred = admitFetches(plan);
+    }
+    if (!plan.empty() && store->getCoAccessTracker()) {
+        addPrefetches(plan);
+    }
+    if (!plan.empty()) {
+        num_fetched_items = doFetch(plan);
+    }
+
     stats.numRemainingBgJobs.fetch_sub(num_fetched_items);
 
     if (!pendingFetch.load()) {
-        // wait a bit until next fetch request arrives
+        // wait a bit until next fetch request arrives, or come back soon
+        // for the reads held back for the other classes
         double sleep = std::max(store->getBGFetchDelay(), sleepInterval);
+        if (deferred) {
+            sleep = BgFetchScheduler::retryInterval;
+        }
         task->snooze(sleep);
 
         if (pendingFetch.load()) {
@@ -178,6 +314,9 @@ bool BgFetcher::pendingJob() {
     std::vector<int> vbIds = shard->getVBuckets();
     size_t numVbuckets = vbIds.size();
     for (size_t i = 0; i < numVbuckets; ++i) {
+        if (shard->getBgFetcher(vbIds[i]) != this) {
+            continue;
+        }
         RCPtr<VBucket> vb = shard->getBucket(vbIds[i]);
         if (vb && vb->hasPendingBGFetchItems()) {
             return true;
@@ -21,9 +21,11 @@
 #include "config.h"
 
 #include <list>
+#include <map>
 #include <set>
 #include <string>
 
+#include "bgfetch_scheduler.h"
 #include "common.h"
 #include "item.h"
 #include "stats.h"
@@ -32,8 +34,11 @@ const uint16_t MAX_BGFETCH_RETRY=5;
 
 class VBucketBGFetchItem {
 public:
-    VBucketBGFetchItem(const void *c, bool meta_only) :
-        cookie(c), initTime(gethrtime()), retryCount(0), metaDataOnly(meta_only)
+    VBucketBGFetchItem(const void *c, bool meta_only,
+                       bg_fetch_class_t cls = BG_FETCH_FRONTEND,
+                       bool prefetch = false) :
+        cookie(c), initTime(gethrtime()), retryCount(0), metaDataOnly(meta_only),
+        fetchClass(cls), isPrefetch(prefetch)
     { }
     ~VBucketBGFetchItem() {}
 
@@ -56,14 +61,20 @@ public:
     hrtime_t initTime;
     uint16_t retryCount;
     bool metaDataOnly;
+    bg_fetch_class_t fetchClass;
+    /* a read ahead of a key read together with a fetched one, not queued */
+    bool isPrefetch;
 };
 
 typedef unordered_map<std::string, std::list<VBucketBGFetchItem *> > vb_bgfetch_queue_t;
 typedef std::pair<std::string, VBucketBGFetchItem *> bgfetched_item_t;
+/* the fetches of a batch, by vbucket in vbucket id (file) order */
+typedef std::map<uint16_t, vb_bgfetch_queue_t> vb_bgfetch_plan_t;
 
 // Forward declarations.
 class EventuallyPersistentStore;
 class KVShard;
+class KVStore;
 class GlobalTask;
 
 /**
@@ -77,10 +88,14 @@ public:
      * Construct a BgFetcher task.
      *
      * @param s the store
-     * @param d the dispatcher
+     * @param k the shard the vbuckets to fetch for belong to
+     * @param kv the read-only KVStore to fetch through
+     * @param prefetch the peers to read ahead for every fetched key
      */
-    BgFetcher(EventuallyPersistentStore *s, KVShard *k, EPStats &st) :
-        store(s), shard(k), taskId(0), stats(st), pendingFetch(false) {}
+    BgFetcher(EventuallyPersistentStore *s, KVShard *k, KVStore *kv,
+              EPStats &st, size_t prefetch) :
+        store(s), shard(k), kvstore(kv), taskId(0), stats(st),
+        prefetchLimit(prefetch), pendingFetch(false) {}
     ~BgFetcher() {
         LockHolder lh(queueMutex);
         if (!pendingVbs.empty()) {
@@ -97,21 +112,28 @@ public:
     bool pendingJob(void);
     void notifyBGEvent(void);
     void setTaskId(size_t newId) { taskId = newId; }
+    KVStore *getKVStore() { return kvstore; }
     void addPendingVB(uint16_t vbId) {
         LockHolder lh(queueMutex);
         pendingVbs.insert(vbId);
     }
 
 private:
-    size_t doFetch(uint16_t vbId);
-    void clearItems(uint16_t vbId);
+    size_t doFetch(vb_bgfetch_plan_t &plan);
+    size_t completeFetches(uint16_t vbId, vb_bgfetch_queue_t &items2fetch,
+                           hrtime_t startTime);
+    void clearItems(uint16_t vbId, vb_bgfetch_queue_t &items2fetch);
+    bool admitFetches(vb_bgfetch_plan_t &plan);
+    void addPrefetches(vb_bgfetch_plan_t &plan);
 
     EventuallyPersistentStore *store;
     KVShard *shard;
-    vb_bgfetch_queue_t items2fetch;
+    KVStore *kvstore;
     size_t taskId;
     Mutex queueMutex;
     EPStats &stats;
+    /* the peers read ahead for every fetched key */
+    size_t prefetchLimit;
 
     AtomicValue<bool> pendingFetch;
     std::set<uint16_t> pendingVbs;
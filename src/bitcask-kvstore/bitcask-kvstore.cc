@@ -0,0 +1,700 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <limits>
+#include <list>
+#include <sstream>
+#include <utility>
+
+#include "bgfetcher.h"
+#include "bitcask-kvstore/bitcask-kvstore.h"
+#include "common.h"
+#include "statwriter.h"
+#include "vbucket.h"
+
+class NoLookupCallback : public Callback<CacheLookup> {
+public:
+    NoLookupCallback() {}
+    ~NoLookupCallback() {}
+    void callback(CacheLookup&) {}
+};
+
+class NoRangeCallback : public Callback<SeqnoRange> {
+public:
+    NoRangeCallback() {}
+    ~NoRangeCallback() {}
+    void callback(SeqnoRange&) {}
+};
+
+static bool isMetaOnlyFetch(const std::list<VBucketBGFetchItem *> &fetches) {
+    std::list<VBucketBGFetchItem *>::const_iterator itr = fetches.begin();
+    for (; itr != fetches.end(); ++itr) {
+        if (!((*itr)->metaDataOnly)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool scanEntryPositionLess(const BitcaskScanEntry &e1,
+                                  const BitcaskScanEntry &e2)
+{
+    if (e1.entry.segment != e2.entry.segment) {
+        return e1.entry.segment < e2.entry.segment;
+    }
+    return e1.entry.offset < e2.entry.offset;
+}
+
+/**
+ * Only the read-write store of a shard merges, it gets the shard's share
+ * of the compaction bandwidth.
+ */
+static size_t compactionRateShare(Configuration &config) {
+    return config.getCompactionIoRate() / config.getMaxNumShards();
+}
+
+class BitcaskKVStore::Request {
+public:
+    Request(const Item &itm, Callback<mutation_result> *cb) :
+        mutation(itm, false), vbid(itm.getVBucketId()), setCb(cb),
+        delCb(NULL), dataSize(itm.getNBytes()), start(gethrtime()) { }
+
+    Request(const Item &itm, Callback<int> *cb) :
+        mutation(itm, true), vbid(itm.getVBucketId()), setCb(NULL),
+        delCb(cb), dataSize(0), start(gethrtime()) { }
+
+    BitcaskMutation mutation;
+    uint16_t vbid;
+    Callback<mutation_result> *setCb;
+    Callback<int> *delCb;
+    size_t dataSize;
+    hrtime_t start;
+};
+
+BitcaskKVStore::BitcaskKVStore(EPStats &stats, Configuration &config,
+                               bool read_only) :
+    KVStore(read_only), epStats(stats), configuration(config),
+    dbname(configuration.getDbname()), db(BitcaskDb::acquire(configuration)),
+    intransaction(false),
+    mergeThrottle(read_only ? 0 : compactionRateShare(configuration))
+{
+}
+
+BitcaskKVStore::~BitcaskKVStore()
+{
+    std::vector<Request *>::iterator it = pendingReqs.begin();
+    for (; it != pendingReqs.end(); ++it) {
+        delete *it;
+    }
+    BitcaskDb::release(db);
+}
+
+void BitcaskKVStore::reset(uint16_t shardId)
+{
+    cb_assert(!isReadOnly());
+    for (uint16_t vbid = 0; vbid < db->getNumVBuckets(); ++vbid) {
+        if (vbid % configuration.getMaxNumShards() != shardId) {
+            continue;
+        }
+        BitcaskVBucket &vb = db->getVBucket(vbid);
+        vbucket_state vbstate;
+        if (!vb.getState(vbstate)) {
+            continue;
+        }
+        vb.reset(true);
+        vbstate.checkpointId = 0;
+        vb.saveState(vbstate);
+    }
+}
+
+bool BitcaskKVStore::commit(Callback<kvstats_ctx> *cb)
+{
+    cb_assert(!isReadOnly());
+    if (intransaction) {
+        intransaction = commitBatch(true, cb) ? false : true;
+    }
+    return !intransaction;
+}
+
+bool BitcaskKVStore::commitNoSync(Callback<kvstats_ctx> *cb)
+{
+    cb_assert(!isReadOnly());
+    if (intransaction) {
+        intransaction = commitBatch(false, cb) ? false : true;
+    }
+    return !intransaction;
+}
+
+bool BitcaskKVStore::syncDeferred(size_t &synced, std::set<uint16_t> &failed)
+{
+    cb_assert(!isReadOnly());
+    synced = 0;
+    failed.clear();
+    std::set<uint16_t>::iterator it = unsyncedVBuckets.begin();
+    for (; it != unsyncedVBuckets.end(); ++it) {
+        if (db->getVBucket(*it).sync()) {
+            ++synced;
+        } else {
+            failed.insert(*it);
+        }
+    }
+    // The ones that failed are still not durable
+    unsyncedVBuckets = failed;
+    return failed.empty();
+}
+
+bool BitcaskKVStore::commitBatch(bool sync, Callback<kvstats_ctx> *cb)
+{
+    size_t pendingCommitCnt = pendingReqs.size();
+    if (pendingCommitCnt == 0) {
+        return true;
+    }
+
+    uint16_t vbucket2flush = pendingReqs[0]->vbid;
+    std::vector<BitcaskMutation *> batch;
+    batch.reserve(pendingCommitCnt);
+    std::vector<Request *>::iterator it = pendingReqs.begin();
+    for (; it != pendingReqs.end(); ++it) {
+        cb_assert(vbucket2flush == (*it)->vbid);
+        batch.push_back(&(*it)->mutation);
+    }
+
+    BitcaskVBucket &vb = db->getVBucket(vbucket2flush);
+    hrtime_t start = gethrtime();
+    bool written = vb.write(batch, sync);
+    st.commitHisto.add((gethrtime() - start) / 1000);
+    st.batchSize.add(pendingCommitCnt);
+    if (written) {
+        st.docsCommitted.store(pendingCommitCnt);
+        if (!sync) {
+            unsyncedVBuckets.insert(vbucket2flush);
+        }
+    } else {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: commit failed, cannot write %llu docs for vbucket = %d",
+            static_cast<unsigned long long>(pendingCommitCnt), vbucket2flush);
+        ++epStats.commitFailed;
+    }
+
+    kvstats_ctx kvctx;
+    kvctx.vbucket = vbucket2flush;
+    vb.getSpace(kvctx.fileSpaceUsed, kvctx.fileSize);
+    if (cb) {
+        cb->callback(kvctx);
+    }
+
+    for (it = pendingReqs.begin(); it != pendingReqs.end(); ++it) {
+        Request *req = *it;
+        size_t keySize = req->mutation.key.length();
+        ++epStats.io_num_write;
+        epStats.io_write_bytes.fetch_add(keySize + req->dataSize);
+
+        hrtime_t elapsed = (gethrtime() - req->start) / 1000;
+        if (req->delCb) {
+            int rv = -1;
+            if (written) {
+                rv = req->mutation.existed ? 1 : 0;
+                st.delTimeHisto.add(elapsed);
+            } else {
+                ++st.numDelFailure;
+            }
+            req->delCb->callback(rv);
+        } else {
+            if (written) {
+                st.writeTimeHisto.add(elapsed);
+                st.writeSizeHisto.add(keySize + req->dataSize);
+            } else {
+                ++st.numSetFailure;
+            }
+            mutation_result p(written ? 1 : -1, !req->mutation.existed);
+            req->setCb->callback(p);
+        }
+        delete req;
+    }
+    pendingReqs.clear();
+    return true;
+}
+
+StorageProperties BitcaskKVStore::getStorageProperties()
+{
+    StorageProperties rv(true, true, true, true);
+    return rv;
+}
+
+void BitcaskKVStore::set(const Item &itm, Callback<mutation_result> &cb)
+{
+    cb_assert(!isReadOnly());
+    cb_assert(intransaction);
+    pendingReqs.push_back(new Request(itm, &cb));
+}
+
+void BitcaskKVStore::del(const Item &itm, Callback<int> &cb)
+{
+    cb_assert(!isReadOnly());
+    cb_assert(intransaction);
+    pendingReqs.push_back(new Request(itm, &cb));
+}
+
+void BitcaskKVStore::fetch(BitcaskVBucket &vb, const std::string &key,
+                           const BitcaskSnapshot *snap, bool metaOnly,
+                           bool fetchDelete, GetValue &rv)
+{
+    BitcaskKeyDirEntry entry;
+    BitcaskSegmentPtr segment;
+    if (!vb.lookup(key, entry, segment, snap) ||
+        (entry.deleted && !metaOnly && !fetchDelete)) {
+        ++st.numGetFailure;
+        rv.setStatus(ENGINE_KEY_ENOENT);
+        return;
+    }
+
+    std::string buf;
+    BitcaskRecord rec;
+    if (!vb.read(segment, entry, buf, rec)) {
+        ++st.numGetFailure;
+        rv.setStatus(ENGINE_TMPFAIL);
+        return;
+    }
+
+    rv = GetValue(rec.toItem(buf.data(), vb.getId(), metaOnly));
+    // update ep-engine IO stats
+    ++epStats.io_num_read;
+    epStats.io_read_bytes.fetch_add(metaOnly ? rec.keyLen :
+                                    rec.keyLen + rec.valueLen);
+    st.readSizeHisto.add(rec.keyLen + rv.getValue()->getNBytes());
+}
+
+void BitcaskKVStore::get(const std::string &key, uint64_t, uint16_t vb,
+                         Callback<GetValue> &cb, bool fetchDelete)
+{
+    getWithHeader(NULL, key, vb, cb, fetchDelete);
+}
+
+void BitcaskKVStore::getWithHeader(void *dbHandle, const std::string &key,
+                                   uint16_t vb, Callback<GetValue> &cb,
+                                   bool fetchDelete)
+{
+    hrtime_t start = gethrtime();
+    RememberingCallback<GetValue> *rc =
+        dynamic_cast<RememberingCallback<GetValue> *>(&cb);
+    bool getMetaOnly = rc && rc->val.isPartial();
+    GetValue rv;
+    fetch(db->getVBucket(vb), key, static_cast<BitcaskSnapshot *>(dbHandle),
+          getMetaOnly, fetchDelete, rv);
+    st.readTimeHisto.add((gethrtime() - start) / 1000);
+    cb.callback(rv);
+}
+
+void BitcaskKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
+{
+    BitcaskVBucket &vbucket = db->getVBucket(vb);
+
+    // Read the records in the order they are laid out in the segments.
+    std::vector<BitcaskScanEntry> entries;
+    entries.reserve(itms.size());
+    vb_bgfetch_queue_t::iterator itr = itms.begin();
+    for (; itr != itms.end(); ++itr) {
+        BitcaskScanEntry se;
+        BitcaskSegmentPtr segment;
+        se.key = itr->first;
+        if (!vbucket.lookup(se.key, se.entry, segment)) {
+            se.entry.segment = std::numeric_limits<uint32_t>::max();
+            se.entry.offset = 0;
+        }
+        entries.push_back(se);
+    }
+    std::sort(entries.begin(), entries.end(), scanEntryPositionLess);
+
+    std::vector<BitcaskScanEntry>::iterator it = entries.begin();
+    for (; it != entries.end(); ++it) {
+        std::list<VBucketBGFetchItem *> &fetches = itms[it->key];
+        GetValue returnVal;
+        fetch(vbucket, it->key, NULL, isMetaOnlyFetch(fetches), false,
+              returnVal);
+        std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
+        for (; fitr != fetches.end(); ++fitr) {
+            // populate return value for remaining fetch items with the
+            // same seqid
+            (*fitr)->value = returnVal;
+            st.readTimeHisto.add((gethrtime() - (*fitr)->initTime) / 1000);
+        }
+    }
+}
+
+bool BitcaskKVStore::delVBucket(uint16_t vbucket, bool recreate)
+{
+    cb_assert(!isReadOnly());
+    BitcaskVBucket &vb = db->getVBucket(vbucket);
+    vbucket_state oldState;
+    bool existed = vb.getState(oldState);
+    vb.reset(false);
+
+    if (recreate) {
+        vbucket_state vbstate(vbucket_state_dead, 0, 0, 0);
+        if (existed) {
+            vbstate.state = oldState.state;
+        }
+        return vb.saveState(vbstate);
+    }
+    return true;
+}
+
+vbucket_map_t BitcaskKVStore::listPersistedVbuckets()
+{
+    vbucket_map_t states;
+    for (uint16_t id = 0; id < db->getNumVBuckets(); ++id) {
+        vbucket_state vb_state;
+        if (db->getVBucket(id).getState(vb_state)) {
+            states[id] = vb_state;
+            ++st.numLoadedVb;
+        }
+    }
+    return states;
+}
+
+void BitcaskKVStore::getPersistedStats(std::map<std::string,
+                                       std::string> &stats)
+{
+    loadStatsFile(dbname, stats);
+}
+
+bool BitcaskKVStore::snapshotStats(const std::map<std::string,
+                                   std::string> &stats)
+{
+    cb_assert(!isReadOnly());
+    return saveStatsFile(dbname, stats);
+}
+
+bool BitcaskKVStore::snapshotVBuckets(const vbucket_map_t &vbstates,
+                                      Callback<kvstats_ctx> *cb)
+{
+    cb_assert(!isReadOnly());
+    bool success = true;
+
+    vbucket_map_t::const_reverse_iterator iter = vbstates.rbegin();
+    for (; iter != vbstates.rend(); ++iter) {
+        uint16_t vbucketId = iter->first;
+        const vbucket_state &vbstate = iter->second;
+        BitcaskVBucket &vb = db->getVBucket(vbucketId);
+        vbucket_state current;
+        if (vb.getState(current) && current.state == vbstate.state &&
+            current.checkpointId == vbstate.checkpointId &&
+            current.failovers.compare(vbstate.failovers) == 0) {
+            continue; // no changes
+        }
+
+        success = vb.saveState(vbstate);
+        if (!success) {
+            ++st.numVbSetFailure;
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to set new state, %s, for vbucket %d\n",
+                VBucket::toString(vbstate.state), vbucketId);
+            break;
+        }
+        if (cb) {
+            kvstats_ctx kvctx;
+            kvctx.vbucket = vbucketId;
+            vb.getSpace(kvctx.fileSpaceUsed, kvctx.fileSize);
+            cb->callback(kvctx);
+        }
+    }
+    return success;
+}
+
+bool BitcaskKVStore::compactVBucket(const uint16_t vbid,
+                                    compaction_ctx *hook_ctx,
+                                    Callback<compaction_ctx> &cb,
+                                    Callback<kvstats_ctx> &kvcb)
+{
+    cb_assert(!isReadOnly());
+    hrtime_t start = gethrtime();
+    size_t startBytes = mergeThrottle.numBytes.load();
+    BitcaskVBucket &vb = db->getVBucket(vbid);
+    if (!vb.merge(hook_ctx, mergeThrottle)) {
+        return false;
+    }
+
+    // Update stats to caller
+    kvstats_ctx kvctx;
+    kvctx.vbucket = vbid;
+    vb.getSpace(kvctx.fileSpaceUsed, kvctx.fileSize);
+    kvcb.callback(kvctx);
+
+    if (hook_ctx->expiredItems.size()) {
+        cb.callback(*hook_ctx);
+    }
+
+    hrtime_t elapsed = gethrtime() - start;
+    st.compactHisto.add(elapsed / 1000);
+    if (elapsed > 0) {
+        size_t bytes = mergeThrottle.numBytes.load() - startBytes;
+        st.lastCompactRate.store(static_cast<size_t>(
+            bytes * 1000000000.0 / elapsed / 1048576));
+    }
+    return true;
+}
+
+void BitcaskKVStore::scan(uint16_t vbid, uint64_t startSeqno,
+                          uint64_t endSeqno, bool deletes, bool live,
+                          bool keysOnly, shared_ptr<Callback<GetValue> > cb,
+                          shared_ptr<Callback<CacheLookup> > cl,
+                          shared_ptr<Callback<SeqnoRange> > sr)
+{
+    BitcaskVBucket &vb = db->getVBucket(vbid);
+    uint64_t highSeqno = vb.getHighSeqno();
+    SeqnoRange range(startSeqno, highSeqno);
+    sr->callback(range);
+
+    std::vector<BitcaskScanEntry> entries;
+    BitcaskSegmentMap segments;
+    vb.collect(startSeqno, std::min(endSeqno, highSeqno), deletes, live,
+               entries, segments);
+
+    hrtime_t start = gethrtime();
+    size_t bytesRead = 0;
+    shared_ptr<BitcaskSegmentReader> reader;
+    uint32_t readerSegment = 0;
+    bool canceled = false;
+    std::vector<BitcaskScanEntry>::iterator it = entries.begin();
+    for (; !canceled && it != entries.end(); ++it) {
+        CacheLookup lookup(it->key, it->entry.seqno, vbid);
+        cl->callback(lookup);
+        if (cl->getStatus() == ENGINE_KEY_EEXISTS) {
+            continue;
+        }
+
+        if (!reader || readerSegment != it->entry.segment) {
+            if (reader) {
+                bytesRead += reader->getBytesRead();
+            }
+            reader.reset(new BitcaskSegmentReader(
+                                segments[it->entry.segment]));
+            readerSegment = it->entry.segment;
+        }
+
+        // Without the value only the start of the record is needed, which
+        // leaves nothing to check its crc against.
+        BitcaskRecord rec;
+        const char *data = reader->get(it->entry.offset,
+                                       BitcaskRecord::HEADER_SIZE);
+        bool metaOnly = keysOnly || it->entry.deleted;
+        if (data != NULL && rec.decodeHeader(data)) {
+            size_t length = metaOnly ? BitcaskRecord::HEADER_SIZE +
+                                       rec.keyLen + rec.extMetaLen :
+                                       rec.length();
+            data = reader->get(it->entry.offset, length);
+            if (data != NULL && !metaOnly && !rec.verify(data)) {
+                data = NULL;
+            }
+        } else {
+            data = NULL;
+        }
+        if (data == NULL) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to retrieve key value from bitcask "
+                "segment %d, vBucket=%d key=%s", it->entry.segment, vbid,
+                it->key.c_str());
+            ++st.numGetFailure;
+            continue;
+        }
+
+        GetValue rv(rec.toItem(data, vbid, metaOnly), ENGINE_SUCCESS, -1,
+                    keysOnly);
+        cb->callback(rv);
+        if (cb->getStatus() == ENGINE_ENOMEM) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Canceling loading database, warmup has completed\n");
+            canceled = true;
+        }
+    }
+
+    if (reader) {
+        bytesRead += reader->getBytesRead();
+    }
+    if (!canceled) {
+        hrtime_t elapsed = gethrtime() - start;
+        st.numScans++;
+        st.scanBytes.fetch_add(bytesRead);
+        if (elapsed > 0) {
+            // bytes per ns * 10^9 / 2^20 = MB/s
+            st.lastScanRate.store(static_cast<size_t>(
+                bytesRead * 1000000000.0 / elapsed / 1048576));
+        }
+    }
+}
+
+void BitcaskKVStore::dump(std::vector<uint16_t> &vbids,
+                          shared_ptr<Callback<GetValue> > cb,
+                          shared_ptr<Callback<CacheLookup> > cl)
+{
+    shared_ptr<Callback<SeqnoRange> > sr(new NoRangeCallback());
+    std::vector<uint16_t>::iterator itr = vbids.begin();
+    for (; itr != vbids.end(); ++itr) {
+        scan(*itr, 0, std::numeric_limits<uint64_t>::max(), false, true,
+             false, cb, cl, sr);
+    }
+}
+
+void BitcaskKVStore::dump(uint16_t vb, uint64_t stSeqno,
+                          shared_ptr<Callback<GetValue> > cb,
+                          shared_ptr<Callback<CacheLookup> > cl,
+                          shared_ptr<Callback<SeqnoRange> > sr)
+{
+    scan(vb, stSeqno, std::numeric_limits<uint64_t>::max(), true, true,
+         false, cb, cl, sr);
+}
+
+void BitcaskKVStore::dumpKeys(std::vector<uint16_t> &vbids,
+                              shared_ptr<Callback<GetValue> > cb)
+{
+    shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
+    shared_ptr<Callback<SeqnoRange> > sr(new NoRangeCallback());
+    std::vector<uint16_t>::iterator itr = vbids.begin();
+    for (; itr != vbids.end(); ++itr) {
+        scan(*itr, 0, std::numeric_limits<uint64_t>::max(), false, true,
+             true, cb, cl, sr);
+    }
+}
+
+void BitcaskKVStore::dumpDeleted(uint16_t vb, uint64_t stSeqno,
+                                 uint64_t enSeqno,
+                                 shared_ptr<Callback<GetValue> > cb)
+{
+    shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
+    shared_ptr<Callback<SeqnoRange> > sr(new NoRangeCallback());
+    scan(vb, stSeqno, enSeqno, true, false, true, cb, cl, sr);
+}
+
+size_t BitcaskKVStore::getEstimatedItemCount(std::vector<uint16_t> &vbs)
+{
+    size_t items = 0;
+    std::vector<uint16_t>::iterator it;
+    for (it = vbs.begin(); it != vbs.end(); ++it) {
+        items += getNumItems(*it);
+    }
+    return items;
+}
+
+size_t BitcaskKVStore::getNumPersistedDeletes(uint16_t vbid)
+{
+    return db->getVBucket(vbid).getNumDeletes();
+}
+
+size_t BitcaskKVStore::getNumItems(uint16_t vbid)
+{
+    return db->getVBucket(vbid).getNumItems();
+}
+
+size_t BitcaskKVStore::getNumItems(uint16_t vbid, uint64_t min_seq,
+                                   uint64_t max_seq)
+{
+    return db->getVBucket(vbid).countRange(min_seq, max_seq);
+}
+
+rollback_error_code BitcaskKVStore::rollback(uint16_t vbid,
+                                             uint64_t rollbackSeqno,
+                                             shared_ptr<RollbackCB> cb)
+{
+    uint64_t newSeqno = 0;
+    if (!db->getVBucket(vbid).rollback(rollbackSeqno, cb, newSeqno)) {
+        return rollback_error_code(ENGINE_ROLLBACK, 0);
+    }
+    return rollback_error_code(ENGINE_SUCCESS, newSeqno);
+}
+
+uint64_t BitcaskKVStore::getLastPersistedSeqno(uint16_t vbid)
+{
+    return db->getVBucket(vbid).getHighSeqno();
+}
+
+ENGINE_ERROR_CODE BitcaskKVStore::getAllKeys(uint16_t vbid,
+                                             std::string &start_key,
+                                             uint32_t count,
+                                             AllKeysCB *cb)
+{
+    std::vector<std::string> keys;
+    db->getVBucket(vbid).getKeys(start_key, count, keys);
+    std::vector<std::string>::iterator it = keys.begin();
+    for (; it != keys.end(); ++it) {
+        if (!cb->addtoAllKeys(it->length(),
+                              const_cast<char *>(it->data()))) {
+            break;
+        }
+    }
+    return ENGINE_SUCCESS;
+}
+
+void BitcaskKVStore::addStats(const std::string &prefix,
+                              ADD_STAT add_stat,
+                              const void *c)
+{
+    const char *prefix_str = prefix.c_str();
+
+    /* stats for both read-only and read-write threads */
+    addStat(prefix_str, "backend_type",   "bitcask",          add_stat, c);
+    addStat(prefix_str, "readTime",       st.readTimeHisto,   add_stat, c);
+    addStat(prefix_str, "readSize",       st.readSizeHisto,   add_stat, c);
+    addStat(prefix_str, "numLoadedVb",    st.numLoadedVb,     add_stat, c);
+    addStat(prefix_str, "scans",          st.numScans,        add_stat, c);
+    addStat(prefix_str, "scan_bytes",     st.scanBytes,       add_stat, c);
+    addStat(prefix_str, "scan_rate",      st.lastScanRate,    add_stat, c);
+    if (!isReadOnly()) {
+        addStat(prefix_str, "compact_bytes", mergeThrottle.numBytes,
+                add_stat, c);
+        addStat(prefix_str, "compact_rate", st.lastCompactRate, add_stat, c);
+        addStat(prefix_str, "compact_throttled", mergeThrottle.numThrottled,
+                add_stat, c);
+        addStat(prefix_str, "compact_wait_time",
+                mergeThrottle.throttleTime, add_stat, c);
+    }
+
+    // failure stats
+    addStat(prefix_str, "failure_get",    st.numGetFailure,  add_stat, c);
+
+    if (!isReadOnly()) {
+        addStat(prefix_str, "failure_set",   st.numSetFailure,   add_stat, c);
+        addStat(prefix_str, "failure_del",   st.numDelFailure,   add_stat, c);
+        addStat(prefix_str, "failure_vbset", st.numVbSetFailure, add_stat, c);
+        addStat(prefix_str, "lastCommDocs",  st.docsCommitted,   add_stat, c);
+    }
+}
+
+void BitcaskKVStore::addTimingStats(const std::string &prefix,
+                                    ADD_STAT add_stat, const void *c) {
+    if (isReadOnly()) {
+        return;
+    }
+    const char *prefix_str = prefix.c_str();
+    addStat(prefix_str, "commit",      st.commitHisto,      add_stat, c);
+    addStat(prefix_str, "compact",     st.compactHisto,     add_stat, c);
+    addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
+    addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
+    addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
+    addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+}
+
+template <typename T>
+void BitcaskKVStore::addStat(const std::string &prefix, const char *stat,
+                             T &val, ADD_STAT add_stat, const void *c)
+{
+    std::stringstream fullstat;
+    fullstat << prefix << ":" << stat;
+    add_casted_stat(fullstat.str().c_str(), val, add_stat, c);
+}
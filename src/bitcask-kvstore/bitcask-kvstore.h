@@ -0,0 +1,262 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_BITCASK_KVSTORE_BITCASK_KVSTORE_H_
+#define SRC_BITCASK_KVSTORE_BITCASK_KVSTORE_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bitcask-kvstore/bitcask-vbucket.h"
+#include "configuration.h"
+#include "couch-kvstore/couch-fs-stats.h"
+#include "histo.h"
+#include "item.h"
+#include "kvstore.h"
+#include "stats.h"
+#include "tasks.h"
+
+class BitcaskKVStoreStats {
+
+public:
+    BitcaskKVStoreStats() :
+      docsCommitted(0), numLoadedVb(0), numGetFailure(0), numSetFailure(0),
+      numDelFailure(0), numVbSetFailure(0), numScans(0), scanBytes(0),
+      lastScanRate(0), lastCompactRate(0),
+      readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
+      writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
+    }
+
+    void reset() {
+        docsCommitted.store(0);
+        numLoadedVb.store(0);
+        numGetFailure.store(0);
+        numSetFailure.store(0);
+        numDelFailure.store(0);
+        numVbSetFailure.store(0);
+        numScans.store(0);
+        scanBytes.store(0);
+        lastScanRate.store(0);
+        lastCompactRate.store(0);
+
+        readTimeHisto.reset();
+        readSizeHisto.reset();
+        writeTimeHisto.reset();
+        writeSizeHisto.reset();
+        delTimeHisto.reset();
+        compactHisto.reset();
+        commitHisto.reset();
+        batchSize.reset();
+    }
+
+    // the number of docs committed
+    AtomicValue<size_t> docsCommitted;
+    // the number of vbuckets loaded
+    AtomicValue<size_t> numLoadedVb;
+
+    //stats tracking failures
+    AtomicValue<size_t> numGetFailure;
+    AtomicValue<size_t> numSetFailure;
+    AtomicValue<size_t> numDelFailure;
+    AtomicValue<size_t> numVbSetFailure;
+
+    // full scans (warmup, backfill) completed and the bytes they read
+    AtomicValue<size_t> numScans;
+    AtomicValue<size_t> scanBytes;
+    // throughput of the last completed scan in MB/s
+    AtomicValue<size_t> lastScanRate;
+    // throughput of the last completed merge in MB/s
+    AtomicValue<size_t> lastCompactRate;
+
+    /* histograms of the same names as the couchstore ones */
+    Histogram<hrtime_t> readTimeHisto;
+    Histogram<size_t> readSizeHisto;
+    Histogram<hrtime_t> writeTimeHisto;
+    Histogram<size_t> writeSizeHisto;
+    Histogram<hrtime_t> delTimeHisto;
+    Histogram<hrtime_t> compactHisto;
+    Histogram<hrtime_t> commitHisto;
+    Histogram<size_t> batchSize;
+};
+
+/**
+ * KVStore with a log-structured layout: every vbucket is a sequence of
+ * append only segment files, and an in-memory key directory points at the
+ * latest record of every key. A flush batch is a single sequential write,
+ * a read a single positioned read.
+ *
+ * Overwritten and deleted records are reclaimed by merging the live
+ * records of a vbucket into new segments, which is what compacting the
+ * vbucket does.
+ */
+class BitcaskKVStore : public KVStore
+{
+public:
+    /**
+     * @param stats the engine stats
+     * @param config the engine configuration
+     * @param read_only true if the kvstore instance is for read operations only
+     */
+    BitcaskKVStore(EPStats &stats, Configuration &config,
+                   bool read_only = false);
+
+    ~BitcaskKVStore();
+
+    void reset(uint16_t shardId);
+
+    bool begin() {
+        cb_assert(!isReadOnly());
+        intransaction = true;
+        return intransaction;
+    }
+
+    bool commit(Callback<kvstats_ctx> *cb);
+
+    /**
+     * Write the pending batch without syncing it, the vbucket is synced by
+     * the next syncDeferred().
+     */
+    bool commitNoSync(Callback<kvstats_ctx> *cb);
+
+    bool syncDeferred(size_t &synced, std::set<uint16_t> &failed);
+
+    void rollback() {
+        cb_assert(!isReadOnly());
+        if (intransaction) {
+            intransaction = false;
+        }
+    }
+
+    StorageProperties getStorageProperties();
+
+    void set(const Item &itm, Callback<mutation_result> &cb);
+
+    void get(const std::string &key, uint64_t rowid,
+             uint16_t vb, Callback<GetValue> &cb, bool fetchDelete = false);
+
+    /**
+     * Get an item from the snapshot a rollback passes to RollbackCB.
+     */
+    void getWithHeader(void *dbHandle, const std::string &key,
+                       uint16_t vb, Callback<GetValue> &cb,
+                       bool fetchDelete = false);
+
+    /**
+     * Fetch a batch of keys, reading the records in the order they are
+     * laid out on disk.
+     */
+    void getMulti(uint16_t vb, vb_bgfetch_queue_t &itms);
+
+    void del(const Item &itm, Callback<int> &cb);
+
+    bool delVBucket(uint16_t vbucket, bool recreate);
+
+    vbucket_map_t listPersistedVbuckets(void);
+
+    void getPersistedStats(std::map<std::string, std::string> &stats);
+
+    bool snapshotStats(const std::map<std::string, std::string> &m);
+
+    bool snapshotVBuckets(const vbucket_map_t &m, Callback<kvstats_ctx> *cb);
+
+    /**
+     * Merge the segments of a vbucket.
+     */
+    bool compactVBucket(const uint16_t vbid, compaction_ctx *cookie,
+                        Callback<compaction_ctx> &cb,
+                        Callback<kvstats_ctx> &kvcb);
+
+    void dump(std::vector<uint16_t> &vbids, shared_ptr<Callback<GetValue> > cb,
+              shared_ptr<Callback<CacheLookup> > cl);
+
+    void dump(uint16_t vb, uint64_t stSeqno,
+              shared_ptr<Callback<GetValue> > cb,
+              shared_ptr<Callback<CacheLookup> > cl,
+              shared_ptr<Callback<SeqnoRange> > sr);
+
+    bool isKeyDumpSupported() {
+        return true;
+    }
+
+    void dumpKeys(std::vector<uint16_t> &vbids,
+                  shared_ptr<Callback<GetValue> > cb);
+
+    void dumpDeleted(uint16_t vb, uint64_t stSeqno, uint64_t enSeqno,
+                     shared_ptr<Callback<GetValue> > cb);
+
+    size_t getEstimatedItemCount(std::vector<uint16_t> &vbs);
+
+    size_t getNumPersistedDeletes(uint16_t vbid);
+
+    size_t getNumItems(uint16_t vbid);
+
+    size_t getNumItems(uint16_t vbid, uint64_t min_seq, uint64_t max_seq);
+
+    rollback_error_code rollback(uint16_t vbid, uint64_t rollbackseqno,
+                                 shared_ptr<RollbackCB> cb);
+
+    uint64_t getLastPersistedSeqno(uint16_t vbid);
+
+    ENGINE_ERROR_CODE getAllKeys(uint16_t vbid, std::string &start_key,
+                                 uint32_t count, AllKeysCB *cb);
+
+    void addStats(const std::string &prefix, ADD_STAT add_stat,
+                  const void *c);
+
+    void addTimingStats(const std::string &prefix, ADD_STAT add_stat,
+                        const void *c);
+
+    void resetStats() {
+        st.reset();
+    }
+
+private:
+    class Request;
+
+    bool commitBatch(bool sync, Callback<kvstats_ctx> *cb);
+    void fetch(BitcaskVBucket &vb, const std::string &key,
+               const BitcaskSnapshot *snap, bool metaOnly, bool fetchDelete,
+               GetValue &rv);
+    void scan(uint16_t vbid, uint64_t startSeqno, uint64_t endSeqno,
+              bool deletes, bool live, bool keysOnly,
+              shared_ptr<Callback<GetValue> > cb,
+              shared_ptr<Callback<CacheLookup> > cl,
+              shared_ptr<Callback<SeqnoRange> > sr);
+
+    template <typename T>
+    void addStat(const std::string &prefix, const char *nm, T &val,
+                 ADD_STAT add_stat, const void *c);
+
+    EPStats &epStats;
+    Configuration &configuration;
+    const std::string dbname;
+    BitcaskDb *db;
+    bool intransaction;
+    std::vector<Request *> pendingReqs;
+    /* vbuckets written by commitNoSync() since the last syncDeferred() */
+    std::set<uint16_t> unsyncedVBuckets;
+    IoThrottle mergeThrottle;
+    BitcaskKVStoreStats st;
+
+    DISALLOW_COPY_AND_ASSIGN(BitcaskKVStore);
+};
+
+#endif  // SRC_BITCASK_KVSTORE_BITCASK_KVSTORE_H_
@@ -0,0 +1,1304 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include <cJSON.h>
+#include <platform/dirutils.h>
+
+#include "bitcask-kvstore/bitcask-vbucket.h"
+#include "couch-kvstore/couch-fs-stats.h"
+extern "C" {
+#include "crc32.h"
+}
+#include "locks.h"
+#include "vbucket.h"
+
+using namespace CouchbaseDirectoryUtilities;
+
+/* anything larger can't be a value length, the header is garbage */
+static const uint32_t MAX_VALUE_LENGTH = 1024 * 1024 * 1024;
+
+static void putUint16(std::string &buf, uint16_t v)
+{
+    v = htons(v);
+    buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void putUint32(std::string &buf, uint32_t v)
+{
+    v = htonl(v);
+    buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void putUint64(std::string &buf, uint64_t v)
+{
+    v = htonll(v);
+    buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static uint16_t getUint16(const char *&p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return ntohs(v);
+}
+
+static uint32_t getUint32(const char *&p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return ntohl(v);
+}
+
+static uint64_t getUint64(const char *&p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return ntohll(v);
+}
+
+static uint32_t recordCrc(const char *buf, size_t length)
+{
+    return crc32buf(reinterpret_cast<uint8_t *>(const_cast<char *>(buf)) +
+                    sizeof(uint32_t), length - sizeof(uint32_t));
+}
+
+static bool preadFully(int fd, char *buf, size_t length, uint64_t offset)
+{
+    while (length > 0) {
+        ssize_t n = pread(fd, buf, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool pwriteFully(int fd, const char *buf, size_t length,
+                        uint64_t offset)
+{
+    while (length > 0) {
+        ssize_t n = pwrite(fd, buf, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        }
+        buf += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool isNumber(const std::string &s)
+{
+    if (s.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const std::string getJSONObjString(const cJSON *i)
+{
+    if (i == NULL || i->type != cJSON_String) {
+        return "";
+    }
+    return i->valuestring;
+}
+
+static bool mutationSeqnoLess(const BitcaskMutation *m1,
+                              const BitcaskMutation *m2)
+{
+    return m1->seqno < m2->seqno;
+}
+
+static bool scanEntryPositionLess(const BitcaskScanEntry &e1,
+                                  const BitcaskScanEntry &e2)
+{
+    if (e1.entry.segment != e2.entry.segment) {
+        return e1.entry.segment < e2.entry.segment;
+    }
+    return e1.entry.offset < e2.entry.offset;
+}
+
+const size_t BitcaskSegmentReader::CHUNK_SIZE;
+
+const char *BitcaskSegmentReader::get(uint64_t offset, size_t length)
+{
+    if (offset + length > segment->size) {
+        return NULL;
+    }
+    if (offset >= bufStart && offset + length <= bufStart + buf.size()) {
+        return buf.data() + (offset - bufStart);
+    }
+
+    size_t want = std::max(length, CHUNK_SIZE);
+    if (offset + want > segment->size) {
+        want = segment->size - offset;
+    }
+    buf.resize(want);
+    if (throttle) {
+        throttle->consume(want);
+    }
+    if (!preadFully(segment->fd, &buf[0], want, offset)) {
+        buf.clear();
+        return NULL;
+    }
+    bufStart = offset;
+    bytesRead += want;
+    return buf.data();
+}
+
+void BitcaskRecord::encode(const Item &itm, bool deleted, std::string &buf)
+{
+    size_t start = buf.size();
+    uint8_t extMetaLen = deleted ? 0 : itm.getExtMetaLen();
+    uint32_t valueLen = deleted ? 0 : itm.getNBytes();
+    uint32_t flags = itm.getFlags();
+
+    buf.append(sizeof(uint32_t), '\0');
+    buf.push_back(static_cast<char>(deleted ? DELETE : SET));
+    buf.push_back(static_cast<char>(extMetaLen));
+    putUint16(buf, itm.getNKey());
+    putUint32(buf, valueLen);
+    buf.append(reinterpret_cast<const char *>(&flags), sizeof(flags));
+    putUint32(buf, static_cast<uint32_t>(itm.getExptime()));
+    putUint64(buf, itm.getBySeqno());
+    putUint64(buf, itm.getRevSeqno());
+    putUint64(buf, itm.getCas());
+    buf.append(itm.getKey());
+    if (extMetaLen > 0) {
+        buf.append(itm.getExtMeta(), extMetaLen);
+    }
+    if (valueLen > 0) {
+        buf.append(itm.getData(), valueLen);
+    }
+
+    uint32_t crc = htonl(recordCrc(buf.data() + start, buf.size() - start));
+    memcpy(&buf[start], &crc, sizeof(crc));
+}
+
+void BitcaskRecord::encodeCommit(uint64_t seqno, std::string &buf)
+{
+    size_t start = buf.size();
+    buf.append(sizeof(uint32_t), '\0');
+    buf.push_back(static_cast<char>(COMMIT));
+    buf.append(HEADER_SIZE - sizeof(uint32_t) - 1 - 3 * sizeof(uint64_t),
+               '\0');
+    putUint64(buf, seqno);
+    putUint64(buf, 0);
+    putUint64(buf, 0);
+
+    uint32_t crc = htonl(recordCrc(buf.data() + start, HEADER_SIZE));
+    memcpy(&buf[start], &crc, sizeof(crc));
+}
+
+bool BitcaskRecord::decodeHeader(const char *buf)
+{
+    const char *p = buf;
+    crc = getUint32(p);
+    type = static_cast<uint8_t>(*p++);
+    extMetaLen = static_cast<uint8_t>(*p++);
+    keyLen = getUint16(p);
+    valueLen = getUint32(p);
+    memcpy(&flags, p, sizeof(flags));
+    p += sizeof(flags);
+    exptime = getUint32(p);
+    seqno = getUint64(p);
+    revSeqno = getUint64(p);
+    cas = getUint64(p);
+    cb_assert(p == buf + HEADER_SIZE);
+
+    switch (type) {
+    case SET:
+        return keyLen > 0 && valueLen <= MAX_VALUE_LENGTH;
+    case DELETE:
+        return keyLen > 0 && valueLen == 0;
+    case COMMIT:
+        return keyLen == 0 && extMetaLen == 0 && valueLen == 0;
+    }
+    return false;
+}
+
+bool BitcaskRecord::verify(const char *buf) const
+{
+    return recordCrc(buf, length()) == crc;
+}
+
+Item *BitcaskRecord::toItem(const char *buf, uint16_t vbid,
+                            bool metaOnly) const
+{
+    const char *key = buf + HEADER_SIZE;
+    uint8_t *extMeta = NULL;
+    if (extMetaLen > 0) {
+        extMeta = reinterpret_cast<uint8_t *>(const_cast<char *>(key)) +
+                  keyLen;
+    }
+
+    Item *it;
+    if (metaOnly || type == DELETE) {
+        it = new Item(key, (size_t)keyLen, 0, flags, (time_t)exptime,
+                      extMeta, extMetaLen, cas, seqno, vbid);
+        it->setRevSeqno(revSeqno);
+        if (type == DELETE) {
+            it->setDeleted();
+        }
+    } else {
+        it = new Item(key, (size_t)keyLen, flags, (time_t)exptime,
+                      key + keyLen + extMetaLen, valueLen, extMeta,
+                      extMetaLen, cas, seqno, vbid, revSeqno);
+    }
+    return it;
+}
+
+BitcaskSegment::~BitcaskSegment()
+{
+    close(fd);
+}
+
+BitcaskMutation::BitcaskMutation(const Item &itm, bool del) :
+    key(itm.getKey()), seqno(itm.getBySeqno()), deleted(del), existed(false)
+{
+    BitcaskRecord::encode(itm, del, record);
+}
+
+BitcaskVBucket::BitcaskVBucket(const std::string &d, uint16_t id,
+                               size_t segSize) :
+    dir(d), vbid(id), segmentSize(segSize), minSegmentId(0), generation(0),
+    loaded(false),
+    stateExists(false), cachedState(vbucket_state_dead, 0, 0, 0),
+    highSeqno(0), maxDeletedSeqno(0), numItems(0), numDeletes(0),
+    liveBytes(0), totalBytes(0)
+{
+    cachedState.purgeSeqno = 0;
+}
+
+void BitcaskVBucket::setDiscovered(const std::vector<uint32_t> &segmentIds,
+                                   bool hasState)
+{
+    LockHolder wl(writeMutex);
+    discoveredSegments = segmentIds;
+    std::sort(discoveredSegments.begin(), discoveredSegments.end());
+    LockHolder lh(mutex);
+    stateExists = hasState;
+}
+
+bool BitcaskVBucket::exists()
+{
+    LockHolder lh(mutex);
+    return stateExists;
+}
+
+void BitcaskVBucket::ensureLoaded()
+{
+    if (!loaded.load()) {
+        LockHolder wl(writeMutex);
+        if (!loaded.load()) {
+            load();
+            loaded.store(true);
+        }
+    }
+}
+
+void BitcaskVBucket::load()
+{
+    BitcaskSegmentMap segs;
+    std::vector<uint32_t>::iterator it = discoveredSegments.begin();
+    for (; it != discoveredSegments.end(); ++it) {
+        std::string path = segmentPath(*it);
+        int fd = open(path.c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to open bitcask "
+                "segment %s: %s, the data of vbucket %d from it on is lost",
+                path.c_str(), strerror(errno), vbid);
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        segs[*it] = BitcaskSegmentPtr(new BitcaskSegment(path, *it, fd,
+                                                         st.st_size));
+    }
+    discoveredSegments.clear();
+
+    BitcaskKeyDir kd;
+    ReplayPos pos;
+    replay(segs, std::numeric_limits<uint64_t>::max(), kd, pos);
+    if (!pos.clean) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: dropping the torn or corrupt "
+            "records of vbucket %d behind seqno %llu", vbid,
+            static_cast<unsigned long long>(pos.seqno));
+    }
+
+    vbucket_state vbstate;
+    bool haveState = readState(vbstate);
+
+    std::vector<BitcaskSegmentPtr> dropped;
+    {
+        LockHolder lh(mutex);
+        segments.swap(segs);
+        keydir.swap(kd);
+        if (!pos.clean) {
+            truncate(pos, dropped);
+        }
+        highSeqno = pos.seqno;
+        maxDeletedSeqno = pos.maxDeletedSeqno;
+        if (haveState) {
+            cachedState = vbstate;
+            maxDeletedSeqno = std::max(maxDeletedSeqno,
+                                       vbstate.maxDeletedSeqno);
+        }
+        recount();
+    }
+
+    std::vector<BitcaskSegmentPtr>::iterator dit = dropped.begin();
+    for (; dit != dropped.end(); ++dit) {
+        remove((*dit)->path.c_str());
+    }
+}
+
+void BitcaskVBucket::replay(const BitcaskSegmentMap &segs, uint64_t maxSeqno,
+                            BitcaskKeyDir &kd, ReplayPos &pos)
+{
+    // A batch is only applied once its commit record was read. The batches
+    // written by a merge span several segments.
+    std::vector<std::pair<std::string, BitcaskKeyDirEntry> > pending;
+    BitcaskSegmentMap::const_iterator it = segs.begin();
+    for (; it != segs.end(); ++it) {
+        const BitcaskSegmentPtr &seg = it->second;
+        BitcaskSegmentReader reader(seg);
+        uint64_t offset = 0;
+        while (offset < seg->size) {
+            BitcaskRecord rec;
+            const char *data = reader.get(offset, BitcaskRecord::HEADER_SIZE);
+            if (data == NULL || !rec.decodeHeader(data) ||
+                (data = reader.get(offset, rec.length())) == NULL ||
+                !rec.verify(data)) {
+                pos.clean = false;
+                return;
+            }
+
+            if (rec.type == BitcaskRecord::COMMIT) {
+                if (rec.seqno > maxSeqno) {
+                    return;
+                }
+                std::vector<std::pair<std::string,
+                                      BitcaskKeyDirEntry> >::iterator pit;
+                for (pit = pending.begin(); pit != pending.end(); ++pit) {
+                    kd[pit->first] = pit->second;
+                    if (pit->second.deleted &&
+                        pit->second.seqno > pos.maxDeletedSeqno) {
+                        pos.maxDeletedSeqno = pit->second.seqno;
+                    }
+                }
+                pending.clear();
+                pos.found = true;
+                pos.segment = seg->id;
+                pos.offset = offset + rec.length();
+                pos.seqno = rec.seqno;
+            } else {
+                BitcaskKeyDirEntry entry;
+                entry.offset = offset;
+                entry.seqno = rec.seqno;
+                entry.segment = seg->id;
+                entry.length = rec.length();
+                entry.deleted = rec.type == BitcaskRecord::DELETE;
+                pending.push_back(std::make_pair(rec.getKey(data), entry));
+            }
+            offset += rec.length();
+        }
+    }
+    if (!pending.empty()) {
+        pos.clean = false;
+    }
+}
+
+void BitcaskVBucket::truncate(const ReplayPos &pos,
+                              std::vector<BitcaskSegmentPtr> &dropped)
+{
+    BitcaskSegmentMap::iterator it = segments.begin();
+    while (it != segments.end()) {
+        BitcaskSegmentPtr seg = it->second;
+        if (!pos.found || seg->id > pos.segment) {
+            dropped.push_back(seg);
+            segments.erase(it++);
+            continue;
+        }
+        if (seg->id == pos.segment && seg->size > pos.offset) {
+            if (ftruncate(seg->fd, pos.offset) != 0) {
+                LOG(EXTENSION_LOG_WARNING, "Warning: failed to truncate "
+                    "bitcask segment %s: %s", seg->path.c_str(),
+                    strerror(errno));
+            }
+            seg->size = pos.offset;
+        }
+        ++it;
+    }
+}
+
+void BitcaskVBucket::recount()
+{
+    numItems = numDeletes = liveBytes = totalBytes = 0;
+    BitcaskKeyDir::iterator it = keydir.begin();
+    for (; it != keydir.end(); ++it) {
+        if (it->second.deleted) {
+            ++numDeletes;
+        } else {
+            ++numItems;
+        }
+        liveBytes += it->second.length;
+    }
+    BitcaskSegmentMap::iterator sit = segments.begin();
+    for (; sit != segments.end(); ++sit) {
+        totalBytes += sit->second->size;
+    }
+}
+
+bool BitcaskVBucket::readState(vbucket_state &vbstate)
+{
+    std::string path = statePath();
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    std::string statjson;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        statjson.append(buf, n);
+    }
+    fclose(fp);
+
+    cJSON *jsonObj = cJSON_Parse(statjson.c_str());
+    if (!jsonObj) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to parse the vbstat json doc for vbucket %d: %s",
+            vbid, statjson.c_str());
+        return false;
+    }
+
+    const std::string state = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "state"));
+    const std::string checkpoint_id = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "checkpoint_id"));
+    const std::string max_deleted_seqno = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "max_deleted_seqno"));
+    const std::string purge_seqno = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "purge_seqno"));
+    cJSON *failover_json = cJSON_GetObjectItem(jsonObj, "failover_table");
+    bool ok = state.compare("") != 0 && checkpoint_id.compare("") != 0 &&
+              max_deleted_seqno.compare("") != 0;
+    if (!ok) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: state JSON doc for vbucket %d is in the wrong format: %s",
+            vbid, statjson.c_str());
+    } else {
+        vbstate.state = VBucket::fromString(state.c_str());
+        vbstate.checkpointId = 0;
+        vbstate.maxDeletedSeqno = 0;
+        vbstate.highSeqno = 0;
+        vbstate.purgeSeqno = 0;
+        parseUint64(checkpoint_id.c_str(), &vbstate.checkpointId);
+        parseUint64(max_deleted_seqno.c_str(), &vbstate.maxDeletedSeqno);
+        parseUint64(purge_seqno.c_str(), &vbstate.purgeSeqno);
+        vbstate.failovers.clear();
+        if (failover_json) {
+            char* json = cJSON_PrintUnformatted(failover_json);
+            vbstate.failovers.assign(json);
+            free(json);
+        }
+    }
+    cJSON_Delete(jsonObj);
+    return ok;
+}
+
+bool BitcaskVBucket::writeState(const vbucket_state &vbstate)
+{
+    std::stringstream jsonState;
+    jsonState << "{\"state\": \"" << VBucket::toString(vbstate.state) << "\""
+              << ",\"checkpoint_id\": \"" << vbstate.checkpointId << "\""
+              << ",\"max_deleted_seqno\": \"" << vbstate.maxDeletedSeqno << "\""
+              << ",\"purge_seqno\": \"" << vbstate.purgeSeqno << "\""
+              << ",\"failover_table\": "
+              << (vbstate.failovers.empty() ? "[]" : vbstate.failovers)
+              << "}";
+    std::string state = jsonState.str();
+
+    // Write a new file and rename it over the old one, a crash leaves one
+    // of the two behind but never a torn state.
+    std::string path = statePath();
+    std::string tmp = path + ".new";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to create %s: %s",
+            tmp.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = pwriteFully(fd, state.data(), state.size(), 0) &&
+              fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to write the state of "
+            "vbucket %d to %s: %s", vbid, path.c_str(), strerror(errno));
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool BitcaskVBucket::getState(vbucket_state &vbstate)
+{
+    ensureLoaded();
+    LockHolder lh(mutex);
+    if (!stateExists) {
+        return false;
+    }
+    vbstate = cachedState;
+    vbstate.highSeqno = highSeqno;
+    vbstate.maxDeletedSeqno = maxDeletedSeqno;
+    return true;
+}
+
+bool BitcaskVBucket::saveState(const vbucket_state &vbstate)
+{
+    ensureLoaded();
+    LockHolder wl(writeMutex);
+    vbucket_state newState = vbstate;
+    {
+        // The seqnos are the vbucket's own, not the caller's.
+        LockHolder lh(mutex);
+        newState.maxDeletedSeqno = maxDeletedSeqno;
+        newState.purgeSeqno = cachedState.purgeSeqno;
+    }
+    if (!writeState(newState)) {
+        return false;
+    }
+    LockHolder lh(mutex);
+    cachedState = newState;
+    stateExists = true;
+    return true;
+}
+
+BitcaskSegmentPtr BitcaskVBucket::createSegment(uint32_t id, bool merging)
+{
+    // A merged segment is written under a name the discovery of the
+    // database directory deletes, and only renamed in place once complete.
+    std::string path = merging ? mergePath(id) : segmentPath(id);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to create bitcask "
+            "segment %s: %s", path.c_str(), strerror(errno));
+        return BitcaskSegmentPtr();
+    }
+    return BitcaskSegmentPtr(new BitcaskSegment(segmentPath(id), id, fd, 0));
+}
+
+BitcaskSegmentPtr BitcaskVBucket::activeSegment()
+{
+    LockHolder lh(mutex);
+    if (segments.empty()) {
+        return BitcaskSegmentPtr();
+    }
+    return segments.rbegin()->second;
+}
+
+bool BitcaskVBucket::write(std::vector<BitcaskMutation *> &batch, bool doSync)
+{
+    ensureLoaded();
+    LockHolder wl(writeMutex);
+
+    std::sort(batch.begin(), batch.end(), mutationSeqnoLess);
+    std::string buf;
+    std::vector<uint64_t> offsets;
+    offsets.reserve(batch.size());
+    uint64_t maxSeqno = highSeqno;
+    std::vector<BitcaskMutation *>::iterator it = batch.begin();
+    for (; it != batch.end(); ++it) {
+        offsets.push_back(buf.size());
+        buf.append((*it)->record);
+        maxSeqno = std::max(maxSeqno, (*it)->seqno);
+    }
+    BitcaskRecord::encodeCommit(maxSeqno, buf);
+
+    BitcaskSegmentPtr seg = activeSegment();
+    if (!seg || seg->id < minSegmentId ||
+        (seg->size > 0 && seg->size + buf.size() > segmentSize)) {
+        if (seg && fsync(seg->fd) != 0) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to sync bitcask "
+                "segment %s: %s", seg->path.c_str(), strerror(errno));
+            return false;
+        }
+        seg = createSegment(std::max(seg ? seg->id + 1 : 1, minSegmentId));
+        if (!seg) {
+            return false;
+        }
+        LockHolder lh(mutex);
+        segments[seg->id] = seg;
+    }
+
+    uint64_t base = seg->size;
+    if (!pwriteFully(seg->fd, buf.data(), buf.size(), base) ||
+        (doSync && fsync(seg->fd) != 0)) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to write %llu bytes to "
+            "bitcask segment %s: %s",
+            static_cast<unsigned long long>(buf.size()), seg->path.c_str(),
+            strerror(errno));
+        if (ftruncate(seg->fd, base) != 0) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to truncate bitcask "
+                "segment %s: %s", seg->path.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    LockHolder lh(mutex);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        BitcaskMutation *m = batch[i];
+        BitcaskKeyDirEntry entry;
+        entry.offset = base + offsets[i];
+        entry.seqno = m->seqno;
+        entry.segment = seg->id;
+        entry.length = m->record.size();
+        entry.deleted = m->deleted;
+
+        std::pair<BitcaskKeyDir::iterator, bool> ret =
+            keydir.insert(std::make_pair(m->key, entry));
+        if (ret.second) {
+            m->existed = false;
+        } else {
+            BitcaskKeyDirEntry &old = ret.first->second;
+            m->existed = !old.deleted;
+            if (old.deleted) {
+                --numDeletes;
+            } else {
+                --numItems;
+            }
+            liveBytes -= old.length;
+            old = entry;
+        }
+        if (entry.deleted) {
+            ++numDeletes;
+            maxDeletedSeqno = std::max(maxDeletedSeqno, entry.seqno);
+        } else {
+            ++numItems;
+        }
+        liveBytes += entry.length;
+    }
+    seg->size += buf.size();
+    totalBytes += buf.size();
+    highSeqno = maxSeqno;
+    return true;
+}
+
+bool BitcaskVBucket::sync()
+{
+    BitcaskSegmentPtr seg = activeSegment();
+    if (seg && fsync(seg->fd) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to sync bitcask "
+            "segment %s: %s", seg->path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool BitcaskVBucket::lookup(const std::string &key, BitcaskKeyDirEntry &entry,
+                            BitcaskSegmentPtr &segment,
+                            const BitcaskSnapshot *snap)
+{
+    ensureLoaded();
+    if (snap) {
+        BitcaskKeyDir::const_iterator it = snap->keydir.find(key);
+        if (it == snap->keydir.end()) {
+            return false;
+        }
+        BitcaskSegmentMap::const_iterator sit;
+        sit = snap->segments.find(it->second.segment);
+        if (sit == snap->segments.end()) {
+            return false;
+        }
+        entry = it->second;
+        segment = sit->second;
+        return true;
+    }
+
+    LockHolder lh(mutex);
+    BitcaskKeyDir::iterator it = keydir.find(key);
+    if (it == keydir.end()) {
+        return false;
+    }
+    BitcaskSegmentMap::iterator sit = segments.find(it->second.segment);
+    cb_assert(sit != segments.end());
+    entry = it->second;
+    segment = sit->second;
+    return true;
+}
+
+bool BitcaskVBucket::read(const BitcaskSegmentPtr &segment,
+                          const BitcaskKeyDirEntry &entry, std::string &buf,
+                          BitcaskRecord &rec)
+{
+    buf.resize(entry.length);
+    if (!preadFully(segment->fd, &buf[0], entry.length, entry.offset)) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to read %u bytes at "
+            "offset %llu of bitcask segment %s: %s", entry.length,
+            static_cast<unsigned long long>(entry.offset),
+            segment->path.c_str(), strerror(errno));
+        return false;
+    }
+    if (!rec.decodeHeader(buf.data()) || rec.length() != entry.length ||
+        !rec.verify(buf.data())) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: corrupt record at offset %llu "
+            "of bitcask segment %s",
+            static_cast<unsigned long long>(entry.offset),
+            segment->path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void BitcaskVBucket::collect(uint64_t startSeqno, uint64_t endSeqno,
+                             bool deletes, bool live,
+                             std::vector<BitcaskScanEntry> &entries,
+                             BitcaskSegmentMap &segs)
+{
+    ensureLoaded();
+    {
+        LockHolder lh(mutex);
+        BitcaskKeyDir::iterator it = keydir.begin();
+        for (; it != keydir.end(); ++it) {
+            const BitcaskKeyDirEntry &e = it->second;
+            if (e.seqno < startSeqno || e.seqno > endSeqno ||
+                !(e.deleted ? deletes : live)) {
+                continue;
+            }
+            BitcaskScanEntry se;
+            se.key = it->first;
+            se.entry = e;
+            entries.push_back(se);
+        }
+        segs = segments;
+    }
+    std::sort(entries.begin(), entries.end(), scanEntryPositionLess);
+}
+
+void BitcaskVBucket::getKeys(const std::string &start, size_t count,
+                             std::vector<std::string> &keys)
+{
+    ensureLoaded();
+    {
+        LockHolder lh(mutex);
+        BitcaskKeyDir::iterator it = keydir.begin();
+        for (; it != keydir.end(); ++it) {
+            if (!it->second.deleted && it->first >= start) {
+                keys.push_back(it->first);
+            }
+        }
+    }
+    if (keys.size() > count) {
+        std::nth_element(keys.begin(), keys.begin() + count, keys.end());
+        keys.resize(count);
+    }
+    std::sort(keys.begin(), keys.end());
+}
+
+bool BitcaskVBucket::merge(compaction_ctx *ctx, IoThrottle &throttle)
+{
+    ensureLoaded();
+    LockHolder ml(mergeMutex);
+
+    // Take the records to merge and seal the segments they are in. The
+    // batches written from now on go to segments numbered behind the ones
+    // the merge may fill, so a replay reads them after the merged records.
+    // Filling segments one after the other, any two neighbours hold more
+    // than a segment's worth of records, which bounds how many it takes.
+    std::vector<BitcaskScanEntry> entries;
+    BitcaskSegmentMap old;
+    uint64_t seqno;
+    uint64_t gen;
+    uint32_t nextId;
+    uint32_t limit;
+    {
+        LockHolder wl(writeMutex);
+        collect(0, std::numeric_limits<uint64_t>::max(), true, true, entries,
+                old);
+        seqno = getHighSeqno();
+        gen = generation;
+        uint64_t bytes = 0;
+        std::vector<BitcaskScanEntry>::iterator it = entries.begin();
+        for (; it != entries.end(); ++it) {
+            bytes += it->entry.length;
+        }
+        nextId = old.empty() ? 1 : old.rbegin()->first + 1;
+        limit = nextId + 2 * (bytes / segmentSize) + 2;
+        minSegmentId = limit;
+    }
+
+    // The merged records go to new segments, closed by a single commit
+    // record, and are only renamed in place once all of them made it to
+    // disk. Until the old segments are gone a replay reads the merged
+    // records after them, which changes nothing as they are the same.
+    std::vector<BitcaskSegmentPtr> outs;
+    BitcaskSegmentPtr out;
+    BitcaskKeyDir merged;
+    std::string buf;
+    uint64_t purgedSeqno = 0;
+    bool ok = true;
+
+    shared_ptr<BitcaskSegmentReader> reader;
+    uint32_t readerSegment = 0;
+    std::vector<BitcaskScanEntry>::iterator it = entries.begin();
+    for (; ok && it != entries.end(); ++it) {
+        if (!reader || readerSegment != it->entry.segment) {
+            reader.reset(new BitcaskSegmentReader(old[it->entry.segment],
+                                                  &throttle));
+            readerSegment = it->entry.segment;
+        }
+        BitcaskRecord rec;
+        const char *data = reader->get(it->entry.offset, it->entry.length);
+        if (data == NULL || !rec.decodeHeader(data) || !rec.verify(data)) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to read the record "
+                "of a key at offset %llu of bitcask segment %d of vbucket %d",
+                static_cast<unsigned long long>(it->entry.offset),
+                it->entry.segment, vbid);
+            ok = false;
+            break;
+        }
+
+        if (rec.type == BitcaskRecord::DELETE) {
+            if (ctx->drop_deletes && rec.exptime < ctx->purge_before_ts &&
+                (!ctx->purge_before_seq ||
+                 rec.seqno <= ctx->purge_before_seq)) {
+                purgedSeqno = std::max(purgedSeqno, rec.seqno);
+                continue;
+            }
+        } else if (rec.exptime && rec.exptime < ctx->curr_time) {
+            expiredItemCtx expItem = { rec.revSeqno, it->key };
+            ctx->expiredItems.push_back(expItem);
+        }
+
+        if (!out || (out->size + buf.size() > 0 &&
+                     out->size + buf.size() + rec.length() > segmentSize)) {
+            if (out && !(ok = pwriteFully(out->fd, buf.data(), buf.size(),
+                                          out->size))) {
+                break;
+            }
+            if (out) {
+                out->size += buf.size();
+                buf.clear();
+            }
+            cb_assert(nextId < limit);
+            out = createSegment(nextId++, true);
+            if (!(ok = out.get() != NULL)) {
+                break;
+            }
+            outs.push_back(out);
+        }
+
+        BitcaskKeyDirEntry entry = it->entry;
+        entry.segment = out->id;
+        entry.offset = out->size + buf.size();
+        merged[it->key] = entry;
+        buf.append(data, rec.length());
+        if (buf.size() >= BitcaskSegmentReader::CHUNK_SIZE) {
+            throttle.consume(buf.size());
+            if (!(ok = pwriteFully(out->fd, buf.data(), buf.size(),
+                                   out->size))) {
+                break;
+            }
+            out->size += buf.size();
+            buf.clear();
+        }
+    }
+
+    if (ok && !out) {
+        out = createSegment(nextId++, true);
+        if ((ok = out.get() != NULL)) {
+            outs.push_back(out);
+        }
+    }
+    if (ok) {
+        BitcaskRecord::encodeCommit(seqno, buf);
+        ok = pwriteFully(out->fd, buf.data(), buf.size(), out->size);
+        out->size += buf.size();
+    }
+    std::vector<BitcaskSegmentPtr>::iterator oit = outs.begin();
+    for (; ok && oit != outs.end(); ++oit) {
+        ok = fsync((*oit)->fd) == 0;
+    }
+
+    {
+        LockHolder wl(writeMutex);
+        minSegmentId = 0;
+        if (ok && gen != generation) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: vbucket %d was rolled back "
+                "or reset while merging its segments, dropping the merge",
+                vbid);
+            ok = false;
+        } else if (!ok) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to merge the "
+                "segments of vbucket %d: %s", vbid, strerror(errno));
+        }
+        for (oit = outs.begin(); ok && oit != outs.end(); ++oit) {
+            std::string tmp = mergePath((*oit)->id);
+            if (rename(tmp.c_str(), (*oit)->path.c_str()) != 0) {
+                LOG(EXTENSION_LOG_WARNING, "Warning: failed to rename %s: "
+                    "%s", tmp.c_str(), strerror(errno));
+                ok = false;
+            }
+        }
+        if (!ok) {
+            // The segments renamed in place already are harmless until the
+            // next load, but are not left behind for it.
+            for (oit = outs.begin(); oit != outs.end(); ++oit) {
+                remove(mergePath((*oit)->id).c_str());
+                remove((*oit)->path.c_str());
+            }
+            return false;
+        }
+
+        // Keys written since the merge started keep their new records.
+        vbucket_state newState;
+        bool haveState;
+        {
+            LockHolder lh(mutex);
+            std::vector<BitcaskScanEntry>::iterator eit = entries.begin();
+            for (; eit != entries.end(); ++eit) {
+                BitcaskKeyDir::iterator kit = keydir.find(eit->key);
+                if (kit == keydir.end() ||
+                    kit->second.segment != eit->entry.segment ||
+                    kit->second.offset != eit->entry.offset) {
+                    continue;
+                }
+                BitcaskKeyDir::iterator mit = merged.find(eit->key);
+                if (mit == merged.end()) {
+                    keydir.erase(kit);
+                } else {
+                    kit->second = mit->second;
+                }
+            }
+            BitcaskSegmentMap::iterator sit = old.begin();
+            for (; sit != old.end(); ++sit) {
+                segments.erase(sit->first);
+            }
+            for (oit = outs.begin(); oit != outs.end(); ++oit) {
+                segments[(*oit)->id] = *oit;
+            }
+            recount();
+            newState = cachedState;
+            haveState = stateExists;
+        }
+
+        if (purgedSeqno > ctx->max_purged_seq) {
+            ctx->max_purged_seq = purgedSeqno;
+        }
+        if (ctx->max_purged_seq > newState.purgeSeqno) {
+            newState.purgeSeqno = ctx->max_purged_seq;
+            if (haveState) {
+                writeState(newState);
+            }
+            LockHolder lh(mutex);
+            cachedState.purgeSeqno = newState.purgeSeqno;
+        }
+    }
+
+    // Oldest first, so that a crash in between never leaves a segment
+    // behind whose records a dropped later one overrode.
+    BitcaskSegmentMap::iterator sit = old.begin();
+    for (; sit != old.end(); ++sit) {
+        remove(sit->second->path.c_str());
+    }
+    return true;
+}
+
+bool BitcaskVBucket::rollback(uint64_t seqno, shared_ptr<RollbackCB> cb,
+                              uint64_t &newSeqno)
+{
+    ensureLoaded();
+    LockHolder wl(writeMutex);
+    ++generation;
+
+    BitcaskSnapshot snap;
+    {
+        LockHolder lh(mutex);
+        snap.segments = segments;
+    }
+    ReplayPos pos;
+    replay(snap.segments, seqno, snap.keydir, pos);
+    if (!pos.found) {
+        return false;
+    }
+
+    std::vector<std::pair<std::string, uint64_t> > changed;
+    size_t total;
+    {
+        LockHolder lh(mutex);
+        total = keydir.size();
+        BitcaskKeyDir::iterator it = keydir.begin();
+        for (; it != keydir.end(); ++it) {
+            if (it->second.seqno > pos.seqno) {
+                changed.push_back(std::make_pair(it->first,
+                                                 it->second.seqno));
+            }
+        }
+    }
+    if (total / 2 <= changed.size()) {
+        return false;
+    }
+
+    cb->setDbHeader(&snap);
+    std::vector<std::pair<std::string, uint64_t> >::iterator cit;
+    for (cit = changed.begin(); cit != changed.end(); ++cit) {
+        Item *it = new Item(cit->first, 0, 0, NULL, 0, NULL, 0, 0,
+                            cit->second, vbid);
+        GetValue rv(it, ENGINE_SUCCESS, -1, true);
+        cb->callback(rv);
+    }
+
+    std::vector<BitcaskSegmentPtr> dropped;
+    {
+        LockHolder lh(mutex);
+        keydir.swap(snap.keydir);
+        truncate(pos, dropped);
+        highSeqno = pos.seqno;
+        maxDeletedSeqno = pos.maxDeletedSeqno;
+        recount();
+    }
+    sync();
+    std::vector<BitcaskSegmentPtr>::iterator dit = dropped.begin();
+    for (; dit != dropped.end(); ++dit) {
+        remove((*dit)->path.c_str());
+    }
+    newSeqno = pos.seqno;
+    return true;
+}
+
+void BitcaskVBucket::reset(bool keepState)
+{
+    ensureLoaded();
+    LockHolder wl(writeMutex);
+    ++generation;
+    BitcaskSegmentMap old;
+    {
+        LockHolder lh(mutex);
+        old.swap(segments);
+        keydir.clear();
+        highSeqno = 0;
+        maxDeletedSeqno = 0;
+        cachedState.checkpointId = 0;
+        cachedState.maxDeletedSeqno = 0;
+        cachedState.purgeSeqno = 0;
+        recount();
+        if (!keepState) {
+            stateExists = false;
+        }
+    }
+    BitcaskSegmentMap::iterator it = old.begin();
+    for (; it != old.end(); ++it) {
+        remove(it->second->path.c_str());
+    }
+    if (!keepState) {
+        remove(statePath().c_str());
+    }
+}
+
+uint64_t BitcaskVBucket::getHighSeqno()
+{
+    ensureLoaded();
+    LockHolder lh(mutex);
+    return highSeqno;
+}
+
+size_t BitcaskVBucket::getNumItems()
+{
+    ensureLoaded();
+    LockHolder lh(mutex);
+    return numItems;
+}
+
+size_t BitcaskVBucket::getNumDeletes()
+{
+    ensureLoaded();
+    LockHolder lh(mutex);
+    return numDeletes;
+}
+
+size_t BitcaskVBucket::countRange(uint64_t minSeqno, uint64_t maxSeqno)
+{
+    ensureLoaded();
+    LockHolder lh(mutex);
+    size_t count = 0;
+    BitcaskKeyDir::iterator it = keydir.begin();
+    for (; it != keydir.end(); ++it) {
+        if (it->second.seqno >= minSeqno && it->second.seqno <= maxSeqno) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t BitcaskVBucket::getNumSegments()
+{
+    ensureLoaded();
+    LockHolder lh(mutex);
+    return segments.size();
+}
+
+void BitcaskVBucket::getSpace(size_t &live, size_t &total)
+{
+    ensureLoaded();
+    LockHolder lh(mutex);
+    live = liveBytes;
+    total = totalBytes;
+}
+
+std::string BitcaskVBucket::segmentPath(uint32_t id) const
+{
+    std::stringstream ss;
+    ss << dir << "/" << vbid << ".bitcask." << id;
+    return ss.str();
+}
+
+std::string BitcaskVBucket::mergePath(uint32_t id) const
+{
+    return segmentPath(id) + ".merge";
+}
+
+std::string BitcaskVBucket::statePath() const
+{
+    std::stringstream ss;
+    ss << dir << "/" << vbid << ".bitcask.state";
+    return ss.str();
+}
+
+Mutex BitcaskDb::registryMutex;
+std::map<std::string, BitcaskDb *> BitcaskDb::registry;
+
+BitcaskDb *BitcaskDb::acquire(Configuration &config)
+{
+    LockHolder lh(registryMutex);
+    std::string dir = config.getDbname();
+    std::map<std::string, BitcaskDb *>::iterator it = registry.find(dir);
+    if (it == registry.end()) {
+        BitcaskDb *db = new BitcaskDb(dir, config.getMaxVbuckets(),
+                                      config.getBitcaskSegmentSize());
+        try {
+            db->discover();
+        } catch (...) {
+            delete db;
+            throw;
+        }
+        it = registry.insert(std::make_pair(dir, db)).first;
+    }
+    ++it->second->refs;
+    return it->second;
+}
+
+void BitcaskDb::release(BitcaskDb *db)
+{
+    LockHolder lh(registryMutex);
+    cb_assert(db->refs > 0);
+    if (--db->refs == 0) {
+        registry.erase(db->dbname);
+        delete db;
+    }
+}
+
+BitcaskDb::BitcaskDb(const std::string &dir, size_t numVBuckets,
+                     size_t segmentSize) : dbname(dir), refs(0)
+{
+    for (size_t i = 0; i < numVBuckets; ++i) {
+        vbuckets.push_back(new BitcaskVBucket(dir, i, segmentSize));
+    }
+}
+
+BitcaskDb::~BitcaskDb()
+{
+    std::vector<BitcaskVBucket *>::iterator it = vbuckets.begin();
+    for (; it != vbuckets.end(); ++it) {
+        delete *it;
+    }
+}
+
+void BitcaskDb::discover()
+{
+    struct stat dbstat;
+    if (stat(dbname.c_str(), &dbstat) != 0 &&
+        mkdir(dbname.c_str(), S_IRWXU) == -1) {
+        std::stringstream ss;
+        ss << "Warning: Failed to create data directory ["
+           << dbname << "]: " << strerror(errno);
+        throw std::runtime_error(ss.str());
+    }
+
+    std::map<uint16_t, std::vector<uint32_t> > segs;
+    std::set<uint16_t> states;
+    std::vector<std::string> files = findFilesContaining(dbname, ".bitcask.");
+    std::vector<std::string>::iterator it = files.begin();
+    for (; it != files.end(); ++it) {
+        size_t slash = it->rfind('/');
+        std::string name = slash == std::string::npos ?
+                           *it : it->substr(slash + 1);
+        size_t dot = name.find(".bitcask.");
+        std::string vb = name.substr(0, dot);
+        std::string rest = name.substr(dot + sizeof(".bitcask.") - 1);
+        if (!isNumber(vb) || atoi(vb.c_str()) >= (int)vbuckets.size()) {
+            continue;
+        }
+        uint16_t vbid = atoi(vb.c_str());
+        if (rest == "state") {
+            states.insert(vbid);
+        } else if (isNumber(rest)) {
+            segs[vbid].push_back(strtoul(rest.c_str(), NULL, 10));
+        } else {
+            // A state update that didn't get renamed in place.
+            remove(it->c_str());
+        }
+    }
+
+    for (size_t i = 0; i < vbuckets.size(); ++i) {
+        vbuckets[i]->setDiscovered(segs[i], states.count(i) > 0);
+    }
+}
@@ -0,0 +1,457 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_BITCASK_KVSTORE_BITCASK_VBUCKET_H_
+#define SRC_BITCASK_KVSTORE_BITCASK_VBUCKET_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "item.h"
+#include "kvstore.h"
+#include "mutex.h"
+
+class IoThrottle;
+
+/**
+ * A record of a segment file, as laid out on disk:
+ *
+ *   crc32 of the rest of the record, type, extended meta data length, key
+ *   length, value length, flags, expiry time, seqno, revision seqno, cas,
+ *   followed by the key, the extended meta data and the value.
+ *
+ * Integers are stored in network byte order, except for the flags which
+ * (like in couchstore) are stored as given by the client.
+ *
+ * A commit record (no key, no value) closes every batch written, its seqno
+ * is the highest one of the batch. Records behind the last commit record
+ * of a vbucket are a torn write and are discarded when the vbucket is
+ * loaded.
+ */
+class BitcaskRecord {
+public:
+    enum Type {
+        SET = 1,
+        DELETE = 2,
+        COMMIT = 3
+    };
+
+    static const size_t HEADER_SIZE = 44;
+
+    /**
+     * Append the record of an item to the buffer.
+     */
+    static void encode(const Item &itm, bool deleted, std::string &buf);
+
+    /**
+     * Append a commit record to the buffer.
+     */
+    static void encodeCommit(uint64_t seqno, std::string &buf);
+
+    /**
+     * Decode the header of a record.
+     *
+     * @return false if the header can't be the one of a valid record
+     */
+    bool decodeHeader(const char *buf);
+
+    /**
+     * Check the crc of a whole record whose header was decoded.
+     */
+    bool verify(const char *buf) const;
+
+    size_t length() const {
+        return HEADER_SIZE + keyLen + extMetaLen + valueLen;
+    }
+
+    std::string getKey(const char *buf) const {
+        return std::string(buf + HEADER_SIZE, keyLen);
+    }
+
+    /**
+     * Build the item of a record whose header was decoded.
+     *
+     * @param buf the whole record
+     * @param vbid vbucket the record belongs to
+     * @param metaOnly leave the value out
+     */
+    Item *toItem(const char *buf, uint16_t vbid, bool metaOnly) const;
+
+    uint32_t crc;
+    uint8_t type;
+    uint8_t extMetaLen;
+    uint16_t keyLen;
+    uint32_t valueLen;
+    uint32_t flags;
+    uint32_t exptime;
+    uint64_t seqno;
+    uint64_t revSeqno;
+    uint64_t cas;
+};
+
+/**
+ * An append only segment file of a vbucket. The descriptor is closed once
+ * the last reader drops its reference, so segments replaced by a merge or
+ * a rollback stay readable for reads already under way.
+ */
+class BitcaskSegment {
+public:
+    BitcaskSegment(const std::string &p, uint32_t i, int f, uint64_t s) :
+        path(p), id(i), fd(f), size(s) { }
+
+    ~BitcaskSegment();
+
+    const std::string path;
+    const uint32_t id;
+    const int fd;
+    /* bytes of committed records, only changed by the writer */
+    uint64_t size;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BitcaskSegment);
+};
+
+typedef shared_ptr<BitcaskSegment> BitcaskSegmentPtr;
+typedef std::map<uint32_t, BitcaskSegmentPtr> BitcaskSegmentMap;
+
+/**
+ * Reads the records of a segment front to back in large chunks, for
+ * replaying, merging and dumping a vbucket.
+ */
+class BitcaskSegmentReader {
+public:
+    static const size_t CHUNK_SIZE = 1024 * 1024;
+
+    /**
+     * @param throttle accounts for the bytes read, if given
+     */
+    BitcaskSegmentReader(const BitcaskSegmentPtr &s, IoThrottle *t = NULL) :
+        segment(s), throttle(t), bufStart(0), bytesRead(0) { }
+
+    /**
+     * Get the given bytes of the segment.
+     *
+     * @return NULL if they are beyond the end of the segment or can't be
+     *         read
+     */
+    const char *get(uint64_t offset, size_t length);
+
+    size_t getBytesRead() const {
+        return bytesRead;
+    }
+
+private:
+    BitcaskSegmentPtr segment;
+    IoThrottle *throttle;
+    std::string buf;
+    uint64_t bufStart;
+    size_t bytesRead;
+
+    DISALLOW_COPY_AND_ASSIGN(BitcaskSegmentReader);
+};
+
+/**
+ * Where the latest record of a key lives.
+ */
+struct BitcaskKeyDirEntry {
+    uint64_t offset;
+    uint64_t seqno;
+    uint32_t segment;
+    uint32_t length;
+    bool deleted;
+};
+
+typedef unordered_map<std::string, BitcaskKeyDirEntry> BitcaskKeyDir;
+
+/**
+ * A consistent view of a vbucket as of some commit, e.g. the one a
+ * rollback rewinds to. It is handed to RollbackCB as the database header
+ * to read the rewound documents through.
+ */
+struct BitcaskSnapshot {
+    BitcaskKeyDir keydir;
+    BitcaskSegmentMap segments;
+};
+
+/**
+ * A mutation of a flush batch, encoded when it is queued.
+ */
+struct BitcaskMutation {
+    BitcaskMutation(const Item &itm, bool del);
+
+    std::string key;
+    uint64_t seqno;
+    bool deleted;
+    std::string record;
+    /* set by the write: did a live version of the key exist before? */
+    bool existed;
+};
+
+/**
+ * A record read back from a segment.
+ */
+struct BitcaskScanEntry {
+    std::string key;
+    BitcaskKeyDirEntry entry;
+};
+
+/**
+ * The data of a vbucket: its segment files, and the key directory
+ * pointing at the latest record of every key, kept entirely in memory and
+ * rebuilt by replaying the segments when the vbucket is first used.
+ *
+ * Writes (batches, rollbacks, resets) are serialized through the write
+ * mutex and may come from both the read-write and the read-only KVStore of
+ * a shard. A merge only takes it to start and to finish, so batches keep
+ * being written while it copies the records. Readers only hold the
+ * directory mutex long enough to look keys up, then read the records from
+ * the segments without any lock.
+ */
+class BitcaskVBucket {
+public:
+    BitcaskVBucket(const std::string &dir, uint16_t vbid, size_t segmentSize);
+
+    /**
+     * Set what discovering the database directory found of this vbucket.
+     */
+    void setDiscovered(const std::vector<uint32_t> &segmentIds,
+                       bool hasState);
+
+    /**
+     * Does the vbucket exist on disk (does it have a state)?
+     */
+    bool exists();
+
+    /**
+     * Get the persisted state, with the high seqno of the segments.
+     *
+     * @return false if the vbucket doesn't exist
+     */
+    bool getState(vbucket_state &vbstate);
+
+    /**
+     * Persist the state of the vbucket.
+     */
+    bool saveState(const vbucket_state &vbstate);
+
+    /**
+     * Append a batch of mutations, in seqno order, followed by its commit
+     * record.
+     *
+     * @param batch the mutations, their existed flags are set
+     * @param sync sync the segment before returning
+     * @return false if the batch couldn't be written, none of it is visible
+     */
+    bool write(std::vector<BitcaskMutation *> &batch, bool sync);
+
+    /**
+     * Sync the active segment.
+     */
+    bool sync();
+
+    /**
+     * Look a key up.
+     *
+     * @param snap read from this snapshot instead of the current data
+     */
+    bool lookup(const std::string &key, BitcaskKeyDirEntry &entry,
+                BitcaskSegmentPtr &segment,
+                const BitcaskSnapshot *snap = NULL);
+
+    /**
+     * Read the record of a directory entry.
+     *
+     * @param buf receives the whole record
+     */
+    bool read(const BitcaskSegmentPtr &segment,
+              const BitcaskKeyDirEntry &entry, std::string &buf,
+              BitcaskRecord &rec);
+
+    /**
+     * Collect the keys whose latest record has a seqno in the range, in the
+     * order they are laid out on disk (which is seqno order).
+     *
+     * @param deletes include deleted keys
+     * @param live include live keys
+     */
+    void collect(uint64_t startSeqno, uint64_t endSeqno, bool deletes,
+                 bool live, std::vector<BitcaskScanEntry> &entries,
+                 BitcaskSegmentMap &segments);
+
+    /**
+     * Get up to count live keys not less than the start key, in key order.
+     */
+    void getKeys(const std::string &start, size_t count,
+                 std::vector<std::string> &keys);
+
+    /**
+     * Rewrite the live records into new segments and drop the old ones,
+     * purging deletions and reporting expired items as the compaction
+     * context asks for. Batches written meanwhile go to segments behind
+     * the merged ones and are kept.
+     *
+     * @return false if the merge failed or was overtaken by a rollback or
+     *         a reset, the vbucket is left as it was
+     */
+    bool merge(compaction_ctx *ctx, IoThrottle &throttle);
+
+    /**
+     * Roll the vbucket back to its last commit not beyond the given seqno.
+     *
+     * @param seqno the seqno to roll back to
+     * @param cb gets called for every key changed since that commit
+     * @param newSeqno set to the seqno the vbucket got rolled back to
+     * @return false if the vbucket has to be reset instead
+     */
+    bool rollback(uint64_t seqno, shared_ptr<RollbackCB> cb,
+                  uint64_t &newSeqno);
+
+    /**
+     * Drop all the data of the vbucket, and its state too unless it is
+     * kept.
+     */
+    void reset(bool keepState);
+
+    uint64_t getHighSeqno();
+    size_t getNumItems();
+    size_t getNumDeletes();
+    size_t countRange(uint64_t minSeqno, uint64_t maxSeqno);
+    size_t getNumSegments();
+
+    /**
+     * Bytes of the records the directory points at, and of all segments.
+     */
+    void getSpace(size_t &live, size_t &total);
+
+    uint16_t getId() const {
+        return vbid;
+    }
+
+private:
+    struct ReplayPos {
+        ReplayPos() : found(false), segment(0), offset(0), seqno(0),
+                      maxDeletedSeqno(0), clean(true) { }
+
+        /* a commit was found, the position is the end of the last one */
+        bool found;
+        uint32_t segment;
+        uint64_t offset;
+        uint64_t seqno;
+        uint64_t maxDeletedSeqno;
+        /* no torn or corrupt records behind the last commit */
+        bool clean;
+    };
+
+    void ensureLoaded();
+    void load();
+    void replay(const BitcaskSegmentMap &segs, uint64_t maxSeqno,
+                BitcaskKeyDir &keydir, ReplayPos &pos);
+    void truncate(const ReplayPos &pos,
+                  std::vector<BitcaskSegmentPtr> &dropped);
+    void recount();
+    bool readState(vbucket_state &vbstate);
+    bool writeState(const vbucket_state &vbstate);
+    BitcaskSegmentPtr createSegment(uint32_t id, bool merging = false);
+    BitcaskSegmentPtr activeSegment();
+    std::string segmentPath(uint32_t id) const;
+    std::string mergePath(uint32_t id) const;
+    std::string statePath() const;
+
+    const std::string dir;
+    const uint16_t vbid;
+    const size_t segmentSize;
+
+    /* serializes merges */
+    Mutex mergeMutex;
+
+    /* serializes writes, rollbacks, resets and loading */
+    Mutex writeMutex;
+    /* batches go to segments from this one on, the ones below are being
+     * merged */
+    uint32_t minSegmentId;
+    /* bumped by every rollback and reset, a merge that sees it change
+     * gives up */
+    uint64_t generation;
+    AtomicValue<bool> loaded;
+    std::vector<uint32_t> discoveredSegments;
+
+    /* guards everything below */
+    Mutex mutex;
+    bool stateExists;
+    vbucket_state cachedState;
+    BitcaskSegmentMap segments;
+    BitcaskKeyDir keydir;
+    uint64_t highSeqno;
+    uint64_t maxDeletedSeqno;
+    size_t numItems;
+    size_t numDeletes;
+    size_t liveBytes;
+    size_t totalBytes;
+
+    DISALLOW_COPY_AND_ASSIGN(BitcaskVBucket);
+};
+
+/**
+ * All the vbuckets of a database directory. The read-write and read-only
+ * KVStores of every shard share one instance, so they see the same key
+ * directories.
+ */
+class BitcaskDb {
+public:
+    /**
+     * Get the instance of the configured database directory, creating and
+     * discovering it on first use.
+     */
+    static BitcaskDb *acquire(Configuration &config);
+
+    /**
+     * Drop a reference taken with acquire().
+     */
+    static void release(BitcaskDb *db);
+
+    BitcaskVBucket &getVBucket(uint16_t vbid) {
+        cb_assert(vbid < vbuckets.size());
+        return *vbuckets[vbid];
+    }
+
+    size_t getNumVBuckets() const {
+        return vbuckets.size();
+    }
+
+private:
+    BitcaskDb(const std::string &dir, size_t numVBuckets, size_t segmentSize);
+    ~BitcaskDb();
+
+    void discover();
+
+    static Mutex registryMutex;
+    static std::map<std::string, BitcaskDb *> registry;
+
+    const std::string dbname;
+    std::vector<BitcaskVBucket *> vbuckets;
+    size_t refs;
+
+    DISALLOW_COPY_AND_ASSIGN(BitcaskDb);
+};
+
+#endif  // SRC_BITCASK_KVSTORE_BITCASK_VBUCKET_H_
@@ -31,6 +31,9 @@
 #cmakedefine HAVE_GETTIMEOFDAY ${GETTIMEOFDAY}
 #cmakedefine HAVE_GETOPT_LONG ${HAVE_GETOPT_LONG}
 
+/* Libraries */
+#cmakedefine HAVE_LIBURING ${HAVE_LIBURING}
+
 /* various */
 #define VERSION "${EP_ENGINE_VERSION}"
 
@@ -0,0 +1,115 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "common.h"
+#include "couch-kvstore/couch-block-cache.h"
+#include "locks.h"
+
+const size_t CouchBlockCache::BLOCK_SIZE;
+const size_t CouchBlockCache::NUM_PARTITIONS;
+
+CouchBlockCache::CouchBlockCache(size_t capacity) :
+    numHits(0), numMisses(0), numEvictions(0),
+    maxBlocks(capacity / BLOCK_SIZE), numBlocks(0), nextFileId(1)
+{
+    if (maxBlocks > 0 && maxBlocks < NUM_PARTITIONS) {
+        maxBlocks = NUM_PARTITIONS;
+    }
+}
+
+CouchBlockCache::~CouchBlockCache()
+{
+    for (size_t i = 0; i < NUM_PARTITIONS; ++i) {
+        std::list<Entry>::iterator it = partitions[i].lru.begin();
+        for (; it != partitions[i].lru.end(); ++it) {
+            delete [] it->data;
+        }
+    }
+}
+
+uint64_t CouchBlockCache::getFileId(const std::string &path, uint64_t inode)
+{
+    LockHolder lh(filesMutex);
+    std::map<std::string, std::pair<uint64_t, uint64_t> >::iterator it;
+    it = files.find(path);
+    if (it == files.end() || it->second.first != inode) {
+        // Blocks of the previous file under this name are never looked up
+        // again, they age out of the LRU.
+        files[path] = std::make_pair(inode, nextFileId++);
+        return nextFileId - 1;
+    }
+    return it->second.second;
+}
+
+void CouchBlockCache::invalidate(const std::string &prefix)
+{
+    LockHolder lh(filesMutex);
+    std::map<std::string, std::pair<uint64_t, uint64_t> >::iterator it;
+    it = files.lower_bound(prefix);
+    while (it != files.end() &&
+           it->first.compare(0, prefix.size(), prefix) == 0) {
+        files.erase(it++);
+    }
+}
+
+bool CouchBlockCache::get(uint64_t fileId, uint64_t block, size_t offset,
+                          size_t len, char *buf)
+{
+    BlockKey key(fileId, block);
+    Partition &p = partitionOf(key);
+    LockHolder lh(p.mutex);
+    std::map<BlockKey, std::list<Entry>::iterator>::iterator it;
+    it = p.index.find(key);
+    if (it == p.index.end()) {
+        ++numMisses;
+        return false;
+    }
+    p.lru.splice(p.lru.begin(), p.lru, it->second);
+    memcpy(buf, it->second->data + offset, len);
+    ++numHits;
+    return true;
+}
+
+void CouchBlockCache::put(uint64_t fileId, uint64_t block, const char *data)
+{
+    BlockKey key(fileId, block);
+    Partition &p = partitionOf(key);
+    LockHolder lh(p.mutex);
+    if (p.index.find(key) != p.index.end()) {
+        return;
+    }
+
+    Entry entry;
+    entry.key = key;
+    if (p.lru.size() >= maxBlocks / NUM_PARTITIONS) {
+        // Reuse the buffer of the least recently used block.
+        entry.data = p.lru.back().data;
+        p.index.erase(p.lru.back().key);
+        p.lru.pop_back();
+        ++numEvictions;
+    } else {
+        entry.data = new char[BLOCK_SIZE];
+        ++numBlocks;
+    }
+    memcpy(entry.data, data, BLOCK_SIZE);
+    p.lru.push_front(entry);
+    p.index[key] = p.lru.begin();
+}
@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_BLOCK_CACHE_H_
+#define SRC_COUCH_KVSTORE_COUCH_BLOCK_CACHE_H_ 1
+
+#include "config.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "atomic.h"
+#include "mutex.h"
+
+/**
+ * LRU cache of fixed size blocks of couchstore files, filled by the file
+ * ops so that hot B-tree nodes are served from memory owned (and
+ * accounted) by the engine rather than from the kernel page cache.
+ *
+ * couchstore files are append only: once the file has grown past a block
+ * the block never changes, only blocks entirely below the size a file
+ * handle saw when it was opened may be inserted. A file that is replaced
+ * (compacted, deleted or recreated) gets a new identity, either through
+ * invalidate() or because its inode changed.
+ *
+ * The blocks are spread over independently locked partitions to keep
+ * concurrent readers from contending.
+ */
+class CouchBlockCache {
+public:
+    static const size_t BLOCK_SIZE = 4096;
+
+    /**
+     * @param capacity memory budget of the cached blocks in bytes, 0
+     *        disables the cache
+     */
+    CouchBlockCache(size_t capacity);
+
+    ~CouchBlockCache();
+
+    bool isEnabled() const {
+        return maxBlocks > 0;
+    }
+
+    /**
+     * Get the identity under which the blocks of a file are cached.
+     */
+    uint64_t getFileId(const std::string &path, uint64_t inode);
+
+    /**
+     * Forget the blocks of all files whose path starts with the prefix.
+     */
+    void invalidate(const std::string &prefix);
+
+    /**
+     * Copy part of a cached block.
+     *
+     * @return false if the block isn't cached
+     */
+    bool get(uint64_t fileId, uint64_t block, size_t offset, size_t len,
+             char *buf);
+
+    /**
+     * Cache a copy of a full block.
+     */
+    void put(uint64_t fileId, uint64_t block, const char *data);
+
+    size_t getMemoryUsed() const {
+        return numBlocks.load() * BLOCK_SIZE;
+    }
+
+    AtomicValue<size_t> numHits;
+    AtomicValue<size_t> numMisses;
+    AtomicValue<size_t> numEvictions;
+
+private:
+    typedef std::pair<uint64_t, uint64_t> BlockKey;
+
+    struct Entry {
+        BlockKey key;
+        char *data;
+    };
+
+    struct Partition {
+        Partition() { }
+
+        Mutex mutex;
+        /* most recently used first */
+        std::list<Entry> lru;
+        std::map<BlockKey, std::list<Entry>::iterator> index;
+
+        DISALLOW_COPY_AND_ASSIGN(Partition);
+    };
+
+    static const size_t NUM_PARTITIONS = 16;
+
+    Partition &partitionOf(const BlockKey &key) {
+        return partitions[(key.first * 31 + key.second) % NUM_PARTITIONS];
+    }
+
+    size_t maxBlocks;
+    AtomicValue<size_t> numBlocks;
+    Partition partitions[NUM_PARTITIONS];
+
+    Mutex filesMutex;
+    /* path -> (inode, identity) */
+    std::map<std::string, std::pair<uint64_t, uint64_t> > files;
+    uint64_t nextFileId;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchBlockCache);
+};
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_BLOCK_CACHE_H_
@@ -17,9 +17,19 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
+
 #include "common.h"
 #include "couch-kvstore/couch-fs-stats.h"
 #include "histo.h"
+#include "locks.h"
 
 extern "C" {
 static couch_file_handle cfs_construct(couchstore_error_info_t*, void* cookie);
@@ -39,7 +49,7 @@ static couchstore_error_t cfs_advise(couchstore_error_info_t*,
 static void cfs_destroy(couchstore_error_info_t*,couch_file_handle);
 }
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
+couch_file_ops getCouchstoreStatsOps(CouchstoreFileOpsCtx* ctx) {
     couch_file_ops ops = {
         5,
         cfs_construct,
@@ -51,7 +61,7 @@ couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
         cfs_sync,
         cfs_advise,
         cfs_destroy,
-        stats
+        ctx
     };
     return ops;
 }
@@ -60,14 +70,244 @@ struct StatFile {
     const couch_file_ops* orig_ops;
     couch_file_handle orig_handle;
     CouchstoreStats* stats;
+    DeferredSyncs* syncs;
     cs_off_t last_offs;
+    std::string path;
+    CouchBlockCache* cache;
+    IoThrottle* throttle;
+    bool direct_io;
+    // Reads go through whole blocks (cached or read with O_DIRECT).
+    bool block_reads;
+    uint64_t file_id;
+    // Size of the file when opened, the data below it never changes.
+    cs_off_t stable_size;
+    int direct_fd;
+    char* scratch;
 };
 
+static char *allocBlocks(size_t len) {
+#ifdef _MSC_VER
+    return static_cast<char *>(_aligned_malloc(len,
+                                               CouchBlockCache::BLOCK_SIZE));
+#else
+    void *p = NULL;
+    if (posix_memalign(&p, CouchBlockCache::BLOCK_SIZE, len) != 0) {
+        return NULL;
+    }
+    return static_cast<char *>(p);
+#endif
+}
+
+static void freeBlocks(char *p) {
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static void stopBlockReads(StatFile *sf) {
+    if (sf->direct_fd >= 0) {
+        ::close(sf->direct_fd);
+        sf->direct_fd = -1;
+    }
+    if (sf->scratch) {
+        freeBlocks(sf->scratch);
+        sf->scratch = NULL;
+    }
+    sf->block_reads = false;
+}
+
+static ssize_t readBlocks(couchstore_error_info_t *errinfo, StatFile *sf,
+                          char *buf, size_t len, cs_off_t offset) {
+#ifndef _MSC_VER
+    if (sf->direct_fd >= 0) {
+        ssize_t rv;
+        do {
+            rv = ::pread(sf->direct_fd, buf, len, offset);
+        } while (rv < 0 && errno == EINTR);
+        if (rv < 0) {
+            errinfo->error = errno;
+            return COUCHSTORE_ERROR_READ;
+        }
+        return rv;
+    }
+#endif
+    return sf->orig_ops->pread(errinfo, sf->orig_handle, buf, len, offset);
+}
+
+/**
+ * Read through whole aligned blocks. Blocks that are entirely below the
+ * stable size of the file are served from / added to the block cache.
+ */
+static ssize_t blockPread(couchstore_error_info_t *errinfo, StatFile *sf,
+                          char *buf, size_t sz, cs_off_t off) {
+    const size_t bs = CouchBlockCache::BLOCK_SIZE;
+    if (sz > bs) {
+        // Document bodies; not worth caching, but O_DIRECT still needs
+        // them aligned.
+        if (sf->direct_fd < 0) {
+            return sf->orig_ops->pread(errinfo, sf->orig_handle, buf, sz,
+                                       off);
+        }
+        cs_off_t start = off - off % bs;
+        size_t skip = static_cast<size_t>(off - start);
+        size_t len = (skip + sz + bs - 1) / bs * bs;
+        char *tmp = allocBlocks(len);
+        if (tmp == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        ssize_t got = readBlocks(errinfo, sf, tmp, len, start);
+        if (got >= 0) {
+            got = got > static_cast<ssize_t>(skip) ?
+                std::min(static_cast<ssize_t>(sz), got - (ssize_t)skip) : 0;
+            memcpy(buf, tmp + skip, got);
+        }
+        freeBlocks(tmp);
+        return got;
+    }
+
+    size_t done = 0;
+    while (done < sz) {
+        cs_off_t pos = off + done;
+        uint64_t block = pos / bs;
+        size_t skip = static_cast<size_t>(pos % bs);
+        size_t want = std::min(sz - done, bs - skip);
+        bool cacheable = sf->cache &&
+            static_cast<cs_off_t>((block + 1) * bs) <= sf->stable_size;
+        if (cacheable &&
+            sf->cache->get(sf->file_id, block, skip, want, buf + done)) {
+            done += want;
+            continue;
+        }
+
+        ssize_t got = readBlocks(errinfo, sf, sf->scratch, bs, block * bs);
+        if (got < 0) {
+            return got;
+        }
+        if (cacheable && static_cast<size_t>(got) == bs) {
+            sf->cache->put(sf->file_id, block, sf->scratch);
+        }
+        if (static_cast<size_t>(got) <= skip) {
+            break;
+        }
+        size_t n = std::min(want, static_cast<size_t>(got) - skip);
+        memcpy(buf + done, sf->scratch + skip, n);
+        done += n;
+        if (n < want) {
+            break;
+        }
+    }
+    return done;
+}
+
+IoThrottle::IoThrottle(size_t rate) :
+    numBytes(0), numThrottled(0), throttleTime(0), bytesPerSec(rate),
+    burst(rate / 10.0), tokens(rate / 10.0), lastRefill(gethrtime()) { }
+
+void IoThrottle::consume(size_t bytes) {
+    numBytes.fetch_add(bytes);
+    if (bytesPerSec == 0) {
+        return;
+    }
+
+    LockHolder lh(mutex);
+    hrtime_t now = gethrtime();
+    tokens += (now - lastRefill) * (bytesPerSec / 1000000000.0);
+    if (tokens > burst) {
+        tokens = burst;
+    }
+    lastRefill = now;
+    tokens -= bytes;
+    if (tokens >= 0) {
+        return;
+    }
+    size_t wait = static_cast<size_t>(-tokens * 1000000 / bytesPerSec);
+    lh.unlock();
+
+    ++numThrottled;
+    throttleTime.fetch_add(wait);
+    usleep(wait);
+}
+
+void DeferredSyncs::setDeferring(bool to) {
+#ifdef _MSC_VER
+    // Syncing by path isn't supported here, always sync right away.
+    (void)to;
+#else
+    deferring = to;
+#endif
+}
+
+bool DeferredSyncs::syncAll(CouchstoreStats &stats, size_t &synced,
+                            std::vector<std::string> &failed) {
+    synced = 0;
+    failed.clear();
+    if (files.empty()) {
+        return true;
+    }
+
+    bool ret = true;
+    std::vector<std::pair<int, std::string> > fds;
+    std::set<std::string>::iterator it = files.begin();
+    for (; it != files.end(); ++it) {
+        int fd = open(it->c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (errno != ENOENT) {
+                LOG(EXTENSION_LOG_WARNING, "Failed to open %s for a deferred "
+                    "sync: %s", it->c_str(), strerror(errno));
+                failed.push_back(*it);
+                ret = false;
+            }
+            continue;
+        }
+        fds.push_back(std::make_pair(fd, *it));
+    }
+
+    std::vector<int> handles;
+    std::vector<std::pair<int, std::string> >::iterator fit = fds.begin();
+    for (; fit != fds.end(); ++fit) {
+        handles.push_back(fit->first);
+    }
+
+    std::vector<int> errors;
+    {
+        BlockTimer bt(&stats.syncTimeHisto);
+        ring.syncAll(handles, errors);
+    }
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        if (errors[i] == 0) {
+            ++synced;
+        } else {
+            LOG(EXTENSION_LOG_WARNING, "Deferred sync of %s failed: %s",
+                fds[i].second.c_str(), strerror(errors[i]));
+            failed.push_back(fds[i].second);
+            ret = false;
+        }
+        ::close(fds[i].first);
+    }
+
+    files.clear();
+    files.insert(failed.begin(), failed.end());
+    return ret;
+}
+
 extern "C" {
     static couch_file_handle cfs_construct(couchstore_error_info_t *errinfo,
                                            void* cookie) {
         StatFile* sf = new StatFile;
-        sf->stats = static_cast<CouchstoreStats*>(cookie);
+        CouchstoreFileOpsCtx* ctx = static_cast<CouchstoreFileOpsCtx*>(cookie);
+        sf->stats = ctx->stats;
+        sf->syncs = ctx->syncs;
+        sf->cache = (ctx->cache && ctx->cache->isEnabled()) ? ctx->cache : NULL;
+        sf->throttle = ctx->throttle;
+        sf->direct_io = ctx->directIO;
+        sf->block_reads = false;
+        sf->file_id = 0;
+        sf->stable_size = 0;
+        sf->direct_fd = -1;
+        sf->scratch = NULL;
         sf->orig_ops = couchstore_get_default_file_ops();
         sf->orig_handle = sf->orig_ops->constructor(errinfo,
                                                     sf->orig_ops->cookie);
@@ -80,12 +320,45 @@ extern "C" {
                                        const char* path,
                                        int flags) {
         StatFile* sf = reinterpret_cast<StatFile*>(*h);
-        return sf->orig_ops->open(errinfo, &sf->orig_handle, path, flags);
+        sf->path.assign(path);
+        couchstore_error_t err = sf->orig_ops->open(errinfo, &sf->orig_handle,
+                                                    path, flags);
+        struct stat st;
+        if (err != COUCHSTORE_SUCCESS || (!sf->cache && !sf->direct_io) ||
+            stat(path, &st) != 0) {
+            return err;
+        }
+
+#ifdef O_DIRECT
+        if (sf->direct_io && (flags & O_ACCMODE) == O_RDONLY) {
+            sf->direct_fd = ::open(path, O_RDONLY | O_DIRECT);
+            if (sf->direct_fd < 0) {
+                // e.g. tmpfs; keep using the page cache.
+                LOG(EXTENSION_LOG_DEBUG, "Failed to open %s with O_DIRECT: %s",
+                    path, strerror(errno));
+            }
+        }
+#endif
+        if (!sf->cache && sf->direct_fd < 0) {
+            return err;
+        }
+        sf->scratch = allocBlocks(CouchBlockCache::BLOCK_SIZE);
+        if (sf->scratch == NULL) {
+            stopBlockReads(sf);
+            return err;
+        }
+        if (sf->cache) {
+            sf->file_id = sf->cache->getFileId(sf->path, st.st_ino);
+        }
+        sf->stable_size = st.st_size;
+        sf->block_reads = true;
+        return err;
     }
 
     static void cfs_close(couchstore_error_info_t *errinfo,
                           couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        stopBlockReads(sf);
         sf->orig_ops->close(errinfo, sf->orig_handle);
     }
 
@@ -100,7 +373,13 @@ extern "C" {
             sf->stats->readSeekHisto.add(abs(off - sf->last_offs));
         }
         sf->last_offs = off;
+        if (sf->throttle) {
+            sf->throttle->consume(sz);
+        }
         BlockTimer bt(&sf->stats->readTimeHisto);
+        if (sf->block_reads) {
+            return blockPread(errinfo, sf, static_cast<char *>(buf), sz, off);
+        }
         return sf->orig_ops->pread(errinfo, sf->orig_handle, buf, sz, off);
     }
 
@@ -111,6 +390,9 @@ extern "C" {
                               cs_off_t off) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
         sf->stats->writeSizeHisto.add(sz);
+        if (sf->throttle) {
+            sf->throttle->consume(sz);
+        }
         BlockTimer bt(&sf->stats->writeTimeHisto);
         return sf->orig_ops->pwrite(errinfo, sf->orig_handle, buf, sz, off);
     }
@@ -124,6 +406,10 @@ extern "C" {
     static couchstore_error_t cfs_sync(couchstore_error_info_t *errinfo,
                                        couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (sf->syncs && sf->syncs->isDeferring()) {
+            sf->syncs->add(sf->path);
+            return COUCHSTORE_SUCCESS;
+        }
         BlockTimer bt(&sf->stats->syncTimeHisto);
         return sf->orig_ops->sync(errinfo, sf->orig_handle);
     }
@@ -140,6 +426,7 @@ extern "C" {
     static void cfs_destroy(couchstore_error_info_t *errinfo,
                             couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        stopBlockReads(sf);
         sf->orig_ops->destructor(errinfo, sf->orig_handle);
         delete sf;
     }
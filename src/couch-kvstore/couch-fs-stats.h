@@ -22,7 +22,15 @@
 
 #include <libcouchstore/couch_db.h>
 
+#include <set>
+#include <string>
+#include <vector>
+
+#include "couch-kvstore/couch-block-cache.h"
+#include "couch-kvstore/couch-fs-uring.h"
+#include "atomic.h"
 #include "histo.h"
+#include "mutex.h"
 
 struct CouchstoreStats {
 public:
@@ -54,6 +62,116 @@ public:
     }
 };
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats);
+/**
+ * Syncs of couchstore files postponed by the file ops while deferring is
+ * turned on, so that they can be issued together by syncAll().
+ *
+ * Not thread safe. The owning KVStore only commits, and so defers syncs,
+ * under its shard's write lock. Its compactions run without that lock,
+ * but they sync through file ops of their own that never defer.
+ */
+class DeferredSyncs {
+public:
+    DeferredSyncs(CouchIoRing &r) : deferring(false), ring(r) { }
+
+    void setDeferring(bool to);
+
+    bool isDeferring() const {
+        return deferring;
+    }
+
+    void add(const std::string &path) {
+        files.insert(path);
+    }
+
+    /**
+     * Sync all files whose sync was deferred. The syncs of the whole group
+     * are in flight together (or at least their writeback is started
+     * before waiting for any), so the disk sees them all at once. Files
+     * that no longer exist (compacted or deleted vbuckets) are skipped,
+     * whoever removed them has synced their replacement.
+     *
+     * A failed fsync may have dropped the dirty pages of the file, so
+     * syncing it again doesn't make its earlier writes durable: the files
+     * that failed are kept for the next call, but they are also reported
+     * so that the caller writes their data again.
+     *
+     * @param stats where to account the time spent syncing
+     * @param synced set to the number of files synced
+     * @param failed set to the paths of the files that failed to sync
+     * @return false if any file failed to sync
+     */
+    bool syncAll(CouchstoreStats &stats, size_t &synced,
+                 std::vector<std::string> &failed);
+
+private:
+    bool deferring;
+    CouchIoRing &ring;
+    std::set<std::string> files;
+};
+
+/**
+ * Token bucket limiting the bandwidth of the file ops it is attached to.
+ * A caller that takes more tokens than are left sleeps until the bucket
+ * has refilled them, so the long term rate never exceeds the limit while
+ * up to a tenth of a second worth of I/O can be issued in a burst.
+ *
+ * Thread safe.
+ */
+class IoThrottle {
+public:
+    /**
+     * @param rate bytes per second, 0 only counts the bytes
+     */
+    IoThrottle(size_t rate);
+
+    bool isEnabled() const {
+        return bytesPerSec > 0;
+    }
+
+    /**
+     * Account for the given number of bytes about to be read or written,
+     * waiting as long as needed to stay within the rate.
+     */
+    void consume(size_t bytes);
+
+    // bytes passed through the throttle
+    AtomicValue<size_t> numBytes;
+    // calls that had to wait, and the total time they waited (usec)
+    AtomicValue<size_t> numThrottled;
+    AtomicValue<size_t> throttleTime;
+
+private:
+    size_t bytesPerSec;
+    double burst;
+    Mutex mutex;
+    /* may go negative, that debt is paid off by the next callers */
+    double tokens;
+    hrtime_t lastRefill;
+
+    DISALLOW_COPY_AND_ASSIGN(IoThrottle);
+};
+
+/**
+ * Cookie of the file ops returned by getCouchstoreStatsOps(), shared by
+ * all file handles they create.
+ */
+struct CouchstoreFileOpsCtx {
+    CouchstoreFileOpsCtx(CouchstoreStats *s, DeferredSyncs *d = NULL,
+                         CouchBlockCache *c = NULL, bool direct = false,
+                         IoThrottle *t = NULL) :
+        stats(s), syncs(d), cache(c), directIO(direct), throttle(t) { }
+
+    CouchstoreStats *stats;
+    DeferredSyncs *syncs;
+    /* blocks read through the file ops are cached here, if enabled */
+    CouchBlockCache *cache;
+    /* read read-only files with O_DIRECT, bypassing the page cache */
+    bool directIO;
+    /* all reads and writes are paced by this throttle, if set */
+    IoThrottle *throttle;
+};
+
+couch_file_ops getCouchstoreStatsOps(CouchstoreFileOpsCtx* ctx);
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_FS_STATS_H_
@@ -0,0 +1,259 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "common.h"
+#include "couch-kvstore/couch-fs-uring.h"
+#include "locks.h"
+
+struct CouchIoRing::Request {
+    enum Op {
+        FADVISE,
+        FSYNC
+    };
+
+    Request(Op o, int f, cs_off_t off = 0, size_t len = 0) :
+        op(o), fd(f), offset(off), length(len), error(0) { }
+
+    Op op;
+    int fd;
+    cs_off_t offset;
+    size_t length;
+    int error;
+};
+
+CouchIoRing::CouchIoRing(size_t queueDepth) : depth(queueDepth), ring(NULL)
+{
+#ifdef HAVE_LIBURING
+    if (depth > 0) {
+        struct io_uring *r = new struct io_uring;
+        int ret = io_uring_queue_init(depth, r, 0);
+        if (ret < 0) {
+            LOG(EXTENSION_LOG_WARNING, "Failed to set up an io_uring of "
+                "depth %llu (%s), falling back to synchronous I/O",
+                static_cast<unsigned long long>(depth), strerror(-ret));
+            delete r;
+        } else {
+            ring = r;
+        }
+    }
+#endif
+}
+
+CouchIoRing::~CouchIoRing()
+{
+#ifdef HAVE_LIBURING
+    if (ring) {
+        struct io_uring *r = static_cast<struct io_uring *>(ring);
+        io_uring_queue_exit(r);
+        delete r;
+    }
+#endif
+}
+
+void CouchIoRing::prefetch(int fd, const std::vector<Extent> &extents)
+{
+    std::vector<Request> reqs;
+    reqs.reserve(extents.size());
+    std::vector<Extent>::const_iterator it = extents.begin();
+    for (; it != extents.end(); ++it) {
+        reqs.push_back(Request(Request::FADVISE, fd, it->first, it->second));
+    }
+    submit(reqs);
+}
+
+void CouchIoRing::prefetch(const std::vector<FileExtent> &extents)
+{
+    std::vector<Request> reqs;
+    reqs.reserve(extents.size());
+    std::vector<FileExtent>::const_iterator it = extents.begin();
+    for (; it != extents.end(); ++it) {
+        reqs.push_back(Request(Request::FADVISE, it->first,
+                               it->second.first, it->second.second));
+    }
+    submit(reqs);
+}
+
+void CouchIoRing::syncAll(const std::vector<int> &fds,
+                          std::vector<int> &errors)
+{
+    std::vector<Request> reqs;
+    reqs.reserve(fds.size());
+    std::vector<int>::const_iterator it = fds.begin();
+    for (; it != fds.end(); ++it) {
+        reqs.push_back(Request(Request::FSYNC, *it));
+    }
+
+    if (!isAsync()) {
+        // Get writeback of all files going before waiting for the first.
+#ifdef SYNC_FILE_RANGE_WRITE
+        for (it = fds.begin(); it != fds.end(); ++it) {
+            sync_file_range(*it, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+#endif
+    }
+    submit(reqs);
+
+    errors.clear();
+    std::vector<Request>::iterator rit = reqs.begin();
+    for (; rit != reqs.end(); ++rit) {
+        errors.push_back(rit->error);
+    }
+}
+
+void CouchIoRing::submit(std::vector<Request> &reqs)
+{
+    LockHolder lh(mutex);
+    size_t next = 0;
+#ifdef HAVE_LIBURING
+    while (ring && next < reqs.size()) {
+        struct io_uring *r = static_cast<struct io_uring *>(ring);
+        size_t first = next;
+        for (; next < reqs.size() && next - first < depth; ++next) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(r);
+            if (sqe == NULL) {
+                break;
+            }
+            Request &req = reqs[next];
+            if (req.op == Request::FSYNC) {
+                io_uring_prep_fsync(sqe, req.fd, 0);
+            } else {
+                io_uring_prep_fadvise(sqe, req.fd, req.offset, req.length,
+                                      POSIX_FADV_WILLNEED);
+            }
+            io_uring_sqe_set_data(sqe, &req);
+        }
+
+        size_t queued = next - first;
+        int ret = queued > 0 ? io_uring_submit_and_wait(r, queued) : -EBUSY;
+        size_t reaped = 0;
+        while (ret >= 0 && reaped < queued) {
+            struct io_uring_cqe *cqe = NULL;
+            ret = io_uring_wait_cqe(r, &cqe);
+            if (ret == -EINTR) {
+                ret = 0;
+                continue;
+            } else if (ret < 0) {
+                break;
+            }
+            Request *req = static_cast<Request *>(io_uring_cqe_get_data(cqe));
+            int res = cqe->res;
+            io_uring_cqe_seen(r, cqe);
+            ++reaped;
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                // The kernel doesn't know the opcode, e.g. fadvise < 5.6.
+                runSync(*req);
+            } else {
+                req->error = res < 0 ? -res : 0;
+            }
+        }
+
+        if (ret < 0) {
+            // Tearing the ring down is the only way to make sure nothing
+            // still refers to these requests once we return.
+            LOG(EXTENSION_LOG_WARNING, "io_uring failed (%s), falling back "
+                "to synchronous I/O", strerror(-ret));
+            io_uring_queue_exit(r);
+            delete r;
+            ring = NULL;
+            next = first;
+        }
+    }
+#endif
+
+    // Without a ring every request runs synchronously. Requests whose
+    // outcome got lost with a failed ring are simply repeated, syncing or
+    // advising a file twice is harmless.
+    for (; next < reqs.size(); ++next) {
+        runSync(reqs[next]);
+    }
+}
+
+void CouchIoRing::runSync(Request &req)
+{
+    req.error = 0;
+    if (req.op == Request::FSYNC) {
+        if (fsync(req.fd) != 0) {
+            req.error = errno;
+        }
+    } else {
+#ifdef POSIX_FADV_WILLNEED
+        req.error = posix_fadvise(req.fd, req.offset, req.length,
+                                  POSIX_FADV_WILLNEED);
+#endif
+    }
+}
+
+const size_t CouchScanReadahead::ALIGNMENT;
+
+CouchScanReadahead::CouchScanReadahead(CouchIoRing &r,
+                                       const std::string &path,
+                                       size_t bytes) :
+    ring(r), budget(bytes - bytes % ALIGNMENT), fd(-1), windowStart(0),
+    windowEnd(0)
+{
+    if (budget > 0) {
+        fd = ::open(path.c_str(), O_RDONLY);
+    }
+}
+
+CouchScanReadahead::~CouchScanReadahead()
+{
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+void CouchScanReadahead::advance(cs_off_t offset, size_t length)
+{
+    if (fd < 0) {
+        return;
+    }
+
+    cs_off_t start = offset - offset % ALIGNMENT;
+    cs_off_t end = start + budget;
+    if (offset < windowStart || offset > windowEnd) {
+        windowStart = start;
+    } else if (offset + static_cast<cs_off_t>(length) <=
+               windowEnd - static_cast<cs_off_t>(budget / 2)) {
+        return;
+    } else {
+        // Only the part beyond the current window still has to be read.
+        start = windowEnd;
+        windowStart = offset - offset % ALIGNMENT;
+    }
+
+    if (end < offset + static_cast<cs_off_t>(length)) {
+        end = offset + length;
+    }
+    if (end <= start) {
+        return;
+    }
+    std::vector<CouchIoRing::Extent> extents;
+    extents.push_back(std::make_pair(start, static_cast<size_t>(end - start)));
+    ring.prefetch(fd, extents);
+    windowEnd = end;
+}
@@ -0,0 +1,136 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_FS_URING_H_
+#define SRC_COUCH_KVSTORE_COUCH_FS_URING_H_ 1
+
+#include "config.h"
+
+#include <libcouchstore/couch_db.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mutex.h"
+
+/**
+ * Submits groups of file requests to the kernel together through an
+ * io_uring, so the device works on all of them at once instead of one
+ * system call at a time.
+ *
+ * When io_uring isn't built in, is refused by the kernel or the queue
+ * depth is 0, the requests are issued one by one with the equivalent
+ * synchronous calls.
+ *
+ * Thread safe, submissions of concurrent callers are serialized.
+ */
+class CouchIoRing {
+public:
+    typedef std::pair<cs_off_t, size_t> Extent;
+    typedef std::pair<int, Extent> FileExtent;
+
+    CouchIoRing(size_t queueDepth);
+
+    ~CouchIoRing();
+
+    /**
+     * Is the queue enabled at all (a non-zero depth was configured)?
+     */
+    bool isEnabled() const {
+        return depth > 0;
+    }
+
+    /**
+     * Are requests submitted through io_uring?
+     */
+    bool isAsync() const {
+        return ring != NULL;
+    }
+
+    /**
+     * Start reading the given extents of a file into the page cache,
+     * without waiting for the data.
+     */
+    void prefetch(int fd, const std::vector<Extent> &extents);
+
+    /**
+     * Start reading the given extents of several files into the page
+     * cache, without waiting for the data.
+     */
+    void prefetch(const std::vector<FileExtent> &extents);
+
+    /**
+     * fsync all the given files, with all syncs in flight at once.
+     *
+     * @param fds the files to sync
+     * @param errors set to 0 or the errno of the sync of each file
+     */
+    void syncAll(const std::vector<int> &fds, std::vector<int> &errors);
+
+private:
+    struct Request;
+
+    void submit(std::vector<Request> &reqs);
+    void runSync(Request &req);
+
+    size_t depth;
+    void *ring;
+    Mutex mutex;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchIoRing);
+};
+
+/**
+ * Keeps a window of a file ahead of a mostly sequential scan in the page
+ * cache, so the scan's small reads hit memory while the device streams
+ * the file in large chunks.
+ *
+ * The window is refilled once the cursor has used up half of it; a cursor
+ * that jumps outside of the window restarts it at its new position.
+ */
+class CouchScanReadahead {
+public:
+    /**
+     * @param ring queue the read-ahead is submitted through
+     * @param path the file being scanned
+     * @param budget size of the window in bytes, 0 disables read-ahead
+     */
+    CouchScanReadahead(CouchIoRing &ring, const std::string &path,
+                       size_t budget);
+
+    ~CouchScanReadahead();
+
+    /**
+     * The scan is about to read the given extent.
+     */
+    void advance(cs_off_t offset, size_t length);
+
+private:
+    static const size_t ALIGNMENT = 4096;
+
+    CouchIoRing &ring;
+    size_t budget;
+    int fd;
+    /* the part of the file currently read ahead */
+    cs_off_t windowStart;
+    cs_off_t windowEnd;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchScanReadahead);
+};
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_FS_URING_H_
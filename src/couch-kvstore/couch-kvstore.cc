@@ -117,6 +117,15 @@ static std::string getSystemStrerror(void) {
     return ss.str();
 }
 
+static std::string getDBFileName(const std::string &dbname,
+                                 uint16_t vbid,
+                                 uint64_t rev)
+{
+    std::stringstream ss;
+    ss << dbname << "/" << vbid << ".couch." << rev;
+    return ss.str();
+}
+
 static uint8_t determine_datatype(const unsigned char* value,
                                   size_t length) {
     if (checkUTF8JSON(value, length)) {
@@ -199,6 +208,20 @@ static bool allDigit(std::string &input)
     return true;
 }
 
+static bool getVBucketIdFromFileName(const std::string &filename,
+                                     uint16_t &vbid)
+{
+    size_t firstSlash = filename.rfind("/");
+    size_t start = firstSlash == std::string::npos ? 0 : firstSlash + 1;
+    std::string vbIdStr = filename.substr(start,
+                                          filename.find(".", start) - start);
+    if (vbIdStr.empty() || !allDigit(vbIdStr)) {
+        return false;
+    }
+    vbid = static_cast<uint16_t>(atoi(vbIdStr.c_str()));
+    return true;
+}
+
 static std::string couchkvstore_strerrno(Db *db, couchstore_error_t err) {
     return (err == COUCHSTORE_ERROR_OPEN_FILE ||
             err == COUCHSTORE_ERROR_READ ||
@@ -207,13 +230,44 @@ static std::string couchkvstore_strerrno(Db *db, couchstore_error_t err) {
 
 struct GetMultiCbCtx {
     GetMultiCbCtx(CouchKVStore &c, uint16_t v, vb_bgfetch_queue_t &f) :
-        cks(c), vbId(v), fetches(f) {}
+        cks(c), vbId(v), fetches(f), staged(NULL) {}
 
     CouchKVStore &cks;
     uint16_t vbId;
     vb_bgfetch_queue_t &fetches;
+    /* if set, the docinfos are only collected here */
+    std::vector<DocInfo *> *staged;
 };
 
+static DocInfo *copyDocInfo(const DocInfo *src) {
+    char *buf = new char[sizeof(DocInfo) + src->id.size + src->rev_meta.size];
+    DocInfo *dst = reinterpret_cast<DocInfo *>(buf);
+    *dst = *src;
+    dst->id.buf = buf + sizeof(DocInfo);
+    memcpy(dst->id.buf, src->id.buf, src->id.size);
+    dst->rev_meta.buf = dst->id.buf + src->id.size;
+    memcpy(dst->rev_meta.buf, src->rev_meta.buf, src->rev_meta.size);
+    return dst;
+}
+
+static void freeDocInfoCopy(DocInfo *docinfo) {
+    delete [] reinterpret_cast<char *>(docinfo);
+}
+
+static bool docInfoOffsetLess(const DocInfo *a, const DocInfo *b) {
+    return a->bp < b->bp;
+}
+
+static bool isMetaOnlyFetch(const std::list<VBucketBGFetchItem *> &fetches) {
+    std::list<VBucketBGFetchItem *>::const_iterator itr = fetches.begin();
+    for (; itr != fetches.end(); ++itr) {
+        if (!((*itr)->metaDataOnly)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 struct StatResponseCtx {
 public:
     StatResponseCtx(std::map<std::pair<uint16_t, uint16_t>, vbucket_state> &sm,
@@ -226,11 +280,16 @@ public:
 };
 
 struct LoadResponseCtx {
+    LoadResponseCtx() : readahead(NULL), bytesRead(0) { }
+
     shared_ptr<Callback<GetValue> > callback;
     shared_ptr<Callback<CacheLookup> > lookup;
     uint16_t vbucketId;
     bool keysonly;
     EPStats *stats;
+    /* keeps the file ahead of the scan cursor in memory, may be NULL */
+    CouchScanReadahead *readahead;
+    size_t bytesRead;
 };
 
 struct AllKeysCtx {
@@ -306,13 +365,48 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev,
     start = gethrtime();
 }
 
+/**
+ * With value only eviction the engine keeps every key in memory and knows
+ * itself whether a key is on disk, the docinfos need only be read ahead of
+ * a write under full eviction.
+ */
+static bool needsDocInfoPreread(Configuration &config) {
+    return config.isCouchDocinfoPreread() ||
+           config.getItemEvictionPolicy().compare("value_only") != 0;
+}
+
+/**
+ * The block cache budget is split evenly over the read-only and the
+ * read-write store of every shard.
+ */
+static size_t blockCacheShare(Configuration &config) {
+    return config.getCouchBlockCacheSize() / (2 * config.getMaxNumShards());
+}
+
+/**
+ * Only the read-write store of a shard compacts, it gets the shard's share
+ * of the compaction bandwidth.
+ */
+static size_t compactionRateShare(Configuration &config) {
+    return config.getCompactionIoRate() / config.getMaxNumShards();
+}
+
 CouchKVStore::CouchKVStore(EPStats &stats, Configuration &config, bool read_only) :
     KVStore(read_only), epStats(stats), configuration(config),
     dbname(configuration.getDbname()), couchNotifier(NULL),
-    intransaction(false), dbFileRevMapPopulated(false)
+    intransaction(false), dbFileRevMapPopulated(false),
+    docInfoPreread(needsDocInfoPreread(configuration)),
+    ioRing(configuration.getCouchIoQueueDepth()), deferredSyncs(ioRing),
+    blockCache(blockCacheShare(configuration)),
+    fileOpsCtx(&st.fsStats, &deferredSyncs, &blockCache,
+               configuration.isCouchDirectIo()),
+    compactThrottle(compactionRateShare(configuration)),
+    compactFileOpsCtx(&st.fsStats, NULL, NULL, false, &compactThrottle),
+    handleCacheSize(configuration.getCouchHandleCacheSize())
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    statCollectingFileOps = getCouchstoreStatsOps(&fileOpsCtx);
+    compactFileOps = getCouchstoreStatsOps(&compactFileOpsCtx);
 
     // init db file map with default revision number, 1
     numDbFiles = static_cast<uint16_t>(configuration.getMaxVbuckets());
@@ -328,10 +422,19 @@ CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     couchNotifier(NULL), dbFileRevMap(copyFrom.dbFileRevMap),
     numDbFiles(copyFrom.numDbFiles),
     intransaction(false),
-    dbFileRevMapPopulated(copyFrom.dbFileRevMapPopulated)
+    dbFileRevMapPopulated(copyFrom.dbFileRevMapPopulated),
+    docInfoPreread(copyFrom.docInfoPreread),
+    ioRing(configuration.getCouchIoQueueDepth()), deferredSyncs(ioRing),
+    blockCache(blockCacheShare(configuration)),
+    fileOpsCtx(&st.fsStats, &deferredSyncs, &blockCache,
+               configuration.isCouchDirectIo()),
+    compactThrottle(compactionRateShare(configuration)),
+    compactFileOpsCtx(&st.fsStats, NULL, NULL, false, &compactThrottle),
+    handleCacheSize(copyFrom.handleCacheSize)
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    statCollectingFileOps = getCouchstoreStatsOps(&fileOpsCtx);
+    compactFileOps = getCouchstoreStatsOps(&compactFileOpsCtx);
 }
 
 void CouchKVStore::reset(uint16_t shardId)
@@ -354,9 +457,12 @@ void CouchKVStore::reset(uint16_t shardId)
         }
         itor->second.checkpointId = 0;
         itor->second.maxDeletedSeqno = 0;
+        closeCachedDBs(vbucket);
         resetVBucket(vbucket, itor->second);
         updateDbFileMap(vbucket, 1);
     }
+    // The headers not yet announced belong to the files just reset
+    deferredHeaderPos.clear();
 }
 
 void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb)
@@ -382,8 +488,9 @@ void CouchKVStore::get(const std::string &key, uint64_t, uint16_t vb,
     GetValue rv;
     uint64_t fileRev = dbFileRevMap[vb];
 
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = openCachedDB(vb, fileRev, &db,
+                                              COUCHSTORE_OPEN_FLAG_RDONLY,
+                                              &fileRev);
     if (errCode != COUCHSTORE_SUCCESS) {
         ++st.numGetFailure;
         LOG(EXTENSION_LOG_WARNING,
@@ -396,7 +503,7 @@ void CouchKVStore::get(const std::string &key, uint64_t, uint16_t vb,
     }
 
     getWithHeader(db, key, vb, cb, fetchDelete);
-    closeDatabaseHandle(db);
+    releaseCachedDB(vb, fileRev, db);
 }
 
 void CouchKVStore::getWithHeader(void *dbHandle, const std::string &key,
@@ -454,61 +561,219 @@ void CouchKVStore::getWithHeader(void *dbHandle, const std::string &key,
     cb.callback(rv);
 }
 
+/**
+ * The state of the getMulti of one vbucket file between looking its keys
+ * up and fetching the documents.
+ */
+struct CouchKVStore::MultiGetFile {
+    MultiGetFile(CouchKVStore &c, uint16_t v, vb_bgfetch_queue_t &f) :
+        vb(v), fileRev(0), db(NULL), errCode(COUCHSTORE_SUCCESS), itms(f),
+        ctx(c, v, f) {}
+
+    uint16_t vb;
+    uint64_t fileRev;
+    Db *db;
+    couchstore_error_t errCode;
+    vb_bgfetch_queue_t &itms;
+    GetMultiCbCtx ctx;
+    /* the docinfos found, in file offset order */
+    std::vector<DocInfo *> staged;
+};
+
+/* at most this many files are kept open by a getMultiVBuckets() */
+static const size_t MAX_MULTIGET_FILES = 16;
+
+/* the order of the keys in the by-id tree */
+static bool sizedBufLess(const sized_buf &a, const sized_buf &b) {
+    int rv = memcmp(a.buf, b.buf, std::min(a.size, b.size));
+    return rv < 0 || (rv == 0 && a.size < b.size);
+}
+
 void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
+{
+    MultiGetFile mg(*this, vb, itms);
+    beginMultiGet(mg);
+    std::vector<MultiGetFile *> files(1, &mg);
+    prefetchDocs(files);
+    endMultiGet(mg);
+}
+
+void CouchKVStore::getMultiVBuckets(vb_bgfetch_plan_t &plan)
+{
+    vb_bgfetch_plan_t::iterator it = plan.begin();
+    while (it != plan.end()) {
+        std::vector<MultiGetFile *> files;
+        for (; it != plan.end() && files.size() < MAX_MULTIGET_FILES; ++it) {
+            files.push_back(new MultiGetFile(*this, it->first, it->second));
+            beginMultiGet(*files.back());
+        }
+
+        prefetchDocs(files);
+
+        std::vector<MultiGetFile *>::iterator fit = files.begin();
+        for (; fit != files.end(); ++fit) {
+            endMultiGet(**fit);
+            delete *fit;
+        }
+    }
+}
+
+void CouchKVStore::beginMultiGet(MultiGetFile &mg)
 {
     std::string dbFile;
-    int numItems = itms.size();
-    uint64_t fileRev = dbFileRevMap[vb];
+    int numItems = mg.itms.size();
+    mg.fileRev = dbFileRevMap[mg.vb];
 
-    Db *db = NULL;
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
-    if (errCode != COUCHSTORE_SUCCESS) {
+    mg.errCode = openCachedDB(mg.vb, mg.fileRev, &mg.db,
+                              COUCHSTORE_OPEN_FLAG_RDONLY, &mg.fileRev);
+    if (mg.errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Warning: failed to open database for data fetch, "
             "vBucketId = %d file = %s numDocs = %d\n",
-            vb, dbFile.c_str(), numItems);
+            mg.vb, dbFile.c_str(), numItems);
         st.numGetFailure.fetch_add(numItems);
-        vb_bgfetch_queue_t::iterator itr = itms.begin();
-        for (; itr != itms.end(); ++itr) {
+        vb_bgfetch_queue_t::iterator itr = mg.itms.begin();
+        for (; itr != mg.itms.end(); ++itr) {
             std::list<VBucketBGFetchItem *> &fetches = (*itr).second;
             std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
             for (; fitr != fetches.end(); ++fitr) {
                 (*fitr)->value.setStatus(ENGINE_NOT_MY_VBUCKET);
             }
         }
+        mg.db = NULL;
         return;
     }
 
+    if (mg.itms.empty()) {
+        return;
+    }
+
+    // Look the keys up in the order of the by-id tree, so that the lookups
+    // of neighbouring keys share the reads of the tree nodes.
+    std::vector<sized_buf> ids(mg.itms.size());
     size_t idx = 0;
-    sized_buf *ids = new sized_buf[itms.size()];
-    vb_bgfetch_queue_t::iterator itr = itms.begin();
-    for (; itr != itms.end(); ++itr) {
+    vb_bgfetch_queue_t::iterator itr = mg.itms.begin();
+    for (; itr != mg.itms.end(); ++itr) {
         ids[idx].size = itr->first.size();
         ids[idx].buf = const_cast<char *>(itr->first.c_str());
         ++idx;
     }
+    std::sort(ids.begin(), ids.end(), sizedBufLess);
 
-    GetMultiCbCtx ctx(*this, vb, itms);
-    errCode = couchstore_docinfos_by_id(db, ids, itms.size(),
-                                        0, getMultiCbC, &ctx);
-    if (errCode != COUCHSTORE_SUCCESS) {
+    if (ioRing.isEnabled()) {
+        // Look all the keys up before reading any document body, so that
+        // the reads of the bodies can be submitted together.
+        mg.ctx.staged = &mg.staged;
+    }
+    mg.errCode = couchstore_docinfos_by_id(mg.db, &ids[0], ids.size(),
+                                           0, getMultiCbC, &mg.ctx);
+    mg.ctx.staged = NULL;
+    std::sort(mg.staged.begin(), mg.staged.end(), docInfoOffsetLess);
+}
+
+void CouchKVStore::endMultiGet(MultiGetFile &mg)
+{
+    if (mg.db == NULL) {
+        return;
+    }
+
+    std::string dbFile;
+    int numItems = mg.itms.size();
+    if (mg.errCode == COUCHSTORE_SUCCESS) {
+        std::vector<DocInfo *>::iterator sit = mg.staged.begin();
+        for (; sit != mg.staged.end(); ++sit) {
+            getMultiCb(mg.db, *sit, &mg.ctx);
+        }
+    }
+    std::for_each(mg.staged.begin(), mg.staged.end(), freeDocInfoCopy);
+    mg.staged.clear();
+
+    if (mg.errCode != COUCHSTORE_SUCCESS) {
         st.numGetFailure.fetch_add(numItems);
-        for (itr = itms.begin(); itr != itms.end(); ++itr) {
+        vb_bgfetch_queue_t::iterator itr = mg.itms.begin();
+        for (; itr != mg.itms.end(); ++itr) {
             LOG(EXTENSION_LOG_WARNING, "Warning: failed to read database by"
                 " vBucketId = %d key = %s file = %s error = %s [%s]\n",
-                vb, (*itr).first.c_str(),
-                dbFile.c_str(), couchstore_strerror(errCode),
-                couchkvstore_strerrno(db, errCode).c_str());
+                mg.vb, (*itr).first.c_str(),
+                dbFile.c_str(), couchstore_strerror(mg.errCode),
+                couchkvstore_strerrno(mg.db, mg.errCode).c_str());
             std::list<VBucketBGFetchItem *> &fetches = (*itr).second;
             std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
             for (; fitr != fetches.end(); ++fitr) {
-                (*fitr)->value.setStatus(couchErr2EngineErr(errCode));
+                (*fitr)->value.setStatus(couchErr2EngineErr(mg.errCode));
             }
         }
     }
-    closeDatabaseHandle(db);
-    delete []ids;
+    releaseCachedDB(mg.vb, mg.fileRev, mg.db,
+                    mg.errCode == COUCHSTORE_SUCCESS);
+    mg.db = NULL;
+}
+
+/**
+ * Upper bound of the bytes a document body takes in the file: the body is
+ * stored behind an 8 byte length/crc header, with a block marker byte at
+ * every 4k boundary it crosses.
+ */
+static size_t bodyExtentLength(const DocInfo *docinfo) {
+    size_t len = docinfo->size + 8;
+    return len + len / 4095 + 1;
+}
+
+void CouchKVStore::prefetchDocs(std::vector<MultiGetFile *> &files)
+{
+    std::vector<std::vector<CouchIoRing::Extent> > fileExtents(files.size());
+    size_t numExtents = 0;
+    for (size_t ii = 0; ii < files.size(); ++ii) {
+        MultiGetFile &mg = *files[ii];
+        if (mg.db == NULL || mg.errCode != COUCHSTORE_SUCCESS) {
+            continue;
+        }
+        std::vector<DocInfo *>::iterator it = mg.staged.begin();
+        for (; it != mg.staged.end(); ++it) {
+            DocInfo *docinfo = *it;
+            std::string key(docinfo->id.buf, docinfo->id.size);
+            vb_bgfetch_queue_t::iterator qitr = mg.itms.find(key);
+            if (docinfo->deleted || qitr == mg.itms.end() ||
+                isMetaOnlyFetch(qitr->second)) {
+                continue;
+            }
+            fileExtents[ii].push_back(std::make_pair(docinfo->bp,
+                                                     bodyExtentLength(docinfo)));
+        }
+        numExtents += fileExtents[ii].size();
+    }
+
+    if (numExtents < 2) {
+        // A single read gains nothing from being submitted ahead.
+        return;
+    }
+
+    // The reads of all the files go into the queue together
+    std::vector<CouchIoRing::FileExtent> extents;
+    std::vector<int> fds;
+    for (size_t ii = 0; ii < files.size(); ++ii) {
+        if (fileExtents[ii].empty()) {
+            continue;
+        }
+        std::string dbFileName = getDBFileName(dbname, files[ii]->vb,
+                                               files[ii]->fileRev);
+        int fd = ::open(dbFileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        fds.push_back(fd);
+        std::vector<CouchIoRing::Extent>::iterator it = fileExtents[ii].begin();
+        for (; it != fileExtents[ii].end(); ++it) {
+            extents.push_back(std::make_pair(fd, *it));
+        }
+    }
+
+    ioRing.prefetch(extents);
+    st.numDocsPrefetched.fetch_add(extents.size());
+    std::vector<int>::iterator fit = fds.begin();
+    for (; fit != fds.end(); ++fit) {
+        ::close(*fit);
+    }
 }
 
 void CouchKVStore::del(const Item &itm,
@@ -529,6 +794,7 @@ bool CouchKVStore::delVBucket(uint16_t vbucket, bool recreate)
     cb_assert(couchNotifier);
     RememberingCallback<bool> cb;
 
+    closeCachedDBs(vbucket);
     couchNotifier->delVBucket(vbucket, cb);
     cb.waitForValue();
 
@@ -596,67 +862,7 @@ vbucket_map_t CouchKVStore::listPersistedVbuckets()
 
 void CouchKVStore::getPersistedStats(std::map<std::string, std::string> &stats)
 {
-    char *buffer = NULL;
-    std::string fname = dbname + "/stats.json";
-    if (access(fname.c_str(), R_OK) == -1) {
-        return ;
-    }
-
-    std::ifstream session_stats;
-    session_stats.exceptions (session_stats.failbit | session_stats.badbit);
-    try {
-        session_stats.open(fname.c_str(), std::ios::binary);
-        session_stats.seekg(0, std::ios::end);
-        int flen = session_stats.tellg();
-        if (flen < 0) {
-            LOG(EXTENSION_LOG_WARNING,
-                "Warning: error in session stats ifstream!!!");
-            session_stats.close();
-            return;
-        }
-        session_stats.seekg(0, std::ios::beg);
-        buffer = new char[flen + 1];
-        session_stats.read(buffer, flen);
-        session_stats.close();
-        buffer[flen] = '\0';
-
-        cJSON *json_obj = cJSON_Parse(buffer);
-        if (!json_obj) {
-            LOG(EXTENSION_LOG_WARNING,
-                "Warning: failed to parse the session stats json doc!!!");
-            delete[] buffer;
-            return;
-        }
-
-        int json_arr_size = cJSON_GetArraySize(json_obj);
-        for (int i = 0; i < json_arr_size; ++i) {
-            cJSON *obj = cJSON_GetArrayItem(json_obj, i);
-            if (obj) {
-                stats[obj->string] = obj->valuestring ? obj->valuestring : "";
-            }
-        }
-        cJSON_Delete(json_obj);
-
-    } catch (const std::ifstream::failure &e) {
-        LOG(EXTENSION_LOG_WARNING,
-            "Warning: failed to load the engine session stats "
-            " due to IO exception \"%s\"", e.what());
-    } catch (...) {
-        LOG(EXTENSION_LOG_WARNING,
-            "Warning: failed to load the engine session stats "
-            " due to IO exception");
-    }
-
-    delete[] buffer;
-}
-
-static std::string getDBFileName(const std::string &dbname,
-                                 uint16_t vbid,
-                                 uint64_t rev)
-{
-    std::stringstream ss;
-    ss << dbname << "/" << vbid << ".couch." << rev;
-    return ss.str();
+    loadStatsFile(dbname, stats);
 }
 
 static int edit_docinfo_hook(DocInfo **info, const sized_buf *item) {
@@ -764,13 +970,13 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
                                   Callback<kvstats_ctx> &kvcb) {
     couchstore_compact_hook       hook = time_purge_hook;
     couchstore_docinfo_hook      dhook = edit_docinfo_hook;
-    const couch_file_ops     *def_iops = couchstore_get_default_file_ops();
     Db                      *compactdb = NULL;
     Db                       *targetDb = NULL;
     uint64_t                   fileRev = dbFileRevMap[vbid];
     uint64_t                   new_rev = fileRev + 1;
     couchstore_error_t         errCode = COUCHSTORE_SUCCESS;
     hrtime_t                     start = gethrtime();
+    size_t                  startBytes = compactThrottle.numBytes.load();
     uint64_t              newHeaderPos = 0;
     std::string                 dbfile;
     std::string           compact_file;
@@ -780,7 +986,8 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
 
     // Open the source VBucket database file ...
     errCode = openDB(vbid, fileRev, &compactdb,
-                     (uint64_t)COUCHSTORE_OPEN_FLAG_RDONLY, NULL);
+                     (uint64_t)COUCHSTORE_OPEN_FLAG_RDONLY, NULL,
+                     &compactFileOps);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
                 "Warning: failed to open database, vbucketId = %d "
@@ -795,7 +1002,8 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
 
     // Perform COMPACTION of vbucket.couch.rev into vbucket.couch.rev.compact
     errCode = couchstore_compact_db_ex(compactdb, compact_file.c_str(), 0,
-                                       hook, dhook, hook_ctx, def_iops);
+                                       hook, dhook, hook_ctx,
+                                       &compactFileOps);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Warning: failed to compact database with name=%s "
@@ -866,7 +1074,13 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
         cb.callback(*hook_ctx);
     }
 
-    st.compactHisto.add((gethrtime() - start) / 1000);
+    hrtime_t elapsed = gethrtime() - start;
+    st.compactHisto.add(elapsed / 1000);
+    if (elapsed > 0) {
+        size_t bytes = compactThrottle.numBytes.load() - startBytes;
+        st.lastCompactRate.store(static_cast<size_t>(
+            bytes * 1000000000.0 / elapsed / 1048576));
+    }
     return retVal;
 }
 
@@ -939,67 +1153,7 @@ bool CouchKVStore::snapshotVBuckets(const vbucket_map_t &vbstates,
 bool CouchKVStore::snapshotStats(const std::map<std::string, std::string> &stats)
 {
     cb_assert(!isReadOnly());
-    size_t count = 0;
-    size_t size = stats.size();
-    std::stringstream stats_buf;
-    stats_buf << "{";
-    std::map<std::string, std::string>::const_iterator it = stats.begin();
-    for (; it != stats.end(); ++it) {
-        stats_buf << "\"" << it->first << "\": \"" << it->second << "\"";
-        ++count;
-        if (count < size) {
-            stats_buf << ", ";
-        }
-    }
-    stats_buf << "}";
-
-    // TODO: This stats json should be written into the master database. However,
-    // we don't support the write synchronization between CouchKVStore in C++ and
-    // compaction manager in the erlang side for the master database yet. At this time,
-    // we simply log the engine stats into a separate json file. As part of futhre work,
-    // we need to get rid of the tight coupling between those two components.
-    bool rv = true;
-    std::string next_fname = dbname + "/stats.json.new";
-    std::ofstream new_stats;
-    new_stats.exceptions (new_stats.failbit | new_stats.badbit);
-    try {
-        new_stats.open(next_fname.c_str());
-        new_stats << stats_buf.str().c_str() << std::endl;
-        new_stats.flush();
-        new_stats.close();
-    } catch (const std::ofstream::failure& e) {
-        LOG(EXTENSION_LOG_WARNING, "Warning: failed to log the engine stats to "
-            "file \"%s\" due to IO exception \"%s\"; Not critical because new "
-            "stats will be dumped later, please ignore.",
-            next_fname.c_str(), e.what());
-        rv = false;
-    }
-
-    if (rv) {
-        std::string old_fname = dbname + "/stats.json.old";
-        std::string stats_fname = dbname + "/stats.json";
-        if (access(old_fname.c_str(), F_OK) == 0 && remove(old_fname.c_str()) != 0) {
-            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to remove '%s': %s",
-                old_fname.c_str(), strerror(errno));
-            remove(next_fname.c_str());
-            rv = false;
-        } else if (access(stats_fname.c_str(), F_OK) == 0 &&
-                   rename(stats_fname.c_str(), old_fname.c_str()) != 0) {
-            LOG(EXTENSION_LOG_WARNING,
-                "Warning: failed to rename '%s' to '%s': %s",
-                stats_fname.c_str(), old_fname.c_str(), strerror(errno));
-            remove(next_fname.c_str());
-            rv = false;
-        } else if (rename(next_fname.c_str(), stats_fname.c_str()) != 0) {
-            LOG(EXTENSION_LOG_WARNING,
-                "Warning: failed to rename '%s' to '%s': %s",
-                next_fname.c_str(), stats_fname.c_str(), strerror(errno));
-            remove(next_fname.c_str());
-            rv = false;
-        }
-    }
-
-    return rv;
+    return saveStatsFile(dbname, stats);
 }
 
 bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
@@ -1137,6 +1291,63 @@ bool CouchKVStore::commit(Callback<kvstats_ctx> *cb)
     return !intransaction;
 }
 
+bool CouchKVStore::commitNoSync(Callback<kvstats_ctx> *cb)
+{
+    cb_assert(!isReadOnly());
+    deferredSyncs.setDeferring(true);
+    bool ret = commit(cb);
+    deferredSyncs.setDeferring(false);
+    return ret;
+}
+
+bool CouchKVStore::syncDeferred(size_t &synced, std::set<uint16_t> &failed)
+{
+    cb_assert(!isReadOnly());
+    std::vector<std::string> files;
+    failed.clear();
+    bool ret = deferredSyncs.syncAll(st.fsStats, synced, files);
+    std::vector<std::string>::iterator fit = files.begin();
+    for (; fit != files.end(); ++fit) {
+        uint16_t vbid;
+        if (getVBucketIdFromFileName(*fit, vbid)) {
+            failed.insert(vbid);
+        }
+    }
+
+    // mccouch may only learn of the headers that are on disk, the ones of
+    // the vbuckets that failed are written again
+    std::vector<HeaderPos>::iterator it = deferredHeaderPos.begin();
+    for (; it != deferredHeaderPos.end() && !epStats.isShutdown; ++it) {
+        // A compaction since the commit announced its own file already
+        if (it->fileRev == dbFileRevMap[it->vbid] &&
+            failed.find(it->vbid) == failed.end()) {
+            notifyHeaderPos(it->vbid, it->fileRev, it->pos);
+        }
+    }
+    deferredHeaderPos.clear();
+    return ret;
+}
+
+void CouchKVStore::notifyHeaderPos(uint16_t vbid, uint64_t fileRev,
+                                   uint64_t headerPos)
+{
+    hrtime_t cs_begin = gethrtime();
+    if (couchNotifier->isAsync()) {
+        couchNotifier->notify_headerpos_update_async(vbid, fileRev,
+                                                     headerPos);
+    } else {
+        RememberingCallback<uint16_t> cb;
+        couchNotifier->notify_headerpos_update(vbid, fileRev, headerPos, cb);
+        if (cb.val != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            cb_assert(cb.val != PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to notify "
+                    "CouchDB of update for vbucket=%d, error=0x%x\n",
+                    vbid, cb.val);
+        }
+    }
+    st.notifyHisto.add((gethrtime() - cs_begin) / 1000);
+}
+
 uint64_t CouchKVStore::getLastPersistedSeqno(uint16_t vbid) {
     vbucket_map_t::iterator it = cachedVBStates.find(vbid);
     if (it != cachedVBStates.end()) {
@@ -1158,6 +1369,35 @@ void CouchKVStore::addStats(const std::string &prefix,
     addStat(prefix_str, "readTime",       st.readTimeHisto,   add_stat, c);
     addStat(prefix_str, "readSize",       st.readSizeHisto,   add_stat, c);
     addStat(prefix_str, "numLoadedVb",    st.numLoadedVb,     add_stat, c);
+    addStat(prefix_str, "handle_hits",    st.numHandleCacheHits,   add_stat, c);
+    addStat(prefix_str, "handle_misses",  st.numHandleCacheMisses, add_stat, c);
+    addStat(prefix_str, "handle_evicted", st.numHandleCacheEvictions,
+            add_stat, c);
+    addStat(prefix_str, "prefetched",     st.numDocsPrefetched, add_stat, c);
+    addStat(prefix_str, "scans",          st.numScans,     add_stat, c);
+    addStat(prefix_str, "scan_bytes",     st.scanBytes,    add_stat, c);
+    addStat(prefix_str, "scan_rate",      st.lastScanRate, add_stat, c);
+    if (!isReadOnly()) {
+        addStat(prefix_str, "compact_bytes", compactThrottle.numBytes,
+                add_stat, c);
+        addStat(prefix_str, "compact_rate", st.lastCompactRate, add_stat, c);
+        addStat(prefix_str, "compact_throttled", compactThrottle.numThrottled,
+                add_stat, c);
+        addStat(prefix_str, "compact_wait_time",
+                compactThrottle.throttleTime, add_stat, c);
+    }
+    if (blockCache.isEnabled()) {
+        size_t hits = blockCache.numHits.load();
+        size_t misses = blockCache.numMisses.load();
+        size_t evicted = blockCache.numEvictions.load();
+        size_t ratio = (hits + misses) ? hits * 100 / (hits + misses) : 0;
+        size_t mem = blockCache.getMemoryUsed();
+        addStat(prefix_str, "block_hits",      hits,    add_stat, c);
+        addStat(prefix_str, "block_misses",    misses,  add_stat, c);
+        addStat(prefix_str, "block_hit_ratio", ratio,   add_stat, c);
+        addStat(prefix_str, "block_evicted",   evicted, add_stat, c);
+        addStat(prefix_str, "block_mem",       mem,     add_stat, c);
+    }
 
     // failure stats
     addStat(prefix_str, "failure_open",   st.numOpenFailure, add_stat, c);
@@ -1184,6 +1424,7 @@ void CouchKVStore::addTimingStats(const std::string &prefix,
     addStat(prefix_str, "compact",     st.compactHisto,     add_stat, c);
     addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
     addStat(prefix_str, "save_documents", st.saveDocsHisto, add_stat, c);
+    addStat(prefix_str, "notify",      st.notifyHisto,      add_stat, c);
     addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
     addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
     addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
@@ -1232,8 +1473,9 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
 
     Db *db = NULL;
     uint64_t rev = dbFileRevMap[vbid];
-    couchstore_error_t errorCode = openDB(vbid, rev, &db,
-                                          COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errorCode = openCachedDB(vbid, rev, &db,
+                                                COUCHSTORE_OPEN_FLAG_RDONLY,
+                                                &rev);
     if (errorCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Failed to open database, name=%s/%d.couch.%lu",
@@ -1244,21 +1486,38 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
         errorCode = couchstore_db_info(db, &info);
         if (errorCode != COUCHSTORE_SUCCESS) {
             LOG(EXTENSION_LOG_WARNING, "Failed to read DB info for backfill");
-            closeDatabaseHandle(db);
+            releaseCachedDB(vbid, rev, db, false);
             abort();
         }
         SeqnoRange range(startSeqno, info.last_sequence);
         sr->callback(range);
 
+        size_t budget = keysOnly ? 0 :
+                        configuration.getCouchScanReadaheadSize();
+        CouchScanReadahead readahead(ioRing,
+                                     getDBFileName(dbname, vbid, rev),
+                                     budget);
         LoadResponseCtx ctx;
         ctx.vbucketId = vbid;
         ctx.keysonly = keysOnly;
         ctx.callback = cb;
         ctx.lookup = cl;
         ctx.stats = &epStats;
+        ctx.readahead = &readahead;
+        hrtime_t start = gethrtime();
         errorCode = couchstore_changes_since(db, startSeqno, options,
                                              recordDbDumpC,
                                              static_cast<void *>(&ctx));
+        if (errorCode == COUCHSTORE_SUCCESS) {
+            hrtime_t elapsed = gethrtime() - start;
+            st.numScans++;
+            st.scanBytes.fetch_add(ctx.bytesRead);
+            if (elapsed > 0) {
+                // bytes per ns * 10^9 / 2^20 = MB/s
+                st.lastScanRate.store(static_cast<size_t>(
+                    ctx.bytesRead * 1000000000.0 / elapsed / 1048576));
+            }
+        }
         if (errorCode != COUCHSTORE_SUCCESS) {
             if (errorCode == COUCHSTORE_ERROR_CANCEL) {
                 LOG(EXTENSION_LOG_WARNING,
@@ -1271,7 +1530,8 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
                 remVBucketFromDbFileMap(vbid);
             }
         }
-        closeDatabaseHandle(db);
+        releaseCachedDB(vbid, rev, db, errorCode == COUCHSTORE_SUCCESS ||
+                                       errorCode == COUCHSTORE_ERROR_CANCEL);
     }
 }
 
@@ -1303,6 +1563,7 @@ void CouchKVStore::open()
 void CouchKVStore::close()
 {
     intransaction = false;
+    closeAllCachedDBs();
     if (!isReadOnly()) {
         CouchNotifier::deleteNotifier();
     }
@@ -1352,6 +1613,9 @@ void CouchKVStore::updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev)
         return;
     }
 
+    if (dbFileRevMap[vbucketId] != newFileRev) {
+        closeCachedDBs(vbucketId);
+    }
     dbFileRevMap[vbucketId] = newFileRev;
 }
 
@@ -1359,10 +1623,13 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
                                         uint64_t fileRev,
                                         Db **db,
                                         uint64_t options,
-                                        uint64_t *newFileRev)
+                                        uint64_t *newFileRev,
+                                        couch_file_ops *ops)
 {
     std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
-    couch_file_ops* ops = &statCollectingFileOps;
+    if (ops == NULL) {
+        ops = &statCollectingFileOps;
+    }
 
     uint64_t newRevNum = fileRev;
     couchstore_error_t errorCode = COUCHSTORE_SUCCESS;
@@ -1416,6 +1683,149 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
     return errorCode;
 }
 
+couchstore_error_t CouchKVStore::openCachedDB(uint16_t vbucketId,
+                                              uint64_t fileRev,
+                                              Db **db,
+                                              uint64_t options,
+                                              uint64_t *newFileRev)
+{
+    // The writer keeps closing its file after each commit, mccouch gets
+    // notified of (and may compact) the file right after that.
+    if (handleCacheSize == 0 || !isReadOnly() ||
+        options != COUCHSTORE_OPEN_FLAG_RDONLY) {
+        return openDB(vbucketId, fileRev, db, options, newFileRev);
+    }
+
+    std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
+    struct stat fst;
+    bool exists = stat(dbFileName.c_str(), &fst) == 0;
+
+    LockHolder lh(handleCacheMutex);
+    std::map<uint16_t, CachedDb>::iterator it = handleCache.find(vbucketId);
+    if (it != handleCache.end()) {
+        CachedDb cached = it->second;
+        handleCacheLru.erase(cached.lruPos);
+        handleCache.erase(it);
+
+        // The handle only sees the file up to the header it last read or
+        // wrote. Reuse it only if the file is the same one and nobody
+        // appended to it since, otherwise it would miss those updates.
+        DbInfo info;
+        if (cached.rev == fileRev && exists &&
+            cached.ino == static_cast<uint64_t>(fst.st_ino) &&
+            couchstore_db_info(cached.db, &info) == COUCHSTORE_SUCCESS &&
+            info.file_size == static_cast<uint64_t>(fst.st_size)) {
+            handleInodes[cached.db] = cached.ino;
+            ++st.numHandleCacheHits;
+            *db = cached.db;
+            if (newFileRev != NULL) {
+                *newFileRev = fileRev;
+            }
+            return COUCHSTORE_SUCCESS;
+        }
+        lh.unlock();
+        closeDatabaseHandle(cached.db);
+        lh.lock();
+    }
+    ++st.numHandleCacheMisses;
+    lh.unlock();
+
+    uint64_t rev = fileRev;
+    couchstore_error_t errCode = openDB(vbucketId, fileRev, db, options,
+                                        &rev);
+    if (errCode == COUCHSTORE_SUCCESS) {
+        // The inode is only known if the file stat'ed above is the one
+        // that got opened, a handle without it isn't cached.
+        uint64_t ino = (exists && rev == fileRev) ? fst.st_ino : 0;
+        lh.lock();
+        handleInodes[*db] = ino;
+    }
+    if (newFileRev != NULL) {
+        *newFileRev = rev;
+    }
+    return errCode;
+}
+
+void CouchKVStore::releaseCachedDB(uint16_t vbucketId, uint64_t fileRev,
+                                   Db *db, bool reusable)
+{
+    Db *evicted = NULL;
+    {
+        LockHolder lh(handleCacheMutex);
+        uint64_t ino = 0;
+        std::map<Db *, uint64_t>::iterator in = handleInodes.find(db);
+        if (in != handleInodes.end()) {
+            ino = in->second;
+            handleInodes.erase(in);
+        }
+
+        if (reusable && ino != 0 && fileRev == dbFileRevMap[vbucketId] &&
+            handleCache.find(vbucketId) == handleCache.end()) {
+            handleCacheLru.push_front(vbucketId);
+            CachedDb &cached = handleCache[vbucketId];
+            cached.rev = fileRev;
+            cached.db = db;
+            cached.ino = ino;
+            cached.lruPos = handleCacheLru.begin();
+            db = NULL;
+
+            if (handleCache.size() > handleCacheSize) {
+                uint16_t victim = handleCacheLru.back();
+                handleCacheLru.pop_back();
+                evicted = handleCache[victim].db;
+                handleCache.erase(victim);
+                ++st.numHandleCacheEvictions;
+            }
+        }
+    }
+
+    if (db) {
+        closeDatabaseHandle(db);
+    }
+    if (evicted) {
+        closeDatabaseHandle(evicted);
+    }
+}
+
+void CouchKVStore::closeCachedDBs(uint16_t vbid)
+{
+    std::stringstream prefix;
+    prefix << dbname << "/" << vbid << ".couch.";
+    blockCache.invalidate(prefix.str());
+
+    Db *db = NULL;
+    {
+        LockHolder lh(handleCacheMutex);
+        std::map<uint16_t, CachedDb>::iterator it = handleCache.find(vbid);
+        if (it == handleCache.end()) {
+            return;
+        }
+        db = it->second.db;
+        handleCacheLru.erase(it->second.lruPos);
+        handleCache.erase(it);
+    }
+    closeDatabaseHandle(db);
+}
+
+void CouchKVStore::closeAllCachedDBs()
+{
+    std::vector<Db *> dbs;
+    {
+        LockHolder lh(handleCacheMutex);
+        std::map<uint16_t, CachedDb>::iterator it = handleCache.begin();
+        for (; it != handleCache.end(); ++it) {
+            dbs.push_back(it->second.db);
+        }
+        handleCache.clear();
+        handleCacheLru.clear();
+    }
+
+    std::vector<Db *>::iterator it = dbs.begin();
+    for (; it != dbs.end(); ++it) {
+        closeDatabaseHandle(*it);
+    }
+}
+
 couchstore_error_t CouchKVStore::openDB_retry(std::string &dbfile,
                                               uint64_t options,
                                               const couch_file_ops *ops,
@@ -1622,8 +2032,14 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
     exptime = ntohl(exptime);
     cas = ntohll(cas);
 
+    loadCtx->bytesRead += key.size + metadata.size;
     if (!loadCtx->keysonly && !docinfo->deleted) {
         couchstore_error_t errCode ;
+        if (loadCtx->readahead) {
+            loadCtx->readahead->advance(docinfo->bp,
+                                        bodyExtentLength(docinfo));
+        }
+        loadCtx->bytesRead += docinfo->size;
         errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc,
                                                    DECOMPRESS_DOC_BODIES);
 
@@ -1791,8 +2207,10 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
             kvctx.keyStats[key] = std::make_pair(false,
                     !docinfos[idx]->deleted);
         }
-        couchstore_docinfos_by_id(db, ids, (unsigned) docCount, 0,
-                readDocInfos, &kvctx);
+        if (docInfoPreread) {
+            couchstore_docinfos_by_id(db, ids, (unsigned) docCount, 0,
+                    readDocInfos, &kvctx);
+        }
         delete[] ids;
 
         hrtime_t cs_begin = gethrtime();
@@ -1828,14 +2246,13 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
             return errCode;
         }
 
-        RememberingCallback<uint16_t> cb;
         uint64_t newHeaderPos = couchstore_get_header_position(db);
-        couchNotifier->notify_headerpos_update(vbid, newFileRev, newHeaderPos, cb);
-        if (cb.val != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
-            cb_assert(cb.val != PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
-            LOG(EXTENSION_LOG_WARNING, "Warning: failed to notify "
-                    "CouchDB of update for vbucket=%d, error=0x%x\n",
-                    vbid, cb.val);
+        if (deferredSyncs.isDeferring()) {
+            // Announced by syncDeferred() once the header is on disk
+            HeaderPos hp = { vbid, newFileRev, newHeaderPos };
+            deferredHeaderPos.push_back(hp);
+        } else {
+            notifyHeaderPos(vbid, newFileRev, newHeaderPos);
         }
         st.batchSize.add(docCount);
 
@@ -1892,7 +2309,7 @@ void CouchKVStore::commitCallback(std::vector<CouchRequest *> &committedReqs,
             int rv = getMutationStatus(errCode);
             if (rv != -1) {
                 const std::string &key = committedReqs[index]->getKey();
-                if (kvctx.keyStats[key].first) {
+                if (kvctx.keyStats[key].first || !docInfoPreread) {
                     rv = 1; // Deletion is for an existing item on DB file.
                 } else {
                     rv = 0; // Deletion is for a non-existing item on DB file.
@@ -2021,12 +2438,15 @@ couchstore_error_t CouchKVStore::saveVBState(Db *db, vbucket_state &vbState)
 int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
 {
     cb_assert(docinfo);
-    std::string keyStr(docinfo->id.buf, docinfo->id.size);
     cb_assert(ctx);
     GetMultiCbCtx *cbCtx = static_cast<GetMultiCbCtx *>(ctx);
+    if (cbCtx->staged) {
+        cbCtx->staged->push_back(copyDocInfo(docinfo));
+        return 0;
+    }
+    std::string keyStr(docinfo->id.buf, docinfo->id.size);
     CouchKVStoreStats &st = cbCtx->cks.getCKVStoreStat();
 
-
     vb_bgfetch_queue_t::iterator qitr = cbCtx->fetches.find(keyStr);
     if (qitr == cbCtx->fetches.end()) {
         // this could be a serious race condition in couchstore,
@@ -2038,15 +2458,9 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
         return 0;
     }
 
-    bool meta_only = true;
     std::list<VBucketBGFetchItem *> &fetches = (*qitr).second;
-    std::list<VBucketBGFetchItem *>::iterator itr = fetches.begin();
-    for (; itr != fetches.end(); ++itr) {
-        if (!((*itr)->metaDataOnly)) {
-            meta_only = false;
-            break;
-        }
-    }
+    std::list<VBucketBGFetchItem *>::iterator itr;
+    bool meta_only = isMetaOnlyFetch(fetches);
 
     GetValue returnVal;
     couchstore_error_t errCode = cbCtx->cks.fetchDoc(db, docinfo, returnVal,
@@ -2200,15 +2614,16 @@ size_t CouchKVStore::getNumItems(uint16_t vbid, uint64_t min_seq,
     Db *db = NULL;
     uint64_t count = 0;
     uint64_t rev = dbFileRevMap[vbid];
-    couchstore_error_t errCode = openDB(vbid, rev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = openCachedDB(vbid, rev, &db,
+                                              COUCHSTORE_OPEN_FLAG_RDONLY,
+                                              &rev);
     if (errCode == COUCHSTORE_SUCCESS) {
         errCode = couchstore_changes_count(db, min_seq, max_seq, &count);
         if (errCode != COUCHSTORE_SUCCESS) {
             LOG(EXTENSION_LOG_WARNING, "Failed to get changes count for "
                 "vBucket = %d rev = %llu", vbid, rev);
         }
-        closeDatabaseHandle(db);
+        releaseCachedDB(vbid, rev, db, errCode == COUCHSTORE_SUCCESS);
     } else {
         LOG(EXTENSION_LOG_WARNING, "Failed to open database file for vBucket"
             " = %d rev = %llu", vbid, rev);
@@ -2380,7 +2795,10 @@ int populateAllKeys(Db *db, DocInfo *docinfo, void *ctx) {
     AllKeysCtx *allKeysCtx = (AllKeysCtx *)ctx;
     uint16_t keylen = docinfo->id.size;
     char *key = docinfo->id.buf;
-    (allKeysCtx->cb)->addtoAllKeys(keylen, key);
+    if (!(allKeysCtx->cb)->addtoAllKeys(keylen, key)) {
+        // The page is full, the client continues from the last key
+        return COUCHSTORE_ERROR_CANCEL;
+    }
     if (--(allKeysCtx->count) <= 0) {
         //Only when count met is less than the actual number of entries
         return COUCHSTORE_ERROR_CANCEL;
@@ -2394,8 +2812,9 @@ ENGINE_ERROR_CODE CouchKVStore::getAllKeys(uint16_t vbid,
                                            AllKeysCB *cb) {
     Db *db = NULL;
     uint64_t rev = dbFileRevMap[vbid];
-    couchstore_error_t errCode = openDB(vbid, rev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = openCachedDB(vbid, rev, &db,
+                                              COUCHSTORE_OPEN_FLAG_RDONLY,
+                                              &rev);
     if(errCode == COUCHSTORE_SUCCESS) {
         sized_buf ref = {NULL, 0};
         ref.buf = (char*) start_key.c_str();
@@ -2404,7 +2823,8 @@ ENGINE_ERROR_CODE CouchKVStore::getAllKeys(uint16_t vbid,
         errCode = couchstore_all_docs(db, &ref, COUCHSTORE_NO_OPTIONS,
                                       populateAllKeys,
                                       static_cast<void *>(&ctx));
-        closeDatabaseHandle(db);
+        releaseCachedDB(vbid, rev, db, errCode == COUCHSTORE_SUCCESS ||
+                                       errCode == COUCHSTORE_ERROR_CANCEL);
         if (errCode == COUCHSTORE_SUCCESS ||
                 errCode == COUCHSTORE_ERROR_CANCEL)  {
             return ENGINE_SUCCESS;
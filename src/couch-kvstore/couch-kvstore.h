@@ -21,6 +21,7 @@
 #include "config.h"
 #include "libcouchstore/couch_db.h"
 
+#include <list>
 #include <map>
 #include <string>
 #include <vector>
@@ -31,6 +32,7 @@
 #include "histo.h"
 #include "item.h"
 #include "kvstore.h"
+#include "mutex.h"
 #include "stats.h"
 #include "tasks.h"
 
@@ -49,6 +51,9 @@ public:
       docsCommitted(0), numOpen(0), numClose(0),
       numLoadedVb(0), numGetFailure(0), numSetFailure(0),
       numDelFailure(0), numOpenFailure(0), numVbSetFailure(0),
+      numHandleCacheHits(0), numHandleCacheMisses(0),
+      numHandleCacheEvictions(0), numDocsPrefetched(0),
+      numScans(0), scanBytes(0), lastScanRate(0), lastCompactRate(0),
       readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
       writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
     }
@@ -63,6 +68,14 @@ public:
         numDelFailure.store(0);
         numOpenFailure.store(0);
         numVbSetFailure.store(0);
+        numHandleCacheHits.store(0);
+        numHandleCacheMisses.store(0);
+        numHandleCacheEvictions.store(0);
+        numDocsPrefetched.store(0);
+        numScans.store(0);
+        scanBytes.store(0);
+        lastScanRate.store(0);
+        lastCompactRate.store(0);
 
         readTimeHisto.reset();
         readSizeHisto.reset();
@@ -72,6 +85,7 @@ public:
         compactHisto.reset();
         commitHisto.reset();
         saveDocsHisto.reset();
+        notifyHisto.reset();
         batchSize.reset();
         fsStats.reset();
     }
@@ -92,6 +106,20 @@ public:
     AtomicValue<size_t> numOpenFailure;
     AtomicValue<size_t> numVbSetFailure;
 
+    // database handles served from / missing in / evicted from the cache
+    AtomicValue<size_t> numHandleCacheHits;
+    AtomicValue<size_t> numHandleCacheMisses;
+    AtomicValue<size_t> numHandleCacheEvictions;
+    // document bodies read ahead for a batched bg fetch
+    AtomicValue<size_t> numDocsPrefetched;
+    // full scans (warmup, backfill) completed and the bytes they read
+    AtomicValue<size_t> numScans;
+    AtomicValue<size_t> scanBytes;
+    // throughput of the last completed scan in MB/s
+    AtomicValue<size_t> lastScanRate;
+    // throughput of the last completed compaction in MB/s
+    AtomicValue<size_t> lastCompactRate;
+
     /* for flush and vb delete, no error handling in CouchKVStore, such
      * failure should be tracked in MC-engine  */
 
@@ -111,6 +139,8 @@ public:
     Histogram<hrtime_t> compactHisto;
     // Time spent in couchstore save documents
     Histogram<hrtime_t> saveDocsHisto;
+    // Time the flusher spends notifying mccouch of a commit
+    Histogram<hrtime_t> notifyHisto;
     // Batch size of saveDocs calls
     Histogram<size_t> batchSize;
 
@@ -280,6 +310,9 @@ public:
      * Deconstructor
      */
     virtual ~CouchKVStore() {
+        size_t synced;
+        std::vector<std::string> failed;
+        deferredSyncs.syncAll(st.fsStats, synced, failed);
         close();
     }
 
@@ -306,6 +339,21 @@ public:
      */
     bool commit(Callback<kvstats_ctx> *cb);
 
+    /**
+     * Commit a transaction (unless not currently in one), leaving the
+     * file syncs to the next syncDeferred() call.
+     *
+     * @return true if the commit is completed successfully.
+     */
+    bool commitNoSync(Callback<kvstats_ctx> *cb);
+
+    /**
+     * Sync the vbucket files written by commitNoSync() since the last call.
+     *
+     * @return true if all files were synced
+     */
+    bool syncDeferred(size_t &synced, std::set<uint16_t> &failed);
+
     /**
      * Rollback a transaction (unless not currently in one).
      */
@@ -313,6 +361,10 @@ public:
         cb_assert(!isReadOnly());
         if (intransaction) {
             intransaction = false;
+            for (size_t i = 0; i < pendingReqsQ.size(); ++i) {
+                delete pendingReqsQ[i];
+            }
+            pendingReqsQ.clear();
         }
     }
 
@@ -323,6 +375,10 @@ public:
      */
     StorageProperties getStorageProperties(void);
 
+    bool reportsPriorExistence() {
+        return docInfoPreread;
+    }
+
     /**
      * Insert or update a given document.
      *
@@ -356,6 +412,15 @@ public:
      */
     void getMulti(uint16_t vb, vb_bgfetch_queue_t &itms);
 
+    /**
+     * Retrieve the documents of several vbuckets at once. The keys of all
+     * the files are looked up first, so that the reads of the document
+     * bodies of all of them can be submitted together.
+     *
+     * @param plan the items to retrieve, by vbucket
+     */
+    void getMultiVBuckets(vb_bgfetch_plan_t &plan);
+
     /**
      * Delete a given document from the underlying storage system.
      *
@@ -373,6 +438,12 @@ public:
      */
     bool delVBucket(uint16_t vbucket, bool recreate);
 
+    /**
+     * Close the cached database handle of the given vbucket, if any, and
+     * drop the cached blocks of its files.
+     */
+    void closeCachedDBs(uint16_t vbid);
+
     /**
      * Retrieve the list of persisted vbucket states
      *
@@ -545,6 +616,25 @@ public:
     static int recordDbDump(Db *db, DocInfo *docinfo, void *ctx);
     static int recordDbStat(Db *db, DocInfo *docinfo, void *ctx);
     static int getMultiCb(Db *db, DocInfo *docinfo, void *ctx);
+
+    struct MultiGetFile;
+
+    /**
+     * Open the file of a getMulti and look its keys up.
+     */
+    void beginMultiGet(MultiGetFile &mg);
+
+    /**
+     * Submit the reads of the bodies of the documents the lookups of the
+     * given files found together, ahead of fetching them one by one.
+     */
+    void prefetchDocs(std::vector<MultiGetFile *> &files);
+
+    /**
+     * Fetch the documents of a getMulti in file order and close its file.
+     */
+    void endMultiGet(MultiGetFile &mg);
+
     static void readVBState(Db *db, uint16_t vbId, vbucket_state &vbState);
 
     couchstore_error_t fetchDoc(Db *db, DocInfo *docinfo,
@@ -605,13 +695,39 @@ private:
     void remVBucketFromDbFileMap(uint16_t vbucketId);
     void updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev);
     couchstore_error_t openDB(uint16_t vbucketId, uint64_t fileRev, Db **db,
-                              uint64_t options, uint64_t *newFileRev = NULL);
+                              uint64_t options, uint64_t *newFileRev = NULL,
+                              couch_file_ops *ops = NULL);
     couchstore_error_t openDB_retry(std::string &dbfile, uint64_t options,
                                     const couch_file_ops *ops,
                                     Db **db, uint64_t *newFileRev);
+
+    /**
+     * Like openDB(), but hand out a handle kept open by the handle cache
+     * if it is still current. Only read-only handles of a read-only store
+     * are cached. A handle obtained here must be
+     * given back through releaseCachedDB().
+     */
+    couchstore_error_t openCachedDB(uint16_t vbucketId, uint64_t fileRev,
+                                    Db **db, uint64_t options,
+                                    uint64_t *newFileRev = NULL);
+
+    /**
+     * Give back a handle obtained from openCachedDB(). It is kept open for
+     * reuse unless reusable is false (e.g. after an I/O error), its file
+     * revision is out of date or the cache already holds a handle for the
+     * vbucket.
+     */
+    void releaseCachedDB(uint16_t vbucketId, uint64_t fileRev, Db *db,
+                         bool reusable = true);
+
+    void closeAllCachedDBs();
     couchstore_error_t saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
                                 DocInfo **docinfos, size_t docCount,
                                 kvstats_ctx &kvctx);
+    /**
+     * Tell mccouch about the new header of a vbucket file.
+     */
+    void notifyHeaderPos(uint16_t vbid, uint64_t fileRev, uint64_t headerPos);
     void commitCallback(std::vector<CouchRequest *> &committedReqs,
                         kvstats_ctx &kvctx,
                         couchstore_error_t errCode);
@@ -640,10 +756,44 @@ private:
     std::vector<CouchRequest *> pendingReqsQ;
     bool intransaction;
     bool dbFileRevMapPopulated;
+    /* look up the old docinfos of a batch before writing it */
+    bool docInfoPreread;
 
     /* all stats */
     CouchKVStoreStats   st;
+    /* batched fsyncs and read-ahead, io_uring backed where available */
+    CouchIoRing ioRing;
+    /* file syncs postponed by commitNoSync */
+    DeferredSyncs deferredSyncs;
+    /* a header written to a vbucket file */
+    struct HeaderPos {
+        uint16_t vbid;
+        uint64_t fileRev;
+        uint64_t pos;
+    };
+    /* headers written by commitNoSync, announced to mccouch once synced */
+    std::vector<HeaderPos> deferredHeaderPos;
+    /* blocks of the database files read through the file ops */
+    CouchBlockCache blockCache;
+    CouchstoreFileOpsCtx fileOpsCtx;
     couch_file_ops statCollectingFileOps;
+    /* compactions read and write through their own, throttled, file ops */
+    IoThrottle compactThrottle;
+    CouchstoreFileOpsCtx compactFileOpsCtx;
+    couch_file_ops compactFileOps;
+    /* open database handles, most recently used vbucket first */
+    struct CachedDb {
+        uint64_t rev;
+        Db *db;
+        uint64_t ino;
+        std::list<uint16_t>::iterator lruPos;
+    };
+    Mutex handleCacheMutex;
+    size_t handleCacheSize;
+    std::map<uint16_t, CachedDb> handleCache;
+    std::list<uint16_t> handleCacheLru;
+    /* inode of the file of each handle currently handed out */
+    std::map<Db *, uint64_t> handleInodes;
     /* vbucket state cache*/
     vbucket_map_t cachedVBStates;
     /* deleted docs in each file*/
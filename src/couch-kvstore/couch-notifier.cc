@@ -23,6 +23,8 @@
 #include <cctype>
 #include <cstdlib>
 #include <map>
+#include <stdexcept>
+#include <vector>
 
 #include "couch-kvstore/couch-notifier.h"
 #include "ep_engine.h"
@@ -188,6 +190,36 @@ private:
     Callback<uint16_t> &callback;
 };
 
+/*
+ * The response to a header position update sent by the notifier thread,
+ * nobody waits for it.
+ */
+class HeaderPosResponseHandler: public BinaryPacketHandler {
+public:
+    HeaderPosResponseHandler(uint32_t sno, CouchNotifier &n, uint16_t vb,
+                             const CouchNotifier::HeaderPos &p) :
+        BinaryPacketHandler(sno), notifier(n), vbucket(vb), pos(p) {
+    }
+
+    virtual void response(protocol_binary_response_header *res) {
+        uint16_t rcode = ntohs(res->response.status);
+        if (rcode != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to notify "
+                "CouchDB of update for vbucket=%d, error=0x%x\n",
+                vbucket, rcode);
+        }
+    }
+
+    virtual void connectionReset() {
+        notifier.requeueHeaderPos(vbucket, pos);
+    }
+
+private:
+    CouchNotifier &notifier;
+    uint16_t vbucket;
+    CouchNotifier::HeaderPos pos;
+};
+
 Mutex CouchNotifier::initMutex;
 std::map<std::string, CouchNotifier *> CouchNotifier::instances;
 uint16_t CouchNotifier::refCount = 0;
@@ -202,13 +234,148 @@ CouchNotifier::CouchNotifier(EPStats &st, Configuration &config) :
     allowDataLoss(config.isAllowDataLossDuringShutdown()),
     configurationError(true), seqno(0),
     currentCommand(0xff), lastSentCommand(0xff), lastReceivedCommand(0xff),
-    connected(false), inSelectBucket(false)
+    connected(false), inSelectBucket(false),
+    async(config.isCouchNotifyAsync()), running(false), numCoalesced(0),
+    numRequeued(0), numBatches(0)
 {
     memset(&sendMsg, 0, sizeof(sendMsg));
     sendMsg.msg_iov = sendIov;
 
     // Select the bucket (will be sent immediately when we connect)
     selectBucket();
+
+    if (async) {
+        running = true;
+        if (cb_create_thread(&notifierThread, notifierThreadMain, this, 0)
+            != 0) {
+            throw std::runtime_error("Error creating mccouch notifier thread");
+        }
+    }
+}
+
+CouchNotifier::~CouchNotifier() {
+    if (async) {
+        LockHolder plh(pendingSync);
+        running = false;
+        pendingSync.notify();
+        plh.unlock();
+        cb_join_thread(notifierThread);
+    }
+}
+
+void CouchNotifier::notifierThreadMain(void *arg) {
+    static_cast<CouchNotifier*>(arg)->runNotifier();
+}
+
+void CouchNotifier::runNotifier() {
+    LockHolder plh(pendingSync);
+    while (true) {
+        if (pendingHeaderPos.empty()) {
+            if (!running) {
+                break;
+            }
+            pendingSync.wait();
+            continue;
+        }
+        // A graceful shutdown drains the queue first, so that mccouch
+        // learns about every header the flusher committed
+        if (!running && stats.forceShutdown) {
+            break;
+        }
+        plh.unlock();
+
+        // Take the batch with the connection locked, so that a synchronous
+        // notification can't overtake an older position of its vbucket
+        LockHolder lh(mutex);
+        std::map<uint16_t, HeaderPos> batch;
+        plh.lock();
+        batch.swap(pendingHeaderPos);
+        plh.unlock();
+        sendHeaderPositions(batch);
+        lh.unlock();
+
+        plh.lock();
+    }
+
+    if (!pendingHeaderPos.empty()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Dropping %ld pending header position updates for mccouch "
+            "on shutdown", pendingHeaderPos.size());
+    }
+}
+
+void CouchNotifier::sendHeaderPositions(std::map<uint16_t, HeaderPos> &batch)
+{
+    if (batch.empty()) {
+        return;
+    }
+
+    std::vector<protocol_binary_request_notify_vbucket_update>
+        reqs(batch.size());
+    std::map<uint16_t, HeaderPos>::iterator it = batch.begin();
+    size_t ii = 0;
+    while (it != batch.end()) {
+        // Pipeline the requests, up to IOV_MAX of them per sendmsg()
+        std::vector<BinaryPacketHandler*> handlers;
+        numiovec = 0;
+        for (; it != batch.end() && numiovec < IOV_MAX; ++it, ++ii) {
+            protocol_binary_request_notify_vbucket_update &req = reqs[ii];
+            memset(req.bytes, 0, sizeof(req.bytes));
+            req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+            req.message.header.request.opcode = PROTOCOL_BINARY_CMD_NOTIFY_VBUCKET_UPDATE;
+            req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+            req.message.header.request.vbucket = ntohs(it->first);
+            req.message.header.request.opaque = seqno;
+            req.message.header.request.bodylen = ntohl(32);
+
+            req.message.body.file_version = ntohll(it->second.fileVersion);
+            req.message.body.header_offset = ntohll(it->second.headerOffset);
+            req.message.body.vbucket_state_updated = ntohl(VB_NO_CHANGE);
+
+            sendIov[numiovec].iov_base = (char*)req.bytes;
+            sendIov[numiovec].iov_len = sizeof(req.bytes);
+            ++numiovec;
+
+            handlers.push_back(new HeaderPosResponseHandler(seqno++, *this,
+                                                            it->first,
+                                                            it->second));
+        }
+        sendCommands(handlers);
+    }
+    ++numBatches;
+
+    // Updates lost to a connection reset are queued again by their handlers
+    wait();
+}
+
+void CouchNotifier::notify_headerpos_update_async(uint16_t vbucket,
+                                                  uint64_t file_version,
+                                                  uint64_t header_offset)
+{
+    cb_assert(async);
+    LockHolder plh(pendingSync);
+    std::pair<std::map<uint16_t, HeaderPos>::iterator, bool> rv =
+        pendingHeaderPos.insert(std::make_pair(vbucket, HeaderPos()));
+    if (!rv.second) {
+        ++numCoalesced;
+    }
+    rv.first->second = HeaderPos(file_version, header_offset);
+    pendingSync.notify();
+}
+
+void CouchNotifier::requeueHeaderPos(uint16_t vbucket, const HeaderPos &pos)
+{
+    // A newer position of the vbucket may have been queued meanwhile
+    LockHolder plh(pendingSync);
+    if (pendingHeaderPos.insert(std::make_pair(vbucket, pos)).second) {
+        ++numRequeued;
+    }
+}
+
+void CouchNotifier::dropHeaderPos(uint16_t vbucket)
+{
+    LockHolder plh(pendingSync);
+    pendingHeaderPos.erase(vbucket);
 }
 
 void CouchNotifier::resetConnection() {
@@ -484,8 +651,16 @@ void CouchNotifier::sendSingleChunk(const char *ptr, size_t nb)
 
 void CouchNotifier::sendCommand(BinaryPacketHandler *rh)
 {
+    std::vector<BinaryPacketHandler*> handlers(1, rh);
+    sendCommands(handlers);
+}
+
+void CouchNotifier::sendCommands(std::vector<BinaryPacketHandler*> &handlers)
+{
+    // all the packets in sendIov are of the same command
     currentCommand = reinterpret_cast<uint8_t*>(sendIov[0].iov_base)[1];
     int cmdId = commandId(currentCommand);
+    std::vector<BinaryPacketHandler*>::iterator it;
     ensureConnection();
     if (!connected) {
         // we might have been disconnected
@@ -493,12 +668,15 @@ void CouchNotifier::sendCommand(BinaryPacketHandler *rh)
             "Failed to send data for %s: connection to mccouch is "
             "not established successfully, shutdown in progress %s",
             cmd2str(currentCommand), stats.isShutdown ? "yes" : "no");
-        commandStats[cmdId].numError++;
-        delete rh;
+        commandStats[cmdId].numError += handlers.size();
+        for (it = handlers.begin(); it != handlers.end(); ++it) {
+            delete *it;
+        }
         return;
     }
 
-    responseHandler.push_back(rh);
+    responseHandler.insert(responseHandler.end(), handlers.begin(),
+                           handlers.end());
 
     do {
         sendMsg.msg_iovlen = numiovec;
@@ -554,7 +732,7 @@ void CouchNotifier::sendCommand(BinaryPacketHandler *rh)
             if (towrite == static_cast<size_t>(nw)) {
                 // Everything successfully sent!
                 lastSentCommand = currentCommand;
-                commandStats[cmdId].numSent++;
+                commandStats[cmdId].numSent += handlers.size();
                 currentCommand = static_cast<uint8_t>(0xff);
                 LOG(EXTENSION_LOG_DEBUG,
                     "Successfully sending to mccouch: cmd=%s, bytes=%ld",
@@ -775,6 +953,9 @@ bool CouchNotifier::waitOnce()
 void CouchNotifier::delVBucket(uint16_t vb, Callback<bool> &cb) {
     protocol_binary_request_del_vbucket req;
     LockHolder lh(mutex);
+    if (async) {
+        dropHeaderPos(vb);
+    }
     // delete vbucket must wait for a response
     do {
         memset(req.bytes, 0, sizeof(req.bytes));
@@ -796,6 +977,10 @@ void CouchNotifier::flush(Callback<bool> &cb) {
     protocol_binary_request_flush req;
     // flush must wait for a response
     LockHolder lh(mutex);
+    if (async) {
+        LockHolder plh(pendingSync);
+        pendingHeaderPos.clear();
+    }
     do {
         memset(req.bytes, 0, sizeof(req.bytes));
         req.message.header.request.magic = PROTOCOL_BINARY_REQ;
@@ -844,6 +1029,22 @@ void CouchNotifier::notify_update(const VBStateNotification &vbs,
 {
     protocol_binary_request_notify_vbucket_update req;
     LockHolder lh(mutex);
+    if (async) {
+        // send a pending header position of the vbucket first, so that
+        // mccouch sees the updates in order
+        std::map<uint16_t, HeaderPos> batch;
+        LockHolder plh(pendingSync);
+        std::map<uint16_t, HeaderPos>::iterator it =
+            pendingHeaderPos.find(vbs.vbucket);
+        if (it != pendingHeaderPos.end()) {
+            batch.insert(*it);
+            pendingHeaderPos.erase(it);
+        }
+        plh.unlock();
+        sendHeaderPositions(batch);
+        // this notification supersedes it if it got lost after all
+        dropHeaderPos(vbs.vbucket);
+    }
     // notify_bucket must wait for a response
     do {
         memset(req.bytes, 0, sizeof(req.bytes));
@@ -879,6 +1080,17 @@ void CouchNotifier::addStats(const std::string &prefix,
     add_prefixed_stat(prefix, "last_sent_command", cmd2str(lastSentCommand), add_stat, c);
     add_prefixed_stat(prefix, "last_received_command", cmd2str(lastReceivedCommand),
             add_stat, c);
+    if (async) {
+        size_t pending;
+        {
+            LockHolder plh(pendingSync);
+            pending = pendingHeaderPos.size();
+        }
+        add_prefixed_stat(prefix, "notify_pending", pending, add_stat, c);
+        add_prefixed_stat(prefix, "notify_coalesced", numCoalesced.load(), add_stat, c);
+        add_prefixed_stat(prefix, "notify_requeued", numRequeued.load(), add_stat, c);
+        add_prefixed_stat(prefix, "notify_batches", numBatches.load(), add_stat, c);
+    }
 }
 
 const char *CouchNotifier::cmd2str(uint8_t cmd)
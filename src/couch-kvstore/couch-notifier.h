@@ -32,6 +32,7 @@
 #include "configuration.h"
 #include "kvstore.h"
 #include "mutex.h"
+#include "syncobject.h"
 
 /*
  * libevent2 define evutil_socket_t so that it'll automagically work
@@ -172,22 +173,50 @@ public:
         notify_update(vbs, file_version, header_offset, cb);
     }
 
+    /**
+     * Queue a header position update for the notifier thread and return
+     * without waiting for mccouch. A pending update of the same vbucket
+     * is replaced, as mccouch only needs the latest header. Failures are
+     * logged and counted in the notify_vbucket_update stats, updates lost
+     * to a connection reset are queued again.
+     *
+     * Only available when couch_notify_async is enabled.
+     */
+    void notify_headerpos_update_async(uint16_t vbucket,
+                                       uint64_t file_version,
+                                       uint64_t header_offset);
+
+    bool isAsync() const {
+        return async;
+    }
+
     void addStats(const std::string &prefix,
                   ADD_STAT add_stat,
                   const void *c);
 
 protected:
     friend class SelectBucketResponseHandler;
+    friend class HeaderPosResponseHandler;
 
 private:
+    struct HeaderPos {
+        HeaderPos() : fileVersion(0), headerOffset(0) { }
+        HeaderPos(uint64_t fv, uint64_t ho) :
+            fileVersion(fv), headerOffset(ho) { }
+
+        uint64_t fileVersion;
+        uint64_t headerOffset;
+    };
+
     CouchNotifier(EPStats &st, Configuration &config);
-    ~CouchNotifier() { }
+    ~CouchNotifier();
     void selectBucket(void);
     void reschedule(std::list<BinaryPacketHandler*> &packets);
     void resetConnection();
 
     void sendSingleChunk(const char *ptr, size_t nb);
     void sendCommand(BinaryPacketHandler *rh);
+    void sendCommands(std::vector<BinaryPacketHandler*> &handlers);
     bool processInput();
     void maybeProcessInput();
     void wait();
@@ -203,6 +232,12 @@ private:
     int  commandId(uint8_t opcode);
     const char *cmdId2str(int id);
 
+    static void notifierThreadMain(void *arg);
+    void runNotifier();
+    void sendHeaderPositions(std::map<uint16_t, HeaderPos> &batch);
+    void requeueHeaderPos(uint16_t vbucket, const HeaderPos &pos);
+    void dropHeaderPos(uint16_t vbucket);
+
     evutil_socket_t sock;
 
     EPStats &stats;
@@ -286,6 +321,16 @@ private:
     struct iovec sendIov[IOV_MAX];
     int numiovec;
 
+    /* header position updates waiting for the notifier thread */
+    bool async;
+    bool running;
+    cb_thread_t notifierThread;
+    SyncObject pendingSync;
+    std::map<uint16_t, HeaderPos> pendingHeaderPos;
+    AtomicValue<size_t> numCoalesced;
+    AtomicValue<size_t> numRequeued;
+    AtomicValue<size_t> numBatches;
+
     static Mutex initMutex;
     static std::map<std::string, CouchNotifier *> instances;
     static uint16_t refCount;
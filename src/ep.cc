@@ -37,6 +37,7 @@
 #include "failover-table.h"
 #include "flusher.h"
 #include "htresizer.h"
+#include "htsnapshot.h"
 #include "kvshard.h"
 #include "kvstore.h"
 #include "locks.h"
@@ -45,6 +46,9 @@
 #include "tapconnmap.h"
 #include "tapthrottle.h"
 
+/* How long after warmup the gets are counted in the warmup window stats */
+static const rel_time_t WARMUP_HIT_WINDOW = 600;
+
 class StatsValueChangeListener : public ValueChangedListener {
 public:
     StatsValueChangeListener(EPStats &st) : stats(st) {
@@ -173,7 +177,10 @@ EventuallyPersistentStore::EventuallyPersistentStore(
     engine(theEngine), stats(engine.getEpStats()),
     vbMap(theEngine.getConfiguration(), *this),
     bgFetchQueue(0),
-    diskFlushAll(false), bgFetchDelay(0), statsSnapshotTaskId(0),
+    bgFetchScheduler(stats, theEngine.getConfiguration()),
+    coAccessTracker(NULL),
+    diskFlushAll(false), flushAllGeneration(0), bgFetchDelay(0),
+    statsSnapshotTaskId(0),
     lastTransTimePerItem(0),snapshotVBState(false)
 {
     cachedResidentRatio.activeRatio.store(0);
@@ -190,6 +197,9 @@ EventuallyPersistentStore::EventuallyPersistentStore(
         accessLog.push_back(shardlog);
     }
 
+    unsyncedFlushes.resize(vbMap.numShards);
+    compacting.vbuckets.resize(vbMap.numShards);
+
     storageProperties = new StorageProperties(true, true, true, true);
 
     ExecutorPool::get()->registerBucket(ObjectRegistry::getCurrentEngine());
@@ -200,6 +210,11 @@ EventuallyPersistentStore::EventuallyPersistentStore(
         conflictResolver = new SeqBasedResolution();
     }
 
+    if (config.isBgFetchPrefetch()) {
+        coAccessTracker = new CoAccessTracker(config.getBgFetchPrefetchKeys(),
+                                              config.getBgFetchPrefetchSample());
+    }
+
     stats.setMaxDataSize(config.getMaxSize());
     config.addValueChangedListener("max_size",
                                    new StatsValueChangeListener(stats));
@@ -314,7 +329,10 @@ bool EventuallyPersistentStore::initialize() {
         return false;
     }
 
-    WarmupWaitListener warmupListener(*warmupTask, config.isWaitforwarmup());
+    // Progressive warmup serves the vbuckets as they get loaded
+    WarmupWaitListener warmupListener(*warmupTask,
+                                      config.isWaitforwarmup() &&
+                                      !config.isWarmupProgressive());
     warmupTask->addWarmupStateListener(&warmupListener);
     warmupTask->start();
     warmupListener.wait();
@@ -339,6 +357,11 @@ bool EventuallyPersistentStore::initialize() {
     config.addValueChangedListener("exp_pager_stime",
                                    new EPStoreValueChangeListener(*this));
 
+    size_t compactionSleeptime = config.getCompactionStime();
+    ExTask compactTask = new AutoCompactionTask(&engine,
+                                    static_cast<double>(compactionSleeptime));
+    ExecutorPool::get()->schedule(compactTask, NONIO_TASK_IDX);
+
     ExTask htrTask = new HashtableResizerTask(this, 10);
     ExecutorPool::get()->schedule(htrTask, NONIO_TASK_IDX);
 
@@ -349,7 +372,19 @@ bool EventuallyPersistentStore::initialize() {
     return true;
 }
 
+struct HashTableSnapshotWriter {
+    HashTableSnapshotWriter(EventuallyPersistentStore &st,
+                            const std::string &path) :
+        snapshot(st, path) { }
+
+    HashTableSnapshot snapshot;
+    std::vector<uint16_t> vbids;
+    RememberingCallback<bool> done;
+};
+
 EventuallyPersistentStore::~EventuallyPersistentStore() {
+    // A warmup cut short leaves keys out of the hash tables
+    bool warmedUp = !isWarmingUp();
     stopWarmup();
     stopBgFetcher();
     ExecutorPool::get()->stopTaskGroup(&engine, NONIO_TASK_IDX);
@@ -358,11 +393,16 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
     ExecutorPool::get()->cancel(accessScanner.task);
 
     stopFlusher();
+    if (warmedUp && !stats.forceShutdown &&
+        engine.getConfiguration().isWarmupSnapshot()) {
+        snapshotHashTables();
+    }
     ExecutorPool::get()->unregisterBucket(ObjectRegistry::getCurrentEngine());
 
     engine.getUprConnMap().closeAllStreams();
 
     delete conflictResolver;
+    delete coAccessTracker;
     delete warmupTask;
     delete storageProperties;
 
@@ -370,6 +410,14 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
     for (it = accessLog.begin(); it != accessLog.end(); it++) {
         delete *it;
     }
+
+    std::vector<std::list<PersistenceCallback*> >::iterator sit;
+    for (sit = unsyncedFlushes.begin(); sit != unsyncedFlushes.end(); ++sit) {
+        std::list<PersistenceCallback*>::iterator pit = sit->begin();
+        for (; pit != sit->end(); ++pit) {
+            delete *pit;
+        }
+    }
 }
 
 const Flusher* EventuallyPersistentStore::getFlusher(uint16_t shardId) {
@@ -380,6 +428,62 @@ Warmup* EventuallyPersistentStore::getWarmup(void) const {
     return warmupTask;
 }
 
+std::string EventuallyPersistentStore::getHashTableSnapshotPath(uint16_t id) {
+    std::stringstream ss;
+    ss << engine.getConfiguration().getDbname() << "/htsnapshot." << id;
+    return ss.str();
+}
+
+void EventuallyPersistentStore::snapshotHashTables() {
+    hrtime_t start = gethrtime();
+    std::vector<HashTableSnapshotWriter *> writers;
+    for (uint16_t i = 0; i < vbMap.numShards; i++) {
+        HashTableSnapshotWriter *writer =
+            new HashTableSnapshotWriter(*this, getHashTableSnapshotPath(i));
+        std::vector<int> vbs = vbMap.shards[i]->getVBuckets();
+        std::vector<int>::iterator it = vbs.begin();
+        for (; it != vbs.end(); ++it) {
+            RCPtr<VBucket> vb = getVBucket(*it);
+            if (vb && (vb->getState() == vbucket_state_active ||
+                       vb->getState() == vbucket_state_replica)) {
+                writer->vbids.push_back(*it);
+            }
+        }
+        writers.push_back(writer);
+    }
+
+    // The shards are written in parallel by the writer threads, which the
+    // stopped flushers left idle
+    ExecutorPool *iom = ExecutorPool::get();
+    std::vector<HashTableSnapshotWriter *>::iterator it;
+    uint16_t shardId = 0;
+    for (it = writers.begin(); it != writers.end(); ++it, ++shardId) {
+        ExTask task = new HashTableSnapshotTask(&engine, (*it)->snapshot,
+                                                (*it)->vbids, (*it)->done,
+                                                shardId);
+        iom->schedule(task, WRITER_TASK_IDX);
+    }
+
+    bool success = true;
+    for (it = writers.begin(); it != writers.end(); ++it) {
+        (*it)->done.waitForValue();
+        success = success && (*it)->done.val;
+    }
+
+    if (!success) {
+        // A partial set of snapshots would only be thrown away at startup
+        for (it = writers.begin(); it != writers.end(); ++it) {
+            (*it)->snapshot.remove();
+        }
+    }
+    for (it = writers.begin(); it != writers.end(); ++it) {
+        delete *it;
+    }
+    LOG(EXTENSION_LOG_WARNING, "Hash table snapshot %s in %s",
+        success ? "written" : "failed",
+        hrtime2text(gethrtime() - start).c_str());
+}
+
 bool EventuallyPersistentStore::startFlusher() {
     for (uint16_t i = 0; i < vbMap.numShards; ++i) {
         Flusher *flusher = vbMap.shards[i]->getFlusher();
@@ -436,27 +540,34 @@ void EventuallyPersistentStore::wakeUpFlusher() {
 
 bool EventuallyPersistentStore::startBgFetcher() {
     for (uint16_t i = 0; i < vbMap.numShards; i++) {
-        BgFetcher *bgfetcher = vbMap.shards[i]->getBgFetcher();
-        if (bgfetcher == NULL) {
+        std::vector<BgFetcher *> &bgfetchers = vbMap.shards[i]->getBgFetchers();
+        if (bgfetchers.empty()) {
             LOG(EXTENSION_LOG_WARNING,
                 "Falied to start bg fetcher for shard %d", i);
             return false;
         }
-        bgfetcher->start();
+        std::vector<BgFetcher *>::iterator it = bgfetchers.begin();
+        for (; it != bgfetchers.end(); ++it) {
+            (*it)->start();
+        }
     }
     return true;
 }
 
 void EventuallyPersistentStore::stopBgFetcher() {
     for (uint16_t i = 0; i < vbMap.numShards; i++) {
-        BgFetcher *bgfetcher = vbMap.shards[i]->getBgFetcher();
-        if (multiBGFetchEnabled() && bgfetcher->pendingJob()) {
-            LOG(EXTENSION_LOG_WARNING,
-                "Shutting down engine while there are still pending data "
-                "read for shard %d from database storage", i);
+        std::vector<BgFetcher *> &bgfetchers = vbMap.shards[i]->getBgFetchers();
+        std::vector<BgFetcher *>::iterator it = bgfetchers.begin();
+        for (; it != bgfetchers.end(); ++it) {
+            if (multiBGFetchEnabled() && (*it)->pendingJob()) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Shutting down engine while there are still pending data "
+                    "read for shard %d from database storage", i);
+            }
+            LOG(EXTENSION_LOG_INFO,
+                "Stopping bg fetcher for underlying storage");
+            (*it)->stop();
         }
-        LOG(EXTENSION_LOG_INFO, "Stopping bg fetcher for underlying storage");
-        bgfetcher->stop();
     }
 }
 
@@ -849,6 +960,15 @@ void EventuallyPersistentStore::snapshotVBuckets(const Priority &priority,
     visit(v);
     hrtime_t start = gethrtime();
     LockHolder lh(shard->getWriteLock());
+    {
+        // Snapshotted again once their compaction is done
+        LockHolder clh(compacting.sync);
+        std::set<uint16_t> &running = compacting.vbuckets[shardId];
+        std::set<uint16_t>::iterator it = running.begin();
+        for (; it != running.end(); ++it) {
+            v.states.erase(*it);
+        }
+    }
     KVStore *rwUnderlying = shard->getRWUnderlying();
     if (!rwUnderlying->snapshotVBuckets(v.states, &kvcb)) {
         LOG(EXTENSION_LOG_WARNING,
@@ -970,7 +1090,10 @@ bool EventuallyPersistentStore::completeVBucketDeletion(uint16_t vbid,
         uint16_t sid = vbMap.getShard(vbid)->getId();
         KVShard *shard = vbMap.shards[sid];
         LockHolder ls(shard->getWriteLock());
+        waitForCompactions(sid, vbid);
         KVStore *rwUnderlying = getRWUnderlying(vbid);
+        // Don't let the reader keep the deleted file open.
+        shard->closeCachedDBs(vbid);
         if (rwUnderlying->delVBucket(vbid, recreate)) {
             vbMap.setBucketDeletion(vbid, false);
             vbMap.setPersistenceSeqno(vbid, 0);
@@ -1084,9 +1207,19 @@ bool EventuallyPersistentStore::compactVBucket(const uint16_t vbid,
                                                const void *cookie) {
     KVShard *shard = vbMap.getShard(vbid);
     ENGINE_ERROR_CODE err = ENGINE_SUCCESS;
-    LockHolder lh(shard->getWriteLock());
     RCPtr<VBucket> vb = vbMap.getBucket(vbid);
     if (vb) {
+        {
+            // Taken with the write lock so that no write to the file is in
+            // progress, and nobody waiting for the shard's compactions
+            // sees new ones start.
+            LockHolder lh(shard->getWriteLock());
+            LockHolder clh(compacting.sync);
+            if (!compacting.vbuckets[shard->getId()].insert(vbid).second) {
+                return true;
+            }
+        }
+
         if (vb->getState() == vbucket_state_active) {
             // Set the current time ONLY for active vbuckets.
             ctx->curr_time = ep_real_time();
@@ -1100,22 +1233,129 @@ bool EventuallyPersistentStore::compactVBucket(const uint16_t vbid,
             LOG(EXTENSION_LOG_WARNING,
                     "VBucket compaction failed failed!!!");
             err = ENGINE_FAILED;
-            engine.storeEngineSpecific(cookie, NULL);
+            if (cookie) {
+                engine.storeEngineSpecific(cookie, NULL);
+            }
         } else {
             vb->setPurgeSeqno(ctx->purge_before_seq);
+            // The pre-compaction file is gone, let the reader drop it.
+            shard->closeCachedDBs(vbid);
+        }
+
+        {
+            LockHolder clh(compacting.sync);
+            compacting.vbuckets[shard->getId()].erase(vbid);
+            compacting.sync.notify();
         }
+        // Catch up with the writes to the file held back meanwhile
+        scheduleVBSnapshot(Priority::VBucketPersistHighPriority,
+                           shard->getId());
+        shard->getFlusher()->notifyFlushEvent();
     } else {
         err = ENGINE_NOT_MY_VBUCKET;
-        engine.storeEngineSpecific(cookie, NULL);
+        if (cookie) {
+            engine.storeEngineSpecific(cookie, NULL);
+        }
     }
 
     if (cookie) {
         engine.notifyIOComplete(cookie, err);
+    } else {
+        LockHolder alh(autoCompaction.mutex);
+        autoCompaction.vbuckets.erase(vbid);
+        --stats.autoCompactionsRunning;
     }
     --stats.pendingCompactions;
     return false;
 }
 
+bool EventuallyPersistentStore::isCompacting(uint16_t vbid) {
+    LockHolder lh(compacting.sync);
+    uint16_t shardId = vbMap.getShard(vbid)->getId();
+    return compacting.vbuckets[shardId].count(vbid) != 0;
+}
+
+void EventuallyPersistentStore::waitForCompactions(uint16_t shardId,
+                                                   int vbid) {
+    LockHolder lh(compacting.sync);
+    std::set<uint16_t> &running = compacting.vbuckets[shardId];
+    while (vbid < 0 ? !running.empty() : running.count(vbid) != 0) {
+        compacting.sync.wait();
+    }
+}
+
+void EventuallyPersistentStore::scheduleAutoCompactions() {
+    Configuration &config = engine.getConfiguration();
+    size_t threshold = config.getCompactionFragThreshold();
+    if (threshold == 0) {
+        stats.autoCompactionQueue.store(0);
+        return;
+    }
+    size_t minFileSize = config.getCompactionMinFileSize();
+    size_t maxPerShard = config.getCompactionMaxConcurrent();
+
+    // (fragmentation, vbucket), most fragmented first
+    std::vector<std::pair<size_t, uint16_t> > candidates;
+    for (size_t i = 0; i < vbMap.getSize(); ++i) {
+        RCPtr<VBucket> vb = vbMap.getBucket(i);
+        if (!vb) {
+            continue;
+        }
+        size_t fileSize = vb->fileSize;
+        size_t spaceUsed = vb->fileSpaceUsed;
+        if (fileSize < minFileSize || fileSize == 0 || spaceUsed > fileSize) {
+            continue;
+        }
+        size_t fragmentation = (fileSize - spaceUsed) * 100 / fileSize;
+        if (fragmentation >= threshold) {
+            candidates.push_back(std::make_pair(fragmentation, vb->getId()));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              std::greater<std::pair<size_t, uint16_t> >());
+
+    LockHolder lh(autoCompaction.mutex);
+    std::vector<size_t> running(vbMap.numShards, 0);
+    std::set<uint16_t>::iterator sit = autoCompaction.vbuckets.begin();
+    for (; sit != autoCompaction.vbuckets.end(); ++sit) {
+        ++running[vbMap.getShard(*sit)->getId()];
+    }
+
+    size_t waiting = 0;
+    std::vector<std::pair<size_t, uint16_t> >::iterator it;
+    for (it = candidates.begin(); it != candidates.end(); ++it) {
+        uint16_t vbid = it->second;
+        if (autoCompaction.vbuckets.count(vbid) != 0) {
+            continue;
+        }
+        size_t shard = vbMap.getShard(vbid)->getId();
+        if (running[shard] >= maxPerShard) {
+            ++waiting;
+            continue;
+        }
+
+        compaction_ctx c;
+        c.purge_before_ts = 0;
+        c.purge_before_seq = 0;
+        c.drop_deletes = 0;
+        c.max_purged_seq = 0;
+        c.curr_time = 0;
+        ++stats.pendingCompactions;
+        if (compactDB(vbid, c, NULL) != ENGINE_EWOULDBLOCK) {
+            --stats.pendingCompactions;
+            continue;
+        }
+        autoCompaction.vbuckets.insert(vbid);
+        ++running[shard];
+        ++stats.autoCompactionsRunning;
+        ++stats.autoCompactions;
+        LOG(EXTENSION_LOG_INFO, "Scheduled compaction of vbucket %d, %llu%% "
+            "of its file is stale", vbid,
+            static_cast<unsigned long long>(it->first));
+    }
+    stats.autoCompactionQueue.store(waiting);
+}
+
 bool EventuallyPersistentStore::resetVBucket(uint16_t vbid) {
     LockHolder lh(vbsetMutex);
     bool rv(false);
@@ -1182,13 +1422,15 @@ void EventuallyPersistentStore::snapshotStats() {
 
 void EventuallyPersistentStore::updateBGStats(const hrtime_t init,
                                               const hrtime_t start,
-                                              const hrtime_t stop) {
+                                              const hrtime_t stop,
+                                              bg_fetch_class_t cls) {
     if (stop >= start && start >= init) {
         // skip the measurement if the counter wrapped...
         ++stats.bgNumOperations;
         hrtime_t w = (start - init) / 1000;
         BlockTimer::log(start - init, "bgwait", stats.timingLog);
         stats.bgWaitHisto.add(w);
+        stats.bgClassWaitHisto[cls].add(w);
         stats.bgWait.fetch_add(w);
         atomic_setIfLess(stats.bgMinWait, w);
         atomic_setIfBigger(stats.bgMaxWait, w);
@@ -1196,6 +1438,7 @@ void EventuallyPersistentStore::updateBGStats(const hrtime_t init,
         hrtime_t l = (stop - start) / 1000;
         BlockTimer::log(stop - start, "bgload", stats.timingLog);
         stats.bgLoadHisto.add(l);
+        stats.bgClassLoadHisto[cls].add(l);
         stats.bgLoad.fetch_add(l);
         atomic_setIfLess(stats.bgMinLoad, l);
         atomic_setIfBigger(stats.bgMaxLoad, l);
@@ -1207,7 +1450,8 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
                                                 uint64_t rowid,
                                                 const void *cookie,
                                                 hrtime_t init,
-                                                bool isMeta) {
+                                                bool isMeta,
+                                                bg_fetch_class_t cls) {
     hrtime_t start(gethrtime());
     // Go find the data
     RememberingCallback<GetValue> gcb;
@@ -1292,7 +1536,7 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     lh.unlock();
 
     hrtime_t stop = gethrtime();
-    updateBGStats(init, start, stop);
+    updateBGStats(init, start, stop, cls);
     bgFetchQueue--;
 
     delete gcb.val.getValue();
@@ -1307,8 +1551,10 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
     if (!vb) {
         std::vector<bgfetched_item_t>::iterator itemItr = fetchedItems.begin();
         for (; itemItr != fetchedItems.end(); ++itemItr) {
-            engine.notifyIOComplete((*itemItr).second->cookie,
-                                    ENGINE_NOT_MY_VBUCKET);
+            if (!(*itemItr).second->isPrefetch) {
+                engine.notifyIOComplete((*itemItr).second->cookie,
+                                        ENGINE_NOT_MY_VBUCKET);
+            }
         }
         LOG(EXTENSION_LOG_WARNING,
             "EP Store completes %d of batched background fetch for "
@@ -1327,6 +1573,20 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
         int bucket = 0;
         LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
         StoredValue *v = fetchValidValue(vb, key, bucket, true);
+        if (bgitem->isPrefetch) {
+            // Nobody waits for a read ahead, keep the value if the key is
+            // still the same non-resident one, as the first to evict
+            if (status == ENGINE_SUCCESS && v && !v->isResident() &&
+                !v->isDeleted() && !v->isTempItem() &&
+                v->getCas() == fetchedValue->getCas() &&
+                v->unlocked_restoreValue(fetchedValue, vb->ht)) {
+                v->setNRUValue(MAX_NRU_VALUE);
+                v->setPrefetched(true);
+                ++stats.bgPrefetched;
+                stats.bgPrefetchedBytes.fetch_add(fetchedValue->getNBytes());
+            }
+            continue;
+        }
         if (bgitem->metaDataOnly) {
             if (v && v->unlocked_restoreMeta(fetchedValue, status, vb->ht)) {
                 status = ENGINE_SUCCESS;
@@ -1389,7 +1649,8 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
         }
 
         hrtime_t endTime = gethrtime();
-        updateBGStats(bgitem->initTime, startTime, endTime);
+        updateBGStats(bgitem->initTime, startTime, endTime,
+                      bgitem->fetchClass);
         engine.notifyIOComplete(bgitem->cookie, status);
     }
 
@@ -1403,9 +1664,11 @@ void EventuallyPersistentStore::bgFetch(const std::string &key,
                                         uint16_t vbucket,
                                         uint64_t rowid,
                                         const void *cookie,
-                                        bool isMeta) {
+                                        bool isMeta,
+                                        bg_fetch_class_t cls) {
     std::stringstream ss;
 
+    bgFetchScheduler.enqueue(cls);
     if (multiBGFetchEnabled()) {
         RCPtr<VBucket> vb = getVBucket(vbucket);
         cb_assert(vb);
@@ -1414,9 +1677,10 @@ void EventuallyPersistentStore::bgFetch(const std::string &key,
         // schedule to the current batch of background fetch of the given
         // vbucket
         VBucketBGFetchItem * fetchThis = new VBucketBGFetchItem(cookie,
-                                                                isMeta);
-        vb->queueBGFetchItem(key, fetchThis, myShard->getBgFetcher());
-        myShard->getBgFetcher()->notifyBGEvent();
+                                                                isMeta, cls);
+        BgFetcher *bgFetcher = myShard->getBgFetcher(vbucket);
+        vb->queueBGFetchItem(key, fetchThis, bgFetcher);
+        bgFetcher->notifyBGEvent();
         ss << "Queued a background fetch, now at "
            << vb->numPendingBGFetchItems() << std::endl;
         LOG(EXTENSION_LOG_DEBUG, "%s", ss.str().c_str());
@@ -1426,7 +1690,7 @@ void EventuallyPersistentStore::bgFetch(const std::string &key,
                                             bgFetchQueue.load());
         ExecutorPool* iom = ExecutorPool::get();
         ExTask task = new BGFetchTask(&engine, key, vbucket, rowid, cookie,
-                                      isMeta,
+                                      isMeta, cls,
                                       Priority::BgFetcherGetMetaPriority,
                                       bgFetchDelay, false);
         iom->schedule(task, READER_TASK_IDX);
@@ -1462,6 +1726,16 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
         }
     }
 
+    if (coAccessTracker && queueBG) {
+        coAccessTracker->accessed(cookie, vbucket, key);
+    }
+
+    bool warmupWindow = queueBG &&
+                        ep_current_time() < stats.warmupWindowEnd.load();
+    if (warmupWindow) {
+        ++stats.warmupWindowGets;
+    }
+
     int bucket_num(0);
     LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
     StoredValue *v = fetchValidValue(vb, key, bucket_num, true,
@@ -1476,15 +1750,26 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
         if (!v->isResident()) {
             if (queueBG) {
                 bgFetch(key, vbucket, v->getBySeqno(), cookie);
+                warmupTask->vbucketRequested(vbucket);
+            }
+            if (warmupWindow) {
+                ++stats.warmupWindowMisses;
             }
             return GetValue(NULL, ENGINE_EWOULDBLOCK, v->getBySeqno(),
                             true, v->getNRUValue());
         }
+        if (v->isPrefetched() && queueBG) {
+            v->setPrefetched(false);
+            ++stats.bgPrefetchHits;
+        }
 
         GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
                     ENGINE_SUCCESS, v->getBySeqno(), false, v->getNRUValue());
         return rv;
     } else {
+        if (queueBG) {
+            warmupTask->vbucketRequested(vbucket);
+        }
         if (eviction_policy == VALUE_ONLY || diskFlushAll) {
             GetValue rv;
             return rv;
@@ -1494,6 +1779,9 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
             ec = addTempItemForBgFetch(lh, bucket_num, key, vb,
                                        cookie, false);
         }
+        if (warmupWindow) {
+            ++stats.warmupWindowMisses;
+        }
         return GetValue(NULL, ec, -1, true);
     }
 }
@@ -1563,7 +1851,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(
         stats.numOpsGetMeta++;
 
         if (v->isTempInitialItem()) { // Need bg meta fetch.
-            bgFetch(key, vbucket, -1, cookie, true);
+            bgFetch(key, vbucket, -1, cookie, true,
+                    BG_FETCH_GET_META);
             return ENGINE_EWOULDBLOCK;
         } else if (v->isTempNonExistentItem()) {
             metadata.cas = v->getCas();
@@ -1618,7 +1907,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(const Item &itm,
     if (!force) {
         if (v)  {
             if (v->isTempInitialItem()) {
-                bgFetch(itm.getKey(), itm.getVBucketId(), -1, cookie, true);
+                bgFetch(itm.getKey(), itm.getVBucketId(), -1, cookie, true,
+                        BG_FETCH_GET_META);
                 return ENGINE_EWOULDBLOCK;
             }
             if (!conflictResolver->resolve(v, itm.getMetaData(), false)) {
@@ -1662,7 +1952,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(const Item &itm,
         {            // CAS operation with non-resident item + full eviction.
             if (v) { // temp item is already created. Simply schedule a
                 lh.unlock(); // bg fetch job.
-                bgFetch(itm.getKey(), vb->getId(), -1, cookie, true);
+                bgFetch(itm.getKey(), vb->getId(), -1, cookie, true,
+                        BG_FETCH_GET_META);
                 return ENGINE_EWOULDBLOCK;
             }
             ret = addTempItemForBgFetch(lh, bucket_num, itm.getKey(), vb,
@@ -1763,6 +2054,7 @@ EventuallyPersistentStore::statsVKey(const std::string &key,
         bgFetchQueue++;
         cb_assert(bgFetchQueue > 0);
         ExecutorPool* iom = ExecutorPool::get();
+        bgFetchScheduler.enqueue(BG_FETCH_STATS);
         ExTask task = new VKeyStatBGFetchTask(&engine, key, vbucket,
                                            v->getBySeqno(), cookie,
                                            Priority::VKeyStatBgFetcherPriority,
@@ -1789,6 +2081,7 @@ EventuallyPersistentStore::statsVKey(const std::string &key,
                     ++bgFetchQueue;
                     cb_assert(bgFetchQueue > 0);
                     ExecutorPool* iom = ExecutorPool::get();
+                    bgFetchScheduler.enqueue(BG_FETCH_STATS);
                     ExTask task = new VKeyStatBGFetchTask(&engine, key,
                                                           vbucket, -1, cookie,
                                            Priority::VKeyStatBgFetcherPriority,
@@ -1983,7 +2276,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(
         if (eviction_policy == FULL_EVICTION &&
             v->isTempInitialItem() && bgfetch) {
             lh.unlock();
-            bgFetch(key, vbucket, -1, cookie, true);
+            bgFetch(key, vbucket, -1, cookie, true,
+                    BG_FETCH_STATS);
             return ENGINE_EWOULDBLOCK;
         }
         kstats.logically_deleted = v->isDeleted();
@@ -2045,6 +2339,11 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
                                                         ItemMetaData *itemMeta,
                                                         bool tapBackfill)
 {
+    // Only warmup itself (expired items) and replication force deletes
+    if (!force && isWarmingUp()) {
+        return ENGINE_TMPFAIL;
+    }
+
     RCPtr<VBucket> vb = getVBucket(vbucket);
     if (!vb || (vb->getState() == vbucket_state_dead && !force)) {
         ++stats.numNotMyVBuckets;
@@ -2172,7 +2471,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(
     if (!force) { // Need conflict resolution.
         if (v)  {
             if (v->isTempInitialItem()) {
-                bgFetch(key, vbucket, -1, cookie, true);
+                bgFetch(key, vbucket, -1, cookie, true,
+                        BG_FETCH_GET_META);
                 return ENGINE_EWOULDBLOCK;
             }
             if (!conflictResolver->resolve(v, *itemMeta, true)) {
@@ -2236,7 +2536,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(
         break;
     case NEED_BG_FETCH:
         lh.unlock();
-        bgFetch(key, vbucket, -1, cookie, true);
+        bgFetch(key, vbucket, -1, cookie, true,
+                BG_FETCH_GET_META);
         ret = ENGINE_EWOULDBLOCK;
     }
 
@@ -2255,6 +2556,8 @@ void EventuallyPersistentStore::reset() {
         }
     }
 
+    // Any batch collected until now holds items that are gone from memory
+    ++flushAllGeneration;
     bool inverse = false;
     if (diskFlushAll.compare_exchange_strong(inverse, true)) {
         ++stats.diskQueueSize;
@@ -2275,14 +2578,24 @@ class PersistenceCallback : public Callback<mutation_result>,
 public:
 
     PersistenceCallback(const queued_item &qi, RCPtr<VBucket> &vb,
-                        EventuallyPersistentStore *st, EPStats *s, uint64_t c)
-        : queuedItem(qi), vbucket(vb), store(st), stats(s), cas(c) {
+                        EventuallyPersistentStore *st, EPStats *s, uint64_t c,
+                        bool existence = false)
+        : queuedItem(qi), vbucket(vb), store(st), stats(s), cas(c),
+          requeued(false), reported(false),
+          existenceFromMemory(existence), deferred(false), pending(false),
+          setResult(0, false), delResult(0) {
         cb_assert(vb);
         cb_assert(s);
     }
 
     // This callback is invoked for set only.
     void callback(mutation_result &value) {
+        reported = true;
+        if (deferred && value.first == 1) {
+            setResult = value;
+            pending = true;
+            return;
+        }
         if (value.first == 1) {
             int bucket_num(0);
             LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(),
@@ -2361,6 +2674,12 @@ public:
         // -1 means fail
         // 1 means we deleted one row
         // 0 means we did not delete a row, but did not fail (did not exist)
+        reported = true;
+        if (deferred && value >= 0) {
+            delResult = value;
+            pending = true;
+            return;
+        }
         if (value >= 0) {
             // We have succesfully removed an item from the disk, we
             // may now remove it from the hash table.
@@ -2370,6 +2689,11 @@ public:
             StoredValue *v = store->fetchValidValue(vbucket,
                                                     queuedItem->getKey(),
                                                     bucket_num, true, false);
+            if (existenceFromMemory) {
+                // All keys are in memory, the ones ever persisted or loaded
+                // from disk are no longer new cache items.
+                value = (v && !v->isNewCacheItem()) ? 1 : 0;
+            }
             if (v && v->isDeleted()) {
                 bool newCacheItem = v->isNewCacheItem();
                 bool deleted = vbucket->ht.unlocked_del(queuedItem->getKey(),
@@ -2401,8 +2725,10 @@ public:
         }
     }
 
-private:
-
+    /**
+     * Put the item back on the reject queue of its vbucket so that it is
+     * written again by a later flush.
+     */
     void redirty() {
         if (store->vbMap.isBucketDeletion(vbucket->getId())) {
             vbucket->doStatsForFlushing(*queuedItem, queuedItem->size());
@@ -2414,13 +2740,83 @@ private:
                                          queuedItem->getVBucketId(),
                                          &StoredValue::reDirty);
         vbucket->rejectQueue.push(queuedItem);
+        requeued = true;
+    }
+
+    bool isRequeued() const {
+        return requeued;
+    }
+
+    /**
+     * @return true if the KVStore fired this callback. A failure it
+     *         reported is already redirtied by the callback itself.
+     */
+    bool isReported() const {
+        return reported;
+    }
+
+    /**
+     * Hold a successful write back until synced() is called: the item
+     * mustn't be marked clean or removed from the hash table before the
+     * file it was written to is synced. Failures are handled right away.
+     */
+    void deferUntilSynced() {
+        deferred = true;
+    }
+
+    /**
+     * @return true if a successful write is held back for synced()
+     */
+    bool isPending() const {
+        return pending;
+    }
+
+    /**
+     * The file the item was written to is synced, apply the write held
+     * back by deferUntilSynced().
+     */
+    void synced() {
+        cb_assert(pending);
+        deferred = false;
+        pending = false;
+        if (queuedItem->getOperation() == queue_op_del) {
+            callback(delResult);
+        } else {
+            callback(setResult);
+        }
+    }
+
+    /**
+     * The file the item was written to failed to sync, the write held
+     * back by deferUntilSynced() may not be on disk: write it again.
+     */
+    void syncFailed() {
+        cb_assert(pending);
+        deferred = false;
+        pending = false;
+        redirty();
     }
 
+    uint16_t getVBucketId() const {
+        return queuedItem->getVBucketId();
+    }
+
+private:
+
     const queued_item queuedItem;
-    RCPtr<VBucket> &vbucket;
+    RCPtr<VBucket> vbucket;
     EventuallyPersistentStore *store;
     EPStats *stats;
     uint64_t cas;
+    bool requeued;
+    bool reported;
+    // Tell deletions of keys that were on disk from the hash table, the
+    // KVStore didn't look.
+    bool existenceFromMemory;
+    bool deferred;
+    bool pending;
+    mutation_result setResult;
+    int delResult;
     DISALLOW_COPY_AND_ASSIGN(PersistenceCallback);
 };
 
@@ -2428,6 +2824,9 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
     for (size_t i = 0; i < vbMap.numShards; ++i) {
         KVShard* shard = vbMap.shards[i];
         LockHolder lh(shard->getWriteLock());
+        // A compaction finishing after the reset would bring the old
+        // data back
+        waitForCompactions(i);
         shard->getRWUnderlying()->reset(i);
     }
 
@@ -2436,8 +2835,149 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
     stats.decrDiskQueueSize(1);
 }
 
-int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
+void EventuallyPersistentStore::collectFlushBatch(FlushBatch &batch) {
+    RCPtr<VBucket> vb = vbMap.getBucket(batch.vbid);
+    batch.vbucket = vb;
+    if (!vb) {
+        return;
+    }
+
+    batch.flushAllGen = flushAllGeneration.load();
+    size_t limit = batch.maxItems;
+    std::vector<queued_item> items;
+    while (!vb->rejectQueue.empty() && (limit == 0 || items.size() < limit)) {
+        items.push_back(vb->rejectQueue.front());
+        vb->rejectQueue.pop();
+    }
+
+    if (vb->rejectQueue.empty()) {
+        vb->getBackfillItems(items);
+        vb->checkpointManager.getAllItemsForPersistence(items);
+    }
+
+    if (limit > 0 && items.size() > limit) {
+        // Only the oldest items go, so that the persisted seqno never gets
+        // ahead of an item that isn't on disk yet.
+        for (size_t i = limit; i < items.size(); ++i) {
+            vb->rejectQueue.push(items[i]);
+        }
+        items.resize(limit);
+    }
+
+    if (items.empty()) {
+        return;
+    }
+
+    getRWUnderlying(batch.vbid)->optimizeWrites(items);
+
+    Item *prev = NULL;
+    std::vector<queued_item>::iterator it = items.begin();
+    for(; it != items.end(); ++it) {
+        if ((*it)->getOperation() != queue_op_set &&
+            (*it)->getOperation() != queue_op_del) {
+            continue;
+        } else if (!prev || prev->getKey() != (*it)->getKey()) {
+            prev = (*it).get();
+            batch.items.push_back(*it);
+        } else {
+            stats.decrDiskQueueSize(1);
+            vb->doStatsForFlushing(*(*it), (*it)->size());
+        }
+    }
+}
+
+void EventuallyPersistentStore::dropFlushBatch(FlushBatch *batch,
+                                               const char *reason) {
+    RCPtr<VBucket> &vb = batch->vbucket;
+    std::vector<queued_item>::iterator it = batch->items.begin();
+    for (; vb && it != batch->items.end(); ++it) {
+        stats.decrDiskQueueSize(1);
+        vb->doStatsForFlushing(*(*it), (*it)->size());
+    }
+    LOG(EXTENSION_LOG_INFO, "Dropped %lu staged items of vb %d, %s",
+        static_cast<unsigned long>(batch->items.size()), batch->vbid,
+        reason);
+    delete batch;
+}
+
+bool EventuallyPersistentStore::persistenceCompleted(uint16_t vbid,
+                                                     RCPtr<VBucket> &vb) {
+    if (!vb->rejectQueue.empty()) {
+        return false;
+    }
+
+    uint64_t highSeqno = getRWUnderlying(vbid)->getLastPersistedSeqno(vbid);
+    if (highSeqno > 0 && highSeqno != vbMap.getPersistenceSeqno(vbid)) {
+        vbMap.setPersistenceSeqno(vbid, highSeqno);
+    }
+
+    vb->checkpointManager.itemsPersisted();
+    uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
+    uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
+    vb->notifyCheckpointPersisted(engine, seqno, true);
+    vb->notifyCheckpointPersisted(engine, chkid, false);
+    if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
+        vbMap.setPersistenceCheckpointId(vbid, chkid);
+        return true;
+    }
+    return false;
+}
+
+bool EventuallyPersistentStore::syncDeferredFlushes(uint16_t shardId,
+                                            const std::set<uint16_t> &vbids,
+                                            size_t &synced) {
+    KVShard *shard = vbMap.shards[shardId];
+    bool schedule_vb_snapshot = false;
+
+    LockHolder lh(shard->getWriteLock());
+    std::set<uint16_t> failed;
+    bool success = shard->getRWUnderlying()->syncDeferred(synced, failed);
+    if (!success) {
+        ++stats.commitFailed;
+    }
+
+    // Only now are the items written since the last sync durable. The
+    // ones of a file that failed to sync may be lost whatever a retried
+    // sync says, they are written again.
+    std::list<PersistenceCallback*> &pcbs = unsyncedFlushes[shardId];
+    while (!pcbs.empty()) {
+        PersistenceCallback *pcb = pcbs.front();
+        if (failed.find(pcb->getVBucketId()) != failed.end()) {
+            pcb->syncFailed();
+        } else {
+            pcb->synced();
+        }
+        delete pcb;
+        pcbs.pop_front();
+    }
+
+    std::set<uint16_t>::const_iterator it = vbids.begin();
+    for (; it != vbids.end(); ++it) {
+        RCPtr<VBucket> vb = vbMap.getBucket(*it);
+        if (vb && failed.find(*it) == failed.end() &&
+            persistenceCompleted(*it, vb)) {
+            schedule_vb_snapshot = true;
+        }
+    }
+
+    if (schedule_vb_snapshot) {
+        scheduleVBSnapshot(Priority::VBucketPersistHighPriority, shardId);
+    }
+    return success;
+}
+
+int EventuallyPersistentStore::flushVBucket(uint16_t vbid,
+                                            FlushBatch *staged,
+                                            bool deferSync,
+                                            size_t maxItems) {
     KVShard *shard = vbMap.getShard(vbid);
+    if (staged && (diskFlushAll ||
+                   staged->flushAllGen != flushAllGeneration.load())) {
+        // Staged before a flush all, writing it after the flush all would
+        // bring the flushed items back
+        dropFlushBatch(staged, "staged before a flush all");
+        staged = NULL;
+    }
     if (diskFlushAll) {
         if (shard->getId() == EP_PRIMARY_SHARD) {
             flushOneDeleteAll();
@@ -2447,81 +2987,101 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
         }
     }
 
-    if (vbMap.isBucketCreation(vbid)) {
+    if (!staged && vbMap.isBucketCreation(vbid)) {
         return RETRY_FLUSH_VBUCKET;
     }
 
     int items_flushed = 0;
     bool schedule_vb_snapshot = false;
-    rel_time_t flush_start = ep_current_time();
 
     LockHolder lh(shard->getWriteLock());
-    RCPtr<VBucket> vb = vbMap.getBucket(vbid);
-    if (vb) {
-        KVStatsCallback cb(this);
-        std::vector<queued_item> items;
-        KVStore *rwUnderlying = getRWUnderlying(vbid);
-
-        while (!vb->rejectQueue.empty()) {
-            items.push_back(vb->rejectQueue.front());
-            vb->rejectQueue.pop();
+    if (staged && (vbMap.isBucketDeletion(vbid) ||
+                   vbMap.getBucket(vbid).get() != staged->vbucket.get())) {
+        // The vbucket was deleted, and maybe created again, since the batch
+        // was staged. Its items must not be written to the new file.
+        dropFlushBatch(staged, "staged before the vbucket was deleted");
+        staged = NULL;
+        if (vbMap.isBucketCreation(vbid)) {
+            return RETRY_FLUSH_VBUCKET;
+        }
+    }
+    if (isCompacting(vbid)) {
+        // Its file is being replaced, the flusher is woken up once the
+        // compaction is done.
+        if (staged && staged->vbucket) {
+            std::vector<queued_item>::iterator it = staged->items.begin();
+            for (; it != staged->items.end(); ++it) {
+                staged->vbucket->rejectQueue.push(*it);
+            }
         }
+        delete staged;
+        return 0;
+    }
 
-        vb->getBackfillItems(items);
-        vb->checkpointManager.getAllItemsForPersistence(items);
+    FlushBatch collected(vbid, maxItems);
+    FlushBatch *batch = staged;
+    if (!batch) {
+        collectFlushBatch(collected);
+        batch = &collected;
+    }
 
-        if (!items.empty()) {
-            while (!rwUnderlying->begin()) {
-                ++stats.beginFailed;
-                LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
-                    "Retry in 1 sec ...");
-                sleep(1);
+    RCPtr<VBucket> &vb = batch->vbucket;
+    if (vb) {
+        KVStatsCallback cb(this);
+        KVStore *rwUnderlying = getRWUnderlying(vbid);
+        rel_time_t flush_start = batch->flushStart;
+
+        if (!batch->items.empty() && !rwUnderlying->begin()) {
+            ++stats.beginFailed;
+            LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction on "
+                "vb %d, requeue %lu items and retry later", vbid,
+                static_cast<unsigned long>(batch->items.size()));
+            std::vector<queued_item>::iterator it = batch->items.begin();
+            for (; it != batch->items.end(); ++it) {
+                vb->rejectQueue.push(*it);
             }
-            rwUnderlying->optimizeWrites(items);
-
-            Item *prev = NULL;
+            items_flushed = BACKOFF_FLUSH_VBUCKET;
+        } else if (!batch->items.empty()) {
             std::list<PersistenceCallback*> pcbs;
-            std::vector<queued_item>::iterator it = items.begin();
-            for(; it != items.end(); ++it) {
-                if ((*it)->getOperation() != queue_op_set &&
-                    (*it)->getOperation() != queue_op_del) {
-                    continue;
-                } else if (!prev || prev->getKey() != (*it)->getKey()) {
-                    prev = (*it).get();
-                    ++items_flushed;
-                    PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
-                    if (cb) {
-                        pcbs.push_back(cb);
+            std::vector<queued_item>::iterator it = batch->items.begin();
+            for(; it != batch->items.end(); ++it) {
+                ++items_flushed;
+                PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
+                if (cb) {
+                    if (deferSync) {
+                        cb->deferUntilSynced();
                     }
-                    ++stats.flusher_todo;
-                } else {
-                    stats.decrDiskQueueSize(1);
-                    vb->doStatsForFlushing(*(*it), (*it)->size());
+                    pcbs.push_back(cb);
                 }
+                ++stats.flusher_todo;
             }
 
             BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
                              stats.timingLog);
             hrtime_t start = gethrtime();
 
-            while (!rwUnderlying->commit(&cb)) {
+            bool committed = deferSync ? rwUnderlying->commitNoSync(&cb) :
+                                         rwUnderlying->commit(&cb);
+            if (!committed) {
                 ++stats.commitFailed;
-                LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
-                    "1 sec...\n");
-                sleep(1);
-
-            }
-
-            if (vb->rejectQueue.empty()) {
-                uint64_t highSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
-                if (highSeqno > 0 &&
-                    highSeqno != vbMap.getPersistenceSeqno(vbid)) {
-                    vbMap.setPersistenceSeqno(vbid, highSeqno);
-                }
+                LOG(EXTENSION_LOG_WARNING, "Flusher commit failed on vb %d, "
+                    "requeue %d items and retry later", vbid, items_flushed);
+                rwUnderlying->rollback();
             }
 
+            bool requeued = false;
             while (!pcbs.empty()) {
-                delete pcbs.front();
+                PersistenceCallback *pcb = pcbs.front();
+                if (!pcb->isReported()) {
+                    // The store didn't get to write this one
+                    pcb->redirty();
+                }
+                requeued = requeued || pcb->isRequeued();
+                if (pcb->isPending()) {
+                    unsyncedFlushes[shard->getId()].push_back(pcb);
+                } else {
+                    delete pcb;
+                }
                 pcbs.pop_front();
             }
 
@@ -2539,21 +3099,20 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
                                                 - flush_start);
             stats.flusher_todo.store(0);
 
+            if (requeued) {
+                // Let the flusher back off instead of hammering a failing
+                // disk with the requeued items.
+                items_flushed = BACKOFF_FLUSH_VBUCKET;
+            }
         }
 
-        if (vb->rejectQueue.empty()) {
-            vb->checkpointManager.itemsPersisted();
-            uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
-            uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
-            vb->notifyCheckpointPersisted(engine, seqno, true);
-            vb->notifyCheckpointPersisted(engine, chkid, false);
-            if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
-                vbMap.setPersistenceCheckpointId(vbid, chkid);
-                schedule_vb_snapshot = true;
-            }
+        if (!deferSync && persistenceCompleted(vbid, vb)) {
+            schedule_vb_snapshot = true;
         }
     }
 
+    delete staged;
+
     if (schedule_vb_snapshot || snapshotVBState) {
         scheduleVBSnapshot(Priority::VBucketPersistHighPriority,
                            shard->getId());
@@ -2606,7 +3165,8 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
         BlockTimer timer(&stats.diskDelHisto, "disk_delete",
                          stats.timingLog);
         PersistenceCallback *cb =
-            new PersistenceCallback(qi, vb, this, &stats, 0);
+            new PersistenceCallback(qi, vb, this, &stats, 0,
+                                    !rwUnderlying->reportsPriorExistence());
         rwUnderlying->del(*qi, *cb);
         return cb;
     }
@@ -2643,6 +3203,10 @@ std::map<uint16_t, vbucket_state> EventuallyPersistentStore::loadVBucketState()
 }
 
 void EventuallyPersistentStore::warmupCompleted() {
+    // Count the gets served from memory and from disk for a while, to see
+    // how well the warmup picked what to load
+    stats.warmupWindowEnd.store(ep_current_time() + WARMUP_HIT_WINDOW);
+
     // Run the vbucket state snapshot job once after the warmup
     scheduleVBSnapshot(Priority::VBucketPersistHighPriority);
 
@@ -2694,6 +3258,10 @@ bool EventuallyPersistentStore::isWarmingUp() {
     return !warmupTask->isComplete();
 }
 
+bool EventuallyPersistentStore::isWarmingUp(uint16_t vbid) {
+    return isWarmingUp() && !warmupTask->isVBucketReadable(vbid);
+}
+
 void EventuallyPersistentStore::stopWarmup(void)
 {
     // forcefully stop current warmup task
@@ -2873,6 +3441,10 @@ void EventuallyPersistentStore::resetUnderlyingStats(void)
         KVShard *shard = vbMap.shards[i];
         shard->getRWUnderlying()->resetStats();
         shard->getROUnderlying()->resetStats();
+        std::vector<BgFetcher *> &bgfetchers = shard->getBgFetchers();
+        for (size_t j = 1; j < bgfetchers.size(); ++j) {
+            bgfetchers[j]->getKVStore()->resetStats();
+        }
     }
 }
 
@@ -2887,6 +3459,14 @@ void EventuallyPersistentStore::addKVStoreStats(ADD_STAT add_stat,
                                                      cookie);
         vbMap.shards[i]->getROUnderlying()->addStats(roPrefix.str(), add_stat,
                                                      cookie);
+        // the read-only KVStores of the other bg fetchers of the shard
+        std::vector<BgFetcher *> &bgfetchers = vbMap.shards[i]->getBgFetchers();
+        for (size_t j = 1; j < bgfetchers.size(); ++j) {
+            std::stringstream prefix;
+            prefix << "ro_" << i << "_" << j;
+            bgfetchers[j]->getKVStore()->addStats(prefix.str(), add_stat,
+                                                  cookie);
+        }
     }
 }
 
@@ -2903,6 +3483,13 @@ void EventuallyPersistentStore::addKVStoreTimingStats(ADD_STAT add_stat,
         vbMap.shards[i]->getROUnderlying()->addTimingStats(roPrefix.str(),
                                                            add_stat,
                                                            cookie);
+        std::vector<BgFetcher *> &bgfetchers = vbMap.shards[i]->getBgFetchers();
+        for (size_t j = 1; j < bgfetchers.size(); ++j) {
+            std::stringstream prefix;
+            prefix << "ro_" << i << "_" << j;
+            bgfetchers[j]->getKVStore()->addTimingStats(prefix.str(), add_stat,
+                                                        cookie);
+        }
     }
 }
 
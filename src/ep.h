@@ -43,6 +43,7 @@
 #include "kvstore.h"
 #include "locks.h"
 #include "executorpool.h"
+#include "prefetcher.h"
 #include "stats.h"
 #include "stored-value.h"
 #include "vbucket.h"
@@ -171,6 +172,29 @@ private:
 const uint16_t EP_PRIMARY_SHARD = 0;
 class KVShard;
 
+/**
+ * Items drained from a vbucket's reject, backfill and checkpoint queues,
+ * sorted and deduplicated, waiting to be written to the underlying KVStore.
+ */
+class FlushBatch {
+public:
+    FlushBatch(uint16_t vb, size_t max = 0) :
+        vbid(vb), maxItems(max), flushAllGen(0),
+        flushStart(ep_current_time()) { }
+
+    uint16_t vbid;
+    //! Most items to drain into the batch, 0 if unlimited
+    size_t maxItems;
+    //! The flush all generation the items were collected in
+    size_t flushAllGen;
+    RCPtr<VBucket> vbucket;
+    std::vector<queued_item> items;
+    rel_time_t flushStart;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FlushBatch);
+};
+
 /**
  * Manager of all interaction with the persistence.
  */
@@ -368,6 +392,8 @@ public:
 
     void stopFlusher(void);
 
+    void snapshotHashTables(void);
+
     bool startFlusher(void);
 
     bool pauseFlusher(void);
@@ -391,12 +417,14 @@ public:
      * @param cookie the cookie of the requestor
      * @param type whether the fetch is for a non-resident value or metadata of
      *             a (possibly) deleted item
+     * @param cls the class the read is scheduled by
      */
     void bgFetch(const std::string &key,
                  uint16_t vbucket,
                  uint64_t rowid,
                  const void *cookie,
-                 bool isMeta = false);
+                 bool isMeta = false,
+                 bg_fetch_class_t cls = BG_FETCH_FRONTEND);
 
     /**
      * Complete a background fetch of a non resident value or metadata.
@@ -408,13 +436,15 @@ public:
      * @param init the timestamp of when the request came in
      * @param type whether the fetch is for a non-resident value or metadata of
      *             a (possibly) deleted item
+     * @param cls the class the read was scheduled by
      */
     void completeBGFetch(const std::string &key,
                          uint16_t vbucket,
                          uint64_t rowid,
                          const void *cookie,
                          hrtime_t init,
-                         bool isMeta);
+                         bool isMeta,
+                         bg_fetch_class_t cls);
     /**
      * Complete a batch of background fetch of a non resident value or metadata.
      *
@@ -435,10 +465,12 @@ public:
      * @param init the time of epstore's initialization
      * @param start the time when the background fetch was started
      * @param stop the time when the background fetch completed
+     * @param cls the class the background fetch was scheduled by
      */
     void updateBGStats(const hrtime_t init,
                        const hrtime_t start,
-                       const hrtime_t stop);
+                       const hrtime_t stop,
+                       bg_fetch_class_t cls);
 
     RCPtr<VBucket> getVBucket(uint16_t vbid) {
         return vbMap.getBucket(vbid);
@@ -490,15 +522,32 @@ public:
                                 const void *ck);
 
     /**
-     * Callback to do the compaction of a vbucket
+     * Callback to do the compaction of a vbucket. The shard's write lock
+     * isn't held while compacting, so the shard's RW KVStore is used by
+     * the flusher meanwhile. Only writes to the compacted vbucket's file
+     * wait for it, for the whole compaction: so do the persistence waiters
+     * of the vbucket, even the high priority ones.
      *
      * @param vbid The Id of the VBucket which needs to be compacted
      * @param ctx Context for couchstore compaction hooks
      * @param ck cookie used to notify connection of operation completion
+     * @return true if another compaction of the vbucket is running and
+     *         this one has to be retried later
      */
     bool compactVBucket(const uint16_t vbid, compaction_ctx *ctx,
                         const void *ck);
 
+    /**
+     * @return true if the file of the given vbucket is being compacted
+     */
+    bool isCompacting(uint16_t vbid);
+
+    /**
+     * Schedule the compaction of the most fragmented vbucket files, as far
+     * as the per shard limit of concurrent compactions allows.
+     */
+    void scheduleAutoCompactions();
+
     /**
      * Reset a given vbucket from memory and disk. This differs from vbucket deletion in that
      * it does not delete the vbucket instance from memory hash table.
@@ -522,6 +571,12 @@ public:
     const Flusher* getFlusher(uint16_t shardId);
     Warmup* getWarmup(void) const;
 
+    /**
+     * Get the file the hash tables of the vbuckets of a shard are written
+     * to on a graceful shutdown.
+     */
+    std::string getHashTableSnapshotPath(uint16_t shardId);
+
     ENGINE_ERROR_CODE getKeyStats(const std::string &key, uint16_t vbucket,
                                   const void* cookie, key_stats &kstats,
                                   bool bgfetch, bool wantsDeleted=false);
@@ -556,6 +611,18 @@ public:
         return vbMap.getShard(vbId)->getROUnderlying();
     }
 
+    BgFetchScheduler &getBgFetchScheduler() {
+        return bgFetchScheduler;
+    }
+
+    /**
+     * Get the tracker of the keys read together, NULL unless
+     * bg_fetch_prefetch is on.
+     */
+    CoAccessTracker *getCoAccessTracker() {
+        return coAccessTracker;
+    }
+
     void deleteExpiredItem(uint16_t, std::string &, time_t, uint64_t );
     void deleteExpiredItems(std::list<std::pair<uint16_t, std::string> > &);
 
@@ -633,14 +700,63 @@ public:
 
     bool isWarmingUp();
 
+    /**
+     * Check if the reads of a vbucket have to wait for warmup: until it
+     * completes, or under progressive warmup until the keys of the vbucket
+     * are loaded.
+     */
+    bool isWarmingUp(uint16_t vbid);
+
     bool maybeEnableTraffic(void);
 
     /**
      * Flushes all items waiting for persistence in a given vbucket
      * @param vbid The id of the vbucket to flush
-     * @return The amount of items flushed
+     * @param staged a batch collected ahead of time for this vbucket, which
+     *               is written instead of draining the vbucket's queues.
+     *               Ownership is transferred to this call.
+     * @param deferSync if true the commit isn't synced to disk, the items
+     *                  aren't marked clean and the persistence waiters
+     *                  aren't notified, all are left to a later
+     *                  syncDeferredFlushes() call
+     * @param maxItems the most items to write in this flush (0 for no
+     *                 limit), ignored if a staged batch is given
+     * @return The amount of items flushed, RETRY_FLUSH_VBUCKET if the
+     *         vbucket isn't created yet, or BACKOFF_FLUSH_VBUCKET if the
+     *         write failed and the items were requeued
      */
-    int flushVBucket(uint16_t vbid);
+    int flushVBucket(uint16_t vbid, FlushBatch *staged = NULL,
+                     bool deferSync = false, size_t maxItems = 0);
+
+    /**
+     * Sync the files of a shard written by flushes with deferred syncs,
+     * mark their items clean and notify the persistence waiters of the
+     * given vbuckets. The items of the vbuckets whose files fail to sync
+     * are redirtied instead, to be written again.
+     *
+     * @param shardId the shard whose files to sync
+     * @param vbids the vbuckets whose persistence can be acknowledged
+     * @param synced set to the number of files synced
+     * @return false if some files couldn't be synced
+     */
+    bool syncDeferredFlushes(uint16_t shardId,
+                             const std::set<uint16_t> &vbids,
+                             size_t &synced);
+
+    /**
+     * Drain the items waiting for persistence in the batch's vbucket into
+     * the batch, dropping the ones superseded by a later mutation of the
+     * same key. Does not touch the underlying KVStore, so it may run
+     * without the shard's write lock as long as no other flush of the
+     * same vbucket is in progress.
+     *
+     * If the batch has an item limit the oldest items are taken and the
+     * rest are left on the vbucket's reject queue, which also holds back
+     * the checkpoint persistence notifications until they are written.
+     *
+     * @param batch the batch to fill
+     */
+    void collectFlushBatch(FlushBatch &batch);
 
     void addKVStoreStats(ADD_STAT add_stat, const void* cookie);
 
@@ -726,9 +842,26 @@ private:
     }
 
     void flushOneDeleteAll(void);
+    //! Throw away a batch whose items must not be written any more
+    void dropFlushBatch(FlushBatch *batch, const char *reason);
+
+    /**
+     * Wait for the running compactions of a shard, or of one of its
+     * vbuckets, to finish. New ones can't start while the caller holds
+     * the shard's write lock.
+     */
+    void waitForCompactions(uint16_t shardId, int vbid = -1);
     PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
                                           RCPtr<VBucket> &vb);
 
+    /**
+     * Update the persisted seqno and checkpoint of a vbucket after a flush
+     * and notify its persistence waiters, unless some items were rejected.
+     *
+     * @return true if the vbucket state needs to be snapshotted
+     */
+    bool persistenceCompleted(uint16_t vbid, RCPtr<VBucket> &vb);
+
     StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
                                  int bucket_num, bool wantsDeleted=false,
                                  bool trackReference=true, bool queueExpired=true);
@@ -764,7 +897,14 @@ private:
     std::vector<MutationLog*>       accessLog;
 
     AtomicValue<size_t> bgFetchQueue;
+    BgFetchScheduler bgFetchScheduler;
+    CoAccessTracker *coAccessTracker;
     AtomicValue<bool> diskFlushAll;
+    //! Bumped by every flush all, to tell the batches collected before it
+    AtomicValue<size_t> flushAllGeneration;
+    //! Per shard, the writes of deferred sync flushes waiting for the
+    //! sync of their files. Guarded by the shard's write lock.
+    std::vector<std::list<PersistenceCallback*> > unsyncedFlushes;
     Mutex vbsetMutex;
     uint32_t bgFetchDelay;
     struct ExpiryPagerDelta {
@@ -780,6 +920,17 @@ private:
         size_t task;
         hrtime_t lastTaskRuntime;
     } accessScanner;
+    struct AutoCompaction {
+        Mutex mutex;
+        /* vbuckets whose compaction the engine scheduled by itself */
+        std::set<uint16_t> vbuckets;
+    } autoCompaction;
+    struct Compacting {
+        SyncObject sync;
+        /* per shard, the vbuckets whose files are being compacted. Only
+           added to with the shard's write lock held. */
+        std::vector<std::set<uint16_t> > vbuckets;
+    } compacting;
     struct ResidentRatio {
         AtomicValue<size_t> activeRatio;
         AtomicValue<size_t> replicaRatio;
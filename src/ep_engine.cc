@@ -455,6 +455,22 @@ extern "C" {
                 validate(vsize, static_cast<uint64_t>(0),
                          std::numeric_limits<uint64_t>::max());
                 e->getConfiguration().setExpPagerStime((size_t)vsize);
+            } else if (strcmp(keyz, "compaction_frag_threshold") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setCompactionFragThreshold(v);
+            } else if (strcmp(keyz, "compaction_max_concurrent") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setCompactionMaxConcurrent(v);
+            } else if (strcmp(keyz, "compaction_min_file_size") == 0) {
+                char *ptr = NULL;
+                checkNumeric(valz);
+                uint64_t vsize = strtoull(valz, &ptr, 10);
+                validate(vsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                e->getConfiguration().setCompactionMinFileSize((size_t)vsize);
+            } else if (strcmp(keyz, "compaction_stime") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setCompactionStime(v);
             } else if (strcmp(keyz, "couch_response_timeout") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setCouchResponseTimeout(v);
@@ -467,6 +483,9 @@ extern "C" {
             } else if (strcmp(keyz, "pager_active_vb_pcnt") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setPagerActiveVbPcnt(v);
+            } else if (strcmp(keyz, "warmup_load_limit") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setWarmupLoadLimit(v);
             } else if (strcmp(keyz, "warmup_min_memory_threshold") == 0) {
                 checkNumeric(valz);
                 validate(v, 0, std::numeric_limits<int>::max());
@@ -2060,6 +2079,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::store(const void *cookie,
 
     it->setVBucketId(vbucket);
 
+    // Reads of a progressive warmup may be served, writes still wait for
+    // the whole warmup (REPLACE, APPEND and PREPEND read the item first)
+    if (isDegradedMode()) {
+        return ENGINE_TMPFAIL;
+    }
+
     switch (operation) {
     case OPERATION_CAS:
         if (it->getCas() == 0) {
@@ -2069,9 +2094,6 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::store(const void *cookie,
         }
         // FALLTHROUGH
     case OPERATION_SET:
-        if (isDegradedMode()) {
-            return ENGINE_TMPFAIL;
-        }
         ret = epstore->set(*it, cookie);
         if (ret == ENGINE_SUCCESS) {
             *cas = it->getCas();
@@ -2080,10 +2102,6 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::store(const void *cookie,
         break;
 
     case OPERATION_ADD:
-        if (isDegradedMode()) {
-            return ENGINE_TMPFAIL;
-        }
-
         if (it->getCas() != 0) {
             // Adding an item with a cas value doesn't really make sense...
             return ENGINE_KEY_EEXISTS;
@@ -2938,6 +2956,26 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     epstats.commit_time, add_stat, cookie);
     add_casted_stat("ep_commit_time_total",
                     epstats.cumulativeCommitTime, add_stat, cookie);
+    add_casted_stat("ep_flusher_batches_staged",
+                    epstats.flusherBatchesStaged, add_stat, cookie);
+    add_casted_stat("ep_flusher_staging_waits",
+                    epstats.flusherStagingWaits, add_stat, cookie);
+    add_casted_stat("ep_flusher_batches_capped",
+                    epstats.flusherBatchesCapped, add_stat, cookie);
+    add_casted_stat("ep_flusher_retries",
+                    epstats.flusherRetries, add_stat, cookie);
+    add_casted_stat("ep_flusher_degraded_time",
+                    epstats.flusherDegradedTime, add_stat, cookie);
+    add_casted_stat("ep_group_commits",
+                    epstats.groupCommits, add_stat, cookie);
+    add_casted_stat("ep_group_commit_syncs",
+                    epstats.groupCommitSyncs, add_stat, cookie);
+    size_t groupSyncRate = 0;
+    for (size_t i = 0; i < epstore->getVBuckets().getNumShards(); ++i) {
+        groupSyncRate += epstore->getFlusher(i)->getGroupCommitSyncRate();
+    }
+    add_casted_stat("ep_group_commit_syncs_per_sec", groupSyncRate,
+                    add_stat, cookie);
     add_casted_stat("ep_vbucket_del",
                     epstats.vbucketDeletions, add_stat, cookie);
     add_casted_stat("ep_vbucket_del_fail",
@@ -3188,6 +3226,28 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_max_bg_remaining_jobs", epstats.maxRemainingBgJobs,
                     add_stat, cookie);
+    add_casted_stat("ep_bg_prefetch_issued", epstats.bgPrefetchIssued,
+                    add_stat, cookie);
+    add_casted_stat("ep_bg_prefetched", epstats.bgPrefetched,
+                    add_stat, cookie);
+    add_casted_stat("ep_bg_prefetched_bytes", epstats.bgPrefetchedBytes,
+                    add_stat, cookie);
+    add_casted_stat("ep_bg_prefetch_hits", epstats.bgPrefetchHits,
+                    add_stat, cookie);
+    add_casted_stat("ep_bg_prefetch_wasted", epstats.bgPrefetchWasted,
+                    add_stat, cookie);
+    add_casted_stat("ep_bg_prefetch_wasted_bytes",
+                    epstats.bgPrefetchWastedBytes, add_stat, cookie);
+    size_t prefetched = epstats.bgPrefetched.load();
+    add_casted_stat("ep_bg_prefetch_accuracy",
+                    prefetched ? epstats.bgPrefetchHits.load() * 100 /
+                                 prefetched : 0,
+                    add_stat, cookie);
+    if (epstore->getCoAccessTracker()) {
+        add_casted_stat("ep_bg_prefetch_keys",
+                        epstore->getCoAccessTracker()->getNumKeys(),
+                        add_stat, cookie);
+    }
     add_casted_stat("ep_tap_bg_fetched", stats.numTapBGFetched,
                     add_stat, cookie);
     add_casted_stat("ep_tap_bg_fetch_requeued", stats.numTapBGFetchRequeued,
@@ -3225,6 +3285,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
 
     add_casted_stat("ep_pending_compactions", epstats.pendingCompactions,
                     add_stat, cookie);
+    add_casted_stat("ep_auto_compactions", epstats.autoCompactions,
+                    add_stat, cookie);
+    add_casted_stat("ep_auto_compactions_running",
+                    epstats.autoCompactionsRunning, add_stat, cookie);
+    add_casted_stat("ep_auto_compaction_queue", epstats.autoCompactionQueue,
+                    add_stat, cookie);
     add_casted_stat("ep_rollback_count", epstats.rollbackCount,
                     add_stat, cookie);
 
@@ -3268,6 +3334,18 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                         add_stat, cookie);
     }
 
+    for (int i = 0; i < BG_FETCH_NUM_CLASSES; ++i) {
+        bg_fetch_class_t cls = static_cast<bg_fetch_class_t>(i);
+        std::string prefix("ep_bg_");
+        prefix.append(BgFetchScheduler::getClassName(cls));
+        add_casted_stat((prefix + "_waiting").c_str(),
+                        epstats.bgClassWaiting[i], add_stat, cookie);
+        add_casted_stat((prefix + "_deferred").c_str(),
+                        epstats.bgClassDeferred[i], add_stat, cookie);
+        add_casted_stat((prefix + "_overdue").c_str(),
+                        epstats.bgClassOverdue[i], add_stat, cookie);
+    }
+
     add_casted_stat("ep_num_non_resident",
                     activeCountVisitor.getNonResident() +
                     pendingCountVisitor.getNonResident() +
@@ -3403,6 +3481,13 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doVBucketStats(
             } else {
                 vb->addStats(detailsRequested, add_stat, cookie,
                              store->getItemEvictionPolicy());
+                if (detailsRequested) {
+                    char buf[32];
+                    snprintf(buf, sizeof(buf), "vb_%d:warmup", vb->getId());
+                    add_casted_stat(buf,
+                            store->getWarmup()->getVBucketState(vb->getId()),
+                            add_stat, cookie);
+                }
             }
         }
 
@@ -3954,6 +4039,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
                                                            ADD_STAT add_stat) {
     add_casted_stat("bg_wait", stats.bgWaitHisto, add_stat, cookie);
     add_casted_stat("bg_load", stats.bgLoadHisto, add_stat, cookie);
+    for (int i = 0; i < BG_FETCH_NUM_CLASSES; ++i) {
+        std::string name(BgFetchScheduler::getClassName(
+                                        static_cast<bg_fetch_class_t>(i)));
+        add_casted_stat(("bg_wait_" + name).c_str(), stats.bgClassWaitHisto[i],
+                        add_stat, cookie);
+        add_casted_stat(("bg_load_" + name).c_str(), stats.bgClassLoadHisto[i],
+                        add_stat, cookie);
+    }
     add_casted_stat("set_with_meta", stats.setWithMetaHisto, add_stat, cookie);
     add_casted_stat("bg_tap_wait", stats.tapBgWaitHisto, add_stat, cookie);
     add_casted_stat("bg_tap_load", stats.tapBgLoadHisto, add_stat, cookie);
@@ -3972,6 +4065,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("del_vb_cmd", stats.delVbucketCmdHisto, add_stat, cookie);
     add_casted_stat("chk_persistence_cmd", stats.chkPersistenceHisto,
                     add_stat, cookie);
+    add_casted_stat("persist_wait_fast", stats.persistWaitFastHisto,
+                    add_stat, cookie);
+    add_casted_stat("persist_wait_bulk", stats.persistWaitBulkHisto,
+                    add_stat, cookie);
     // Tap commands
     add_casted_stat("tap_vb_set", stats.tapVbucketSetHisto, add_stat, cookie);
     add_casted_stat("tap_vb_reset", stats.tapVbucketResetHisto,
@@ -3980,6 +4077,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     // Misc
     add_casted_stat("notify_io", stats.notifyIOHisto, add_stat, cookie);
     add_casted_stat("batch_read", stats.getMultiHisto, add_stat, cookie);
+    add_casted_stat("bg_batch_read", stats.bgFetchBatchHisto,
+                    add_stat, cookie);
+    add_casted_stat("bg_batch_keys", stats.bgFetchBatchSizeHisto,
+                    add_stat, cookie);
 
     // Disk stats
     add_casted_stat("disk_insert", stats.diskInsertHisto, add_stat, cookie);
@@ -3987,6 +4088,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("disk_del", stats.diskDelHisto, add_stat, cookie);
     add_casted_stat("disk_vb_del", stats.diskVBDelHisto, add_stat, cookie);
     add_casted_stat("disk_commit", stats.diskCommitHisto, add_stat, cookie);
+    add_casted_stat("group_commit_items", stats.groupCommitBatchHisto,
+                    add_stat, cookie);
     add_casted_stat("disk_vbstate_snapshot", stats.snapshotVbucketHisto,
                     add_stat, cookie);
 
@@ -4247,6 +4350,9 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::getStats(const void* cookie,
     } else if (nkey == 6 && strncmp(stat_key, "warmup", 6) == 0) {
         epstore->getWarmup()->addStats(add_stat, cookie);
         rv = ENGINE_SUCCESS;
+    } else if (nkey == 15 && strncmp(stat_key, "warmup-vbuckets", 15) == 0) {
+        epstore->getWarmup()->addVBucketStats(add_stat, cookie);
+        rv = ENGINE_SUCCESS;
     } else if (nkey == 4 && strncmp(stat_key, "info", 4) == 0) {
         add_casted_stat("info", get_stats_info(), add_stat, cookie);
         rv = ENGINE_SUCCESS;
@@ -4424,6 +4530,13 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::touch(const void *cookie,
                             PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
     }
 
+    if (isDegradedMode()) {
+        std::string msg("Temporary Failure");
+        return sendResponse(response, NULL, 0, NULL, 0, msg.c_str(),
+                            msg.length(), PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_ETMPFAIL, 0, cookie);
+    }
+
     protocol_binary_request_touch *t =
                      reinterpret_cast<protocol_binary_request_touch*>(request);
     void *key = t->bytes + sizeof(t->bytes);
@@ -5081,7 +5194,8 @@ EventuallyPersistentEngine::handleTrafficControlCmd(const void *cookie,
 
     switch (request->request.opcode) {
     case PROTOCOL_BINARY_CMD_ENABLE_TRAFFIC:
-        if (epstore->isWarmingUp()) {
+        if (epstore->isWarmingUp() &&
+            !configuration.isWarmupProgressive()) {
             // engine is still warming up, do not turn on data traffic yet
             msg << "Persistent engine is still warming up!";
             status = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
@@ -5348,13 +5462,18 @@ public:
     }
 
     bool run() {
-        AllKeysCB *cb = new AllKeysCB();
+        AllKeysCB *cb =
+            new AllKeysCB(engine->getConfiguration().getAllKeysPageSize());
         ENGINE_ERROR_CODE err =
               engine->getEpStore()->getROUnderlying(vbid)->getAllKeys(vbid,
                                                               start_key, count,
                                                               cb);
         if (err == ENGINE_SUCCESS) {
-            err =  sendResponse(response, NULL, 0, NULL, 0,
+            uint32_t flags = htonl(GET_KEYS_PAGE_TRUNCATED);
+            bool truncated = cb->isTruncated();
+            err =  sendResponse(response, NULL, 0,
+                                truncated ? &flags : NULL,
+                                truncated ? sizeof(flags) : 0,
                                 cb->getAllKeysPtr(), cb->getAllKeysLen(),
                                 PROTOCOL_BINARY_RAW_BYTES,
                                 PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
@@ -5414,10 +5533,11 @@ EventuallyPersistentEngine::getAllKeys(const void* cookie,
     char *keyptr = (char*)(request->bytes + sizeof(request->bytes) + extlen);
     std::string start_key(keyptr, keylen);
 
+    // A long listing shouldn't hold up the bg fetches of the reader pool.
     ExTask task = new FetchAllKeysTask(this, cookie, response, start_key,
                                        vbucket, count,
-                                       Priority::BgFetcherPriority);
-    ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+                                       Priority::FetchAllKeysPriority);
+    ExecutorPool::get()->schedule(task, AUXIO_TASK_IDX);
     return ENGINE_EWOULDBLOCK;
 }
 
@@ -220,6 +220,11 @@ public:
                                  uint64_t* cas,
                                  uint16_t vbucket)
     {
+        // A readable vbucket of a progressive warmup still takes no writes
+        if (isDegradedMode()) {
+            return ENGINE_TMPFAIL;
+        }
+
         ENGINE_ERROR_CODE ret = epstore->deleteItem(key, cas,
                                                     vbucket, cookie,
                                                     false, // not force
@@ -255,7 +260,7 @@ public:
         if (ret == ENGINE_SUCCESS) {
             *itm = gv.getValue();
         } else if (ret == ENGINE_KEY_ENOENT || ret == ENGINE_NOT_MY_VBUCKET) {
-            if (isDegradedMode()) {
+            if (isDegradedMode(vbucket)) {
                 return ENGINE_TMPFAIL;
             }
         }
@@ -299,6 +304,10 @@ public:
                                  uint16_t vbucket)
     {
         BlockTimer timer(&stats.arithCmdHisto);
+        if (isDegradedMode()) {
+            return ENGINE_TMPFAIL;
+        }
+
         item *it = NULL;
         uint8_t ext_meta[1];
         uint8_t ext_len = EXT_META_LEN;
@@ -673,6 +682,13 @@ public:
         return epstore->isWarmingUp() || !trafficEnabled.load();
     }
 
+    /**
+     * Check if the reads of a vbucket can't be served yet.
+     */
+    bool isDegradedMode(uint16_t vbucket) const {
+        return epstore->isWarmingUp(vbucket) || !trafficEnabled.load();
+    }
+
     WorkLoadPolicy &getWorkLoadPolicy(void) {
         return *workload;
     }
@@ -24,6 +24,7 @@
 #include <map>
 #include <vector>
 
+#include "ep_engine.h"
 #include "flusher.h"
 
 bool Flusher::stop(bool isForceShutdown) {
@@ -129,12 +130,31 @@ void Flusher::initialize(size_t tid) {
 
 void Flusher::schedule_UNLOCKED() {
     ExecutorPool* iom = ExecutorPool::get();
-    ExTask task = new FlusherTask(ObjectRegistry::getCurrentEngine(),
-                                  this, Priority::FlusherPriority,
+    EventuallyPersistentEngine *engine = ObjectRegistry::getCurrentEngine();
+    ExTask task = new FlusherTask(engine, this, Priority::FlusherPriority,
                                   shard->getId());
     this->setTaskId(task->getId());
     iom->schedule(task, WRITER_TASK_IDX);
     cb_assert(taskId > 0);
+
+    Configuration &config = engine->getConfiguration();
+    groupCommitWindow = config.getGroupCommitWindow() * 1000000;
+    groupCommitMaxItems = config.getGroupCommitMaxItems();
+    latencyTarget = config.getFlusherLatencyTarget() * 1000000;
+    maxBatchItems = config.getFlusherMaxBatchItems();
+    fastLaneMaxItems = config.getFlusherFastLaneMaxItems();
+    adaptiveBatchLimit = FLUSH_BATCH_INITIAL_ITEMS;
+    if (maxBatchItems > 0) {
+        adaptiveBatchLimit = std::min(adaptiveBatchLimit, maxBatchItems);
+    }
+
+    if (config.isFlusherPipelineEnabled()) {
+        ExTask prepTask = new FlushPrepareTask(engine, this,
+                                               Priority::FlushPreparePriority,
+                                               shard->getId());
+        prepareTaskId = prepTask->getId();
+        iom->schedule(prepTask, WRITER_TASK_IDX);
+    }
 }
 
 void Flusher::start() {
@@ -162,6 +182,10 @@ bool Flusher::step(GlobalTask *task) {
         case paused:
         case pausing:
             if (_state == pausing) {
+                if (!groupCommitVbs.empty() && !commitGroup()) {
+                    backingOff(task);
+                    return true;
+                }
                 transition_state(paused);
             }
             // Indefinitely put task to sleep..
@@ -169,8 +193,11 @@ bool Flusher::step(GlobalTask *task) {
             return true;
         case running:
             {
+                if (backingOff(task)) {
+                    return true;
+                }
                 flushVB();
-                if (_state == running) {
+                if (_state == running && !backingOff(task)) {
                     double tosleep = computeMinSleepTime();
                     if (tosleep > 0) {
                         task->snooze(tosleep);
@@ -179,18 +206,30 @@ bool Flusher::step(GlobalTask *task) {
                 return true;
             }
         case stopping:
+            if (backingOff(task)) {
+                return true;
+            }
             {
                 std::stringstream ss;
                 ss << "Shutting down flusher (Write of all dirty items)"
                    << std::endl;
                 LOG(EXTENSION_LOG_DEBUG, "%s", ss.str().c_str());
             }
-            completeFlush();
+            if (!completeFlush()) {
+                // Keep all the dirty items, try again once the backoff
+                // expires.
+                backingOff(task);
+                return true;
+            }
             LOG(EXTENSION_LOG_DEBUG, "Flusher stopped");
             transition_state(stopped);
         case stopped:
             {
                 LockHolder lh(taskMutex);
+                if (prepareTaskId) {
+                    ExecutorPool::get()->cancel(prepareTaskId);
+                    prepareTaskId = 0;
+                }
                 taskId = 0;
                 return false;
             }
@@ -212,9 +251,227 @@ bool Flusher::step(GlobalTask *task) {
     abort();
 }
 
-void Flusher::completeFlush() {
+bool Flusher::prepareStep(GlobalTask *task) {
+    if (_state == stopped) {
+        return false;
+    }
+
+    // Go back to sleep before looking at the slot, so that a wake up sent
+    // by the flusher task while we are collecting isn't lost.
+    task->snooze(INT_MAX);
+
+    LockHolder lh(stagingSync);
+    if (staging != staging_requested) {
+        return true;
+    }
+    staging = staging_collecting;
+    FlushBatch *batch = new FlushBatch(stagedVb, stagedMaxItems);
+    lh.unlock();
+
+    // Leave the flush all and vbucket creation cases to the flusher task,
+    // they need the shard's write lock.
+    bool collect = !store->diskFlushAll &&
+                   !store->vbMap.isBucketCreation(batch->vbid);
+    if (collect) {
+        store->collectFlushBatch(*batch);
+        ++store->stats.flusherBatchesStaged;
+    } else {
+        delete batch;
+        batch = NULL;
+    }
+
+    lh.lock();
+    stagedBatch = batch;
+    staging = batch ? staging_ready : staging_idle;
+    stagingSync.notify();
+    return true;
+}
+
+void Flusher::stageNext(uint16_t vbid, size_t maxItems) {
+    if (store->isCompacting(vbid)) {
+        return;
+    }
+    LockHolder lh(stagingSync);
+    if (staging != staging_idle) {
+        return;
+    }
+    staging = staging_requested;
+    stagedVb = vbid;
+    stagedMaxItems = maxItems;
+    if (!ExecutorPool::get()->wake(prepareTaskId)) {
+        staging = staging_idle;
+    }
+}
+
+FlushBatch *Flusher::takeStagedBatch(uint16_t vbid) {
+    LockHolder lh(stagingSync);
+    if (staging == staging_idle || stagedVb != vbid) {
+        return NULL;
+    }
+
+    if (staging == staging_requested) {
+        // The prepare task hasn't started on it yet, cheaper to collect it
+        // inline than to wait for a writer thread to pick it up.
+        staging = staging_idle;
+        return NULL;
+    }
+
+    if (staging == staging_collecting) {
+        ++store->stats.flusherStagingWaits;
+        while (staging == staging_collecting) {
+            stagingSync.wait();
+        }
+    }
+
+    FlushBatch *batch = stagedBatch;
+    stagedBatch = NULL;
+    staging = staging_idle;
+    return batch;
+}
+
+bool Flusher::completeFlush() {
     while(!canSnooze()) {
         flushVB();
+        if (retryAt > gethrtime()) {
+            return false;
+        }
+    }
+    if (!groupCommitVbs.empty()) {
+        return commitGroup();
+    }
+    return true;
+}
+
+void Flusher::backOff() {
+    hrtime_t now = gethrtime();
+    EPStats &stats = store->stats;
+    if (degradedSince == 0) {
+        retryBackoff = FLUSH_RETRY_MIN_BACKOFF;
+    } else {
+        stats.flusherDegradedTime.fetch_add((now - degradedSince) / 1000000);
+        retryBackoff = std::min(retryBackoff * 2, DEFAULT_MAX_SLEEP_TIME);
+    }
+    degradedSince = now;
+    retryAt = now + static_cast<hrtime_t>(retryBackoff * 1000000000);
+    ++stats.flusherRetries;
+    LOG(EXTENSION_LOG_WARNING, "Flusher of shard %d failed to write, "
+        "retry in %.1f sec", shard->getId(), retryBackoff);
+}
+
+void Flusher::recovered() {
+    if (degradedSince == 0) {
+        return;
+    }
+    hrtime_t now = gethrtime();
+    store->stats.flusherDegradedTime.fetch_add((now - degradedSince) /
+                                               1000000);
+    LOG(EXTENSION_LOG_WARNING, "Flusher of shard %d recovered after %s",
+        shard->getId(), hrtime2text(now - degradedSince).c_str());
+    degradedSince = 0;
+    retryAt = 0;
+}
+
+bool Flusher::backingOff(GlobalTask *task) {
+    hrtime_t now = gethrtime();
+    if (retryAt <= now) {
+        return false;
+    }
+    // Flush events may wake us up early, go back to sleep for the rest of
+    // the backoff without touching the disk.
+    task->snooze(static_cast<double>(retryAt - now) / 1000000000);
+    return true;
+}
+
+bool Flusher::groupCommitDue() {
+    if (groupCommitVbs.empty()) {
+        return false;
+    }
+    // Never go to sleep with unsynced commits.
+    return canSnooze() || groupCommitItems >= groupCommitMaxItems ||
+           gethrtime() - groupCommitStart >= groupCommitWindow;
+}
+
+bool Flusher::commitGroup() {
+    std::set<uint16_t> ready;
+    std::set<uint16_t> held;
+    {
+        LockHolder lh(stagingSync);
+        std::set<uint16_t>::iterator it = groupCommitVbs.begin();
+        for (; it != groupCommitVbs.end(); ++it) {
+            // A staged batch has already moved the persistence cursor of
+            // its vbucket, so its waiters must wait for the next group.
+            if (staging != staging_idle && stagedVb == *it) {
+                held.insert(*it);
+            } else {
+                ready.insert(*it);
+            }
+        }
+    }
+
+    size_t synced = 0;
+    if (!store->syncDeferredFlushes(shard->getId(), ready, synced)) {
+        // Nothing of the group is left unsynced, what failed is requeued
+        LOG(EXTENSION_LOG_WARNING, "Group commit of shard %d failed to sync, "
+            "the writes of the files that failed will be retried",
+            shard->getId());
+        groupCommitVbs.swap(held);
+        groupCommitItems = 0;
+        groupCommitStart = gethrtime();
+        backOff();
+        return false;
+    }
+    recovered();
+
+    hrtime_t now = gethrtime();
+    EPStats &stats = store->stats;
+    ++stats.groupCommits;
+    stats.groupCommitSyncs.fetch_add(synced);
+    stats.groupCommitBatchHisto.add(groupCommitItems);
+    if (lastGroupCommit > 0 && now > lastGroupCommit) {
+        groupCommitSyncRate.store(synced * 1000000000ULL /
+                                  (now - lastGroupCommit));
+    }
+    lastGroupCommit = now;
+
+    groupCommitVbs.swap(held);
+    groupCommitItems = 0;
+    groupCommitStart = now;
+    return true;
+}
+
+size_t Flusher::batchLimit(bool highPriority) {
+    if (highPriority) {
+        // Short commits keep the fast lane fast, the rest of a long
+        // backlog is written by the following fast lane passes.
+        if (maxBatchItems > 0) {
+            return std::min(fastLaneMaxItems, maxBatchItems);
+        }
+        return fastLaneMaxItems;
+    }
+    if (latencyTarget == 0) {
+        return maxBatchItems;
+    }
+    return adaptiveBatchLimit;
+}
+
+void Flusher::adjustBatchLimit(hrtime_t took, bool capped) {
+    if (latencyTarget == 0) {
+        return;
+    }
+
+    if (took > latencyTarget) {
+        // Shrink in proportion to the overshoot.
+        size_t limit = static_cast<size_t>(
+            static_cast<double>(adaptiveBatchLimit) * latencyTarget / took);
+        adaptiveBatchLimit = std::max(limit, FLUSH_BATCH_MIN_ITEMS);
+    } else if (capped) {
+        // There is a backlog and room in the latency budget, grow slowly
+        // to amortize the commit cost over more items.
+        adaptiveBatchLimit += adaptiveBatchLimit / 4;
+    }
+
+    if (maxBatchItems > 0) {
+        adaptiveBatchLimit = std::min(adaptiveBatchLimit, maxBatchItems);
     }
 }
 
@@ -236,9 +493,6 @@ void Flusher::flushVB(void) {
     }
 
     if (lpVbs.empty()) {
-        if (hpVbs.empty()) {
-            doHighPriority = false;
-        }
         bool inverse = true;
         pendingMutation.compare_exchange_strong(inverse, false);
         std::vector<int> vbs = shard->getVBucketsSortedByState();
@@ -248,19 +502,22 @@ void Flusher::flushVB(void) {
         }
     }
 
-    if (!doHighPriority && shard->highPriorityCount.load() > 0) {
+    // Fast lane: look for new persistence waiters between any two vbucket
+    // flushes of the regular round, not only once per round. The round
+    // gets one vbucket in after each fast lane pass so it can't starve.
+    if (fastLaneMaxItems > 0 && hpVbs.empty() && !doHighPriority &&
+        shard->highPriorityCount.load() > 0) {
         std::vector<int> vbs = shard->getVBuckets();
         std::vector<int>::iterator itr = vbs.begin();
         for (; itr != vbs.end(); ++itr) {
             RCPtr<VBucket> vb = store->getVBucket(*itr);
-            if (vb && vb->getHighPriorityChkSize() > 0) {
+            if (vb && vb->getHighPriorityChkSize() > 0 &&
+                !store->isCompacting(*itr)) {
+                vb->markHighPriorityFastLane();
                 hpVbs.push(static_cast<uint16_t>(*itr));
             }
         }
-        numHighPriority = hpVbs.size();
-        if (!hpVbs.empty()) {
-            doHighPriority = true;
-        }
+        doHighPriority = !hpVbs.empty();
     }
 
     if (hpVbs.empty() && lpVbs.empty()) {
@@ -269,17 +526,83 @@ void Flusher::flushVB(void) {
     } else if (!hpVbs.empty()) {
         uint16_t vbid = hpVbs.front();
         hpVbs.pop();
-        if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
-            hpVbs.push(vbid);
-        }
+        flushVBFromQueue(vbid, hpVbs);
     } else {
-        if (doHighPriority && --numHighPriority == 0) {
-            doHighPriority = false;
-        }
+        doHighPriority = false;
         uint16_t vbid = lpVbs.front();
         lpVbs.pop();
-        if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
-            lpVbs.push(vbid);
+        flushVBFromQueue(vbid, lpVbs);
+    }
+}
+
+void Flusher::flushVBFromQueue(uint16_t vbid, std::queue<uint16_t> &from) {
+    bool highPriority = &from == &hpVbs;
+    if (store->isCompacting(vbid)) {
+        if (_state != stopping) {
+            // Left for the flush event sent when the compaction is done
+            return;
         }
+        store->waitForCompactions(shard->getId(), vbid);
+    }
+    if (highPriority && groupCommitVbs.count(vbid) > 0 && !commitGroup()) {
+        // The earlier writes of the vbucket must be synced before its
+        // waiters can be told about them.
+        from.push(vbid);
+        return;
+    }
+
+    FlushBatch *staged = NULL;
+    if (prepareTaskId) {
+        staged = takeStagedBatch(vbid);
+        // Let the prepare task collect the next vbucket in line while we
+        // are committing this one.
+        bool nextHighPriority = !hpVbs.empty();
+        std::queue<uint16_t> &next = nextHighPriority ? hpVbs : lpVbs;
+        if (!next.empty() && next.front() != vbid) {
+            stageNext(next.front(), batchLimit(nextHighPriority));
+        }
+    }
+
+    // Fast lane flushes sync right away, their waiters shouldn't sit out
+    // the group commit window.
+    bool deferSync = groupCommitWindow > 0 && !highPriority;
+    hrtime_t start = gethrtime();
+    int flushed = store->flushVBucket(vbid, staged, deferSync,
+                                      batchLimit(highPriority));
+    if (flushed == RETRY_FLUSH_VBUCKET) {
+        from.push(vbid);
+    } else if (flushed == BACKOFF_FLUSH_VBUCKET) {
+        from.push(vbid);
+        backOff();
+        return;
+    } else {
+        RCPtr<VBucket> vb = store->getVBucket(vbid);
+        bool capped = vb && !vb->rejectQueue.empty();
+        if (capped) {
+            // Come back for the rest after the other vbuckets had a turn,
+            // the next fast lane pass picks up a vbucket that still has
+            // waiters.
+            ++store->stats.flusherBatchesCapped;
+            if (!highPriority) {
+                from.push(vbid);
+            }
+        }
+        if (!highPriority) {
+            adjustBatchLimit(gethrtime() - start, capped);
+        }
+
+        if (deferSync) {
+            if (groupCommitVbs.empty()) {
+                groupCommitStart = gethrtime();
+            }
+            groupCommitVbs.insert(vbid);
+            groupCommitItems += flushed;
+        } else if (flushed > 0) {
+            recovered();
+        }
+    }
+
+    if (groupCommitDue()) {
+        commitGroup();
     }
 }
@@ -23,6 +23,7 @@
 #include <list>
 #include <map>
 #include <queue>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -32,6 +33,7 @@
 
 #define NO_VBUCKETS_INSTANTIATED 0xFFFF
 #define RETRY_FLUSH_VBUCKET (-1)
+#define BACKOFF_FLUSH_VBUCKET (-2)
 
 enum flusher_state {
     initializing,
@@ -46,6 +48,12 @@ class Flusher;
 
 const double DEFAULT_MIN_SLEEP_TIME = MIN_SLEEP_TIME;
 const double DEFAULT_MAX_SLEEP_TIME = 10.0;
+// Backoff (in seconds) after a failed write, doubled on every consecutive
+// failure up to DEFAULT_MAX_SLEEP_TIME
+const double FLUSH_RETRY_MIN_BACKOFF = 1.0;
+// Bounds of the adaptive flush batch size
+const size_t FLUSH_BATCH_MIN_ITEMS = 100;
+const size_t FLUSH_BATCH_INITIAL_ITEMS = 10000;
 
 class KVShard;
 
@@ -56,9 +64,16 @@ class Flusher {
 public:
 
     Flusher(EventuallyPersistentStore *st, KVShard *k) :
-        store(st), _state(initializing), taskId(0), minSleepTime(0.1),
-        forceShutdownReceived(false), doHighPriority(false),
-        numHighPriority(0), pendingMutation(false), shard(k) { }
+        store(st), _state(initializing), taskId(0), prepareTaskId(0),
+        minSleepTime(0.1), forceShutdownReceived(false),
+        doHighPriority(false), pendingMutation(false),
+        staging(staging_idle), stagedVb(0), stagedMaxItems(0),
+        stagedBatch(NULL),
+        groupCommitWindow(0), groupCommitMaxItems(0), groupCommitStart(0),
+        groupCommitItems(0), lastGroupCommit(0), groupCommitSyncRate(0),
+        retryAt(0), retryBackoff(0), degradedSince(0), latencyTarget(0),
+        maxBatchItems(0), adaptiveBatchLimit(0), fastLaneMaxItems(0),
+        shard(k) { }
 
     ~Flusher() {
         if (_state != stopped) {
@@ -66,6 +81,10 @@ public:
                 stateName(_state));
 
         }
+        if (stagedBatch) {
+            store->dropFlushBatch(stagedBatch,
+                                  "left staged by a stopped flusher");
+        }
     }
 
     bool stop(bool isForceShutdown = false);
@@ -77,6 +96,13 @@ public:
     void wake(void);
     bool step(GlobalTask *task);
 
+    /**
+     * Collect the batch of the vbucket the flusher task is going to flush
+     * next, while the flusher task is busy committing the current one.
+     * Only used when flusher pipelining is enabled.
+     */
+    bool prepareStep(GlobalTask *task);
+
     enum flusher_state state() const;
     const char * stateName() const;
 
@@ -91,10 +117,39 @@ public:
     }
     void setTaskId(size_t newId) { taskId = newId; }
 
+    /**
+     * Data file syncs per second issued by the group commits of this
+     * flusher, measured over the most recent group.
+     */
+    size_t getGroupCommitSyncRate() const {
+        return groupCommitSyncRate.load();
+    }
+
 private:
+    /**
+     * State of the single staging slot shared between the flusher task and
+     * the prepare task.
+     */
+    enum staging_state {
+        staging_idle,       //!< Nothing handed to the prepare task
+        staging_requested,  //!< Waiting for the prepare task to pick it up
+        staging_collecting, //!< The prepare task is collecting the batch
+        staging_ready       //!< A collected batch is waiting to be flushed
+    };
+
     bool transition_state(enum flusher_state to);
     void flushVB();
-    void completeFlush();
+    void flushVBFromQueue(uint16_t vbid, std::queue<uint16_t> &from);
+    void stageNext(uint16_t vbid, size_t maxItems);
+    FlushBatch *takeStagedBatch(uint16_t vbid);
+    size_t batchLimit(bool highPriority);
+    void adjustBatchLimit(hrtime_t took, bool capped);
+    bool groupCommitDue();
+    bool commitGroup();
+    void backOff();
+    void recovered();
+    bool backingOff(GlobalTask *task);
+    bool completeFlush();
     void schedule_UNLOCKED();
     double computeMinSleepTime();
 
@@ -108,16 +163,47 @@ private:
     volatile enum flusher_state  _state;
     Mutex                        taskMutex;
     size_t                       taskId;
+    size_t                       prepareTaskId;
 
     double                   minSleepTime;
     rel_time_t               flushStart;
     AtomicValue<bool> forceShutdownReceived;
     std::queue<uint16_t> hpVbs;
     std::queue<uint16_t> lpVbs;
+    // True after a fast lane pass until the regular round had a turn
     bool doHighPriority;
-    size_t numHighPriority;
     AtomicValue<bool> pendingMutation;
 
+    SyncObject stagingSync;
+    enum staging_state staging;
+    uint16_t stagedVb;
+    size_t stagedMaxItems;
+    FlushBatch *stagedBatch;
+
+    // Group commit window (ns) and item cap, 0 window if disabled
+    hrtime_t groupCommitWindow;
+    size_t groupCommitMaxItems;
+    hrtime_t groupCommitStart;
+    size_t groupCommitItems;
+    hrtime_t lastGroupCommit;
+    AtomicValue<size_t> groupCommitSyncRate;
+    // Vbuckets flushed with deferred syncs since the last group commit
+    std::set<uint16_t> groupCommitVbs;
+
+    // Earliest time the next write may be attempted after a failure
+    hrtime_t retryAt;
+    double retryBackoff;
+    // Start of the current run of failed writes, 0 if writes succeed
+    hrtime_t degradedSince;
+
+    // Target time (ns) of a single flush, 0 if batches aren't sized to it
+    hrtime_t latencyTarget;
+    // Hard cap of the items per flush, 0 if unlimited
+    size_t maxBatchItems;
+    size_t adaptiveBatchLimit;
+    // Cap of the items per fast lane flush, 0 if there is no fast lane
+    size_t fastLaneMaxItems;
+
     KVShard *shard;
 
     DISALLOW_COPY_AND_ASSIGN(Flusher);
@@ -0,0 +1,443 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+extern "C" {
+#include "crc32.h"
+}
+#include "ep.h"
+#include "htsnapshot.h"
+
+const uint32_t HashTableSnapshot::BLOCK_SIZE = 1024 * 1024;
+
+static const uint64_t SNAPSHOT_MAGIC = 0x45504854534e4150ULL;  // EPHTSNAP
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+static const uint8_t RECORD_VBUCKET = 'V';
+static const uint8_t RECORD_ITEM = 'I';
+static const uint8_t RECORD_END = 'E';
+
+/* type, vbucket id, high seqno */
+static const size_t VBUCKET_RECORD_SIZE = 1 + 2 + 8;
+/* type, nru, has value, ext meta length, key length, flags, exptime, cas,
+   rev seqno, by seqno, value length */
+static const size_t ITEM_RECORD_SIZE = 1 + 1 + 1 + 1 + 2 + 4 + 4 + 8 + 8 +
+                                       8 + 4;
+
+struct SnapshotHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t policy;
+};
+
+struct SnapshotBlockHeader {
+    uint32_t length;
+    uint32_t crc;
+};
+
+namespace {
+
+    /**
+     * Packs the records into blocks and writes them out with their crc.
+     */
+    class SnapshotWriter {
+    public:
+        SnapshotWriter(FILE *f) : fp(f), failed(false) {
+            block.reserve(HashTableSnapshot::BLOCK_SIZE);
+        }
+
+        /* Make room for a record of that size, records never span blocks */
+        void reserve(size_t size) {
+            if (!block.empty() &&
+                block.size() + size > HashTableSnapshot::BLOCK_SIZE) {
+                flush();
+            }
+        }
+
+        template <typename T>
+        void put(const T &val) {
+            append(&val, sizeof(val));
+        }
+
+        void append(const void *data, size_t size) {
+            block.append(static_cast<const char *>(data), size);
+        }
+
+        void flush() {
+            if (block.empty() || failed) {
+                block.clear();
+                return;
+            }
+            SnapshotBlockHeader hdr;
+            hdr.length = static_cast<uint32_t>(block.size());
+            hdr.crc = crc32buf(reinterpret_cast<uint8_t *>(&block[0]),
+                               block.size());
+            if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+                fwrite(block.data(), block.size(), 1, fp) != 1) {
+                failed = true;
+            }
+            block.clear();
+        }
+
+        bool hasFailed() const {
+            return failed;
+        }
+
+    private:
+        FILE *fp;
+        std::string block;
+        bool failed;
+    };
+
+    class SnapshotVisitor : public HashTableVisitor {
+    public:
+        SnapshotVisitor(SnapshotWriter &w, bool values) :
+            writer(w), withValues(values), numItems(0) { }
+
+        void visit(StoredValue *v) {
+            if (v->isDeleted() || v->isTempItem()) {
+                return;
+            }
+            const std::string &key = v->getKey();
+            value_t value = v->getValue();
+            bool hasValue = withValues && v->isResident() && value.get();
+            uint8_t extLen = hasValue ? value->getExtLen() : 0;
+            uint32_t valueLen = hasValue ? value->vlength() : 0;
+
+            writer.reserve(ITEM_RECORD_SIZE + key.length() + extLen +
+                           valueLen);
+            writer.put(RECORD_ITEM);
+            writer.put(v->getNRUValue());
+            writer.put(static_cast<uint8_t>(hasValue));
+            writer.put(extLen);
+            writer.put(static_cast<uint16_t>(key.length()));
+            writer.put(v->getFlags());
+            writer.put(static_cast<uint32_t>(v->getExptime()));
+            writer.put(v->getCas());
+            writer.put(v->getRevSeqno());
+            writer.put(v->getBySeqno());
+            writer.put(valueLen);
+            writer.append(key.data(), key.length());
+            if (hasValue) {
+                writer.append(value->getExtMeta(), extLen);
+                writer.append(value->getData(), valueLen);
+            }
+            ++numItems;
+        }
+
+        size_t getNumItems() const {
+            return numItems;
+        }
+
+    private:
+        SnapshotWriter &writer;
+        bool withValues;
+        size_t numItems;
+    };
+
+    /**
+     * Reads the records of the blocks of a mapped snapshot.
+     */
+    class SnapshotReader {
+    public:
+        SnapshotReader(const char *s, size_t len) :
+            end(s + len), pos(s), blockEnd(s), corrupt(false) { }
+
+        /* Move to the next record, false at the end of the file */
+        bool next() {
+            if (pos < blockEnd) {
+                return true;
+            }
+            if (pos == end) {
+                return false;
+            }
+            SnapshotBlockHeader hdr;
+            if (static_cast<size_t>(end - pos) < sizeof(hdr)) {
+                corrupt = true;
+                return false;
+            }
+            memcpy(&hdr, pos, sizeof(hdr));
+            pos += sizeof(hdr);
+            if (hdr.length == 0 ||
+                static_cast<size_t>(end - pos) < hdr.length) {
+                corrupt = true;
+                return false;
+            }
+            uint8_t *payload = reinterpret_cast<uint8_t *>(
+                                                const_cast<char *>(pos));
+            if (crc32buf(payload, hdr.length) != hdr.crc) {
+                corrupt = true;
+                return false;
+            }
+            blockEnd = pos + hdr.length;
+            return true;
+        }
+
+        template <typename T>
+        bool get(T &val) {
+            return read(&val, sizeof(val));
+        }
+
+        bool read(void *data, size_t size) {
+            if (static_cast<size_t>(blockEnd - pos) < size) {
+                corrupt = true;
+                return false;
+            }
+            memcpy(data, pos, size);
+            pos += size;
+            return true;
+        }
+
+        /* Point at the next bytes of the record instead of copying them */
+        const char *skip(size_t size) {
+            if (static_cast<size_t>(blockEnd - pos) < size) {
+                corrupt = true;
+                return NULL;
+            }
+            const char *rv = pos;
+            pos += size;
+            return rv;
+        }
+
+        bool isCorrupt() const {
+            return corrupt;
+        }
+
+    private:
+        const char *end;
+        const char *pos;
+        const char *blockEnd;
+        bool corrupt;
+    };
+}
+
+bool HashTableSnapshot::write(const std::vector<uint16_t> &vbids) {
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to create the hash table snapshot "
+            "%s: %s", tmp.c_str(), strerror(errno));
+        return false;
+    }
+
+    item_eviction_policy_t policy = store.getItemEvictionPolicy();
+    SnapshotHeader hdr;
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.policy = static_cast<uint32_t>(policy);
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+    SnapshotWriter writer(fp);
+    size_t numItems = 0;
+    std::vector<uint16_t>::const_iterator it = vbids.begin();
+    for (; ok && it != vbids.end(); ++it) {
+        RCPtr<VBucket> vb = store.getVBucket(*it);
+        if (!vb) {
+            continue;
+        }
+        int64_t highSeqno = vb->getHighSeqno();
+        if (static_cast<uint64_t>(highSeqno) !=
+            store.getVBuckets().getPersistenceSeqno(*it)) {
+            // Not everything made it to disk, the data files are the truth
+            LOG(EXTENSION_LOG_WARNING, "Not writing the hash table snapshot "
+                "%s, vbucket %d has unpersisted mutations", path.c_str(), *it);
+            ok = false;
+            break;
+        }
+
+        writer.reserve(VBUCKET_RECORD_SIZE);
+        writer.put(RECORD_VBUCKET);
+        writer.put(*it);
+        writer.put(highSeqno);
+
+        SnapshotVisitor visitor(writer, policy == VALUE_ONLY);
+        vb->ht.visit(visitor);
+        numItems += visitor.getNumItems();
+    }
+
+    if (ok) {
+        writer.reserve(1);
+        writer.put(RECORD_END);
+        writer.flush();
+        ok = !writer.hasFailed() && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    }
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+        LOG(EXTENSION_LOG_WARNING, "Wrote %ld items to the hash table "
+            "snapshot %s", numItems, path.c_str());
+        return true;
+    }
+    ::remove(tmp.c_str());
+    return false;
+}
+
+ht_snapshot_load_t HashTableSnapshot::load(const std::vector<uint16_t> &vbids,
+                               const std::map<uint16_t, vbucket_state> &states,
+                               size_t &keys, size_t &values) {
+    keys = values = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return HT_SNAPSHOT_MISSING;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        close(fd);
+        return HT_SNAPSHOT_CORRUPT;
+    }
+    size_t size = st.st_size;
+    void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to map the hash table snapshot "
+            "%s: %s", path.c_str(), strerror(errno));
+        return HT_SNAPSHOT_CORRUPT;
+    }
+    // One pass from start to end
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    const char *data = static_cast<const char *>(addr);
+    SnapshotHeader hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    item_eviction_policy_t policy = store.getItemEvictionPolicy();
+    if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+        munmap(addr, size);
+        return HT_SNAPSHOT_CORRUPT;
+    }
+    if (hdr.policy != static_cast<uint32_t>(policy)) {
+        munmap(addr, size);
+        return HT_SNAPSHOT_STALE;
+    }
+
+    std::set<uint16_t> wanted(vbids.begin(), vbids.end());
+    std::set<uint16_t> seen;
+    ht_snapshot_load_t rv = HT_SNAPSHOT_CORRUPT;
+    SnapshotReader reader(data + sizeof(hdr), size - sizeof(hdr));
+    RCPtr<VBucket> vb;
+    uint16_t vbid = 0;
+
+    while (reader.next()) {
+        uint8_t type;
+        reader.get(type);
+        if (type == RECORD_END) {
+            rv = seen == wanted ? HT_SNAPSHOT_LOADED : HT_SNAPSHOT_STALE;
+            break;
+        } else if (type == RECORD_VBUCKET) {
+            int64_t highSeqno;
+            if (!reader.get(vbid) || !reader.get(highSeqno)) {
+                break;
+            }
+            vb.reset();
+            if (wanted.find(vbid) != wanted.end()) {
+                std::map<uint16_t, vbucket_state>::const_iterator sit;
+                sit = states.find(vbid);
+                if (sit == states.end() || sit->second.highSeqno != highSeqno) {
+                    LOG(EXTENSION_LOG_WARNING, "Hash table snapshot %s is "
+                        "stale for vbucket %d", path.c_str(), vbid);
+                    rv = HT_SNAPSHOT_STALE;
+                    break;
+                }
+                vb = store.getVBucket(vbid);
+                seen.insert(vbid);
+            }
+        } else if (type == RECORD_ITEM) {
+            uint8_t nru, hasValue, extLen;
+            uint16_t keyLen;
+            uint32_t flags, exptime, valueLen;
+            uint64_t cas, revSeqno;
+            int64_t bySeqno;
+            if (!reader.get(nru) || !reader.get(hasValue) ||
+                !reader.get(extLen) || !reader.get(keyLen) ||
+                !reader.get(flags) || !reader.get(exptime) ||
+                !reader.get(cas) || !reader.get(revSeqno) ||
+                !reader.get(bySeqno) || !reader.get(valueLen)) {
+                break;
+            }
+            const char *key = reader.skip(keyLen);
+            const char *ext = reader.skip(extLen);
+            const char *value = reader.skip(valueLen);
+            if (key == NULL || ext == NULL || value == NULL) {
+                break;
+            }
+            if (!vb) {
+                continue;
+            }
+
+            Item itm(key, keyLen, flags, exptime,
+                     hasValue ? value : NULL, valueLen,
+                     reinterpret_cast<uint8_t *>(const_cast<char *>(ext)),
+                     extLen, cas, bySeqno, vbid, revSeqno, nru);
+            mutation_type_t mtype = vb->ht.insert(itm, policy, false,
+                                                  !hasValue);
+            if (mtype == NOMEM) {
+                rv = HT_SNAPSHOT_NOMEM;
+                break;
+            }
+            if (mtype == NOT_FOUND) {
+                ++keys;
+                if (hasValue) {
+                    ++values;
+                }
+            }
+        } else {
+            break;
+        }
+    }
+
+    munmap(addr, size);
+    if (rv == HT_SNAPSHOT_CORRUPT) {
+        LOG(EXTENSION_LOG_WARNING, "Hash table snapshot %s is corrupt",
+            path.c_str());
+    }
+    return rv;
+}
+
+void HashTableSnapshot::remove() {
+    ::remove(path.c_str());
+}
+
+const char *HashTableSnapshot::getLoadResult(ht_snapshot_load_t rv) {
+    switch (rv) {
+    case HT_SNAPSHOT_LOADED:
+        return "loaded";
+    case HT_SNAPSHOT_MISSING:
+        return "missing";
+    case HT_SNAPSHOT_CORRUPT:
+        return "corrupt";
+    case HT_SNAPSHOT_STALE:
+        return "stale";
+    case HT_SNAPSHOT_NOMEM:
+        return "nomem";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,98 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_HTSNAPSHOT_H_
+#define SRC_HTSNAPSHOT_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "kvstore.h"
+
+class EventuallyPersistentStore;
+
+typedef enum {
+    HT_SNAPSHOT_LOADED,
+    HT_SNAPSHOT_MISSING,     // no snapshot file
+    HT_SNAPSHOT_CORRUPT,     // bad magic, checksum or truncated
+    HT_SNAPSHOT_STALE,       // the data files moved on since it was written
+    HT_SNAPSHOT_NOMEM        // doesn't fit in the bucket quota any more
+} ht_snapshot_load_t;
+
+/**
+ * An image of the hash tables of the vbuckets of a shard, written on a
+ * graceful shutdown once everything is persisted and read back at startup
+ * in place of the warmup scans.
+ *
+ * The file is a header followed by blocks, each a length, the crc32 of its
+ * payload and the payload: a run of records, a vbucket record (its id and
+ * high seqno) followed by the records of its items, and an end record.
+ * Every item carries its key and metadata, and its value if it was
+ * resident (never under full eviction, where the values are read from disk
+ * on demand). Deleted and temporary items are left out.
+ *
+ * The file is mapped in and streamed through at load. It is only used if
+ * every active and replica vbucket of the shard is in it with the high
+ * seqno its data file has, and is removed once read, so that a crash later
+ * never brings back stale data.
+ */
+class HashTableSnapshot {
+public:
+    HashTableSnapshot(EventuallyPersistentStore &st, const std::string &p) :
+        store(st), path(p) { }
+
+    /**
+     * Write the snapshot of the given vbuckets.
+     *
+     * @return false if the snapshot could not be written
+     */
+    bool write(const std::vector<uint16_t> &vbids);
+
+    /**
+     * Load the snapshot into the hash tables of the given vbuckets.
+     *
+     * @param vbids the vbuckets that have to be in the snapshot
+     * @param states the persisted state of the vbuckets
+     * @param keys set to the keys loaded
+     * @param values set to the values loaded
+     */
+    ht_snapshot_load_t load(const std::vector<uint16_t> &vbids,
+                            const std::map<uint16_t, vbucket_state> &states,
+                            size_t &keys, size_t &values);
+
+    void remove();
+
+    const std::string &getPath() const {
+        return path;
+    }
+
+    static const char *getLoadResult(ht_snapshot_load_t rv);
+
+    static const uint32_t BLOCK_SIZE;
+
+private:
+    EventuallyPersistentStore &store;
+    std::string path;
+
+    DISALLOW_COPY_AND_ASSIGN(HashTableSnapshot);
+};
+
+#endif  // SRC_HTSNAPSHOT_H_
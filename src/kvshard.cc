@@ -30,6 +30,7 @@ KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store) :
     EPStats &stats = store.getEPEngine().getEpStats();
     Configuration &config = store.getEPEngine().getConfiguration();
     maxVbuckets = config.getMaxVbuckets();
+    numShards = store.getEPEngine().getWorkLoadPolicy().getNumShards();
 
     vbuckets = new RCPtr<VBucket>[maxVbuckets];
 
@@ -37,7 +38,18 @@ KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store) :
     roUnderlying = KVStoreFactory::create(stats, config, true);
 
     flusher = new Flusher(&store, this);
-    bgFetcher = new BgFetcher(&store, this, stats);
+
+    size_t numFetchers = std::max(config.getBgFetchQueueDepth(),
+                                  static_cast<size_t>(1));
+    size_t prefetch = config.getBgFetchPrefetchLimit();
+    bgFetchers.push_back(new BgFetcher(&store, this, roUnderlying, stats,
+                                       prefetch));
+    for (size_t i = 1; i < numFetchers; ++i) {
+        KVStore *kvstore = KVStoreFactory::create(stats, config, true);
+        bgFetchStores.push_back(kvstore);
+        bgFetchers.push_back(new BgFetcher(&store, this, kvstore, stats,
+                                           prefetch));
+    }
 }
 
 KVShard::~KVShard() {
@@ -47,10 +59,17 @@ KVShard::~KVShard() {
             flusher->stateName());
     }
     delete flusher;
-    delete bgFetcher;
+    std::vector<BgFetcher *>::iterator it = bgFetchers.begin();
+    for (; it != bgFetchers.end(); ++it) {
+        delete *it;
+    }
 
     delete rwUnderlying;
     delete roUnderlying;
+    std::vector<KVStore *>::iterator sit = bgFetchStores.begin();
+    for (; sit != bgFetchStores.end(); ++sit) {
+        delete *sit;
+    }
 
     delete[] vbuckets;
 }
@@ -67,8 +86,17 @@ Flusher *KVShard::getFlusher() {
     return flusher;
 }
 
-BgFetcher *KVShard::getBgFetcher() {
-    return bgFetcher;
+BgFetcher *KVShard::getBgFetcher(uint16_t vbid) {
+    // the vbuckets of the shard are the ones with vbid % numShards == shardId
+    return bgFetchers[(vbid / numShards) % bgFetchers.size()];
+}
+
+void KVShard::closeCachedDBs(uint16_t vbid) {
+    roUnderlying->closeCachedDBs(vbid);
+    KVStore *kvstore = getBgFetcher(vbid)->getKVStore();
+    if (kvstore != roUnderlying) {
+        kvstore->closeCachedDBs(vbid);
+    }
 }
 
 RCPtr<VBucket> KVShard::getBucket(uint16_t id) const {
@@ -53,7 +53,7 @@
  *   | vbuckets: VBucket[] (partitions)|----> [(VBucket),(VBucket)..]
  *   |                                 |
  *   | flusher: Flusher                |
- *   | BGFetcher: bgFetcher            |
+ *   | BGFetcher: bgFetchers[]         |----> one per bg_fetch_queue_depth
  *   |                                 |
  *   | rwUnderlying: KVStore (write)   |----> (CouchKVStore)
  *   | roUnderlying: KVStore (read)    |----> (CouchKVStore)
@@ -72,7 +72,22 @@ public:
     KVStore *getROUnderlying();
 
     Flusher *getFlusher();
-    BgFetcher *getBgFetcher();
+
+    /**
+     * Get the BgFetcher serving the given vbucket. The vbuckets of the
+     * shard are spread over bg_fetch_queue_depth fetchers, each reading
+     * its vbuckets through a read-only KVStore of its own.
+     */
+    BgFetcher *getBgFetcher(uint16_t vbid);
+    std::vector<BgFetcher *> &getBgFetchers() {
+        return bgFetchers;
+    }
+
+    /**
+     * Make all the read-only KVStores of the shard drop the file handles
+     * they keep open for the given vbucket.
+     */
+    void closeCachedDBs(uint16_t vbid);
 
     RCPtr<VBucket> getBucket(uint16_t id) const;
     void setBucket(const RCPtr<VBucket> &b);
@@ -191,9 +206,13 @@ private:
     Mutex       writeLock;
 
     Flusher    *flusher;
-    BgFetcher  *bgFetcher;
+    std::vector<BgFetcher *> bgFetchers;
+    /* the read-only KVStores of all but the first fetcher, that one uses
+     * roUnderlying */
+    std::vector<KVStore *> bgFetchStores;
 
     size_t maxVbuckets;
+    size_t numShards;
     uint16_t shardId;
 
     bool opLock; // Used by ExecutoPool infrastructure to serialize operations
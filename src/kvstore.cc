@@ -17,13 +17,23 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
 #include <map>
+#include <sstream>
 #include <string>
 
+#include <cJSON.h>
+
+#include "bitcask-kvstore/bitcask-kvstore.h"
 #include "common.h"
 #include "couch-kvstore/couch-kvstore.h"
 #include "ep_engine.h"
 #include "kvstore.h"
+#include "memory-kvstore/memory-kvstore.h"
 #include "stats.h"
 #include "warmup.h"
 
@@ -35,6 +45,10 @@ KVStore *KVStoreFactory::create(EPStats &stats, Configuration &config,
     std::string backend = config.getBackend();
     if (backend.compare("couchdb") == 0) {
         ret = new CouchKVStore(stats, config, read_only);
+    } else if (backend.compare("bitcask") == 0) {
+        ret = new BitcaskKVStore(stats, config, read_only);
+    } else if (backend.compare("memory") == 0) {
+        ret = new MemoryKVStore(stats, config, read_only);
     } else {
         LOG(EXTENSION_LOG_WARNING, "Unknown backend: [%s]", backend.c_str());
     }
@@ -47,6 +61,129 @@ size_t KVStore::getEstimatedItemCount(std::vector<uint16_t> &vbs) {
     return 0;
 }
 
+bool KVStore::saveStatsFile(const std::string &dbname,
+                            const std::map<std::string, std::string> &stats)
+{
+    size_t count = 0;
+    size_t size = stats.size();
+    std::stringstream stats_buf;
+    stats_buf << "{";
+    std::map<std::string, std::string>::const_iterator it = stats.begin();
+    for (; it != stats.end(); ++it) {
+        stats_buf << "\"" << it->first << "\": \"" << it->second << "\"";
+        ++count;
+        if (count < size) {
+            stats_buf << ", ";
+        }
+    }
+    stats_buf << "}";
+
+    // TODO: This stats json should be written into the master database. However,
+    // we don't support the write synchronization between CouchKVStore in C++ and
+    // compaction manager in the erlang side for the master database yet. At this time,
+    // we simply log the engine stats into a separate json file. As part of futhre work,
+    // we need to get rid of the tight coupling between those two components.
+    bool rv = true;
+    std::string next_fname = dbname + "/stats.json.new";
+    std::ofstream new_stats;
+    new_stats.exceptions (new_stats.failbit | new_stats.badbit);
+    try {
+        new_stats.open(next_fname.c_str());
+        new_stats << stats_buf.str().c_str() << std::endl;
+        new_stats.flush();
+        new_stats.close();
+    } catch (const std::ofstream::failure& e) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to log the engine stats to "
+            "file \"%s\" due to IO exception \"%s\"; Not critical because new "
+            "stats will be dumped later, please ignore.",
+            next_fname.c_str(), e.what());
+        rv = false;
+    }
+
+    if (rv) {
+        std::string old_fname = dbname + "/stats.json.old";
+        std::string stats_fname = dbname + "/stats.json";
+        if (access(old_fname.c_str(), F_OK) == 0 && remove(old_fname.c_str()) != 0) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to remove '%s': %s",
+                old_fname.c_str(), strerror(errno));
+            remove(next_fname.c_str());
+            rv = false;
+        } else if (access(stats_fname.c_str(), F_OK) == 0 &&
+                   rename(stats_fname.c_str(), old_fname.c_str()) != 0) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to rename '%s' to '%s': %s",
+                stats_fname.c_str(), old_fname.c_str(), strerror(errno));
+            remove(next_fname.c_str());
+            rv = false;
+        } else if (rename(next_fname.c_str(), stats_fname.c_str()) != 0) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to rename '%s' to '%s': %s",
+                next_fname.c_str(), stats_fname.c_str(), strerror(errno));
+            remove(next_fname.c_str());
+            rv = false;
+        }
+    }
+
+    return rv;
+}
+
+void KVStore::loadStatsFile(const std::string &dbname,
+                            std::map<std::string, std::string> &stats)
+{
+    char *buffer = NULL;
+    std::string fname = dbname + "/stats.json";
+    if (access(fname.c_str(), R_OK) == -1) {
+        return ;
+    }
+
+    std::ifstream session_stats;
+    session_stats.exceptions (session_stats.failbit | session_stats.badbit);
+    try {
+        session_stats.open(fname.c_str(), std::ios::binary);
+        session_stats.seekg(0, std::ios::end);
+        int flen = session_stats.tellg();
+        if (flen < 0) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: error in session stats ifstream!!!");
+            session_stats.close();
+            return;
+        }
+        session_stats.seekg(0, std::ios::beg);
+        buffer = new char[flen + 1];
+        session_stats.read(buffer, flen);
+        session_stats.close();
+        buffer[flen] = '\0';
+
+        cJSON *json_obj = cJSON_Parse(buffer);
+        if (!json_obj) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to parse the session stats json doc!!!");
+            delete[] buffer;
+            return;
+        }
+
+        int json_arr_size = cJSON_GetArraySize(json_obj);
+        for (int i = 0; i < json_arr_size; ++i) {
+            cJSON *obj = cJSON_GetArrayItem(json_obj, i);
+            if (obj) {
+                stats[obj->string] = obj->valuestring ? obj->valuestring : "";
+            }
+        }
+        cJSON_Delete(json_obj);
+
+    } catch (const std::ifstream::failure &e) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to load the engine session stats "
+            " due to IO exception \"%s\"", e.what());
+    } catch (...) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to load the engine session stats "
+            " due to IO exception");
+    }
+
+    delete[] buffer;
+}
+
 void RollbackCB::callback(GetValue &val) {
     cb_assert(val.getValue());
     cb_assert(dbHandle);
@@ -98,17 +235,26 @@ void RollbackCB::callback(GetValue &val) {
     delete itm;
 }
 
-void AllKeysCB::addtoAllKeys(uint16_t len, char *buf) {
-    if (length + len > buffersize) {
-        buffersize *= 2;
-        char *temp = (char *) malloc (buffersize);
-        memcpy (temp, buffer, length);
-        free (buffer);
+bool AllKeysCB::addtoAllKeys(uint16_t len, char *buf) {
+    uint64_t needed = length + len + sizeof(uint16_t);
+    if (needed > maxsize) {
+        full = true;
+        return false;
+    }
+    if (needed > buffersize) {
+        uint64_t newsize = std::min(std::max(buffersize * 2, needed),
+                                    maxsize);
+        char *temp = (char *) realloc(buffer, newsize);
+        if (temp == NULL) {
+            full = true;
+            return false;
+        }
         buffer = temp;
+        buffersize = newsize;
     }
-    len = htons(len);
-    memcpy (buffer + length, &len, sizeof(uint16_t));
-    len = ntohs(len);
+    uint16_t nlen = htons(len);
+    memcpy (buffer + length, &nlen, sizeof(uint16_t));
     memcpy (buffer + length + sizeof(uint16_t), buf, len);
-    length += len + sizeof(uint16_t);
+    length = needed;
+    return true;
 }
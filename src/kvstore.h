@@ -20,8 +20,10 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <cstring>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -174,15 +176,63 @@ public:
     /**
      * Commit a transaction (unless not currently in one).
      *
+     * The callbacks of the mutations are expected to be fired with their
+     * results, failures included, before this returns. A mutation whose
+     * callback isn't fired is assumed not to be written.
+     *
      * @return false if the commit fails
      */
     virtual bool commit(Callback<kvstats_ctx> *cb) = 0;
 
+    /**
+     * Commit a transaction (unless not currently in one) without waiting
+     * for it to reach the disk. It becomes durable with the next call to
+     * syncDeferred(). Stores that can't defer their syncs just commit.
+     *
+     * @return false if the commit fails
+     */
+    virtual bool commitNoSync(Callback<kvstats_ctx> *cb) {
+        return commit(cb);
+    }
+
+    /**
+     * Sync everything written by commitNoSync() since the last call.
+     *
+     * @param synced set to the number of files synced
+     * @param failed set to the vbuckets whose files failed to sync. What
+     *               was written to them since the last call may be lost
+     *               even if a later sync succeeds, it must be written again.
+     * @return false if the sync fails
+     */
+    virtual bool syncDeferred(size_t &synced, std::set<uint16_t> &failed) {
+        synced = 0;
+        failed.clear();
+        return true;
+    }
+
     /**
      * Rollback the current transaction.
      */
     virtual void rollback() = 0;
 
+    /**
+     * Drop what is cached of a vbucket's database files between calls
+     * (open handles, file blocks), e.g. after another KVStore instance
+     * replaced or deleted its file.
+     */
+    virtual void closeCachedDBs(uint16_t) { }
+
+    /**
+     * True if the status given to the set and delete callbacks tells
+     * whether the key existed (not deleted) on disk before the write.
+     * Otherwise every set is reported as an insertion and every deletion
+     * as one of an existing key, and the caller has to tell from what it
+     * knows itself.
+     */
+    virtual bool reportsPriorExistence() {
+        return true;
+    }
+
     /**
      * Get the properties of the underlying storage.
      */
@@ -213,6 +263,18 @@ public:
         throw std::runtime_error("Backend does not support getMulti()");
     }
 
+    /**
+     * Get the items of several vbuckets. Stores that can overlap the reads
+     * of different files should override this, by default the vbuckets
+     * are read one after the other.
+     */
+    virtual void getMultiVBuckets(vb_bgfetch_plan_t &plan) {
+        vb_bgfetch_plan_t::iterator it = plan.begin();
+        for (; it != plan.end(); ++it) {
+            getMulti(it->first, it->second);
+        }
+    }
+
     /**
      * Delete an item from the kv store.
      */
@@ -251,7 +313,9 @@ public:
                                   Callback<kvstats_ctx> *cb) = 0;
 
     /**
-     * Compact a vbucket file.
+     * Compact a vbucket file. Called without the shard's write lock, so
+     * it may run alongside writes to the other vbuckets of the store and
+     * other compactions. Nothing else writes the vbucket meanwhile.
      */
     virtual bool compactVBucket(const uint16_t vbid,
                                 compaction_ctx *c,
@@ -335,6 +399,19 @@ public:
                                          AllKeysCB *cb) = 0;
 
 protected:
+    /**
+     * Write a snapshot of stats to <dbname>/stats.json, the previous one
+     * is kept as stats.json.old.
+     */
+    static bool saveStatsFile(const std::string &dbname,
+                              const std::map<std::string, std::string> &m);
+
+    /**
+     * Read the stats last written with saveStatsFile(), if any.
+     */
+    static void loadStatsFile(const std::string &dbname,
+                              std::map<std::string, std::string> &stats);
+
     bool readOnly;
 
 };
@@ -379,19 +456,16 @@ private:
 /**
  * Callback class used by AllKeysAPI, for caching fetched keys
  *
- * As by default (or in most cases), number of keys is 1000,
- * and an average key could be 32B in length, initialize buffersize of
- * allKeys to 34000 (1000 * 32 + 1000 * 2), the additional 2 bytes per
- * key is for the keylength.
- *
- * This initially allocated buffersize is doubled whenever the length
- * of the buffer holding all the keys, crosses the buffersize.
+ * The keys are laid out the way they are sent: a 2 byte key length in
+ * network byte order followed by the key. The buffer starts small, as by
+ * default (or in most cases) 1000 keys of 32B or so are asked for, and
+ * grows in place up to the page size. A key that doesn't fit any more
+ * ends the page, the client continues from the last key it got.
  */
 class AllKeysCB {
 public:
-    AllKeysCB() {
-        length = 0;
-        buffersize = 34000;
+    AllKeysCB(size_t maxSize) : length(0), maxsize(maxSize), full(false) {
+        buffersize = std::min(maxsize, static_cast<uint64_t>(34000));
         buffer = (char *) malloc(buffersize);
     }
 
@@ -399,16 +473,29 @@ public:
         free(buffer);
     }
 
-    void addtoAllKeys (uint16_t len, char *buf);
+    /**
+     * Add a key to the page.
+     *
+     * @return false if the page is full, the key wasn't added
+     */
+    bool addtoAllKeys (uint16_t len, char *buf);
 
     char* getAllKeysPtr() { return buffer; }
     uint64_t getAllKeysLen() { return length; }
 
+    /**
+     * Was a key left out because the page was full?
+     */
+    bool isTruncated() { return full; }
+
 private:
     uint64_t length;
     uint64_t buffersize;
+    const uint64_t maxsize;
     char *buffer;
+    bool full;
 
+    DISALLOW_COPY_AND_ASSIGN(AllKeysCB);
 };
 
 #endif  // SRC_KVSTORE_H_
@@ -0,0 +1,493 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <limits>
+#include <list>
+#include <sstream>
+
+#include "bgfetcher.h"
+#include "common.h"
+#include "memory-kvstore/memory-kvstore.h"
+#include "statwriter.h"
+#include "vbucket.h"
+
+class NoLookupCallback : public Callback<CacheLookup> {
+public:
+    NoLookupCallback() {}
+    ~NoLookupCallback() {}
+    void callback(CacheLookup&) {}
+};
+
+class NoRangeCallback : public Callback<SeqnoRange> {
+public:
+    NoRangeCallback() {}
+    ~NoRangeCallback() {}
+    void callback(SeqnoRange&) {}
+};
+
+static bool isMetaOnlyFetch(const std::list<VBucketBGFetchItem *> &fetches) {
+    std::list<VBucketBGFetchItem *>::const_iterator itr = fetches.begin();
+    for (; itr != fetches.end(); ++itr) {
+        if (!((*itr)->metaDataOnly)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class MemoryKVStore::Request {
+public:
+    Request(const Item &itm, Callback<mutation_result> *cb) :
+        doc(new MemoryDocument(itm, false)), vbid(itm.getVBucketId()),
+        setCb(cb), delCb(NULL) { }
+
+    Request(const Item &itm, Callback<int> *cb) :
+        doc(new MemoryDocument(itm, true)), vbid(itm.getVBucketId()),
+        setCb(NULL), delCb(cb) { }
+
+    MemoryDocumentPtr doc;
+    uint16_t vbid;
+    Callback<mutation_result> *setCb;
+    Callback<int> *delCb;
+};
+
+MemoryKVStore::MemoryKVStore(EPStats &stats, Configuration &config,
+                             bool read_only) :
+    KVStore(read_only), epStats(stats), configuration(config),
+    db(MemoryDb::acquire(configuration)), intransaction(false)
+{
+}
+
+MemoryKVStore::~MemoryKVStore()
+{
+    std::vector<Request *>::iterator it = pendingReqs.begin();
+    for (; it != pendingReqs.end(); ++it) {
+        delete *it;
+    }
+    MemoryDb::release(db);
+}
+
+void MemoryKVStore::reset(uint16_t shardId)
+{
+    cb_assert(!isReadOnly());
+    for (uint16_t vbid = 0; vbid < db->getNumVBuckets(); ++vbid) {
+        if (vbid % configuration.getMaxNumShards() != shardId) {
+            continue;
+        }
+        MemoryVBucket &vb = db->getVBucket(vbid);
+        vbucket_state vbstate;
+        if (!vb.getState(vbstate)) {
+            continue;
+        }
+        vb.reset(true);
+        vbstate.checkpointId = 0;
+        vb.saveState(vbstate);
+    }
+}
+
+bool MemoryKVStore::commit(Callback<kvstats_ctx> *cb)
+{
+    cb_assert(!isReadOnly());
+    if (!intransaction) {
+        return true;
+    }
+    intransaction = false;
+
+    size_t pendingCommitCnt = pendingReqs.size();
+    if (pendingCommitCnt == 0) {
+        return true;
+    }
+
+    uint16_t vbucket2flush = pendingReqs[0]->vbid;
+    std::vector<MemoryDocumentPtr> batch;
+    batch.reserve(pendingCommitCnt);
+    std::vector<Request *>::iterator it = pendingReqs.begin();
+    for (; it != pendingReqs.end(); ++it) {
+        cb_assert(vbucket2flush == (*it)->vbid);
+        batch.push_back((*it)->doc);
+    }
+
+    MemoryVBucket &vb = db->getVBucket(vbucket2flush);
+    std::vector<bool> existed;
+    hrtime_t start = gethrtime();
+    vb.write(batch, existed);
+    st.commitHisto.add((gethrtime() - start) / 1000);
+    st.batchSize.add(pendingCommitCnt);
+    st.docsCommitted.store(pendingCommitCnt);
+
+    kvstats_ctx kvctx;
+    kvctx.vbucket = vbucket2flush;
+    vb.getSpace(kvctx.fileSpaceUsed, kvctx.fileSize);
+    if (cb) {
+        cb->callback(kvctx);
+    }
+
+    for (size_t i = 0; i < pendingReqs.size(); ++i) {
+        Request *req = pendingReqs[i];
+        if (req->delCb) {
+            int rv = existed[i] ? 1 : 0;
+            req->delCb->callback(rv);
+        } else {
+            st.writeSizeHisto.add(req->doc->size());
+            mutation_result p(1, !existed[i]);
+            req->setCb->callback(p);
+        }
+        delete req;
+    }
+    pendingReqs.clear();
+    return true;
+}
+
+StorageProperties MemoryKVStore::getStorageProperties()
+{
+    StorageProperties rv(true, true, true, true);
+    return rv;
+}
+
+void MemoryKVStore::set(const Item &itm, Callback<mutation_result> &cb)
+{
+    cb_assert(!isReadOnly());
+    cb_assert(intransaction);
+    pendingReqs.push_back(new Request(itm, &cb));
+}
+
+void MemoryKVStore::del(const Item &itm, Callback<int> &cb)
+{
+    cb_assert(!isReadOnly());
+    cb_assert(intransaction);
+    pendingReqs.push_back(new Request(itm, &cb));
+}
+
+void MemoryKVStore::fetch(MemoryVBucket &vb, const std::string &key,
+                          const MemorySnapshot *snap, bool metaOnly,
+                          bool fetchDelete, GetValue &rv)
+{
+    MemoryDocumentPtr doc = vb.lookup(key, snap);
+    if (!doc || (doc->deleted && !metaOnly && !fetchDelete)) {
+        ++st.numGetFailure;
+        rv.setStatus(ENGINE_KEY_ENOENT);
+        return;
+    }
+    rv = GetValue(doc->toItem(vb.getId(), metaOnly));
+    st.readSizeHisto.add(key.length() + rv.getValue()->getNBytes());
+}
+
+void MemoryKVStore::get(const std::string &key, uint64_t, uint16_t vb,
+                        Callback<GetValue> &cb, bool fetchDelete)
+{
+    getWithHeader(NULL, key, vb, cb, fetchDelete);
+}
+
+void MemoryKVStore::getWithHeader(void *dbHandle, const std::string &key,
+                                  uint16_t vb, Callback<GetValue> &cb,
+                                  bool fetchDelete)
+{
+    hrtime_t start = gethrtime();
+    RememberingCallback<GetValue> *rc =
+        dynamic_cast<RememberingCallback<GetValue> *>(&cb);
+    bool getMetaOnly = rc && rc->val.isPartial();
+    GetValue rv;
+    fetch(db->getVBucket(vb), key, static_cast<MemorySnapshot *>(dbHandle),
+          getMetaOnly, fetchDelete, rv);
+    st.readTimeHisto.add((gethrtime() - start) / 1000);
+    cb.callback(rv);
+}
+
+void MemoryKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
+{
+    MemoryVBucket &vbucket = db->getVBucket(vb);
+    vb_bgfetch_queue_t::iterator itr = itms.begin();
+    for (; itr != itms.end(); ++itr) {
+        std::list<VBucketBGFetchItem *> &fetches = itr->second;
+        GetValue returnVal;
+        fetch(vbucket, itr->first, NULL, isMetaOnlyFetch(fetches), false,
+              returnVal);
+        std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
+        for (; fitr != fetches.end(); ++fitr) {
+            // populate return value for remaining fetch items with the
+            // same seqid
+            (*fitr)->value = returnVal;
+            st.readTimeHisto.add((gethrtime() - (*fitr)->initTime) / 1000);
+        }
+    }
+}
+
+bool MemoryKVStore::delVBucket(uint16_t vbucket, bool recreate)
+{
+    cb_assert(!isReadOnly());
+    MemoryVBucket &vb = db->getVBucket(vbucket);
+    vbucket_state oldState;
+    bool existed = vb.getState(oldState);
+    vb.reset(false);
+
+    if (recreate) {
+        vbucket_state vbstate(vbucket_state_dead, 0, 0, 0);
+        if (existed) {
+            vbstate.state = oldState.state;
+        }
+        vb.saveState(vbstate);
+    }
+    return true;
+}
+
+vbucket_map_t MemoryKVStore::listPersistedVbuckets()
+{
+    vbucket_map_t states;
+    for (uint16_t id = 0; id < db->getNumVBuckets(); ++id) {
+        vbucket_state vb_state;
+        if (db->getVBucket(id).getState(vb_state)) {
+            states[id] = vb_state;
+            ++st.numLoadedVb;
+        }
+    }
+    return states;
+}
+
+void MemoryKVStore::getPersistedStats(std::map<std::string,
+                                      std::string> &stats)
+{
+    db->getStats(stats);
+}
+
+bool MemoryKVStore::snapshotStats(const std::map<std::string,
+                                  std::string> &stats)
+{
+    cb_assert(!isReadOnly());
+    db->setStats(stats);
+    return true;
+}
+
+bool MemoryKVStore::snapshotVBuckets(const vbucket_map_t &vbstates,
+                                     Callback<kvstats_ctx> *cb)
+{
+    cb_assert(!isReadOnly());
+    vbucket_map_t::const_reverse_iterator iter = vbstates.rbegin();
+    for (; iter != vbstates.rend(); ++iter) {
+        uint16_t vbucketId = iter->first;
+        MemoryVBucket &vb = db->getVBucket(vbucketId);
+        vb.saveState(iter->second);
+        if (cb) {
+            kvstats_ctx kvctx;
+            kvctx.vbucket = vbucketId;
+            vb.getSpace(kvctx.fileSpaceUsed, kvctx.fileSize);
+            cb->callback(kvctx);
+        }
+    }
+    return true;
+}
+
+bool MemoryKVStore::compactVBucket(const uint16_t vbid,
+                                   compaction_ctx *hook_ctx,
+                                   Callback<compaction_ctx> &cb,
+                                   Callback<kvstats_ctx> &kvcb)
+{
+    cb_assert(!isReadOnly());
+    hrtime_t start = gethrtime();
+    MemoryVBucket &vb = db->getVBucket(vbid);
+    vb.compact(hook_ctx);
+
+    // Update stats to caller
+    kvstats_ctx kvctx;
+    kvctx.vbucket = vbid;
+    vb.getSpace(kvctx.fileSpaceUsed, kvctx.fileSize);
+    kvcb.callback(kvctx);
+
+    if (hook_ctx->expiredItems.size()) {
+        cb.callback(*hook_ctx);
+    }
+    st.compactHisto.add((gethrtime() - start) / 1000);
+    return true;
+}
+
+void MemoryKVStore::scan(uint16_t vbid, uint64_t startSeqno,
+                         uint64_t endSeqno, bool deletes, bool live,
+                         bool keysOnly, shared_ptr<Callback<GetValue> > cb,
+                         shared_ptr<Callback<CacheLookup> > cl,
+                         shared_ptr<Callback<SeqnoRange> > sr)
+{
+    MemoryVBucket &vb = db->getVBucket(vbid);
+    uint64_t highSeqno = vb.getHighSeqno();
+    SeqnoRange range(startSeqno, highSeqno);
+    sr->callback(range);
+
+    std::vector<MemoryDocumentPtr> docs;
+    vb.collect(startSeqno, std::min(endSeqno, highSeqno), deletes, live,
+               docs);
+
+    std::vector<MemoryDocumentPtr>::iterator it = docs.begin();
+    for (; it != docs.end(); ++it) {
+        const MemoryDocument &doc = **it;
+        CacheLookup lookup(doc.key, doc.seqno, vbid);
+        cl->callback(lookup);
+        if (cl->getStatus() == ENGINE_KEY_EEXISTS) {
+            continue;
+        }
+
+        GetValue rv(doc.toItem(vbid, keysOnly), ENGINE_SUCCESS, -1,
+                    keysOnly);
+        cb->callback(rv);
+        if (cb->getStatus() == ENGINE_ENOMEM) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Canceling loading database, warmup has completed\n");
+            return;
+        }
+    }
+    st.numScans++;
+}
+
+void MemoryKVStore::dump(std::vector<uint16_t> &vbids,
+                         shared_ptr<Callback<GetValue> > cb,
+                         shared_ptr<Callback<CacheLookup> > cl)
+{
+    shared_ptr<Callback<SeqnoRange> > sr(new NoRangeCallback());
+    std::vector<uint16_t>::iterator itr = vbids.begin();
+    for (; itr != vbids.end(); ++itr) {
+        scan(*itr, 0, std::numeric_limits<uint64_t>::max(), false, true,
+             false, cb, cl, sr);
+    }
+}
+
+void MemoryKVStore::dump(uint16_t vb, uint64_t stSeqno,
+                         shared_ptr<Callback<GetValue> > cb,
+                         shared_ptr<Callback<CacheLookup> > cl,
+                         shared_ptr<Callback<SeqnoRange> > sr)
+{
+    scan(vb, stSeqno, std::numeric_limits<uint64_t>::max(), true, true,
+         false, cb, cl, sr);
+}
+
+void MemoryKVStore::dumpKeys(std::vector<uint16_t> &vbids,
+                             shared_ptr<Callback<GetValue> > cb)
+{
+    shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
+    shared_ptr<Callback<SeqnoRange> > sr(new NoRangeCallback());
+    std::vector<uint16_t>::iterator itr = vbids.begin();
+    for (; itr != vbids.end(); ++itr) {
+        scan(*itr, 0, std::numeric_limits<uint64_t>::max(), false, true,
+             true, cb, cl, sr);
+    }
+}
+
+void MemoryKVStore::dumpDeleted(uint16_t vb, uint64_t stSeqno,
+                                uint64_t enSeqno,
+                                shared_ptr<Callback<GetValue> > cb)
+{
+    shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
+    shared_ptr<Callback<SeqnoRange> > sr(new NoRangeCallback());
+    scan(vb, stSeqno, enSeqno, true, false, true, cb, cl, sr);
+}
+
+size_t MemoryKVStore::getEstimatedItemCount(std::vector<uint16_t> &vbs)
+{
+    size_t items = 0;
+    std::vector<uint16_t>::iterator it;
+    for (it = vbs.begin(); it != vbs.end(); ++it) {
+        items += getNumItems(*it);
+    }
+    return items;
+}
+
+size_t MemoryKVStore::getNumPersistedDeletes(uint16_t vbid)
+{
+    return db->getVBucket(vbid).getNumDeletes();
+}
+
+size_t MemoryKVStore::getNumItems(uint16_t vbid)
+{
+    return db->getVBucket(vbid).getNumItems();
+}
+
+size_t MemoryKVStore::getNumItems(uint16_t vbid, uint64_t min_seq,
+                                  uint64_t max_seq)
+{
+    return db->getVBucket(vbid).countRange(min_seq, max_seq);
+}
+
+rollback_error_code MemoryKVStore::rollback(uint16_t vbid,
+                                            uint64_t rollbackSeqno,
+                                            shared_ptr<RollbackCB> cb)
+{
+    uint64_t newSeqno = 0;
+    if (!db->getVBucket(vbid).rollback(rollbackSeqno, cb, newSeqno)) {
+        return rollback_error_code(ENGINE_ROLLBACK, 0);
+    }
+    return rollback_error_code(ENGINE_SUCCESS, newSeqno);
+}
+
+uint64_t MemoryKVStore::getLastPersistedSeqno(uint16_t vbid)
+{
+    return db->getVBucket(vbid).getHighSeqno();
+}
+
+ENGINE_ERROR_CODE MemoryKVStore::getAllKeys(uint16_t vbid,
+                                            std::string &start_key,
+                                            uint32_t count,
+                                            AllKeysCB *cb)
+{
+    std::vector<std::string> keys;
+    db->getVBucket(vbid).getKeys(start_key, count, keys);
+    std::vector<std::string>::iterator it = keys.begin();
+    for (; it != keys.end(); ++it) {
+        if (!cb->addtoAllKeys(it->length(),
+                              const_cast<char *>(it->data()))) {
+            break;
+        }
+    }
+    return ENGINE_SUCCESS;
+}
+
+void MemoryKVStore::addStats(const std::string &prefix,
+                             ADD_STAT add_stat,
+                             const void *c)
+{
+    const char *prefix_str = prefix.c_str();
+
+    /* stats for both read-only and read-write threads */
+    addStat(prefix_str, "backend_type",   "memory",           add_stat, c);
+    addStat(prefix_str, "readTime",       st.readTimeHisto,   add_stat, c);
+    addStat(prefix_str, "readSize",       st.readSizeHisto,   add_stat, c);
+    addStat(prefix_str, "numLoadedVb",    st.numLoadedVb,     add_stat, c);
+    addStat(prefix_str, "scans",          st.numScans,        add_stat, c);
+    addStat(prefix_str, "failure_get",    st.numGetFailure,   add_stat, c);
+
+    if (!isReadOnly()) {
+        addStat(prefix_str, "lastCommDocs",  st.docsCommitted, add_stat, c);
+    }
+}
+
+void MemoryKVStore::addTimingStats(const std::string &prefix,
+                                   ADD_STAT add_stat, const void *c) {
+    if (isReadOnly()) {
+        return;
+    }
+    const char *prefix_str = prefix.c_str();
+    addStat(prefix_str, "commit",      st.commitHisto,      add_stat, c);
+    addStat(prefix_str, "compact",     st.compactHisto,     add_stat, c);
+    addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
+    addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+}
+
+template <typename T>
+void MemoryKVStore::addStat(const std::string &prefix, const char *stat,
+                            T &val, ADD_STAT add_stat, const void *c)
+{
+    std::stringstream fullstat;
+    fullstat << prefix << ":" << stat;
+    add_casted_stat(fullstat.str().c_str(), val, add_stat, c);
+}
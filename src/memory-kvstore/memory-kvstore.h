@@ -0,0 +1,221 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_MEMORY_KVSTORE_MEMORY_KVSTORE_H_
+#define SRC_MEMORY_KVSTORE_MEMORY_KVSTORE_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "configuration.h"
+#include "histo.h"
+#include "item.h"
+#include "kvstore.h"
+#include "memory-kvstore/memory-vbucket.h"
+#include "stats.h"
+
+class MemoryKVStoreStats {
+
+public:
+    MemoryKVStoreStats() :
+      docsCommitted(0), numLoadedVb(0), numGetFailure(0), numScans(0),
+      readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
+      writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
+    }
+
+    void reset() {
+        docsCommitted.store(0);
+        numLoadedVb.store(0);
+        numGetFailure.store(0);
+        numScans.store(0);
+
+        readTimeHisto.reset();
+        readSizeHisto.reset();
+        writeSizeHisto.reset();
+        compactHisto.reset();
+        commitHisto.reset();
+        batchSize.reset();
+    }
+
+    // the number of docs committed
+    AtomicValue<size_t> docsCommitted;
+    // the number of vbuckets loaded
+    AtomicValue<size_t> numLoadedVb;
+    // the number of gets of missing keys
+    AtomicValue<size_t> numGetFailure;
+    // full scans (warmup, backfill) completed
+    AtomicValue<size_t> numScans;
+
+    /* histograms of the same names as the couchstore ones */
+    Histogram<hrtime_t> readTimeHisto;
+    Histogram<size_t> readSizeHisto;
+    Histogram<size_t> writeSizeHisto;
+    Histogram<hrtime_t> compactHisto;
+    Histogram<hrtime_t> commitHisto;
+    Histogram<size_t> batchSize;
+};
+
+/**
+ * KVStore keeping every vbucket in memory, in an ordered by-id index and a
+ * by-seqno index, with an undo log of the latest mutations for rollbacks.
+ * Nothing is written to disk: the data lives as long as the bucket, which
+ * takes the cost of the storage layer out of engine benchmarks and suits
+ * buckets that are pure caches.
+ *
+ * The values are the blobs of the flushed items, shared with the hash
+ * table, so they count towards the bucket's memory usage for as long as
+ * the store holds on to them.
+ */
+class MemoryKVStore : public KVStore
+{
+public:
+    /**
+     * @param stats the engine stats
+     * @param config the engine configuration
+     * @param read_only true if the kvstore instance is for read operations only
+     */
+    MemoryKVStore(EPStats &stats, Configuration &config,
+                  bool read_only = false);
+
+    ~MemoryKVStore();
+
+    void reset(uint16_t shardId);
+
+    bool begin() {
+        cb_assert(!isReadOnly());
+        intransaction = true;
+        return intransaction;
+    }
+
+    bool commit(Callback<kvstats_ctx> *cb);
+
+    void rollback() {
+        cb_assert(!isReadOnly());
+        if (intransaction) {
+            intransaction = false;
+        }
+    }
+
+    StorageProperties getStorageProperties();
+
+    void set(const Item &itm, Callback<mutation_result> &cb);
+
+    void get(const std::string &key, uint64_t rowid,
+             uint16_t vb, Callback<GetValue> &cb, bool fetchDelete = false);
+
+    /**
+     * Get an item from the snapshot a rollback passes to RollbackCB.
+     */
+    void getWithHeader(void *dbHandle, const std::string &key,
+                       uint16_t vb, Callback<GetValue> &cb,
+                       bool fetchDelete = false);
+
+    void getMulti(uint16_t vb, vb_bgfetch_queue_t &itms);
+
+    void del(const Item &itm, Callback<int> &cb);
+
+    bool delVBucket(uint16_t vbucket, bool recreate);
+
+    vbucket_map_t listPersistedVbuckets(void);
+
+    void getPersistedStats(std::map<std::string, std::string> &stats);
+
+    bool snapshotStats(const std::map<std::string, std::string> &m);
+
+    bool snapshotVBuckets(const vbucket_map_t &m, Callback<kvstats_ctx> *cb);
+
+    /**
+     * Purge the deletions of a vbucket, there is no file to rewrite.
+     */
+    bool compactVBucket(const uint16_t vbid, compaction_ctx *cookie,
+                        Callback<compaction_ctx> &cb,
+                        Callback<kvstats_ctx> &kvcb);
+
+    void dump(std::vector<uint16_t> &vbids, shared_ptr<Callback<GetValue> > cb,
+              shared_ptr<Callback<CacheLookup> > cl);
+
+    void dump(uint16_t vb, uint64_t stSeqno,
+              shared_ptr<Callback<GetValue> > cb,
+              shared_ptr<Callback<CacheLookup> > cl,
+              shared_ptr<Callback<SeqnoRange> > sr);
+
+    bool isKeyDumpSupported() {
+        return true;
+    }
+
+    void dumpKeys(std::vector<uint16_t> &vbids,
+                  shared_ptr<Callback<GetValue> > cb);
+
+    void dumpDeleted(uint16_t vb, uint64_t stSeqno, uint64_t enSeqno,
+                     shared_ptr<Callback<GetValue> > cb);
+
+    size_t getEstimatedItemCount(std::vector<uint16_t> &vbs);
+
+    size_t getNumPersistedDeletes(uint16_t vbid);
+
+    size_t getNumItems(uint16_t vbid);
+
+    size_t getNumItems(uint16_t vbid, uint64_t min_seq, uint64_t max_seq);
+
+    rollback_error_code rollback(uint16_t vbid, uint64_t rollbackseqno,
+                                 shared_ptr<RollbackCB> cb);
+
+    uint64_t getLastPersistedSeqno(uint16_t vbid);
+
+    ENGINE_ERROR_CODE getAllKeys(uint16_t vbid, std::string &start_key,
+                                 uint32_t count, AllKeysCB *cb);
+
+    void addStats(const std::string &prefix, ADD_STAT add_stat,
+                  const void *c);
+
+    void addTimingStats(const std::string &prefix, ADD_STAT add_stat,
+                        const void *c);
+
+    void resetStats() {
+        st.reset();
+    }
+
+private:
+    class Request;
+
+    void fetch(MemoryVBucket &vb, const std::string &key,
+               const MemorySnapshot *snap, bool metaOnly, bool fetchDelete,
+               GetValue &rv);
+    void scan(uint16_t vbid, uint64_t startSeqno, uint64_t endSeqno,
+              bool deletes, bool live, bool keysOnly,
+              shared_ptr<Callback<GetValue> > cb,
+              shared_ptr<Callback<CacheLookup> > cl,
+              shared_ptr<Callback<SeqnoRange> > sr);
+
+    template <typename T>
+    void addStat(const std::string &prefix, const char *nm, T &val,
+                 ADD_STAT add_stat, const void *c);
+
+    EPStats &epStats;
+    Configuration &configuration;
+    MemoryDb *db;
+    bool intransaction;
+    std::vector<Request *> pendingReqs;
+    MemoryKVStoreStats st;
+
+    DISALLOW_COPY_AND_ASSIGN(MemoryKVStore);
+};
+
+#endif  // SRC_MEMORY_KVSTORE_MEMORY_KVSTORE_H_
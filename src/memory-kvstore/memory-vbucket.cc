@@ -0,0 +1,418 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "memory-kvstore/memory-vbucket.h"
+
+MemoryDocument::MemoryDocument(const Item &itm, bool del) :
+    key(itm.getKey()), value(itm.getValue()), cas(itm.getCas()),
+    revSeqno(itm.getRevSeqno()), seqno(itm.getBySeqno()),
+    flags(itm.getFlags()), exptime(itm.getExptime()), deleted(del)
+{
+}
+
+Item *MemoryDocument::toItem(uint16_t vbid, bool metaOnly) const
+{
+    Item *it;
+    if (metaOnly || deleted) {
+        uint8_t *extMeta = NULL;
+        uint8_t extMetaLen = 0;
+        if (value.get() && value->getExtLen() > 0) {
+            extMeta = reinterpret_cast<uint8_t *>(
+                                const_cast<char *>(value->getExtMeta()));
+            extMetaLen = value->getExtLen();
+        }
+        it = new Item(key.data(), key.length(), 0, flags, (time_t)exptime,
+                      extMeta, extMetaLen, cas, seqno, vbid);
+        it->setRevSeqno(revSeqno);
+        if (deleted) {
+            it->setDeleted();
+        }
+    } else {
+        it = new Item(key, flags, (time_t)exptime, value, cas, seqno, vbid,
+                      revSeqno);
+    }
+    return it;
+}
+
+MemoryVBucket::MemoryVBucket(uint16_t id, size_t undoSize) :
+    vbid(id), undoLogSize(undoSize), stateExists(false),
+    cachedState(vbucket_state_dead, 0, 0, 0), undoFloor(0), highSeqno(0),
+    maxDeletedSeqno(0), numDeletes(0), liveBytes(0), undoBytes(0)
+{
+    cachedState.purgeSeqno = 0;
+}
+
+bool MemoryVBucket::getState(vbucket_state &vbstate)
+{
+    LockHolder lh(mutex);
+    if (!stateExists) {
+        return false;
+    }
+    vbstate = cachedState;
+    vbstate.highSeqno = highSeqno;
+    vbstate.maxDeletedSeqno = maxDeletedSeqno;
+    return true;
+}
+
+void MemoryVBucket::saveState(const vbucket_state &vbstate)
+{
+    LockHolder lh(mutex);
+    // The seqnos are the vbucket's own, not the caller's.
+    uint64_t purgeSeqno = cachedState.purgeSeqno;
+    cachedState = vbstate;
+    cachedState.maxDeletedSeqno = maxDeletedSeqno;
+    cachedState.purgeSeqno = purgeSeqno;
+    stateExists = true;
+}
+
+MemoryDocumentPtr MemoryVBucket::replace(const std::string &key,
+                                         const MemoryDocumentPtr &doc)
+{
+    MemoryDocumentPtr old;
+    MemoryKeyIndex::iterator it = byId.find(key);
+    if (it != byId.end()) {
+        old = it->second;
+        bySeqno.erase(old->seqno);
+        liveBytes -= old->size();
+        if (old->deleted) {
+            --numDeletes;
+        }
+        if (!doc) {
+            byId.erase(it);
+        }
+    }
+
+    if (doc) {
+        if (it != byId.end()) {
+            it->second = doc;
+        } else {
+            byId[key] = doc;
+        }
+        bySeqno[doc->seqno] = doc;
+        liveBytes += doc->size();
+        if (doc->deleted) {
+            ++numDeletes;
+        }
+    }
+    return old;
+}
+
+void MemoryVBucket::write(const std::vector<MemoryDocumentPtr> &batch,
+                          std::vector<bool> &existed)
+{
+    LockHolder wl(writeMutex);
+    LockHolder lh(mutex);
+    existed.resize(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const MemoryDocumentPtr &doc = batch[i];
+        UndoRecord rec;
+        rec.seqno = doc->seqno;
+        rec.key = doc->key;
+        rec.previous = replace(doc->key, doc);
+        existed[i] = rec.previous && !rec.previous->deleted;
+        if (rec.previous) {
+            undoBytes += rec.previous->size();
+        }
+        undoLog.push_back(rec);
+
+        highSeqno = std::max(highSeqno, doc->seqno);
+        if (doc->deleted) {
+            maxDeletedSeqno = std::max(maxDeletedSeqno, doc->seqno);
+        }
+    }
+
+    while (undoLog.size() > undoLogSize) {
+        dropOldestUndo();
+    }
+}
+
+void MemoryVBucket::dropOldestUndo()
+{
+    const UndoRecord &rec = undoLog.front();
+    undoFloor = std::max(undoFloor, rec.seqno);
+    if (rec.previous) {
+        undoBytes -= rec.previous->size();
+    }
+    undoLog.pop_front();
+}
+
+MemoryDocumentPtr MemoryVBucket::lookup(const std::string &key,
+                                        const MemorySnapshot *snap)
+{
+    LockHolder lh(mutex);
+    if (snap) {
+        MemoryKeyIndex::const_iterator it = snap->docs.find(key);
+        if (it != snap->docs.end()) {
+            return it->second;
+        }
+    }
+    MemoryKeyIndex::iterator it = byId.find(key);
+    if (it == byId.end()) {
+        return MemoryDocumentPtr();
+    }
+    return it->second;
+}
+
+void MemoryVBucket::collect(uint64_t startSeqno, uint64_t endSeqno,
+                            bool deletes, bool live,
+                            std::vector<MemoryDocumentPtr> &docs)
+{
+    LockHolder lh(mutex);
+    MemorySeqnoIndex::iterator it = bySeqno.lower_bound(startSeqno);
+    for (; it != bySeqno.end() && it->first <= endSeqno; ++it) {
+        if (it->second->deleted ? deletes : live) {
+            docs.push_back(it->second);
+        }
+    }
+}
+
+void MemoryVBucket::getKeys(const std::string &start, size_t count,
+                            std::vector<std::string> &keys)
+{
+    LockHolder lh(mutex);
+    MemoryKeyIndex::iterator it = byId.lower_bound(start);
+    for (; it != byId.end() && keys.size() < count; ++it) {
+        if (!it->second->deleted) {
+            keys.push_back(it->first);
+        }
+    }
+}
+
+void MemoryVBucket::compact(compaction_ctx *ctx)
+{
+    LockHolder wl(writeMutex);
+    LockHolder lh(mutex);
+    uint64_t purgedSeqno = 0;
+    std::vector<std::string> purged;
+    MemoryKeyIndex::iterator it = byId.begin();
+    for (; it != byId.end(); ++it) {
+        const MemoryDocument &doc = *it->second;
+        if (doc.deleted) {
+            if (ctx->drop_deletes && doc.exptime < ctx->purge_before_ts &&
+                (!ctx->purge_before_seq ||
+                 doc.seqno <= ctx->purge_before_seq)) {
+                purgedSeqno = std::max(purgedSeqno, doc.seqno);
+                purged.push_back(it->first);
+            }
+        } else if (doc.exptime && doc.exptime < ctx->curr_time) {
+            expiredItemCtx expItem = { doc.revSeqno, it->first };
+            ctx->expiredItems.push_back(expItem);
+        }
+    }
+
+    std::vector<std::string>::iterator pit = purged.begin();
+    for (; pit != purged.end(); ++pit) {
+        replace(*pit, MemoryDocumentPtr());
+    }
+
+    if (purgedSeqno > ctx->max_purged_seq) {
+        ctx->max_purged_seq = purgedSeqno;
+    }
+    if (ctx->max_purged_seq > cachedState.purgeSeqno) {
+        cachedState.purgeSeqno = ctx->max_purged_seq;
+    }
+
+    // Rolling back behind the purge seqno resets the vbucket anyway, so
+    // the old versions up to it are of no use any more.
+    while (!undoLog.empty() &&
+           undoLog.front().seqno <= cachedState.purgeSeqno) {
+        dropOldestUndo();
+    }
+}
+
+bool MemoryVBucket::rollback(uint64_t seqno, shared_ptr<RollbackCB> cb,
+                             uint64_t &newSeqno)
+{
+    LockHolder wl(writeMutex);
+
+    MemorySnapshot snap;
+    std::vector<std::pair<std::string, uint64_t> > changed;
+    size_t total;
+    {
+        LockHolder lh(mutex);
+        if (seqno >= highSeqno) {
+            newSeqno = highSeqno;
+            return true;
+        }
+        if (undoFloor > seqno) {
+            return false;
+        }
+
+        // Walking back, the latest mutation of a key is seen first and the
+        // oldest one beyond the seqno last, which leaves the version the key
+        // had at the seqno.
+        std::deque<UndoRecord>::reverse_iterator rit = undoLog.rbegin();
+        for (; rit != undoLog.rend() && rit->seqno > seqno; ++rit) {
+            std::pair<MemoryKeyIndex::iterator, bool> r =
+                snap.docs.insert(std::make_pair(rit->key, rit->previous));
+            if (r.second) {
+                changed.push_back(std::make_pair(rit->key, rit->seqno));
+            } else {
+                r.first->second = rit->previous;
+            }
+        }
+        total = byId.size();
+    }
+    if (total / 2 <= changed.size()) {
+        return false;
+    }
+
+    cb->setDbHeader(&snap);
+    std::vector<std::pair<std::string, uint64_t> >::iterator cit;
+    for (cit = changed.begin(); cit != changed.end(); ++cit) {
+        Item *it = new Item(cit->first, 0, 0, NULL, 0, NULL, 0, 0,
+                            cit->second, vbid);
+        GetValue rv(it, ENGINE_SUCCESS, -1, true);
+        cb->callback(rv);
+    }
+
+    LockHolder lh(mutex);
+    while (!undoLog.empty() && undoLog.back().seqno > seqno) {
+        const UndoRecord &rec = undoLog.back();
+        if (rec.previous) {
+            undoBytes -= rec.previous->size();
+        }
+        replace(rec.key, rec.previous);
+        undoLog.pop_back();
+    }
+    highSeqno = undoLog.empty() ? undoFloor : undoLog.back().seqno;
+    if (!bySeqno.empty()) {
+        highSeqno = std::max(highSeqno, bySeqno.rbegin()->first);
+    }
+    maxDeletedSeqno = std::min(maxDeletedSeqno, highSeqno);
+    newSeqno = highSeqno;
+    return true;
+}
+
+void MemoryVBucket::reset(bool keepState)
+{
+    LockHolder wl(writeMutex);
+    LockHolder lh(mutex);
+    byId.clear();
+    bySeqno.clear();
+    undoLog.clear();
+    undoFloor = 0;
+    highSeqno = 0;
+    maxDeletedSeqno = 0;
+    numDeletes = 0;
+    liveBytes = 0;
+    undoBytes = 0;
+    cachedState.checkpointId = 0;
+    cachedState.maxDeletedSeqno = 0;
+    cachedState.purgeSeqno = 0;
+    if (!keepState) {
+        stateExists = false;
+    }
+}
+
+uint64_t MemoryVBucket::getHighSeqno()
+{
+    LockHolder lh(mutex);
+    return highSeqno;
+}
+
+size_t MemoryVBucket::getNumItems()
+{
+    LockHolder lh(mutex);
+    return byId.size() - numDeletes;
+}
+
+size_t MemoryVBucket::getNumDeletes()
+{
+    LockHolder lh(mutex);
+    return numDeletes;
+}
+
+size_t MemoryVBucket::countRange(uint64_t minSeqno, uint64_t maxSeqno)
+{
+    LockHolder lh(mutex);
+    size_t count = 0;
+    MemorySeqnoIndex::iterator it = bySeqno.lower_bound(minSeqno);
+    for (; it != bySeqno.end() && it->first <= maxSeqno; ++it) {
+        if (!it->second->deleted) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void MemoryVBucket::getSpace(size_t &live, size_t &total)
+{
+    LockHolder lh(mutex);
+    live = liveBytes;
+    total = liveBytes + undoBytes;
+}
+
+Mutex MemoryDb::registryMutex;
+std::map<std::string, MemoryDb *> MemoryDb::registry;
+
+MemoryDb *MemoryDb::acquire(Configuration &config)
+{
+    LockHolder lh(registryMutex);
+    std::string name = config.getDbname();
+    std::map<std::string, MemoryDb *>::iterator it = registry.find(name);
+    if (it == registry.end()) {
+        MemoryDb *db = new MemoryDb(name, config.getMaxVbuckets(),
+                                    config.getMemoryUndoLogSize());
+        it = registry.insert(std::make_pair(name, db)).first;
+    }
+    ++it->second->refs;
+    return it->second;
+}
+
+void MemoryDb::release(MemoryDb *db)
+{
+    LockHolder lh(registryMutex);
+    cb_assert(db->refs > 0);
+    if (--db->refs == 0) {
+        registry.erase(db->dbname);
+        delete db;
+    }
+}
+
+MemoryDb::MemoryDb(const std::string &name, size_t numVBuckets,
+                   size_t undoLogSize) : dbname(name), refs(0)
+{
+    for (size_t i = 0; i < numVBuckets; ++i) {
+        vbuckets.push_back(new MemoryVBucket(i, undoLogSize));
+    }
+}
+
+MemoryDb::~MemoryDb()
+{
+    std::vector<MemoryVBucket *>::iterator it = vbuckets.begin();
+    for (; it != vbuckets.end(); ++it) {
+        delete *it;
+    }
+}
+
+void MemoryDb::getStats(std::map<std::string, std::string> &stats)
+{
+    LockHolder lh(statsMutex);
+    stats = persistedStats;
+}
+
+void MemoryDb::setStats(const std::map<std::string, std::string> &stats)
+{
+    LockHolder lh(statsMutex);
+    persistedStats = stats;
+}
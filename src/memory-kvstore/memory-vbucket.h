@@ -0,0 +1,281 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_MEMORY_KVSTORE_MEMORY_VBUCKET_H_
+#define SRC_MEMORY_KVSTORE_MEMORY_VBUCKET_H_ 1
+
+#include "config.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "configuration.h"
+#include "item.h"
+#include "kvstore.h"
+#include "mutex.h"
+#include "tasks.h"
+
+/**
+ * The stored version of a document. Documents are immutable once stored,
+ * so readers can keep using one after the vbucket has moved on. The value
+ * is the blob of the flushed item, shared with the hash table rather than
+ * copied.
+ */
+class MemoryDocument {
+public:
+    MemoryDocument(const Item &itm, bool del);
+
+    /**
+     * Create an item of the document.
+     *
+     * @param metaOnly leave the value out
+     */
+    Item *toItem(uint16_t vbid, bool metaOnly) const;
+
+    /**
+     * Bytes the document accounts for in the vbucket's space stats.
+     */
+    size_t size() const {
+        return sizeof(MemoryDocument) + key.size() +
+               (value.get() ? value->getSize() : 0);
+    }
+
+    const std::string key;
+    const value_t value;
+    const uint64_t cas;
+    const uint64_t revSeqno;
+    const uint64_t seqno;
+    const uint32_t flags;
+    const uint32_t exptime;
+    const bool deleted;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MemoryDocument);
+};
+
+typedef shared_ptr<MemoryDocument> MemoryDocumentPtr;
+
+/* the by-id index, in key order */
+typedef std::map<std::string, MemoryDocumentPtr> MemoryKeyIndex;
+/* the by-seqno index, only the latest version of every key is in it */
+typedef std::map<uint64_t, MemoryDocumentPtr> MemorySeqnoIndex;
+
+/**
+ * A vbucket as of some earlier seqno, handed to RollbackCB as the
+ * database header. It holds the old version of every key changed since
+ * (a NULL document if the key didn't exist), any other key reads through
+ * to the vbucket.
+ */
+struct MemorySnapshot {
+    MemoryKeyIndex docs;
+};
+
+/**
+ * The documents of a vbucket, indexed by key and by seqno, and the undo
+ * log of its latest mutations that rollbacks rewind.
+ *
+ * Writes (batches, compactions, rollbacks, resets) are serialized through
+ * the write mutex, and may come from both the read-write and the read-only
+ * KVStore of a shard. Readers only hold the index mutex long enough to
+ * find the documents they want.
+ */
+class MemoryVBucket {
+public:
+    MemoryVBucket(uint16_t vbid, size_t undoLogSize);
+
+    /**
+     * Get the state of the vbucket, with its high seqno.
+     *
+     * @return false if the vbucket doesn't exist
+     */
+    bool getState(vbucket_state &vbstate);
+
+    void saveState(const vbucket_state &vbstate);
+
+    /**
+     * Apply a batch of mutations.
+     *
+     * @param batch the documents to store, in any order
+     * @param existed set to whether a live version of each key existed
+     */
+    void write(const std::vector<MemoryDocumentPtr> &batch,
+               std::vector<bool> &existed);
+
+    /**
+     * Look a key up.
+     *
+     * @param snap read from this snapshot instead of the current data
+     */
+    MemoryDocumentPtr lookup(const std::string &key,
+                             const MemorySnapshot *snap = NULL);
+
+    /**
+     * Collect the latest versions of the keys whose seqno is in the range,
+     * in seqno order.
+     *
+     * @param deletes include deleted keys
+     * @param live include live keys
+     */
+    void collect(uint64_t startSeqno, uint64_t endSeqno, bool deletes,
+                 bool live, std::vector<MemoryDocumentPtr> &docs);
+
+    /**
+     * Get up to count live keys not less than the start key, in key order.
+     */
+    void getKeys(const std::string &start, size_t count,
+                 std::vector<std::string> &keys);
+
+    /**
+     * Purge deletions and report expired items as the compaction context
+     * asks for, and trim the undo log up to the purge seqno.
+     */
+    void compact(compaction_ctx *ctx);
+
+    /**
+     * Undo the mutations beyond the given seqno.
+     *
+     * @param seqno the seqno to roll back to
+     * @param cb gets called for every key changed since that seqno
+     * @param newSeqno set to the seqno the vbucket got rolled back to
+     * @return false if the undo log doesn't reach back that far, or more
+     *         than half the keys changed, and the vbucket has to be reset
+     *         instead
+     */
+    bool rollback(uint64_t seqno, shared_ptr<RollbackCB> cb,
+                  uint64_t &newSeqno);
+
+    /**
+     * Drop all the documents of the vbucket, and its state too unless it
+     * is kept.
+     */
+    void reset(bool keepState);
+
+    uint64_t getHighSeqno();
+    size_t getNumItems();
+    size_t getNumDeletes();
+    size_t countRange(uint64_t minSeqno, uint64_t maxSeqno);
+
+    /**
+     * Bytes of the current documents, and of those plus the old versions
+     * the undo log holds on to.
+     */
+    void getSpace(size_t &live, size_t &total);
+
+    uint16_t getId() const {
+        return vbid;
+    }
+
+private:
+    struct UndoRecord {
+        uint64_t seqno;
+        std::string key;
+        /* the version the mutation replaced, NULL if none */
+        MemoryDocumentPtr previous;
+    };
+
+    /**
+     * Make a document the current version of its key (or drop the key if
+     * it is NULL) in both indexes, called with the index mutex held.
+     *
+     * @return the version it replaced, NULL if none
+     */
+    MemoryDocumentPtr replace(const std::string &key,
+                              const MemoryDocumentPtr &doc);
+
+    /**
+     * Drop the oldest record of the undo log, called with the index mutex
+     * held.
+     */
+    void dropOldestUndo();
+
+    const uint16_t vbid;
+    const size_t undoLogSize;
+
+    /* serializes writes, compactions, rollbacks and resets */
+    Mutex writeMutex;
+
+    /* guards everything below */
+    Mutex mutex;
+    bool stateExists;
+    vbucket_state cachedState;
+    MemoryKeyIndex byId;
+    MemorySeqnoIndex bySeqno;
+    std::deque<UndoRecord> undoLog;
+    /* the highest seqno of the mutations dropped from the undo log */
+    uint64_t undoFloor;
+    uint64_t highSeqno;
+    uint64_t maxDeletedSeqno;
+    size_t numDeletes;
+    size_t liveBytes;
+    size_t undoBytes;
+
+    DISALLOW_COPY_AND_ASSIGN(MemoryVBucket);
+};
+
+/**
+ * All the vbuckets of a bucket. The read-write and read-only KVStores of
+ * every shard share one instance, found by the bucket's dbname. It lives
+ * as long as any KVStore of the bucket does, so the data goes away with
+ * the bucket.
+ */
+class MemoryDb {
+public:
+    /**
+     * Get the instance of the configured bucket, creating it on first use.
+     */
+    static MemoryDb *acquire(Configuration &config);
+
+    /**
+     * Drop a reference taken with acquire().
+     */
+    static void release(MemoryDb *db);
+
+    MemoryVBucket &getVBucket(uint16_t vbid) {
+        cb_assert(vbid < vbuckets.size());
+        return *vbuckets[vbid];
+    }
+
+    size_t getNumVBuckets() const {
+        return vbuckets.size();
+    }
+
+    void getStats(std::map<std::string, std::string> &stats);
+
+    void setStats(const std::map<std::string, std::string> &stats);
+
+private:
+    MemoryDb(const std::string &name, size_t numVBuckets,
+             size_t undoLogSize);
+    ~MemoryDb();
+
+    static Mutex registryMutex;
+    static std::map<std::string, MemoryDb *> registry;
+
+    const std::string dbname;
+    std::vector<MemoryVBucket *> vbuckets;
+    size_t refs;
+
+    Mutex statsMutex;
+    std::map<std::string, std::string> persistedStats;
+
+    DISALLOW_COPY_AND_ASSIGN(MemoryDb);
+};
+
+#endif  // SRC_MEMORY_KVSTORE_MEMORY_VBUCKET_H_
@@ -18,10 +18,14 @@
 #include "config.h"
 
 #include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include <algorithm>
 #include <string>
 #include <utility>
+#include <vector>
 
 extern "C" {
 #include "crc32.h"
@@ -813,6 +817,111 @@ void MutationLog::iterator::nextBlock() {
     prepItem();
 }
 
+// ----------------------------------------------------------------------
+// Mapped mutation log
+// ----------------------------------------------------------------------
+
+MappedMutationLog::MappedMutationLog(const MutationLog &log)
+  : path(log.getLogFile()),
+    blockSize(log.header().blockSize()),
+    start(log.header().blockSize() * log.header().blockCount()),
+    addr(NULL),
+    size(0),
+    numBlocks(0),
+    truncated(false)
+{
+}
+
+MappedMutationLog::~MappedMutationLog() {
+#ifndef WIN32
+    if (addr != NULL) {
+        munmap(addr, size);
+    }
+#endif
+}
+
+bool MappedMutationLog::open() {
+#ifdef WIN32
+    return false;
+#else
+    if (blockSize == 0) {
+        return false;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < start) {
+        ::close(fd);
+        return false;
+    }
+    size = st.st_size;
+    if (size > start) {
+        void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            size = 0;
+            return false;
+        }
+        addr = static_cast<uint8_t*>(p);
+        madvise(addr, size, MADV_WILLNEED);
+    }
+    ::close(fd);
+
+    numBlocks = (size - start) / blockSize;
+    truncated = (size - start) % blockSize != 0;
+    return true;
+#endif
+}
+
+bool MappedMutationLog::checkBlock(size_t n) const {
+    const uint8_t *buf = getBlock(n);
+    uint32_t crc32(crc32buf(const_cast<uint8_t*>(buf + 2), blockSize - 2));
+    uint16_t computed_crc16(crc32 & 0xffff);
+    uint16_t retrieved_crc16;
+    memcpy(&retrieved_crc16, buf, sizeof(retrieved_crc16));
+    return computed_crc16 == ntohs(retrieved_crc16);
+}
+
+MappedMutationLog::iterator::iterator(const MappedMutationLog &l,
+                                      size_t first, size_t lst)
+  : log(l),
+    block(first),
+    last(lst),
+    p(NULL),
+    items(0),
+    entryBuf(static_cast<uint8_t*>(calloc(1, LOG_ENTRY_BUF_SIZE)))
+{
+    cb_assert(entryBuf);
+}
+
+MappedMutationLog::iterator::~iterator() {
+    free(entryBuf);
+}
+
+const MutationLogEntry *MappedMutationLog::iterator::next() {
+    while (items == 0) {
+        if (block >= last) {
+            return NULL;
+        }
+        p = log.getBlock(block++);
+        memcpy(&items, p + 2, sizeof(items));
+        items = ntohs(items);
+        p += 4;
+    }
+    --items;
+
+    // Copied out like MutationLog::iterator does, the entries in a block
+    // are not aligned
+    size_t remaining = log.blockSize - (p - log.getBlock(block - 1));
+    MutationLogEntry *e =
+        MutationLogEntry::newEntry(const_cast<uint8_t*>(p), remaining);
+    memcpy(entryBuf, p, e->len());
+    p += e->len();
+    return MutationLogEntry::newEntry(entryBuf, LOG_ENTRY_BUF_SIZE);
+}
+
 void MutationLog::resetCounts(size_t *items) {
     for (int i(0); i < MUTATION_LOG_TYPES; ++i) {
         itemsLogged[i] = items[i];
@@ -823,7 +932,14 @@ void MutationLog::resetCounts(size_t *items) {
 // Reading entries
 // ----------------------------------------------------------------------
 
-bool MutationLogHarvester::load() {
+bool MutationLogHarvester::load(size_t threads) {
+    if (threads > 1) {
+        MappedMutationLog mapped(mlog);
+        if (mapped.open()) {
+            return loadMapped(mapped, threads);
+        }
+    }
+
     bool clean(false);
     std::set<uint16_t> shouldClear;
     for (MutationLog::iterator it(mlog.begin()); it != mlog.end(); ++it) {
@@ -891,6 +1007,179 @@ bool MutationLogHarvester::load() {
     return clean;
 }
 
+bool MutationLogHarvester::loadMapped(const MappedMutationLog &mapped,
+                                      size_t threads) {
+    size_t numBlocks = mapped.getNumBlocks();
+
+    // Check the blocks first, a run of them per thread, as replaying stops
+    // at the first bad one
+    std::vector<Partition> parts(std::min(threads,
+                                          std::max(numBlocks, size_t(1))));
+    for (size_t i = 0; i < parts.size(); ++i) {
+        parts[i].log = &mapped;
+        parts[i].first = numBlocks * i / parts.size();
+        parts[i].last = numBlocks * (i + 1) / parts.size();
+    }
+    runPartitions(parts, checkBlocks);
+    size_t good = numBlocks;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (parts[i].bad < parts[i].last) {
+            good = parts[i].bad;
+            break;
+        }
+    }
+
+    // Every thread then replays all the good blocks for its own share of
+    // the vbuckets. The maps of the vbuckets are all created up front, so
+    // that the threads only ever look them up.
+    parts.resize(std::min(threads, std::max(vbid_set.size(), size_t(1))));
+    std::vector<int> owner(std::numeric_limits<uint16_t>::max() + 1, -1);
+    std::set<uint16_t>::const_iterator it = vbid_set.begin();
+    for (int n = 0; it != vbid_set.end(); ++it, ++n) {
+        owner[*it] = n % parts.size();
+        loading[*it];
+        committed[*it];
+    }
+    for (size_t i = 0; i < parts.size(); ++i) {
+        parts[i].harvester = this;
+        parts[i].log = &mapped;
+        parts[i].first = 0;
+        parts[i].last = good;
+        parts[i].id = i;
+        parts[i].owner = &owner;
+    }
+    runPartitions(parts, replayBlocks);
+
+    // Every thread saw every entry
+    memcpy(itemsSeen, parts[0].itemsSeen, sizeof(itemsSeen));
+
+    if (good < numBlocks) {
+        throw MutationLog::CRCReadException();
+    }
+    if (mapped.isTruncated()) {
+        LOG(EXTENSION_LOG_WARNING, "FATAL: too few bytes read in access log"
+            "'%s'", mlog.getLogFile().c_str());
+        throw MutationLog::ShortReadException();
+    }
+    return parts[0].clean;
+}
+
+void MutationLogHarvester::runPartitions(std::vector<Partition> &parts,
+                                         void (*fn)(void *)) {
+    if (parts.empty()) {
+        return;
+    }
+
+    // The calling thread takes the first partition, so that a single one
+    // (the default) doesn't start any thread
+    std::vector<Partition>::iterator it;
+    for (it = parts.begin() + 1; it != parts.end(); ++it) {
+        it->started = cb_create_thread(&it->thread, fn, &(*it), 0) == 0;
+        if (!it->started) {
+            fn(&(*it));
+        }
+    }
+    parts[0].started = false;
+    fn(&parts[0]);
+    for (it = parts.begin(); it != parts.end(); ++it) {
+        if (it->started) {
+            cb_join_thread(it->thread);
+        }
+    }
+}
+
+void MutationLogHarvester::checkBlocks(void *arg) {
+    Partition *part = static_cast<Partition*>(arg);
+    part->bad = part->first;
+    while (part->bad < part->last && part->log->checkBlock(part->bad)) {
+        ++part->bad;
+    }
+}
+
+void MutationLogHarvester::replayBlocks(void *arg) {
+    Partition *part = static_cast<Partition*>(arg);
+    part->harvester->replay(*part);
+}
+
+void MutationLogHarvester::replay(Partition &part) {
+    memset(part.itemsSeen, 0, sizeof(part.itemsSeen));
+    part.clean = false;
+    const std::vector<int> &owner = *part.owner;
+    std::vector<uint16_t> vbs;
+    std::set<uint16_t>::const_iterator vit;
+    for (vit = vbid_set.begin(); vit != vbid_set.end(); ++vit) {
+        if (owner[*vit] == part.id) {
+            vbs.push_back(*vit);
+        }
+    }
+
+    // The same as load() does, but for the vbuckets of the partition only
+    std::set<uint16_t> shouldClear;
+    MappedMutationLog::iterator it(*part.log, part.first, part.last);
+    const MutationLogEntry *le;
+    while ((le = it.next()) != NULL) {
+        ++part.itemsSeen[le->type()];
+        part.clean = false;
+
+        switch (le->type()) {
+        case ML_DEL:
+            // FALLTHROUGH
+        case ML_NEW:
+            if (owner[le->vbucket()] == part.id) {
+                loading.find(le->vbucket())->second[le->key()] =
+                                      std::make_pair(le->rowid(), le->type());
+            }
+            break;
+        case ML_COMMIT2: {
+            part.clean = true;
+            for (std::set<uint16_t>::iterator sit(shouldClear.begin());
+                 sit != shouldClear.end(); ++sit) {
+                committed.find(*sit)->second.clear();
+            }
+            shouldClear.clear();
+
+            std::vector<uint16_t>::iterator vbit;
+            for (vbit = vbs.begin(); vbit != vbs.end(); ++vbit) {
+                unordered_map<std::string, mutation_log_event_t> &l =
+                    loading.find(*vbit)->second;
+                unordered_map<std::string, uint64_t> &c =
+                    committed.find(*vbit)->second;
+
+                unordered_map<std::string, mutation_log_event_t>::iterator
+                              copyit2;
+                for (copyit2 = l.begin(); copyit2 != l.end(); ++copyit2) {
+                    mutation_log_event_t t = copyit2->second;
+
+                    switch (t.second) {
+                    case ML_NEW:
+                        c[copyit2->first] = t.first;
+                        break;
+                    case ML_DEL:
+                        c.erase(copyit2->first);
+                        break;
+                    default:
+                        abort();
+                    }
+                }
+                l.clear();
+            }
+        }
+            break;
+        case ML_COMMIT1:
+            // nothing in particular
+            break;
+        case ML_DEL_ALL:
+            if (owner[le->vbucket()] == part.id) {
+                loading.find(le->vbucket())->second.clear();
+                shouldClear.insert(le->vbucket());
+            }
+            break;
+        default:
+            abort();
+        }
+    }
+}
+
 void MutationLogHarvester::apply(void *arg, mlCallback mlc) {
     for (std::set<uint16_t>::const_iterator it = vbid_set.begin();
          it != vbid_set.end(); ++it) {
@@ -526,6 +526,81 @@ private:
     DISALLOW_COPY_AND_ASSIGN(MutationLog);
 };
 
+/**
+ * A MutationLog mapped in read only, so that its blocks can be checked and
+ * parsed in place, by several threads at once.
+ */
+class MappedMutationLog {
+public:
+    /**
+     * Iterates over the entries of a run of blocks, which have to have been
+     * checked already.
+     */
+    class iterator {
+    public:
+        iterator(const MappedMutationLog &log, size_t first, size_t last);
+
+        ~iterator();
+
+        /**
+         * Get the next entry, NULL past the last block.
+         */
+        const MutationLogEntry *next();
+
+    private:
+        const MappedMutationLog &log;
+        size_t block;
+        size_t last;
+        const uint8_t *p;
+        uint16_t items;
+        uint8_t *entryBuf;
+
+        DISALLOW_COPY_AND_ASSIGN(iterator);
+    };
+
+    MappedMutationLog(const MutationLog &log);
+
+    ~MappedMutationLog();
+
+    /**
+     * Map in the blocks of the log, which has to be open.
+     *
+     * @return false if the log could not be mapped in
+     */
+    bool open();
+
+    size_t getNumBlocks() const {
+        return numBlocks;
+    }
+
+    /**
+     * Whether the log ends in a partial block.
+     */
+    bool isTruncated() const {
+        return truncated;
+    }
+
+    /**
+     * Check a block against its checksum.
+     */
+    bool checkBlock(size_t n) const;
+
+private:
+    const uint8_t *getBlock(size_t n) const {
+        return addr + start + n * blockSize;
+    }
+
+    const std::string path;
+    const size_t blockSize;
+    const size_t start;
+    uint8_t *addr;
+    size_t size;
+    size_t numBlocks;
+    bool truncated;
+
+    DISALLOW_COPY_AND_ASSIGN(MappedMutationLog);
+};
+
 /// @cond DETAILS
 
 //! rowid, (uint8_t)mutation_log_type_t
@@ -574,9 +649,14 @@ public:
     /**
      * Load the entries from the file.
      *
+     * With more than one thread, the log is mapped in, its blocks checked
+     * by all the threads and its entries replayed by all of them, each for
+     * a share of the vbuckets.
+     *
+     * @param threads the number of threads to load the log with
      * @return true if the file was clean and can likely be trusted.
      */
-    bool load();
+    bool load(size_t threads = 1);
 
     /**
      * Apply the processed log entries through the given function.
@@ -603,6 +683,29 @@ public:
 
 private:
 
+    /* The share of the blocks or of the vbuckets of a thread */
+    struct Partition {
+        MutationLogHarvester *harvester;
+        const MappedMutationLog *log;
+        size_t first;
+        size_t last;
+        size_t bad;
+        int id;
+        const std::vector<int> *owner;
+        size_t itemsSeen[MUTATION_LOG_TYPES];
+        bool clean;
+        cb_thread_t thread;
+        bool started;
+    };
+
+    bool loadMapped(const MappedMutationLog &mapped, size_t threads);
+    void replay(Partition &part);
+
+    static void checkBlocks(void *arg);
+    static void replayBlocks(void *arg);
+    static void runPartitions(std::vector<Partition> &parts,
+                              void (*fn)(void *));
+
     MutationLog &mlog;
     EventuallyPersistentEngine *engine;
     std::set<uint16_t> vbid_set;
@@ -0,0 +1,196 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+
+#include "locks.h"
+#include "prefetcher.h"
+
+const size_t CoAccessTracker::WINDOW_SIZE = 4;
+const size_t CoAccessTracker::MAX_PEERS = 4;
+const uint32_t CoAccessTracker::MIN_COUNT = 2;
+const size_t CoAccessTracker::MAX_CONNECTIONS = 4096;
+const size_t CoAccessTracker::NUM_PARTITIONS = 16;
+
+/* Cookies are aligned pointers, mix the bits before using them */
+static uint64_t hashCookie(const void *cookie) {
+    uint64_t h = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(cookie));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+CoAccessTracker::CoAccessTracker(size_t keys, size_t rate) :
+    sampleRate(std::max(rate, static_cast<size_t>(1))),
+    numKeyPartitions(std::max(std::min(keys, NUM_PARTITIONS),
+                              static_cast<size_t>(1))),
+    keysPerPartition(std::max(keys / numKeyPartitions,
+                              static_cast<size_t>(1))),
+    keyPartitions(new KeyPartition[numKeyPartitions]),
+    windowPartitions(new WindowPartition[NUM_PARTITIONS]) {
+}
+
+CoAccessTracker::~CoAccessTracker() {
+    delete []keyPartitions;
+    delete []windowPartitions;
+}
+
+bool CoAccessTracker::isSampled(const void *cookie) const {
+    if (sampleRate == 1) {
+        return true;
+    }
+    return hashCookie(cookie) % sampleRate == 0;
+}
+
+void CoAccessTracker::accessed(const void *cookie, uint16_t vbid,
+                               const std::string &key) {
+    if (!isSampled(cookie)) {
+        return;
+    }
+
+    vb_key_t k(vbid, key);
+    std::vector<vb_key_t> seen;
+    // The high bits, the low ones picked the sampled connections
+    WindowPartition &wp =
+        windowPartitions[(hashCookie(cookie) >> 32) % NUM_PARTITIONS];
+    LockHolder lh(wp.mutex);
+    std::map<const void *, std::deque<vb_key_t> >::iterator wit;
+    wit = wp.windows.find(cookie);
+    if (wit == wp.windows.end()) {
+        if (wp.windows.size() >= MAX_CONNECTIONS / NUM_PARTITIONS) {
+            wp.windows.clear();
+        }
+        wit = wp.windows.insert(std::make_pair(cookie,
+                                               std::deque<vb_key_t>())).first;
+    }
+
+    std::deque<vb_key_t> &window = wit->second;
+    if (!window.empty() && window.back() == k) {
+        // the same get again, once its bg fetch completed
+        return;
+    }
+
+    std::deque<vb_key_t>::iterator it = window.begin();
+    for (; it != window.end(); ++it) {
+        if (*it != k) {
+            seen.push_back(*it);
+        }
+    }
+    window.push_back(k);
+    if (window.size() > WINDOW_SIZE) {
+        window.pop_front();
+    }
+    lh.unlock();
+
+    // Every pair only locks the partition of the key it is added to
+    std::vector<vb_key_t>::iterator sit = seen.begin();
+    for (; sit != seen.end(); ++sit) {
+        addPair(*sit, k);
+        addPair(k, *sit);
+    }
+}
+
+void CoAccessTracker::addPair(const vb_key_t &from, const vb_key_t &to) {
+    KeyPartition &kp = getKeyPartition(from.first);
+    LockHolder lh(kp.mutex);
+    std::map<vb_key_t, Entry>::iterator it = kp.keys.find(from);
+    if (it == kp.keys.end()) {
+        it = kp.keys.insert(std::make_pair(from, Entry())).first;
+        it->second.lruPos = kp.lru.insert(kp.lru.end(), from);
+        while (kp.keys.size() > keysPerPartition) {
+            kp.keys.erase(kp.lru.front());
+            kp.lru.pop_front();
+        }
+    } else {
+        kp.lru.splice(kp.lru.end(), kp.lru, it->second.lruPos);
+    }
+
+    std::vector<Peer> &list = it->second.peers;
+    std::vector<Peer>::iterator pit = list.begin();
+    for (; pit != list.end(); ++pit) {
+        if (pit->key == to) {
+            ++pit->count;
+            return;
+        }
+    }
+
+    if (list.size() < MAX_PEERS) {
+        Peer p;
+        p.key = to;
+        p.count = 1;
+        list.push_back(p);
+        return;
+    }
+
+    // No room: every peer loses a count, and those down to zero make room
+    // for the next newcomers
+    pit = list.begin();
+    while (pit != list.end()) {
+        if (--pit->count == 0) {
+            pit = list.erase(pit);
+        } else {
+            ++pit;
+        }
+    }
+}
+
+namespace {
+    struct PeerCountGreater {
+        bool operator()(const std::pair<uint32_t, vb_key_t> &a,
+                        const std::pair<uint32_t, vb_key_t> &b) const {
+            return a.first > b.first;
+        }
+    };
+}
+
+void CoAccessTracker::getPeers(uint16_t vbid, const std::string &key,
+                               size_t limit, std::vector<vb_key_t> &out) {
+    std::vector<std::pair<uint32_t, vb_key_t> > found;
+    KeyPartition &kp = getKeyPartition(vbid);
+    LockHolder lh(kp.mutex);
+    std::map<vb_key_t, Entry>::iterator it;
+    it = kp.keys.find(vb_key_t(vbid, key));
+    if (it == kp.keys.end()) {
+        return;
+    }
+    // A key read from disk is in use as much as one read by a client
+    kp.lru.splice(kp.lru.end(), kp.lru, it->second.lruPos);
+    std::vector<Peer>::iterator pit = it->second.peers.begin();
+    for (; pit != it->second.peers.end(); ++pit) {
+        if (pit->count >= MIN_COUNT) {
+            found.push_back(std::make_pair(pit->count, pit->key));
+        }
+    }
+    lh.unlock();
+
+    std::stable_sort(found.begin(), found.end(), PeerCountGreater());
+    for (size_t i = 0; i < found.size() && i < limit; ++i) {
+        out.push_back(found[i].second);
+    }
+}
+
+size_t CoAccessTracker::getNumKeys() {
+    size_t rv = 0;
+    for (size_t i = 0; i < numKeyPartitions; ++i) {
+        LockHolder lh(keyPartitions[i].mutex);
+        rv += keyPartitions[i].keys.size();
+    }
+    return rv;
+}
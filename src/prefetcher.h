@@ -0,0 +1,131 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_PREFETCHER_H_
+#define SRC_PREFETCHER_H_ 1
+
+#include "config.h"
+
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "mutex.h"
+
+/* a key and the vbucket it lives in */
+typedef std::pair<uint16_t, std::string> vb_key_t;
+
+/**
+ * A bounded sketch of the keys read together, learnt from the gets of a
+ * sample of the connections. Every get of a sampled connection is paired
+ * with the last few keys the connection read before it, and every key
+ * keeps the few peers it was paired with the most (a Misra-Gries summary,
+ * so a peer that stops showing up gets pushed out by new ones).
+ *
+ * The bg fetcher reads the peers of the keys it has to fetch in the same
+ * batch, so that the misses that would follow are already resident.
+ *
+ * The keys are partitioned by vbucket and the connections by cookie, each
+ * partition with a lock of its own, so that the gets of different
+ * connections don't serialize on a single lock.
+ */
+class CoAccessTracker {
+public:
+    /**
+     * @param maxKeys the keys to keep peers for, the least recently used
+     *                ones are dropped beyond that
+     * @param sampleRate learn from one connection in that many
+     */
+    CoAccessTracker(size_t maxKeys, size_t sampleRate);
+
+    ~CoAccessTracker();
+
+    /**
+     * A connection read a key.
+     */
+    void accessed(const void *cookie, uint16_t vbid, const std::string &key);
+
+    /**
+     * Get the peers of a key seen with it often enough to be worth a
+     * read, most frequent first.
+     *
+     * @param limit the most peers to return
+     */
+    void getPeers(uint16_t vbid, const std::string &key, size_t limit,
+                  std::vector<vb_key_t> &peers);
+
+    size_t getNumKeys();
+
+    /* the keys of a connection a get is paired with */
+    static const size_t WINDOW_SIZE;
+    /* the peers kept for every key */
+    static const size_t MAX_PEERS;
+    /* the times a pair has to be seen before the peer gets read */
+    static const uint32_t MIN_COUNT;
+    /* the connections whose last keys are remembered */
+    static const size_t MAX_CONNECTIONS;
+    /* the partitions of the keys and of the connections */
+    static const size_t NUM_PARTITIONS;
+
+private:
+    struct Peer {
+        vb_key_t key;
+        uint32_t count;
+    };
+
+    /* the peers of a key, and its place in the LRU order */
+    struct Entry {
+        std::vector<Peer> peers;
+        std::list<vb_key_t>::iterator lruPos;
+    };
+
+    /* the keys of the vbuckets mapped to the partition */
+    struct KeyPartition {
+        Mutex mutex;
+        std::map<vb_key_t, Entry> keys;
+        /* least recently used first */
+        std::list<vb_key_t> lru;
+    };
+
+    /* the last keys of the connections mapped to the partition */
+    struct WindowPartition {
+        Mutex mutex;
+        std::map<const void *, std::deque<vb_key_t> > windows;
+    };
+
+    bool isSampled(const void *cookie) const;
+    void addPair(const vb_key_t &from, const vb_key_t &to);
+
+    KeyPartition &getKeyPartition(uint16_t vbid) {
+        return keyPartitions[vbid % numKeyPartitions];
+    }
+
+    const size_t sampleRate;
+    const size_t numKeyPartitions;
+    const size_t keysPerPartition;
+
+    KeyPartition *keyPartitions;
+    WindowPartition *windowPartitions;
+
+    DISALLOW_COPY_AND_ASSIGN(CoAccessTracker);
+};
+
+#endif  // SRC_PREFETCHER_H_
@@ -29,6 +29,7 @@ const Priority Priority::VKeyStatBgFetcherPriority(
 
 // Priorities for Auxiliary IO tasks
 const Priority Priority::TapBgFetcherPriority("tap_bg_fetcher_priority", 1);
+const Priority Priority::FetchAllKeysPriority("fetch_all_keys_priority", 3);
 
 // Priorities for Read-Write IO tasks
 const Priority Priority::VBucketDeletionPriority(
@@ -38,12 +39,14 @@ const Priority Priority::VBucketPersistHighPriority(
                                            "vbucket_persist_high_priority", 2);
 const Priority Priority::FlushAllPriority("flush_all_priority", 3);
 const Priority Priority::FlusherPriority("flusher_priority", 5);
+const Priority Priority::FlushPreparePriority("flush_prepare_priority", 5);
 const Priority Priority::VBucketPersistLowPriority(
                                           "vbucket_persist_low_priority", 9);
 const Priority Priority::StatSnapPriority("statsnap_priority", 9);
 const Priority Priority::MutationLogCompactorPriority(
                                          "mutation_log_compactor_priority", 9);
 const Priority Priority::AccessScannerPriority("access_scanner_priority", 3);
+const Priority Priority::HTSnapshotPriority("hashtable_snapshot_priority", 5);
 
 // Priorities for NON-IO tasks
 const Priority Priority::PendingOpsPriority("pending_ops_priority", 0);
@@ -35,17 +35,20 @@ public:
     static const Priority TapBgFetcherPriority;
     static const Priority VKeyStatBgFetcherPriority;
     static const Priority WarmupPriority;
+    static const Priority FetchAllKeysPriority;
 
     // Priorities for Read-Write tasks
     static const Priority VBucketPersistHighPriority;
     static const Priority VBucketDeletionPriority;
     static const Priority FlusherPriority;
+    static const Priority FlushPreparePriority;
     static const Priority FlushAllPriority;
     static const Priority CompactorPriority;
     static const Priority VBucketPersistLowPriority;
     static const Priority StatSnapPriority;
     static const Priority MutationLogCompactorPriority;
     static const Priority AccessScannerPriority;
+    static const Priority HTSnapshotPriority;
 
     // Priorities for NON-IO tasks
     static const Priority TapConnNotificationPriority;
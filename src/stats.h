@@ -37,6 +37,18 @@
 
 static const hrtime_t ONE_SECOND(1000000);
 
+/**
+ * The classes the background reads are scheduled by, highest priority
+ * first.
+ */
+typedef enum {
+    BG_FETCH_FRONTEND,      //!< client gets, and the meta reads of mutations
+    BG_FETCH_GET_META,      //!< meta reads of XDCR (get/set/del with meta)
+    BG_FETCH_BACKFILL,      //!< TAP backfill of non-resident items
+    BG_FETCH_STATS,         //!< key and vkey stats
+    BG_FETCH_NUM_CLASSES
+} bg_fetch_class_t;
+
 /**
  * Global engine stats container.
  */
@@ -49,6 +61,9 @@ public:
         warmDups(0),
         warmOOM(0),
         warmupExpired(0),
+        warmupWindowGets(0),
+        warmupWindowMisses(0),
+        warmupWindowEnd(0),
         warmupMemUsedCap(0),
         warmupNumReadCap(0),
         tapThrottleWriteQueueCap(0),
@@ -57,6 +72,13 @@ public:
         flusherCommits(0),
         cumulativeFlushTime(0),
         cumulativeCommitTime(0),
+        flusherBatchesStaged(0),
+        flusherStagingWaits(0),
+        flusherBatchesCapped(0),
+        flusherRetries(0),
+        flusherDegradedTime(0),
+        groupCommits(0),
+        groupCommitSyncs(0),
         tooYoung(0),
         tooOld(0),
         totalPersisted(0),
@@ -103,8 +125,17 @@ public:
         pendingOpsMax(0),
         pendingOpsMaxDuration(0),
         pendingCompactions(0),
+        autoCompactions(0),
+        autoCompactionsRunning(0),
+        autoCompactionQueue(0),
         bg_fetched(0),
         bg_meta_fetched(0),
+        bgPrefetchIssued(0),
+        bgPrefetched(0),
+        bgPrefetchedBytes(0),
+        bgPrefetchHits(0),
+        bgPrefetchWasted(0),
+        bgPrefetchWastedBytes(0),
         numRemainingBgJobs(0),
         bgNumOperations(0),
         maxRemainingBgJobs(0),
@@ -149,7 +180,13 @@ public:
         diskCommitHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
         mlogCompactorHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
         timingLog(NULL),
-        maxDataSize(DEFAULT_MAX_DATA_SIZE) {}
+        maxDataSize(DEFAULT_MAX_DATA_SIZE) {
+        for (int i = 0; i < BG_FETCH_NUM_CLASSES; ++i) {
+            bgClassWaiting[i].store(0);
+            bgClassDeferred[i].store(0);
+            bgClassOverdue[i].store(0);
+        }
+    }
 
     ~EPStats() {
         delete timingLog;
@@ -196,6 +233,12 @@ public:
     AtomicValue<size_t> warmOOM;
     //! Number of expired keys during data loading
     AtomicValue<size_t> warmupExpired;
+    //! Number of gets in the first minutes of traffic after warmup
+    AtomicValue<size_t> warmupWindowGets;
+    //! Number of those gets that had to go to disk
+    AtomicValue<size_t> warmupWindowMisses;
+    //! The end of the window the gets after warmup are counted in
+    AtomicValue<rel_time_t> warmupWindowEnd;
 
     //! Fill % of memory used during warmup we're going to enable traffic
     AtomicValue<double> warmupMemUsedCap;
@@ -216,6 +259,20 @@ public:
     AtomicValue<size_t> cumulativeFlushTime;
     //! Total time spent committing.
     AtomicValue<size_t> cumulativeCommitTime;
+    //! Number of flush batches collected ahead of their commit.
+    AtomicValue<size_t> flusherBatchesStaged;
+    //! Number of times the flusher waited for a batch still being collected.
+    AtomicValue<size_t> flusherStagingWaits;
+    //! Number of flushes that left items behind for a later batch.
+    AtomicValue<size_t> flusherBatchesCapped;
+    //! Number of times the flusher backed off after a failed write.
+    AtomicValue<size_t> flusherRetries;
+    //! Time (in ms) the flushers spent retrying failed writes.
+    AtomicValue<size_t> flusherDegradedTime;
+    //! Number of group commits (deferred syncs issued together).
+    AtomicValue<size_t> groupCommits;
+    //! Number of vbucket files synced by group commits.
+    AtomicValue<size_t> groupCommitSyncs;
     //! Objects that were rejected from persistence for being too fresh.
     AtomicValue<size_t> tooYoung;
     //! Objects that were forced into persistence for being too old.
@@ -319,10 +376,31 @@ public:
     //! Number of pending vbucket compaction requests
     AtomicValue<size_t> pendingCompactions;
 
+    //! Number of compactions the engine scheduled by itself
+    AtomicValue<size_t> autoCompactions;
+
+    //! Number of those compactions not finished yet
+    AtomicValue<size_t> autoCompactionsRunning;
+
+    //! Fragmented vbuckets left waiting by the last check
+    AtomicValue<size_t> autoCompactionQueue;
+
     //! Number of times background fetches occurred.
     AtomicValue<size_t> bg_fetched;
     //! Number of times meta background fetches occurred.
     AtomicValue<size_t> bg_meta_fetched;
+    //! Reads of keys correlated with bg fetched ones added to the batches
+    AtomicValue<size_t> bgPrefetchIssued;
+    //! Values those reads made resident
+    AtomicValue<size_t> bgPrefetched;
+    //! Bytes of those values
+    AtomicValue<size_t> bgPrefetchedBytes;
+    //! Prefetched values a get used
+    AtomicValue<size_t> bgPrefetchHits;
+    //! Prefetched values ejected before any get used them
+    AtomicValue<size_t> bgPrefetchWasted;
+    //! Bytes of those values
+    AtomicValue<size_t> bgPrefetchWastedBytes;
     //! Number of remaining bg fetch jobs.
     AtomicValue<size_t> numRemainingBgJobs;
     //! The number of samples the bgWaitDelta and bgLoadDelta contains of
@@ -354,6 +432,17 @@ public:
     //! Histogram of background wait loads.
     Histogram<hrtime_t> bgLoadHisto;
 
+    //! Background reads of every class queued and not started yet
+    AtomicValue<size_t> bgClassWaiting[BG_FETCH_NUM_CLASSES];
+    //! Times a read of every class was held back for the other classes
+    AtomicValue<size_t> bgClassDeferred[BG_FETCH_NUM_CLASSES];
+    //! Reads of every class let through for having passed their deadline
+    AtomicValue<size_t> bgClassOverdue[BG_FETCH_NUM_CLASSES];
+    //! Histograms of the background wait times of every class
+    Histogram<hrtime_t> bgClassWaitHisto[BG_FETCH_NUM_CLASSES];
+    //! Histograms of the background load times of every class
+    Histogram<hrtime_t> bgClassLoadHisto[BG_FETCH_NUM_CLASSES];
+
     //! Max wall time of deleting a vbucket
     AtomicValue<hrtime_t> vbucketDelMaxWalltime;
     //! Total wall time of deleting vbuckets
@@ -482,6 +571,12 @@ public:
     //! Histogram of wait_for_checkpoint_persistence command
     Histogram<hrtime_t> chkPersistenceHisto;
 
+    //! Histogram of persistence waits served by the flusher's fast lane
+    Histogram<hrtime_t> persistWaitFastHisto;
+
+    //! Histogram of persistence waits served by the regular flusher round
+    Histogram<hrtime_t> persistWaitBulkHisto;
+
     //
     // DB timers.
     //
@@ -510,6 +605,15 @@ public:
     //! Historgram of batch reads
     Histogram<hrtime_t> getMultiHisto;
 
+    //! Histogram of the time the store took for a bg fetch batch
+    Histogram<hrtime_t> bgFetchBatchHisto;
+
+    //! Histogram of keys per bg fetch batch (all vbuckets of a shard)
+    Histogram<size_t> bgFetchBatchSizeHisto;
+
+    //! Histogram of items flushed per group commit
+    Histogram<size_t> groupCommitBatchHisto;
+
     //! Reset all stats to reasonable values.
     void reset() {
         tooYoung.store(0);
@@ -551,10 +655,17 @@ public:
 
         mlogCompactorRuns.store(0);
         alogRuns.store(0);
+        autoCompactions.store(0);
 
         pendingOpsHisto.reset();
         bgWaitHisto.reset();
         bgLoadHisto.reset();
+        for (int i = 0; i < BG_FETCH_NUM_CLASSES; ++i) {
+            bgClassDeferred[i].store(0);
+            bgClassOverdue[i].store(0);
+            bgClassWaitHisto[i].reset();
+            bgClassLoadHisto[i].reset();
+        }
         setWithMetaHisto.reset();
         tapBgWaitHisto.reset();
         tapBgLoadHisto.reset();
@@ -570,6 +681,8 @@ public:
         notifyIOHisto.reset();
         getStatsCmdHisto.reset();
         chkPersistenceHisto.reset();
+        persistWaitFastHisto.reset();
+        persistWaitBulkHisto.reset();
         diskInsertHisto.reset();
         diskUpdateHisto.reset();
         diskDelHisto.reset();
@@ -580,6 +693,9 @@ public:
         dirtyAgeHisto.reset();
         mlogCompactorHisto.reset();
         getMultiHisto.reset();
+        bgFetchBatchHisto.reset();
+        bgFetchBatchSizeHisto.reset();
+        groupCommitBatchHisto.reset();
     }
 
     // Used by stats logging infrastructure.
@@ -42,6 +42,11 @@ static ssize_t prime_size_table[] = {
 
 bool StoredValue::ejectValue(HashTable &ht, item_eviction_policy_t policy) {
     if (eligibleForEviction(policy)) {
+        if (prefetched) {
+            ++ht.stats.bgPrefetchWasted;
+            ht.stats.bgPrefetchWastedBytes.fetch_add(value->length());
+            prefetched = false;
+        }
         reduceCacheSize(ht, value->length());
         markNotResident();
         value = NULL;
@@ -157,6 +162,10 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
         }
     } else { // full eviction.
         if (vptr->eligibleForEviction(policy)) {
+            if (vptr->isPrefetched()) {
+                ++stats.bgPrefetchWasted;
+                stats.bgPrefetchWastedBytes.fetch_add(vptr->valuelen());
+            }
             StoredValue::reduceMetaDataSize(*this, stats,
                                             vptr->metaDataSize());
             StoredValue::reduceCacheSize(*this, vptr->size());
@@ -201,6 +201,7 @@ public:
         reduceCacheSize(ht, currSize);
         value = itm.getValue();
         deleted = false;
+        prefetched = false;
         flags = itm.getFlags();
         bySeqno = itm.getBySeqno();
 
@@ -449,6 +450,18 @@ public:
         newCacheItem = newitem;
     }
 
+    /**
+     * Return true if the value was read ahead of any get, and no get has
+     * used it yet.
+     */
+    bool isPrefetched(void) {
+        return prefetched;
+    }
+
+    void setPrefetched(bool prefetch) {
+        prefetched = prefetch;
+    }
+
     /**
      * Generate a new Item out of this object.
      *
@@ -491,6 +504,7 @@ private:
         exptime = itm.getExptime();
         deleted = false;
         newCacheItem = true;
+        prefetched = false;
         nru = INITIAL_NRU_VALUE;
         lock_expiry = 0;
         keylen = itm.getNKey();
@@ -522,6 +536,7 @@ private:
     bool               _isDirty  :  1; // 1 bit
     bool               deleted   :  1;
     bool               newCacheItem : 1;
+    bool               prefetched : 1; //!< Value read ahead, not used yet
     uint8_t            nru       :  2; //!< True if referenced since last sweep
     uint8_t            keylen;
     char               keybytes[1];    //!< The key itself.
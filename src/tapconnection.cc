@@ -958,12 +958,17 @@ bool TapProducer::waitForOpaqueMsgAck() {
 
 
 bool BGFetchCallback::run() {
+    EventuallyPersistentStore *epstore = epe->getEpStore();
+    cb_assert(epstore);
+    if (!epstore->getBgFetchScheduler().admit(BG_FETCH_BACKFILL, init)) {
+        snooze(BgFetchScheduler::retryInterval);
+        return true;
+    }
+
     hrtime_t start = gethrtime();
     RememberingCallback<GetValue> gcb;
 
     EPStats &stats = epe->getEpStats();
-    EventuallyPersistentStore *epstore = epe->getEpStore();
-    cb_assert(epstore);
 
     epstore->getROUnderlying(vbucket)->get(key, rowid, vbucket, gcb, true);
     gcb.waitForValue();
@@ -994,12 +999,14 @@ bool BGFetchCallback::run() {
         hrtime_t w = (start - init) / 1000;
         stats.tapBgWait.fetch_add(w);
         stats.tapBgWaitHisto.add(w);
+        stats.bgClassWaitHisto[BG_FETCH_BACKFILL].add(w);
         atomic_setIfLess(stats.tapBgMinWait, w);
         atomic_setIfBigger(stats.tapBgMaxWait, w);
 
         hrtime_t l = (stop - start) / 1000;
         stats.tapBgLoad.fetch_add(l);
         stats.tapBgLoadHisto.add(l);
+        stats.bgClassLoadHisto[BG_FETCH_BACKFILL].add(l);
         atomic_setIfLess(stats.tapBgMinLoad, l);
         atomic_setIfBigger(stats.tapBgMaxLoad, l);
     }
@@ -1028,6 +1035,7 @@ const char *TapProducer::opaqueCmdToString(uint32_t opaque_code) {
 }
 
 void TapProducer::queueBGFetch_UNLOCKED(const std::string &key, uint64_t id, uint16_t vb) {
+    engine().getEpStore()->getBgFetchScheduler().enqueue(BG_FETCH_BACKFILL);
     ExTask task = new BGFetchCallback(&engine(), getName(), key, vb, id,
                                       getConnectionToken(),
                                       Priority::TapBgFetcherPriority, 0);
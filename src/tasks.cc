@@ -19,6 +19,7 @@
 #include "bgfetcher.h"
 #include "ep_engine.h"
 #include "flusher.h"
+#include "htsnapshot.h"
 #include "tasks.h"
 #include "warmup.h"
 
@@ -40,18 +41,40 @@ bool FlusherTask::run() {
     return flusher->step(this);
 }
 
+bool FlushPrepareTask::run() {
+    return flusher->prepareStep(this);
+}
+
 bool VBSnapshotTask::run() {
     engine->getEpStore()->snapshotVBuckets(priority, shardID);
     return false;
 }
 
+bool HashTableSnapshotTask::run() {
+    bool success = snapshot.write(vbids);
+    cb.callback(success);
+    return false;
+}
+
 bool VBDeleteTask::run() {
     return !engine->getEpStore()->completeVBucketDeletion(vbucket, cookie,
                                                           recreate);
 }
 
 bool CompactVBucketTask::run() {
-    return engine->getEpStore()->compactVBucket(vbid, &compactCtx, cookie);
+    if (engine->getEpStore()->compactVBucket(vbid, &compactCtx, cookie)) {
+        // Another compaction of the vbucket is running, try again later
+        snooze(1);
+        return true;
+    }
+    return false;
+}
+
+bool AutoCompactionTask::run() {
+    engine->getEpStore()->scheduleAutoCompactions();
+    snooze(static_cast<double>(
+               engine->getConfiguration().getCompactionStime()));
+    return true;
 }
 
 bool StatSnap::run() {
@@ -69,13 +92,32 @@ bool BgFetcherTask::run() {
 
 
 bool VKeyStatBGFetchTask::run() {
-    engine->getEpStore()->completeStatsVKey(cookie, key, vbucket, bySeqNum);
+    EventuallyPersistentStore *store = engine->getEpStore();
+    if (!store->getBgFetchScheduler().admit(BG_FETCH_STATS, init)) {
+        snooze(BgFetchScheduler::retryInterval);
+        return true;
+    }
+
+    hrtime_t start = gethrtime();
+    store->completeStatsVKey(cookie, key, vbucket, bySeqNum);
+    hrtime_t stop = gethrtime();
+
+    EPStats &stats = engine->getEpStats();
+    if (stop >= start && start >= init) {
+        stats.bgClassWaitHisto[BG_FETCH_STATS].add((start - init) / 1000);
+        stats.bgClassLoadHisto[BG_FETCH_STATS].add((stop - start) / 1000);
+    }
     return false;
 }
 
 
 bool BGFetchTask::run() {
-    engine->getEpStore()->completeBGFetch(key, vbucket, seqNum, cookie, init,
-                                          metaFetch);
+    EventuallyPersistentStore *store = engine->getEpStore();
+    if (!store->getBgFetchScheduler().admit(fetchClass, init)) {
+        snooze(BgFetchScheduler::retryInterval);
+        return true;
+    }
+    store->completeBGFetch(key, vbucket, seqNum, cookie, init, metaFetch,
+                           fetchClass);
     return false;
 }
@@ -23,9 +23,12 @@
 #include <list>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "atomic.h"
+#include "callbacks.h"
 #include "priority.h"
+#include "stats.h"
 
 typedef enum {
     TASK_RUNNING,
@@ -37,6 +40,7 @@ class CompareTasksByDueDate;
 class CompareTasksByPriority;
 class EventuallyPersistentEngine;
 class Flusher;
+class HashTableSnapshot;
 class Warmup;
 
 /**
@@ -171,6 +175,32 @@ private:
     uint16_t shardID;
 };
 
+/**
+ * A task for collecting the next flush batch of a shard while its flusher
+ * task is committing the current one. It isn't serialized on the shard so
+ * that it can run alongside the flusher task.
+ */
+class FlushPrepareTask : public GlobalTask {
+public:
+    FlushPrepareTask(EventuallyPersistentEngine *e, Flusher* f,
+                     const Priority &p, uint16_t shardid,
+                     bool completeBeforeShutdown = false) :
+                     GlobalTask(e, p, INT_MAX, completeBeforeShutdown),
+                     flusher(f), shardID(shardid) {}
+
+    bool run();
+
+    std::string getDescription() {
+        std::stringstream ss;
+        ss<<"Collecting the next flush batch: shard "<<shardID;
+        return ss.str();
+    }
+
+private:
+    Flusher* flusher;
+    uint16_t shardID;
+};
+
 /**
  * A task for persisting VBucket state changes to disk and creating a new
  * VBucket database files.
@@ -196,6 +226,33 @@ private:
     uint16_t shardID;
 };
 
+/**
+ * A task writing the snapshot of the hash tables of a shard's vbuckets on a
+ * graceful shutdown, and passing on whether it succeeded.
+ */
+class HashTableSnapshotTask : public GlobalTask {
+public:
+    HashTableSnapshotTask(EventuallyPersistentEngine *e, HashTableSnapshot &s,
+                          const std::vector<uint16_t> &vbs, Callback<bool> &c,
+                          uint16_t sID) :
+        GlobalTask(e, Priority::HTSnapshotPriority), snapshot(s), vbids(vbs),
+        cb(c), shardID(sID) { }
+
+    bool run();
+
+    std::string getDescription() {
+        std::stringstream ss;
+        ss << "Writing the hash table snapshot of shard " << shardID;
+        return ss.str();
+    }
+
+private:
+    HashTableSnapshot &snapshot;
+    std::vector<uint16_t> vbids;
+    Callback<bool> &cb;
+    uint16_t shardID;
+};
+
 /**
  * A task for deleting VBucket files from disk and cleaning up any outstanding
  * writes for that VBucket file.
@@ -249,6 +306,22 @@ private:
     const void* cookie;
 };
 
+/**
+ * A task that periodically looks for fragmented vbucket files and schedules
+ * their compaction.
+ */
+class AutoCompactionTask : public GlobalTask {
+public:
+    AutoCompactionTask(EventuallyPersistentEngine *e, double sleeptime) :
+        GlobalTask(e, Priority::CompactorPriority, sleeptime, false) { }
+
+    bool run();
+
+    std::string getDescription() {
+        return std::string("Scheduling compaction of fragmented vbuckets");
+    }
+};
+
 /**
  * A task that periodically takes a snapshot of the stats and persists them to
  * disk.
@@ -300,7 +373,7 @@ public:
                         const Priority &p, int sleeptime = 0,
                         bool shutdown = false) :
         GlobalTask(e, p, sleeptime, shutdown), key(k),
-                   vbucket(vbid), bySeqNum(s), cookie(c) { }
+                   vbucket(vbid), bySeqNum(s), cookie(c), init(gethrtime()) { }
 
     bool run();
 
@@ -316,6 +389,7 @@ private:
     uint16_t                         vbucket;
     uint64_t                         bySeqNum;
     const void                      *cookie;
+    hrtime_t                         init;
 };
 
 /**
@@ -325,9 +399,11 @@ class BGFetchTask : public GlobalTask {
 public:
     BGFetchTask(EventuallyPersistentEngine *e, const std::string &k,
             uint16_t vbid, uint64_t s, const void *c, bool isMeta,
-            const Priority &p, int sleeptime = 0, bool shutdown = false) :
+            bg_fetch_class_t cls, const Priority &p, int sleeptime = 0,
+            bool shutdown = false) :
         GlobalTask(e, p, sleeptime, shutdown), key(k), vbucket(vbid),
-        seqNum(s), cookie(c), metaFetch(isMeta), init(gethrtime()) { }
+        seqNum(s), cookie(c), metaFetch(isMeta), fetchClass(cls),
+        init(gethrtime()) { }
 
     bool run();
 
@@ -343,6 +419,7 @@ private:
     uint64_t                   seqNum;
     const void                *cookie;
     bool                       metaFetch;
+    bg_fetch_class_t           fetchClass;
     hrtime_t                   init;
 };
 
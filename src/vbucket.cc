@@ -130,6 +130,7 @@ VBucket::~VBucket() {
         std::list<VBucketBGFetchItem *> &bgitems = itr->second;
         std::list<VBucketBGFetchItem *>::iterator vit = bgitems.begin();
         for (; vit != bgitems.end(); ++vit) {
+            --stats.bgClassWaiting[(*vit)->fetchClass];
             delete (*vit);
             ++num_pending_fetches;
         }
@@ -303,6 +304,11 @@ void VBucket::notifyCheckpointPersisted(EventuallyPersistentEngine &e,
         if (entry->id <= idNum) {
             e.notifyIOComplete(entry->cookie, ENGINE_SUCCESS);
             stats.chkPersistenceHisto.add(wall_time / 1000);
+            if (entry->fastLane) {
+                stats.persistWaitFastHisto.add(wall_time / 1000);
+            } else {
+                stats.persistWaitBulkHisto.add(wall_time / 1000);
+            }
             adjustCheckpointFlushTimeout(wall_time / 1000000000);
             LOG(EXTENSION_LOG_WARNING, "Notified the completion of checkpoint "
                 "persistence for vbucket %d, cookie %p", id, entry->cookie);
@@ -357,6 +363,14 @@ size_t VBucket::getHighPriorityChkSize() {
     return numHpChks;
 }
 
+void VBucket::markHighPriorityFastLane() {
+    LockHolder lh(hpChksMutex);
+    std::list<HighPriorityVBEntry>::iterator entry = hpChks.begin();
+    for (; entry != hpChks.end(); ++entry) {
+        entry->fastLane = true;
+    }
+}
+
 size_t VBucket::getCheckpointFlushTimeout() {
     return chkFlushTimeout;
 }
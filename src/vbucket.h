@@ -39,14 +39,18 @@ const size_t MAX_CHK_FLUSH_TIMEOUT = 30; // 30 sec.
 
 struct HighPriorityVBEntry {
     HighPriorityVBEntry() :
-        cookie(NULL), id(0), start(gethrtime()), isBySeqno_(false) { }
+        cookie(NULL), id(0), start(gethrtime()), isBySeqno_(false),
+        fastLane(false) { }
     HighPriorityVBEntry(const void *c, uint64_t idNum, bool isBySeqno) :
-        cookie(c), id(idNum), start(gethrtime()), isBySeqno_(isBySeqno) { }
+        cookie(c), id(idNum), start(gethrtime()), isBySeqno_(isBySeqno),
+        fastLane(false) { }
 
     const void *cookie;
     uint64_t id;
     hrtime_t start;
     bool isBySeqno_;
+    // True once the flusher has picked up the vbucket for this entry
+    bool fastLane;
 };
 
 /**
@@ -324,6 +328,7 @@ public:
     void notifyCheckpointPersisted(EventuallyPersistentEngine &e, uint64_t id, bool isBySeqno);
     void notifyAllPendingConnsFailed(EventuallyPersistentEngine &e);
     size_t getHighPriorityChkSize();
+    void markHighPriorityFastLane();
     static size_t getCheckpointFlushTimeout();
 
     void addStats(bool details, ADD_STAT add_stat, const void *c,
@@ -17,15 +17,19 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <limits>
 #include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "access_log.h"
 #include "ep_engine.h"
 #include "failover-table.h"
+#include "kvstore.h"
 #define STATWRITER_NAMESPACE warmup
 #include "statwriter.h"
 #undef STATWRITER_NAMESPACE
@@ -34,12 +38,15 @@
 #include "warmup.h"
 
 struct WarmupCookie {
-    WarmupCookie(EventuallyPersistentStore *s, Callback<GetValue>&c) :
-        cb(c), epstore(s),
+    WarmupCookie(EventuallyPersistentStore *s, Callback<GetValue>&c,
+                 KVStore *kv = NULL) :
+        cb(c), epstore(s), kvstore(kv),
         loaded(0), skipped(0), error(0)
     { /* EMPTY */ }
     Callback<GetValue> &cb;
     EventuallyPersistentStore *epstore;
+    /* the store to read from, the vbucket's own if NULL */
+    KVStore *kvstore;
     size_t loaded;
     size_t skipped;
     size_t error;
@@ -65,7 +72,11 @@ static bool batchWarmupCallback(uint16_t vbId,
             items2fetch[(*itm).first].push_back(fit);
         }
 
-        c->epstore->getROUnderlying(vbId)->getMulti(vbId, items2fetch);
+        KVStore *kvstore = c->kvstore;
+        if (kvstore == NULL) {
+            kvstore = c->epstore->getROUnderlying(vbId);
+        }
+        kvstore->getMulti(vbId, items2fetch);
 
         vb_bgfetch_queue_t::iterator items = items2fetch.begin();
         for (; items != items2fetch.end(); items++) {
@@ -128,6 +139,9 @@ const int WarmupState::LoadingAccessLog = 5;
 const int WarmupState::LoadingKVPairs = 6;
 const int WarmupState::LoadingData = 7;
 const int WarmupState::Done = 8;
+const int WarmupState::LoadingSnapshot = 9;
+
+const double Warmup::pauseSleepTime = 0.1;
 
 const char *WarmupState::toString(void) const {
     return getStateDescription(state);
@@ -153,6 +167,8 @@ const char *WarmupState::getStateDescription(int st) const {
         return "loading data";
     case Done:
         return "done";
+    case LoadingSnapshot:
+        return "loading hash table snapshot";
     default:
         return "Illegal state";
     }
@@ -181,7 +197,10 @@ bool WarmupState::legalTransition(int to) const {
     case CreateVBuckets:
         return (to == EstimateDatabaseItemCount);
     case EstimateDatabaseItemCount:
-        return (to == KeyDump || to == CheckForAccessLog);
+        return (to == KeyDump || to == CheckForAccessLog ||
+                to == LoadingSnapshot);
+    case LoadingSnapshot:
+        return (to == Done || to == KeyDump || to == CheckForAccessLog);
     case KeyDump:
         return (to == LoadingKVPairs || to == CheckForAccessLog);
     case CheckForAccessLog:
@@ -269,6 +288,10 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                                 NULL);
         }
 
+        if (vbLoaded) {
+            ++vbLoaded[i->getVBucketId()];
+        }
+
         delete i;
         val.setValue(NULL);
 
@@ -361,7 +384,9 @@ void LoadValueCallback::callback(CacheLookup &lookup)
 
 Warmup::Warmup(EventuallyPersistentStore *st) :
     state(), store(st), startTime(0), metadata(0), warmup(0),
-    threadtask_count(0),
+    threadtask_count(0), snapshotTime(0), accessLogTasks(0),
+    accessLogStart(0), stopLoading(false),
+    vbucketsLoaded(0), vbucketsReadable(0),
     estimateTime(0), estimatedItemCount(std::numeric_limits<size_t>::max()),
     cleanShutdown(true), corruptAccessLog(false), warmupComplete(false),
     estimatedWarmupCount(std::numeric_limits<size_t>::max())
@@ -369,16 +394,47 @@ Warmup::Warmup(EventuallyPersistentStore *st) :
     shardVbStates = new std::map<uint16_t, vbucket_state>[
                                                        store->vbMap.numShards];
     shardVbIds = new std::vector<uint16_t>[store->vbMap.numShards];
+    shardPendingVbs = new std::deque<uint16_t>[store->vbMap.numShards];
+    shardPendingSections =
+        new std::deque<const AccessLogSection *>[store->vbMap.numShards];
     shardKeyDumpStatus = new bool[store->vbMap.numShards];
+    shardSnapshotStatus = new ht_snapshot_load_t[store->vbMap.numShards];
+    shardAccessLogs = new AccessLogReader*[store->vbMap.numShards];
     for (size_t i = 0; i < store->vbMap.numShards; i++) {
         shardKeyDumpStatus[i] = false;
+        shardSnapshotStatus[i] = HT_SNAPSHOT_MISSING;
+        shardAccessLogs[i] = NULL;
+    }
+
+    Configuration &config = store->getEPEngine().getConfiguration();
+    maxVbuckets = config.getMaxVbuckets();
+    progressive = config.isWarmupProgressive();
+    vbLoadState = new vbucket_load_state_t[maxVbuckets];
+    vbLoaded = new AtomicValue<size_t>[maxVbuckets];
+    vbReadable = new AtomicValue<bool>[maxVbuckets];
+    vbRequests = new AtomicValue<size_t>[maxVbuckets];
+    for (size_t i = 0; i < maxVbuckets; ++i) {
+        vbLoadState[i] = VB_LOAD_NONE;
+        vbLoaded[i] = 0;
+        vbReadable[i] = false;
+        vbRequests[i] = 0;
     }
 }
 
 Warmup::~Warmup() {
+    releaseLoaders();
+    releaseAccessLogs();
     delete [] shardVbStates;
     delete [] shardVbIds;
+    delete [] shardPendingVbs;
+    delete [] shardPendingSections;
     delete [] shardKeyDumpStatus;
+    delete [] shardSnapshotStatus;
+    delete [] shardAccessLogs;
+    delete [] vbLoadState;
+    delete [] vbLoaded;
+    delete [] vbReadable;
+    delete [] vbRequests;
 }
 
 void Warmup::setEstimatedItemCount(size_t to)
@@ -476,6 +532,12 @@ void Warmup::createVBuckets(uint16_t shardId) {
             store->vbMap.addBucket(vb);
         }
 
+        // Under full eviction the keys not in memory yet are read from
+        // disk on demand anyway
+        if (store->getItemEvictionPolicy() == FULL_EVICTION) {
+            markReadable(vbid);
+        }
+
         // Pass the open checkpoint Id for each vbucket.
         vb->checkpointManager.setOpenCheckpointId(vbs.checkpointId + 1);
         // Pass the max deleted seqno for each vbucket.
@@ -525,17 +587,94 @@ void Warmup::estimateDatabaseItemCount(uint16_t shardId)
     estimateTime.fetch_add(gethrtime() - st);
 
     if (++threadtask_count == store->vbMap.numShards) {
-        if (store->getItemEvictionPolicy() == VALUE_ONLY) {
-            transition(WarmupState::KeyDump);
+        if (store->getEPEngine().getConfiguration().isWarmupSnapshot()) {
+            transition(WarmupState::LoadingSnapshot);
         } else {
-            transition(WarmupState::CheckForAccessLog);
+            transitionToLoadKeys();
+        }
+    }
+}
+
+void Warmup::transitionToLoadKeys()
+{
+    if (store->getItemEvictionPolicy() == VALUE_ONLY) {
+        transition(WarmupState::KeyDump);
+    } else {
+        transition(WarmupState::CheckForAccessLog);
+    }
+}
+
+void Warmup::scheduleLoadingSnapshot()
+{
+    threadtask_count = 0;
+    for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
+        ExTask task = new WarmupLoadSnapshot(*store, this, i,
+                                             Priority::WarmupPriority);
+        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+    }
+}
+
+void Warmup::loadingSnapshot(uint16_t shardId)
+{
+    hrtime_t st = gethrtime();
+    HashTableSnapshot snapshot(*store, store->getHashTableSnapshotPath(shardId));
+    size_t keys = 0;
+    size_t values = 0;
+    shardSnapshotStatus[shardId] = snapshot.load(shardVbIds[shardId],
+                                                 shardVbStates[shardId],
+                                                 keys, values);
+    // Whatever happens now, the data files are the ones to trust
+    snapshot.remove();
+
+    EPStats &stats = store->getEPEngine().getEpStats();
+    stats.warmedUpKeys.fetch_add(keys);
+    stats.warmedUpValues.fetch_add(values);
+    snapshotTime.fetch_add(gethrtime() - st);
+
+    if (++threadtask_count != store->vbMap.numShards) {
+        return;
+    }
+
+    for (size_t i = 0; i < store->vbMap.numShards; i++) {
+        if (shardSnapshotStatus[i] != HT_SNAPSHOT_LOADED) {
+            LOG(EXTENSION_LOG_WARNING, "Hash table snapshot of shard %d %s, "
+                "warming up from the data files", static_cast<int>(i),
+                HashTableSnapshot::getLoadResult(shardSnapshotStatus[i]));
+
+            // Start over from empty hash tables
+            std::map<uint16_t, vbucket_state>::iterator it;
+            for (it = allVbStates.begin(); it != allVbStates.end(); ++it) {
+                RCPtr<VBucket> vb = store->getVBucket(it->first);
+                if (vb) {
+                    size_t numTotal = vb->ht.numTotalItems;
+                    vb->ht.clear();
+                    vb->ht.numTotalItems = numTotal;
+                }
+            }
+            stats.warmedUpKeys = 0;
+            stats.warmedUpValues = 0;
+            transitionToLoadKeys();
+            return;
         }
     }
+
+    metadata = gethrtime() - startTime;
+    LOG(EXTENSION_LOG_WARNING, "%ld keys and %ld values loaded from the hash "
+        "table snapshots in %s", stats.warmedUpKeys.load(),
+        stats.warmedUpValues.load(),
+        hrtime2text(snapshotTime.load() / store->vbMap.numShards).c_str());
+    transition(WarmupState::Done);
 }
 
 void Warmup::scheduleKeyDump()
 {
     threadtask_count = 0;
+    LockHolder lh(loadMutex);
+    for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
+        shardPendingVbs[i].assign(shardVbIds[i].begin(), shardVbIds[i].end());
+    }
+    lh.unlock();
+
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
         ExTask task = new WarmupKeyDump(*store, this,
                                         i, Priority::WarmupPriority);
@@ -544,14 +683,34 @@ void Warmup::scheduleKeyDump()
 
 }
 
-void Warmup::keyDumpforShard(uint16_t shardId)
+bool Warmup::keyDumpforShard(uint16_t shardId)
 {
-    if (store->getROUnderlyingByShard(shardId)->isKeyDumpSupported()) {
+    KVStore *kvstore = store->getROUnderlyingByShard(shardId);
+    if (kvstore->isKeyDumpSupported()) {
         LoadStorageKVPairCallback *load_cb =
             new LoadStorageKVPairCallback(store, false, state.getState());
         shared_ptr<Callback<GetValue> > cb(load_cb);
-        store->getROUnderlyingByShard(shardId)->dumpKeys(shardVbIds[shardId],
-                                      cb);
+        if (progressive) {
+            // One vbucket per run, so that each can be read as soon as
+            // its keys are in and the ones asked for go first
+            LockHolder lh(loadMutex);
+            std::deque<uint16_t> &pending = shardPendingVbs[shardId];
+            if (!pending.empty()) {
+                uint16_t vbid = pending.front();
+                pending.pop_front();
+                lh.unlock();
+                std::vector<uint16_t> vbs(1, vbid);
+                kvstore->dumpKeys(vbs, cb);
+                markReadable(vbid);
+                return true;
+            }
+        } else {
+            kvstore->dumpKeys(shardVbIds[shardId], cb);
+            std::vector<uint16_t>::iterator it = shardVbIds[shardId].begin();
+            for (; it != shardVbIds[shardId].end(); ++it) {
+                markReadable(*it);
+            }
+        }
         shardKeyDumpStatus[shardId] = true;
     }
 
@@ -576,6 +735,7 @@ void Warmup::keyDumpforShard(uint16_t shardId)
             transition(WarmupState::LoadingKVPairs);
         }
     }
+    return false;
 }
 
 void Warmup::scheduleCheckForAccessLog()
@@ -617,13 +777,211 @@ void Warmup::checkForAccessLog()
 
 }
 
+static bool hotterSection(const AccessLogSection *a,
+                          const AccessLogSection *b)
+{
+    return a->nru < b->nru;
+}
+
+class SectionOfVBucket {
+public:
+    SectionOfVBucket(uint16_t vb) : vbid(vb) { }
+
+    bool operator()(const AccessLogSection *section) const {
+        return section->vbid == vbid;
+    }
+
+private:
+    uint16_t vbid;
+};
+
 void Warmup::scheduleLoadingAccessLog()
 {
+    Configuration &config = store->getEPEngine().getConfiguration();
+    EPStats &stats = store->getEPEngine().getEpStats();
+    size_t concurrency = std::max(config.getWarmupConcurrency(),
+                                  static_cast<size_t>(1));
+
+    // A v1 log is read whole by a task of its own, the sections of a v2 log
+    // are spread over a few tasks, each reading through a KVStore of its own
+    LockHolder lh(loadMutex);
+    releaseLoaders();
+    stopLoading = false;
     threadtask_count = 0;
+    accessLogStart = gethrtime();
+    size_t estimate = 0;
+    bool hasSections = false;
+    std::vector<ExTask> tasks;
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadAccessLog(*store, this, i,
-                Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        bool v2 = false;
+        AccessLogReader *alog = openAccessLog(i, v2);
+        if (!v2) {
+            tasks.push_back(new WarmupLoadAccessLog(*store, this, i,
+                                                Priority::WarmupPriority));
+            continue;
+        }
+
+        shardAccessLogs[i] = alog;
+        std::deque<const AccessLogSection *> &pending =
+            shardPendingSections[i];
+        pending.clear();
+        if (alog != NULL) {
+            std::set<uint16_t> vbs(shardVbIds[i].begin(),
+                                   shardVbIds[i].end());
+            const std::vector<AccessLogSection> &sections =
+                alog->getSections();
+            std::vector<AccessLogSection>::const_iterator it;
+            for (it = sections.begin(); it != sections.end(); ++it) {
+                if (it->numKeys > 0 && vbs.find(it->vbid) != vbs.end()) {
+                    pending.push_back(&(*it));
+                    estimate += it->numKeys;
+                }
+            }
+            // The hottest keys first, so that what is loaded before the
+            // memory threshold is reached is what was used the most
+            std::stable_sort(pending.begin(), pending.end(), hotterSection);
+            hasSections = true;
+        }
+
+        size_t numLoaders = std::min(concurrency, pending.size());
+        for (size_t j = 0; j < numLoaders; ++j) {
+            VBucketLoader loader;
+            if (j == 0) {
+                loader.kvstore = store->getROUnderlyingByShard(i);
+                loader.ownsStore = false;
+            } else {
+                loader.kvstore = KVStoreFactory::create(stats, config, true);
+                loader.ownsStore = true;
+            }
+            loader.cb.reset(new LoadStorageKVPairCallback(store, true,
+                                                          state.getState()));
+            tasks.push_back(new WarmupLoadAccessLogSections(*store, this, i,
+                                                  loaders.size(),
+                                                  Priority::WarmupPriority));
+            loaders.push_back(loader);
+        }
+    }
+    if (hasSections) {
+        setEstimatedWarmupCount(estimate);
+    }
+    accessLogTasks = tasks.size();
+    lh.unlock();
+
+    if (tasks.empty()) {
+        completeLoadingAccessLog();
+        return;
+    }
+    std::vector<ExTask>::iterator it = tasks.begin();
+    for (; it != tasks.end(); ++it) {
+        ExecutorPool::get()->schedule(*it, READER_TASK_IDX);
+    }
+}
+
+AccessLogReader *Warmup::openAccessLog(uint16_t shardId, bool &v2)
+{
+    std::string path = store->accessLog[shardId]->getLogFile();
+    for (int i = 0; i < 2; ++i, path.append(".old")) {
+        if (access(path.c_str(), F_OK) != 0) {
+            continue;
+        }
+        if (!AccessLogReader::isAccessLog(path)) {
+            // Left for MutationLogHarvester to read, unless the current
+            // log is a v2 one we failed to read
+            return NULL;
+        }
+        v2 = true;
+        AccessLogReader *alog = new AccessLogReader(path);
+        if (alog->open()) {
+            return alog;
+        }
+        corruptAccessLog = true;
+        LOG(EXTENSION_LOG_WARNING, "Error reading warmup access log: %s",
+            path.c_str());
+        delete alog;
+    }
+    return NULL;
+}
+
+bool Warmup::loadAccessLogSections(uint16_t shardId, size_t loader)
+{
+    LockHolder lh(loadMutex);
+    std::deque<const AccessLogSection *> &pending =
+        shardPendingSections[shardId];
+    if (!stopLoading && !pending.empty()) {
+        const AccessLogSection *section = pending.front();
+        uint16_t vbid = section->vbid;
+        pending.pop_front();
+        VBucketLoader &ld = loaders[loader];
+        lh.unlock();
+
+        // The keys are streamed into batches of the size of a warmup batch,
+        // fetched in the order they are in the data file
+        AccessLogReader *alog = shardAccessLogs[shardId];
+        AccessLogReader::Cursor cursor(*alog, *section);
+        size_t batchSize =
+            store->getEPEngine().getConfiguration().getWarmupBatchSize();
+        WarmupCookie cookie(store, *ld.cb, ld.kvstore);
+        std::vector<std::pair<std::string, uint64_t> > batch;
+        std::string key;
+        bool more = true;
+        while (more && cursor.next(key)) {
+            batch.push_back(std::make_pair(key, 0));
+            if (batch.size() >= batchSize) {
+                more = batchWarmupCallback(vbid, batch, &cookie);
+                batch.clear();
+            }
+        }
+        if (more && !batch.empty()) {
+            more = batchWarmupCallback(vbid, batch, &cookie);
+        }
+
+        if (cursor.isCorrupt()) {
+            corruptAccessLog = true;
+            LOG(EXTENSION_LOG_WARNING, "Damaged section of vbucket %d "
+                "(nru %d) in access log %s, %d items loaded from it", vbid,
+                section->nru, alog->getPath().c_str(), cookie.loaded);
+        }
+
+        lh.lock();
+        if (!more) {
+            stopLoading = true;
+        }
+        return true;
+    }
+    pending.clear();
+
+    if (++threadtask_count == accessLogTasks) {
+        lh.unlock();
+        completeLoadingAccessLog();
+    }
+    return false;
+}
+
+void Warmup::completeLoadingAccessLog()
+{
+    LockHolder lh(loadMutex);
+    releaseLoaders();
+    releaseAccessLogs();
+    lh.unlock();
+
+    LOG(EXTENSION_LOG_WARNING,
+        "%d items loaded from access logs, completed in %s",
+        store->getEPEngine().getEpStats().warmedUpValues.load(),
+        hrtime2text(gethrtime() - accessLogStart).c_str());
+
+    if (!store->maybeEnableTraffic()) {
+        transition(WarmupState::LoadingData);
+    } else {
+        transition(WarmupState::Done);
+    }
+}
+
+void Warmup::releaseAccessLogs()
+{
+    for (size_t i = 0; i < store->vbMap.numShards; i++) {
+        shardPendingSections[i].clear();
+        delete shardAccessLogs[i];
+        shardAccessLogs[i] = NULL;
     }
 }
 
@@ -679,14 +1037,8 @@ void Warmup::loadingAccessLog(uint16_t shardId)
     }
 
     delete load_cb;
-    if (++threadtask_count == store->vbMap.numShards) {
-        if (!store->maybeEnableTraffic()) {
-            transition(WarmupState::LoadingData);
-        }
-        else {
-            transition(WarmupState::Done);
-        }
-
+    if (++threadtask_count == accessLogTasks) {
+        completeLoadingAccessLog();
     }
 }
 
@@ -700,7 +1052,9 @@ size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
     }
 
     hrtime_t st = gethrtime();
-    if (!harvester.load()) {
+    size_t threads =
+        store->getEPEngine().getConfiguration().getAlogLoadThreads();
+    if (!harvester.load(threads)) {
         return -1;
     }
     hrtime_t end = gethrtime();
@@ -726,60 +1080,231 @@ size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
 }
 
 void Warmup::scheduleLoadingKVPairs()
-{
-    threadtask_count = 0;
-    for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingKVPairs(*store, this,
-                                               i, Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
-    }
-
-}
-
-void Warmup::loadKVPairsforShard(uint16_t shardId)
 {
     bool maybe_enable_traffic = false;
     if (store->getItemEvictionPolicy() == FULL_EVICTION) {
         maybe_enable_traffic = true;
     }
+    scheduleLoadingVBuckets(false, maybe_enable_traffic);
+}
 
-    LoadStorageKVPairCallback *load_cb =
-        new LoadStorageKVPairCallback(store, maybe_enable_traffic,
-                                      state.getState());
-    shared_ptr<Callback<GetValue> > cb(load_cb);
-    shared_ptr<Callback<CacheLookup> >
-        cl(new LoadValueCallback(store->vbMap, state.getState()));
-    store->getROUnderlyingByShard(shardId)->dump(shardVbIds[shardId], cb, cl);
-    if (++threadtask_count == store->vbMap.numShards) {
-        transition(WarmupState::Done);
-    }
+bool Warmup::loadKVPairsforShard(uint16_t shardId, size_t loader)
+{
+    return loadVBucket(shardId, loader);
 }
 
 void Warmup::scheduleLoadingData()
 {
     size_t estimatedCount = store->getEPEngine().getEpStats().warmedUpKeys;
     setEstimatedWarmupCount(estimatedCount);
+    scheduleLoadingVBuckets(true, true);
+}
+
+bool Warmup::loadDataforShard(uint16_t shardId, size_t loader)
+{
+    return loadVBucket(shardId, loader);
+}
+
+void Warmup::scheduleLoadingVBuckets(bool data, bool maybeEnableTraffic)
+{
+    Configuration &config = store->getEPEngine().getConfiguration();
+    EPStats &stats = store->getEPEngine().getEpStats();
+    size_t concurrency = std::max(config.getWarmupConcurrency(),
+                                  static_cast<size_t>(1));
+
+    LockHolder lh(loadMutex);
+    releaseLoaders();
+    stopLoading = false;
+    vbucketsLoaded = 0;
+    for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
+        shardPendingVbs[i].assign(shardVbIds[i].begin(), shardVbIds[i].end());
+        std::vector<uint16_t>::iterator it = shardVbIds[i].begin();
+        for (; it != shardVbIds[i].end(); ++it) {
+            vbLoadState[*it] = VB_LOAD_PENDING;
+            vbLoaded[*it] = 0;
+        }
+
+        // No point in more loaders than vbuckets
+        size_t numLoaders = std::min(concurrency, shardVbIds[i].size());
+        numLoaders = std::max(numLoaders, static_cast<size_t>(1));
+        for (size_t j = 0; j < numLoaders; ++j) {
+            VBucketLoader loader;
+            if (j == 0) {
+                loader.kvstore = store->getROUnderlyingByShard(i);
+                loader.ownsStore = false;
+            } else {
+                loader.kvstore = KVStoreFactory::create(stats, config, true);
+                loader.ownsStore = true;
+            }
+            loader.cb.reset(new LoadStorageKVPairCallback(store,
+                                                          maybeEnableTraffic,
+                                                          state.getState(),
+                                                          vbLoaded));
+            loader.cl.reset(new LoadValueCallback(store->vbMap,
+                                                  state.getState()));
+            loaders.push_back(loader);
+        }
+    }
 
+    // The loaders are all set up before the first task can finish
+    std::vector<ExTask> tasks;
     threadtask_count = 0;
+    size_t l = 0;
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingData(*store, this,
-                                            i, Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        size_t numLoaders = std::min(concurrency, shardVbIds[i].size());
+        numLoaders = std::max(numLoaders, static_cast<size_t>(1));
+        for (size_t j = 0; j < numLoaders; ++j, ++l) {
+            if (data) {
+                tasks.push_back(new WarmupLoadingData(*store, this, i, l,
+                                                  Priority::WarmupPriority));
+            } else {
+                tasks.push_back(new WarmupLoadingKVPairs(*store, this, i, l,
+                                                  Priority::WarmupPriority));
+            }
+        }
+    }
+    lh.unlock();
+
+    std::vector<ExTask>::iterator it = tasks.begin();
+    for (; it != tasks.end(); ++it) {
+        ExecutorPool::get()->schedule(*it, READER_TASK_IDX);
     }
 }
 
-void Warmup::loadDataforShard(uint16_t shardId)
+bool Warmup::loadVBucket(uint16_t shardId, size_t loader)
 {
-    LoadStorageKVPairCallback *load_cb =
-        new LoadStorageKVPairCallback(store, true, state.getState());
-    shared_ptr<Callback<GetValue> > cb(load_cb);
-    shared_ptr<Callback<CacheLookup> >
-        cl(new LoadValueCallback(store->vbMap, state.getState()));
-    store->getROUnderlyingByShard(shardId)->dump(shardVbIds[shardId], cb, cl);
+    LockHolder lh(loadMutex);
+    VBucketLoader &ld = loaders[loader];
+    std::deque<uint16_t> &pending = shardPendingVbs[shardId];
+    if (!stopLoading && unlocked_isLoadingPaused(shardId)) {
+        return true;
+    }
+    if (!stopLoading && !pending.empty()) {
+        uint16_t vbid = pending.front();
+        pending.pop_front();
+        vbLoadState[vbid] = VB_LOAD_RUNNING;
+        lh.unlock();
+
+        std::vector<uint16_t> vbs(1, vbid);
+        ld.kvstore->dump(vbs, ld.cb, ld.cl);
+
+        // The callback cuts the scan short once the thresholds are met,
+        // which stops the scans of all the vbuckets. The scan that met them
+        // may well have had nothing left to load.
+        bool stop = ld.cb->getStatus() == ENGINE_ENOMEM;
+        bool complete = !stop;
+        RCPtr<VBucket> vb = store->getVBucket(vbid);
+        if (stop && vb && vbLoaded[vbid].load() >= vb->ht.numTotalItems.load()) {
+            complete = true;
+        }
 
-    if (++threadtask_count == store->vbMap.numShards) {
+        lh.lock();
+        if (stop) {
+            stopLoading = true;
+        }
+        if (complete) {
+            vbLoadState[vbid] = VB_LOAD_DONE;
+            ++vbucketsLoaded;
+            markReadable(vbid);
+        } else {
+            vbLoadState[vbid] = VB_LOAD_STOPPED;
+        }
+        return true;
+    }
+
+    while (!pending.empty()) {
+        vbLoadState[pending.front()] = VB_LOAD_STOPPED;
+        pending.pop_front();
+    }
+
+    if (++threadtask_count == loaders.size()) {
+        releaseLoaders();
+        lh.unlock();
         transition(WarmupState::Done);
     }
+    return false;
+}
+
+void Warmup::markReadable(uint16_t vbid)
+{
+    bool inverse = false;
+    if (vbReadable[vbid].compare_exchange_strong(inverse, true)) {
+        ++vbucketsReadable;
+    }
+}
+
+bool Warmup::isVBucketReadable(uint16_t vbid)
+{
+    return progressive && vbid < maxVbuckets && vbReadable[vbid].load();
+}
+
+void Warmup::vbucketRequested(uint16_t vbid)
+{
+    if (!progressive || vbid >= maxVbuckets || warmupComplete.load()) {
+        return;
+    }
+    ++vbRequests[vbid];
+
+    // Move it to the front of what its shard has left to load
+    KVShard *shard = store->vbMap.getShard(vbid);
+    LockHolder lh(loadMutex);
+    std::deque<uint16_t> &pending = shardPendingVbs[shard->getId()];
+    std::deque<uint16_t>::iterator it = std::find(pending.begin(),
+                                                  pending.end(), vbid);
+    if (it != pending.end() && it != pending.begin()) {
+        pending.erase(it);
+        pending.push_front(vbid);
+    }
+
+    // and so are its access log sections, still the hottest first
+    std::deque<const AccessLogSection *> &sections =
+        shardPendingSections[shard->getId()];
+    std::stable_partition(sections.begin(), sections.end(),
+                          SectionOfVBucket(vbid));
+}
+
+bool Warmup::isLoadingPaused(uint16_t shardId)
+{
+    if (warmupComplete.load()) {
+        return false;
+    }
+    LockHolder lh(loadMutex);
+    return unlocked_isLoadingPaused(shardId);
+}
+
+bool Warmup::unlocked_isLoadingPaused(uint16_t shardId)
+{
+    Configuration &config = store->getEPEngine().getConfiguration();
+    size_t limit = config.getWarmupLoadLimit();
+    std::deque<uint16_t> &pending = shardPendingVbs[shardId];
+    size_t taken = shardVbIds[shardId].size() - pending.size();
+    return limit != 0 && !pending.empty() && taken >= limit;
+}
+
+const char *Warmup::getVBucketState(uint16_t vbid)
+{
+    if (warmupComplete.load()) {
+        return "done";
+    }
+    if (vbid >= maxVbuckets) {
+        return "pending";
+    }
+    LockHolder lh(loadMutex);
+    if (vbLoadState[vbid] == VB_LOAD_DONE) {
+        return "done";
+    }
+    return vbReadable[vbid].load() ? "readable" : "pending";
+}
+
+void Warmup::releaseLoaders()
+{
+    std::vector<VBucketLoader>::iterator it = loaders.begin();
+    for (; it != loaders.end(); ++it) {
+        if (it->ownsStore) {
+            delete it->kvstore;
+        }
+    }
+    loaders.clear();
 }
 
 void Warmup::scheduleCompletion() {
@@ -826,6 +1351,9 @@ void Warmup::step() {
         case WarmupState::LoadingData:
             scheduleLoadingData();
             break;
+        case WarmupState::LoadingSnapshot:
+            scheduleLoadingSnapshot();
+            break;
         case WarmupState::Done:
             scheduleCompletion();
             break;
@@ -903,6 +1431,10 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
         addStat("dups", stats.warmDups, add_stat, c);
         addStat("oom", stats.warmOOM, add_stat, c);
         addStat("item_expired", stats.warmupExpired, add_stat, c);
+        if (stats.warmupWindowEnd.load() != 0) {
+            addStat("window_gets", stats.warmupWindowGets, add_stat, c);
+            addStat("window_misses", stats.warmupWindowMisses, add_stat, c);
+        }
         addStat("min_memory_threshold",
                 stats.warmupMemUsedCap * 100.0, add_stat, c);
         addStat("min_item_threshold",
@@ -929,17 +1461,75 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
             addStat("access_log", "corrupt", add_stat, c);
         }
 
+        if (store->getEPEngine().getConfiguration().isWarmupSnapshot()) {
+            ht_snapshot_load_t rv = HT_SNAPSHOT_LOADED;
+            for (size_t i = 0; i < store->vbMap.numShards; i++) {
+                if (shardSnapshotStatus[i] != HT_SNAPSHOT_LOADED) {
+                    rv = shardSnapshotStatus[i];
+                    break;
+                }
+            }
+            addStat("snapshot", HashTableSnapshot::getLoadResult(rv),
+                    add_stat, c);
+            if (snapshotTime != 0) {
+                addStat("snapshot_time", snapshotTime / 1000, add_stat, c);
+            }
+        }
+
         if (estimatedWarmupCount ==  std::numeric_limits<size_t>::max()) {
             addStat("estimated_value_count", "unknown", add_stat, c);
         } else {
             addStat("estimated_value_count", estimatedWarmupCount,
             add_stat, c);
         }
+        addStat("vbuckets_loaded", vbucketsLoaded, add_stat, c);
+        if (progressive) {
+            addStat("vbuckets_readable", vbucketsReadable, add_stat, c);
+        }
    } else {
         addStat(NULL, "disabled", add_stat, c);
     }
 }
 
+void Warmup::addVBucketStats(ADD_STAT add_stat, const void *c)
+{
+    LockHolder lh(loadMutex);
+    for (size_t i = 0; i < maxVbuckets; ++i) {
+        const char *st;
+        switch (vbLoadState[i]) {
+        case VB_LOAD_PENDING:
+            st = "pending";
+            break;
+        case VB_LOAD_RUNNING:
+            st = "loading";
+            break;
+        case VB_LOAD_DONE:
+            st = "done";
+            break;
+        case VB_LOAD_STOPPED:
+            st = "stopped";
+            break;
+        default:
+            continue;
+        }
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), "vb_%d:state", static_cast<int>(i));
+        add_casted_stat(buf, st, add_stat, c);
+        snprintf(buf, sizeof(buf), "vb_%d:loaded", static_cast<int>(i));
+        add_casted_stat(buf, vbLoaded[i], add_stat, c);
+        RCPtr<VBucket> vb = store->getVBucket(i);
+        if (vb) {
+            snprintf(buf, sizeof(buf), "vb_%d:estimated", static_cast<int>(i));
+            add_casted_stat(buf, vb->ht.numTotalItems, add_stat, c);
+        }
+        if (progressive) {
+            snprintf(buf, sizeof(buf), "vb_%d:requests", static_cast<int>(i));
+            add_casted_stat(buf, vbRequests[i], add_stat, c);
+        }
+    }
+}
+
 void Warmup::populateShardVbStates()
 {
     std::map<uint16_t, vbucket_state>::iterator it;
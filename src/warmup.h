@@ -19,6 +19,7 @@
 
 #include "config.h"
 
+#include <deque>
 #include <list>
 #include <map>
 #include <ostream>
@@ -26,6 +27,10 @@
 #include <vector>
 
 #include "ep_engine.h"
+#include "htsnapshot.h"
+
+class AccessLogReader;
+struct AccessLogSection;
 
 class WarmupState {
 public:
@@ -38,6 +43,7 @@ public:
     static const int LoadingKVPairs;
     static const int LoadingData;
     static const int Done;
+    static const int LoadingSnapshot;
 
     WarmupState() : state(Initialize) {}
 
@@ -74,12 +80,17 @@ public:
  */
 class LoadStorageKVPairCallback : public Callback<GetValue> {
 public:
+    /**
+     * @param _vbLoaded the counters of the items loaded into every vbucket,
+     *                  if any
+     */
     LoadStorageKVPairCallback(EventuallyPersistentStore *ep,
-                              bool _maybeEnableTraffic, int _warmupState)
+                              bool _maybeEnableTraffic, int _warmupState,
+                              AtomicValue<size_t> *_vbLoaded = NULL)
         : vbuckets(ep->vbMap), stats(ep->getEPEngine().getEpStats()),
           epstore(ep), startTime(ep_real_time()),
           hasPurged(false), maybeEnableTraffic(_maybeEnableTraffic),
-          warmupState(_warmupState)
+          warmupState(_warmupState), vbLoaded(_vbLoaded)
     {
         cb_assert(epstore);
     }
@@ -101,6 +112,7 @@ private:
     bool        hasPurged;
     bool        maybeEnableTraffic;
     int         warmupState;
+    AtomicValue<size_t> *vbLoaded;
 };
 
 class LoadValueCallback : public Callback<CacheLookup> {
@@ -137,6 +149,38 @@ public:
 
     void addStats(ADD_STAT add_stat, const void *c) const;
 
+    /**
+     * Add the progress of the scan of every vbucket.
+     */
+    void addVBucketStats(ADD_STAT add_stat, const void *c);
+
+    /**
+     * Check if a vbucket can be read from while warmup goes on, which
+     * only ever happens under progressive warmup once its keys and
+     * metadata are loaded.
+     */
+    bool isVBucketReadable(uint16_t vbid);
+
+    /**
+     * A client asked for a key of a vbucket that is not loaded yet, load
+     * it next.
+     */
+    void vbucketRequested(uint16_t vbid);
+
+    /**
+     * Check if the loaders of a shard have to wait, having loaded as many
+     * vbuckets in the current phase as warmup_load_limit allows.
+     */
+    bool isLoadingPaused(uint16_t shardId);
+
+    /* how long a paused loader sleeps before it checks the limit again */
+    static const double pauseSleepTime;
+
+    /**
+     * Get how far warmup is with a vbucket: pending, readable or done.
+     */
+    const char *getVBucketState(uint16_t vbid);
+
     hrtime_t getTime(void) { return warmup; }
 
     size_t doWarmup(MutationLog &lf, const std::map<uint16_t,
@@ -147,11 +191,13 @@ public:
     void initialize();
     void createVBuckets(uint16_t shardId);
     void estimateDatabaseItemCount(uint16_t shardId);
-    void keyDumpforShard(uint16_t shardId);
+    bool keyDumpforShard(uint16_t shardId);
     void checkForAccessLog();
     void loadingAccessLog(uint16_t shardId);
-    void loadKVPairsforShard(uint16_t shardId);
-    void loadDataforShard(uint16_t shardId);
+    bool loadAccessLogSections(uint16_t shardId, size_t loader);
+    void loadingSnapshot(uint16_t shardId);
+    bool loadKVPairsforShard(uint16_t shardId, size_t loader);
+    bool loadDataforShard(uint16_t shardId, size_t loader);
     void done();
 
 private:
@@ -168,11 +214,30 @@ private:
     void scheduleKeyDump();
     void scheduleCheckForAccessLog();
     void scheduleLoadingAccessLog();
+    void scheduleLoadingSnapshot();
     void scheduleLoadingKVPairs();
     void scheduleLoadingData();
     void scheduleCompletion();
 
+    /**
+     * Open the v2 access log of a shard, or the previous one if the
+     * current one can't be read.
+     *
+     * @param v2 set if the shard has a v2 log, readable or not
+     * @return NULL if there's no v2 log to read
+     */
+    AccessLogReader *openAccessLog(uint16_t shardId, bool &v2);
+    void completeLoadingAccessLog();
+    void releaseAccessLogs();
+
+    void scheduleLoadingVBuckets(bool data, bool maybeEnableTraffic);
+    bool loadVBucket(uint16_t shardId, size_t loader);
+    bool unlocked_isLoadingPaused(uint16_t shardId);
+    void releaseLoaders();
+    void markReadable(uint16_t vbid);
+
     void transition(int to, bool force=false);
+    void transitionToLoadKeys();
 
     WarmupState state;
     EventuallyPersistentStore *store;
@@ -185,8 +250,51 @@ private:
     std::map<uint16_t, vbucket_state> *shardVbStates;
     AtomicValue<size_t> threadtask_count;
     bool *shardKeyDumpStatus;
+    ht_snapshot_load_t *shardSnapshotStatus;
+    AtomicValue<hrtime_t> snapshotTime;
+    /* the v2 access logs being read, NULL for the shards without one */
+    AccessLogReader **shardAccessLogs;
+    size_t accessLogTasks;
+    hrtime_t accessLogStart;
     std::vector<uint16_t> *shardVbIds;
 
+    /* The scans of the vbuckets of a shard are spread over a few tasks,
+       each reading through a KVStore of its own */
+    struct VBucketLoader {
+        KVStore *kvstore;
+        bool ownsStore;
+        shared_ptr<Callback<GetValue> > cb;
+        shared_ptr<Callback<CacheLookup> > cl;
+    };
+
+    enum vbucket_load_state_t {
+        VB_LOAD_NONE,
+        VB_LOAD_PENDING,
+        VB_LOAD_RUNNING,
+        VB_LOAD_DONE,
+        VB_LOAD_STOPPED
+    };
+
+    Mutex loadMutex;
+    std::vector<VBucketLoader> loaders;
+    /* the vbuckets of every shard left to scan */
+    std::deque<uint16_t> *shardPendingVbs;
+    /* the access log sections of every shard left to load, the hottest
+       first */
+    std::deque<const AccessLogSection *> *shardPendingSections;
+    bool stopLoading;
+    size_t maxVbuckets;
+    vbucket_load_state_t *vbLoadState;
+    AtomicValue<size_t> *vbLoaded;
+    AtomicValue<size_t> vbucketsLoaded;
+
+    /* Under progressive warmup the vbuckets are read from as soon as their
+       keys are in, and the ones clients ask for are loaded first */
+    bool progressive;
+    AtomicValue<bool> *vbReadable;
+    AtomicValue<size_t> *vbRequests;
+    AtomicValue<size_t> vbucketsReadable;
+
     AtomicValue<hrtime_t> estimateTime;
     AtomicValue<size_t> estimatedItemCount;
     bool cleanShutdown;
@@ -282,9 +390,11 @@ public:
     }
 
     bool run() {
-
-        _warmup->keyDumpforShard(_shardId);
-        return false;
+        if (_warmup->isLoadingPaused(_shardId)) {
+            snooze(Warmup::pauseSleepTime);
+            return true;
+        }
+        return _warmup->keyDumpforShard(_shardId);
     }
 
 private:
@@ -337,21 +447,44 @@ private:
     uint16_t _shardId;
 };
 
-class WarmupLoadingKVPairs : public GlobalTask {
+class WarmupLoadAccessLogSections : public GlobalTask {
 public:
-    WarmupLoadingKVPairs(EventuallyPersistentStore &st, Warmup* w,
-                         uint16_t sh, const Priority &p) :
-        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh), _warmup(w) { }
+    WarmupLoadAccessLogSections(EventuallyPersistentStore &st, Warmup *w,
+                                uint16_t sh, size_t l, const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh),
+        _loader(l), _warmup(w) { }
 
     std::string getDescription() {
         std::stringstream ss;
-        ss<<"Warmup - loading KV Pairs: shard "<<_shardId;
+        ss<<"Warmup - loading access log: shard "<<_shardId<<" loader "
+          <<_loader;
         return ss.str();
     }
 
     bool run() {
+        return _warmup->loadAccessLogSections(_shardId, _loader);
+    }
+
+private:
+    uint16_t _shardId;
+    size_t _loader;
+    Warmup* _warmup;
+};
+
+class WarmupLoadSnapshot : public GlobalTask {
+public:
+    WarmupLoadSnapshot(EventuallyPersistentStore &st, Warmup *w,
+                       uint16_t sh, const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh), _warmup(w) { }
+
+    std::string getDescription() {
+        std::stringstream ss;
+        ss<<"Warmup - loading hash table snapshot: shard "<<_shardId;
+        return ss.str();
+    }
 
-        _warmup->loadKVPairsforShard(_shardId);
+    bool run() {
+        _warmup->loadingSnapshot(_shardId);
         return false;
     }
 
@@ -360,26 +493,59 @@ private:
     Warmup* _warmup;
 };
 
+class WarmupLoadingKVPairs : public GlobalTask {
+public:
+    WarmupLoadingKVPairs(EventuallyPersistentStore &st, Warmup* w,
+                         uint16_t sh, size_t l, const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh),
+        _loader(l), _warmup(w) { }
+
+    std::string getDescription() {
+        std::stringstream ss;
+        ss<<"Warmup - loading KV Pairs: shard "<<_shardId<<" loader "
+          <<_loader;
+        return ss.str();
+    }
+
+    bool run() {
+        if (_warmup->isLoadingPaused(_shardId)) {
+            snooze(Warmup::pauseSleepTime);
+            return true;
+        }
+        // one vbucket at a time, so that the reader threads are shared
+        return _warmup->loadKVPairsforShard(_shardId, _loader);
+    }
+
+private:
+    uint16_t _shardId;
+    size_t _loader;
+    Warmup* _warmup;
+};
+
 class WarmupLoadingData : public GlobalTask {
 public:
     WarmupLoadingData(EventuallyPersistentStore &st, Warmup* w,
-                      uint16_t sh, const Priority &p) :
-        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh), _warmup(w) {}
+                      uint16_t sh, size_t l, const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh),
+        _loader(l), _warmup(w) {}
 
     std::string getDescription() {
         std::stringstream ss;
-        ss<<"Warmup - loading data: shard "<<_shardId;
+        ss<<"Warmup - loading data: shard "<<_shardId<<" loader "<<_loader;
         return ss.str();
     }
 
     bool run() {
-
-        _warmup->loadDataforShard(_shardId);
-        return false;
+        if (_warmup->isLoadingPaused(_shardId)) {
+            snooze(Warmup::pauseSleepTime);
+            return true;
+        }
+        return _warmup->loadDataforShard(_shardId, _loader);
     }
 
 private:
     uint16_t _shardId;
+    size_t _loader;
     Warmup* _warmup;
 };
 
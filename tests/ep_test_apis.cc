@@ -44,6 +44,8 @@ char *last_body = NULL;
 bool last_deleted_flag = false;
 uint64_t last_cas = 0;
 uint8_t last_datatype = 0x00;
+uint8_t last_extlen = 0;
+uint32_t last_ext_flags = 0;
 ItemMetaData last_meta;
 
 extern "C" bool add_response_get_meta(const void *key, uint16_t keylen,
@@ -81,9 +83,13 @@ bool add_response(const void *key, uint16_t keylen, const void *ext,
                   uint8_t extlen, const void *body, uint32_t bodylen,
                   uint8_t datatype, uint16_t status, uint64_t cas,
                   const void *cookie) {
-    (void)ext;
-    (void)extlen;
     (void)cookie;
+    last_extlen = extlen;
+    last_ext_flags = 0;
+    if (extlen >= sizeof(uint32_t)) {
+        memcpy(&last_ext_flags, ext, sizeof(uint32_t));
+        last_ext_flags = ntohl(last_ext_flags);
+    }
     last_bodylen = bodylen;
     last_status = static_cast<protocol_binary_response_status>(status);
     if (last_body) {
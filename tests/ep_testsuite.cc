@@ -1286,6 +1286,183 @@ static enum test_result test_flush_multiv_restart(ENGINE_HANDLE *h, ENGINE_HANDL
     return SUCCESS;
 }
 
+static enum test_result test_flusher_pipeline(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    const int num_vbs = 8;
+    const int num_keys = 100;
+    for (int vb = 1; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+
+    // Write each key twice so that the deduplication of staged batches
+    // gets exercised as well.
+    for (int round = 0; round < 2; ++round) {
+        for (int j = 0; j < num_keys; ++j) {
+            std::stringstream ss;
+            ss << "key" << j;
+            std::stringstream val;
+            val << "value" << round;
+            item *i = NULL;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                        val.str().c_str(), &i, 0, j % num_vbs)
+                  == ENGINE_SUCCESS, "Failed set.");
+            h1->release(h, NULL, i);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        check_key_value(h, h1, ss.str().c_str(), "value1", 6, j % num_vbs);
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_flusher_pipeline_vb_delete(ENGINE_HANDLE *h,
+                                                        ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 500;
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    check(set_vbucket_state(h, h1, 2, vbucket_state_active),
+          "Failed to set vbucket state.");
+
+    // Queue up enough for the flusher to stage vbucket 2 while it is
+    // still writing vbucket 1
+    stop_persistence(h, h1);
+    for (int j = 0; j < num_keys; ++j) {
+        for (int vb = 1; vb <= 2; ++vb) {
+            std::stringstream ss;
+            ss << "key-" << vb << "-" << j;
+            item *i = NULL;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                        "somevalue", &i, 0, vb) == ENGINE_SUCCESS,
+                  "Failed set.");
+            h1->release(h, NULL, i);
+        }
+    }
+    int staged = get_int_stat(h, h1, "ep_flusher_batches_staged");
+    start_persistence(h, h1);
+    wait_for_stat_change(h, h1, "ep_flusher_batches_staged", staged);
+
+    // Delete and recreate vbucket 2 under the staged batch
+    check(set_vbucket_state(h, h1, 2, vbucket_state_dead),
+          "Failed to set vbucket state.");
+    vbucketDelete(h, h1, 2);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Failed to delete vbucket 2.");
+    check(set_vbucket_state(h, h1, 2, vbucket_state_active),
+          "Failed to set vbucket state.");
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss1;
+        ss1 << "key-1-" << j;
+        check_key_value(h, h1, ss1.str().c_str(), "somevalue", 9, 1);
+        std::stringstream ss2;
+        ss2 << "key-2-" << j;
+        check(verify_key(h, h1, ss2.str().c_str(), 2) == ENGINE_KEY_ENOENT,
+              "Expected the keys of the deleted vbucket to be gone");
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_flusher_batch_limit(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 200;
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "somevalue", &i, 0, 0) == ENGINE_SUCCESS,
+              "Failed set.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_flusher_batches_capped") > 0,
+          "Expected the flushes to be split by the batch limit");
+    check(get_int_stat(h, h1, "ep_total_persisted") == num_keys,
+          "Expected all the items to be persisted");
+    return SUCCESS;
+}
+
+static enum test_result test_group_commit_stats(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    for (int j = 0; j < 10; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "somevalue", &i, 0, j % 2) == ENGINE_SUCCESS,
+              "Failed set.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_change(h, h1, "ep_group_commits", 0);
+    check(get_int_stat(h, h1, "ep_group_commit_syncs") > 0,
+          "Expected the vbucket files to be synced by a group commit");
+    return SUCCESS;
+}
+
+static enum test_result test_flusher_backoff(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    int persisted = get_int_stat(h, h1, "ep_total_persisted");
+
+    // Put a directory in place of the vbucket file so the next write fails
+    std::string file = get_str_stat(h, h1, "ep_dbname") + "/0.couch.1";
+    std::string aside = file + ".aside";
+    check(rename(file.c_str(), aside.c_str()) == 0,
+          "Failed to move the vbucket file aside");
+    check(mkdir(file.c_str(), 0777) == 0, "Failed to block the vbucket file");
+
+    check(store(h, h1, NULL, OPERATION_SET, "key2", "somevalue2", &i)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    wait_for_stat_change(h, h1, "ep_flusher_retries", 0);
+    check(get_int_stat(h, h1, "ep_total_persisted") == persisted,
+          "Expected the failed write not to count as persisted");
+    check(get_int_stat(h, h1, "ep_queue_size") == 1,
+          "Expected the failed write to stay queued");
+
+    CouchbaseDirectoryUtilities::rmrf(file);
+    check(rename(aside.c_str(), file.c_str()) == 0,
+          "Failed to restore the vbucket file");
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_total_persisted") == persisted + 1,
+          "Expected the requeued item to be written once");
+    check(get_int_stat(h, h1, "ep_flusher_degraded_time") > 0,
+          "Expected the time spent backing off to be accounted");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check_key_value(h, h1, "key2", "somevalue2", 10);
+    return SUCCESS;
+}
+
 static enum test_result test_delete(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *i = NULL;
     // First try to delete something we know to not be there.
@@ -1431,6 +1608,78 @@ static enum test_result test_delete_set(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
     return SUCCESS;
 }
 
+static enum test_result test_handle_cache(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    wait_for_persisted_value(h, h1, "key", "somevalue");
+
+    for (int j = 0; j < 3; ++j) {
+        evict_key(h, h1, "key", 0, "Ejected.");
+        check_key_value(h, h1, "key", "somevalue", 9);
+    }
+    check(get_int_stat(h, h1, "ro_0:handle_hits", "kvstore") >= 2,
+          "Expected the bg fetches to reuse the cached db handle");
+
+    // A new commit makes the cached handle stale, it must not be used.
+    wait_for_persisted_value(h, h1, "key", "othervalue");
+    evict_key(h, h1, "key", 0, "Ejected.");
+    check_key_value(h, h1, "key", "othervalue", 10);
+    return SUCCESS;
+}
+
+static enum test_result test_block_cache(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    wait_for_persisted_value(h, h1, "key", "somevalue");
+
+    for (int j = 0; j < 3; ++j) {
+        evict_key(h, h1, "key", 0, "Ejected.");
+        check_key_value(h, h1, "key", "somevalue", 9);
+    }
+    check(get_int_stat(h, h1, "ro_0:block_hits", "kvstore") > 0,
+          "Expected the bg fetches to read B-tree blocks from the cache");
+    check(get_int_stat(h, h1, "ro_0:block_mem", "kvstore") > 0,
+          "Expected blocks to be cached");
+
+    // Blocks written after the cached ones must not be served stale.
+    wait_for_persisted_value(h, h1, "key", "othervalue");
+    evict_key(h, h1, "key", 0, "Ejected.");
+    check_key_value(h, h1, "key", "othervalue", 10);
+    return SUCCESS;
+}
+
+static enum test_result test_scan_readahead(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 100;
+    std::string value(1000, 'x');
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    value.c_str(), &i) == ENGINE_SUCCESS, "Failed to store");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    check(get_int_stat(h, h1, "ro_0:scans", "kvstore") > 0,
+          "Expected warmup to scan the vbucket");
+    check(get_int_stat(h, h1, "ro_0:scan_bytes", "kvstore") >=
+          num_keys * static_cast<int>(value.size()),
+          "Expected the scan to account for the values read");
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        check_key_value(h, h1, ss.str().c_str(), value.c_str(),
+                        value.size());
+    }
+    return SUCCESS;
+}
+
 static enum test_result test_get_delete_missing_file(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     const char *key = "key";
     wait_for_persisted_value(h, h1, key, "value2delete");
@@ -2452,6 +2701,114 @@ static enum test_result test_vbucket_compact(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_auto_compaction(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    std::string value(1024, 'x');
+    for (int j = 0; j < 50; ++j) {
+        wait_for_persisted_value(h, h1, "key", value.c_str());
+    }
+
+    // Nearly all of the file is overwritten versions of the key.
+    wait_for_stat_change(h, h1, "ep_auto_compactions", 0);
+    wait_for_stat_to_be(h, h1, "ep_auto_compactions_running", 0);
+    check(get_int_stat(h, h1, "rw_0:compact_bytes", "kvstore") > 0,
+          "Expected the compaction to go through the throttled file ops");
+
+    check_key_value(h, h1, "key", value.c_str(), value.size());
+    evict_key(h, h1, "key", 0, "Ejected.");
+    check_key_value(h, h1, "key", value.c_str(), value.size());
+    return SUCCESS;
+}
+
+extern "C" {
+    static void compact_vb0_thread(void *arg) {
+        struct handle_pair *hp = static_cast<handle_pair *>(arg);
+        compact_db(hp->h, hp->h1, 0, 0, 0, 0);
+    }
+}
+
+static enum test_result test_compaction_concurrent_flush(ENGINE_HANDLE *h,
+                                                         ENGINE_HANDLE_V1 *h1) {
+    // With a single shard vbuckets 0 and 1 share the flusher
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    std::string value(1024, 'x');
+    for (int j = 0; j < 50; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    value.c_str(), &i, 0, 0) == ENGINE_SUCCESS,
+              "Failed set.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    cb_thread_t th;
+    struct handle_pair hp = {h, h1};
+    int ret = cb_create_thread(&th, compact_vb0_thread, &hp, 0);
+    cb_assert(ret == 0);
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "rw_0:compact_bytes", "kvstore") == 0) {
+        decayingSleep(&sleepTime);
+    }
+
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "other", &i, 0, 1)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_pending_compactions") == 1,
+          "Expected the flush of another vbucket not to wait for the "
+          "compaction");
+
+    // Held back until the compaction is done
+    check(store(h, h1, NULL, OPERATION_SET, "key0", "new", &i, 0, 0)
+          == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    ret = cb_join_thread(th);
+    cb_assert(ret == 0);
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check_key_value(h, h1, "key0", "new", 3, 0);
+    check_key_value(h, h1, "key", "other", 5, 1);
+    return SUCCESS;
+}
+
+static enum test_result test_compaction_trims_undo_log(ENGINE_HANDLE *h,
+                                                       ENGINE_HANDLE_V1 *h1) {
+    // Every version gets flushed on its own, the undo log keeps the ones
+    // the next overwrote
+    for (int j = 0; j < 10; ++j) {
+        std::stringstream ss;
+        ss << "value" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, "key", ss.str().c_str(),
+                    &i, 0, 0) == ENGINE_SUCCESS, "Failed set.");
+        h1->release(h, NULL, i);
+        wait_for_flusher_to_settle(h, h1);
+    }
+    check(del(h, h1, "key", 0, 0) == ENGINE_SUCCESS, "Failed remove.");
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_db_file_size", "diskinfo") >
+          get_int_stat(h, h1, "ep_db_data_size", "diskinfo"),
+          "Expected the undo log to hold on to the old versions");
+
+    compact_db(h, h1, 0, 0xffffffff, 0, 1);
+    wait_for_stat_to_be(h, h1, "ep_pending_compactions", 0);
+    check(get_int_stat(h, h1, "vb_0:purge_seqno", "vbucket-seqno") == 11,
+          "Expected the deletion to be purged");
+    check(get_int_stat(h, h1, "ep_db_file_size", "diskinfo") ==
+          get_int_stat(h, h1, "ep_db_data_size", "diskinfo"),
+          "Expected the undo log to be trimmed up to the purge seqno");
+    return SUCCESS;
+}
+
 static enum test_result vbucket_destroy(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
                                              const char* value = NULL) {
     check(set_vbucket_state(h, h1, 1, vbucket_state_active), "Failed to set vbucket state.");
@@ -5342,6 +5699,34 @@ static enum test_result test_item_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
     return SUCCESS;
 }
 
+static enum test_result test_delete_unpersisted_stats(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    stop_persistence(h, h1);
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i, 0, 0) ==
+            ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    check(del(h, h1, "key", 0, 0) == ENGINE_SUCCESS,
+            "Failed remove with value.");
+    check(store(h, h1, NULL, OPERATION_SET, "key1", "somevalue", &i, 0, 0) ==
+            ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+
+    check(del(h, h1, "key1", 0, 0) == ENGINE_SUCCESS,
+            "Failed remove with value.");
+    wait_for_flusher_to_settle(h, h1);
+
+    // Only the deletion of the key that made it to disk counts.
+    check(get_int_stat(h, h1, "vb_active_ops_create") == 1,
+            "Expected 1 creation");
+    check(get_int_stat(h, h1, "vb_active_ops_delete") == 1,
+            "Expected 1 deletion");
+    check(get_int_stat(h, h1, "curr_items") == 0, "Expected no items");
+    return SUCCESS;
+}
+
 static enum test_result test_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     vals.clear();
     check(h1->get_stats(h, NULL, NULL, 0, add_stats) == ENGINE_SUCCESS,
@@ -5474,6 +5859,116 @@ static enum test_result test_bg_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_bg_fetch_vbuckets(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1) {
+    const int numVbs = 4;
+    item *i = NULL;
+    for (int vb = 1; vb < numVbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+    for (int vb = 0; vb < numVbs; ++vb) {
+        check(store(h, h1, NULL, OPERATION_SET, "key", "value", &i, 0, vb)
+              == ENGINE_SUCCESS, "Failed to store an item.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    for (int vb = 0; vb < numVbs; ++vb) {
+        evict_key(h, h1, "key", vb, "Ejected.");
+    }
+
+    // Let the fetches of all the vbuckets queue up for one batch
+    set_param(h, h1, protocol_binary_engine_param_flush, "bg_fetch_delay", "1");
+    const void *cookies[numVbs];
+    for (int vb = 0; vb < numVbs; ++vb) {
+        cookies[vb] = testHarness.create_cookie();
+        testHarness.set_ewouldblock_handling(cookies[vb], false);
+        check(h1->get(h, cookies[vb], &i, "key", 3, vb) == ENGINE_EWOULDBLOCK,
+              "Expected the get to block on a bg fetch.");
+    }
+    wait_for_stat_to_be(h, h1, "ep_bg_fetched", numVbs);
+
+    for (int vb = 0; vb < numVbs; ++vb) {
+        testHarness.destroy_cookie(cookies[vb]);
+        check_key_value(h, h1, "key", "value", 5, vb);
+    }
+    checkeq(numVbs, get_int_stat(h, h1, "ep_bg_fetched"),
+            "Expected no more bg fetches");
+    return SUCCESS;
+}
+
+static enum test_result test_bg_fetch_classes(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    item *itm = NULL;
+    wait_for_persisted_value(h, h1, "k1", "v1");
+    wait_for_persisted_value(h, h1, "k2", "v2");
+
+    evict_key(h, h1, "k1", 0, "Ejected.");
+    check(del(h, h1, "k2", 0, 0) == ENGINE_SUCCESS, "Failed remove with value.");
+    wait_for_stat_to_be(h, h1, "curr_items", 1);
+
+    // A client get, then an XDCR get_meta of the deleted key
+    check(h1->get(h, NULL, &itm, "k1", 2, 0) == ENGINE_SUCCESS, "Missing key");
+    h1->release(h, NULL, itm);
+    check(get_meta(h, h1, "k2"), "Get meta failed");
+    checkeq(1, get_int_stat(h, h1, "ep_bg_fetched"),
+            "Expected bg_fetched to be 1");
+    checkeq(1, get_int_stat(h, h1, "ep_bg_meta_fetched"),
+            "Expected bg_meta_fetched to be 1");
+
+    const char *classes[] = { "frontend", "get_meta", "backfill", "stats" };
+    for (int i = 0; i < 4; ++i) {
+        std::string prefix("ep_bg_");
+        prefix.append(classes[i]);
+        checkeq(0, get_int_stat(h, h1, (prefix + "_waiting").c_str()),
+                "Expected no reads left waiting");
+        check(vals.find(prefix + "_deferred") != vals.end(),
+              "Missing the deferred reads of a class");
+        check(vals.find(prefix + "_overdue") != vals.end(),
+              "Missing the overdue reads of a class");
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_bg_fetch_prefetch(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1) {
+    item *itm = NULL;
+    wait_for_persisted_value(h, h1, "k1", "v1");
+    wait_for_persisted_value(h, h1, "k2", "v2");
+
+    // Read the two keys together, often enough for them to be peers
+    for (int i = 0; i < 2; ++i) {
+        check(h1->get(h, NULL, &itm, "k1", 2, 0) == ENGINE_SUCCESS,
+              "Missing key");
+        h1->release(h, NULL, itm);
+        check(h1->get(h, NULL, &itm, "k2", 2, 0) == ENGINE_SUCCESS,
+              "Missing key");
+        h1->release(h, NULL, itm);
+    }
+
+    evict_key(h, h1, "k1", 0, "Ejected.");
+    evict_key(h, h1, "k2", 0, "Ejected.");
+
+    // The fetch of k1 reads k2 ahead
+    check(h1->get(h, NULL, &itm, "k1", 2, 0) == ENGINE_SUCCESS, "Missing key");
+    h1->release(h, NULL, itm);
+    wait_for_stat_to_be(h, h1, "ep_bg_prefetched", 1);
+    checkeq(1, get_int_stat(h, h1, "ep_bg_prefetch_issued"),
+            "Expected a read ahead");
+
+    check(h1->get(h, NULL, &itm, "k2", 2, 0) == ENGINE_SUCCESS, "Missing key");
+    h1->release(h, NULL, itm);
+    checkeq(1, get_int_stat(h, h1, "ep_bg_fetched"),
+            "Expected k2 to be resident");
+    checkeq(1, get_int_stat(h, h1, "ep_bg_prefetch_hits"),
+            "Expected the read ahead to be used");
+    checkeq(100, get_int_stat(h, h1, "ep_bg_prefetch_accuracy"),
+            "Expected every read ahead to be used");
+    checkeq(0, get_int_stat(h, h1, "ep_bg_prefetch_wasted"),
+            "Expected no read ahead to be wasted");
+    return SUCCESS;
+}
+
 static enum test_result test_bg_meta_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *itm = NULL;
     h1->reset_stats(h, NULL);
@@ -5831,6 +6326,183 @@ static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     return SUCCESS;
 }
 
+static enum test_result test_warmup_vbuckets(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    const int num_vbs = 8;
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+        for (int i = 0; i < 100; ++i) {
+            std::stringstream key;
+            key << "key-" << vb << "-" << i;
+            check(ENGINE_SUCCESS ==
+                  store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                        "somevalue", &it, 0, vb),
+                  "Error setting.");
+            h1->release(h, NULL, it);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    checkeq(num_vbs, get_int_stat(h, h1, "ep_warmup_vbuckets_loaded",
+                                  "warmup"),
+            "Expected every vbucket to be scanned");
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "warmup-vbuckets", 15, add_stats) ==
+          ENGINE_SUCCESS, "Failed to get the warmup progress of vbuckets");
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        std::stringstream state, loaded;
+        state << "vb_" << vb << ":state";
+        loaded << "vb_" << vb << ":loaded";
+        check(vals[state.str()] == "done", "Expected the vbucket to be done");
+        check(vals[loaded.str()] == "100",
+              "Expected every value of the vbucket loaded");
+    }
+    checkeq(num_vbs * 100, get_int_stat(h, h1, "ep_warmup_value_count",
+                                        "warmup"),
+            "Expected every value loaded");
+    return SUCCESS;
+}
+
+static enum test_result test_warmup_progressive(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    const int num_vbs = 4;
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+        for (int i = 0; i < 10; ++i) {
+            std::stringstream key;
+            key << "key-" << vb << "-" << i;
+            check(ENGINE_SUCCESS ==
+                  store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                        "somevalue", &it, 0, vb),
+                  "Error setting.");
+            h1->release(h, NULL, it);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // Hold the key dump after the first vbucket
+    std::string cfg(testHarness.get_current_testcase()->cfg);
+    cfg.append(";warmup_load_limit=1");
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              cfg.c_str(),
+                              true, false);
+    enable_traffic(h, h1);
+    wait_for_stat_to_be(h, h1, "ep_warmup_vbuckets_readable", 1, "warmup");
+    check(get_str_stat(h, h1, "vb_0:warmup", "vbucket-details 0") ==
+          "readable", "Expected the first vbucket to be readable");
+
+    check(h1->get(h, NULL, &it, "key-0-5", 7, 0) == ENGINE_SUCCESS,
+          "Failed to get a key of a readable vbucket");
+    h1->release(h, NULL, it);
+    check(h1->get(h, NULL, &it, "key-2-5", 7, 2) == ENGINE_TMPFAIL,
+          "Expected a temporary failure for a pending vbucket");
+    check(get_str_stat(h, h1, "vb_2:warmup", "vbucket-details 2") ==
+          "pending", "Expected the vbucket to be pending");
+
+    // Reads only, until the whole warmup is done
+    it = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key-0-5", "othervalue", &it,
+                0, 0) == ENGINE_TMPFAIL,
+          "Expected a set during warmup to fail temporarily");
+    check(store(h, h1, NULL, OPERATION_REPLACE, "key-0-5", "othervalue",
+                &it, 0, 0) == ENGINE_TMPFAIL,
+          "Expected a replace during warmup to fail temporarily");
+    check(del(h, h1, "key-0-5", 0, 0) == ENGINE_TMPFAIL,
+          "Expected a delete during warmup to fail temporarily");
+
+    // The vbucket asked for goes ahead of vbucket 1
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "warmup_load_limit", "2"),
+          "Failed to raise the warmup load limit");
+    wait_for_stat_to_be(h, h1, "ep_warmup_vbuckets_readable", 2, "warmup");
+    check(get_str_stat(h, h1, "vb_2:warmup", "vbucket-details 2") ==
+          "readable", "Expected the requested vbucket to be loaded next");
+    check(get_str_stat(h, h1, "vb_1:warmup", "vbucket-details 1") ==
+          "pending", "Expected vbucket 1 to wait");
+
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "warmup_load_limit", "0"),
+          "Failed to lift the warmup load limit");
+    wait_for_warmup_complete(h, h1);
+    checkeq(num_vbs, get_int_stat(h, h1, "ep_warmup_vbuckets_readable",
+                                  "warmup"),
+            "Expected every vbucket to have been readable");
+    check(store(h, h1, NULL, OPERATION_SET, "key-0-5", "othervalue", &it,
+                0, 0) == ENGINE_SUCCESS,
+          "Failed to set after warmup");
+    h1->release(h, NULL, it);
+    check(get_str_stat(h, h1, "vb_2:warmup", "vbucket-details 2") == "done",
+          "Expected the vbucket to be warmed up");
+
+    check(h1->get(h, NULL, &it, "key-2-5", 7, 2) == ENGINE_SUCCESS,
+          "Failed to get a warmed up key");
+    h1->release(h, NULL, it);
+    check(h1->get(h, NULL, &it, "nokey", 5, 2) == ENGINE_KEY_ENOENT,
+          "Expected a miss to be reported as one");
+    checkeq(2, get_int_stat(h, h1, "ep_warmup_window_gets", "warmup"),
+            "Expected the gets after warmup to be counted");
+    return SUCCESS;
+}
+
+static enum test_result test_warmup_snapshot(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    for (int i = 0; i < 100; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        check(ENGINE_SUCCESS ==
+              store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                    "somevalue", &it, 0, 0),
+              "Error setting.");
+        h1->release(h, NULL, it);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check(get_str_stat(h, h1, "ep_warmup_snapshot", "warmup") == "loaded",
+          "Expected the hash tables to be loaded from the snapshot");
+    checkeq(100, get_int_stat(h, h1, "ep_warmup_value_count", "warmup"),
+            "Expected every value loaded");
+    checkeq(0, get_int_stat(h, h1, "ep_warmup_vbuckets_loaded", "warmup"),
+            "Expected no vbucket to be scanned");
+    check_key_value(h, h1, "key-42", "somevalue", 9);
+
+    // No snapshot is written on a forced shutdown, and the one just read
+    // is gone, so the next warmup scans the data files
+    check(ENGINE_SUCCESS ==
+          store(h, h1, NULL, OPERATION_SET, "key-42", "othervalue", &it, 0, 0),
+          "Error setting.");
+    h1->release(h, NULL, it);
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, true);
+    wait_for_warmup_complete(h, h1);
+    check(get_str_stat(h, h1, "ep_warmup_snapshot", "warmup") == "missing",
+          "Expected no snapshot to load");
+    checkeq(100, get_int_stat(h, h1, "ep_warmup_value_count", "warmup"),
+            "Expected every value loaded");
+    check_key_value(h, h1, "key-42", "othervalue", 10);
+    return SUCCESS;
+}
+
 #if 0
 // Comment out the entire test since the hack gave warnings on win32
 static enum test_result test_warmup_accesslog(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
@@ -5974,6 +6646,45 @@ static enum test_result test_notifier_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *
     return SUCCESS;
 }
 
+static enum test_result test_notifier_async(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    check(set_vbucket_state(h, h1, 0, vbucket_state_active), "Failed to set VB0 state.");
+
+    for (int i = 0; i < 1000; ++i) {
+        std::stringstream key;
+        key << "key-what" << i;
+        check(ENGINE_SUCCESS ==
+              store(h, h1, NULL, OPERATION_SET, key.str().c_str(), "somevalue2remember", &it),
+              "Error setting.");
+        h1->release(h, NULL, it);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "rw_0:notify_pending", 0, "kvstore");
+
+    // every file update is either sent or replaced by a newer update of
+    // its vbucket before it was sent
+    useconds_t sleepTime = 128;
+    int close, sent, coalesced;
+    do {
+        decayingSleep(&sleepTime);
+        close = get_int_stat(h, h1, "rw_0:close", "kvstore");
+        sent = get_int_stat(h, h1, "rw_0:notify_vbucket_update:sent", "kvstore");
+        coalesced = get_int_stat(h, h1, "rw_0:notify_coalesced", "kvstore");
+    } while (sent + coalesced < close);
+    check(sent + coalesced == close,
+          "expected notify_vbucket_update and coalesced equal to close");
+    check(get_int_stat(h, h1, "rw_0:notify_batches", "kvstore") > 0,
+          "expected batches sent by the notifier thread");
+    check(get_int_stat(h, h1, "rw_0:notify_requeued", "kvstore") == 0,
+          "expected no updates lost to a connection reset");
+
+    wait_for_stat_to_be(h, h1, "rw_0:notify_vbucket_update:success", sent,
+                        "kvstore");
+    int error = get_int_stat(h, h1, "rw_0:notify_vbucket_update:error", "kvstore");
+    check(error == 0, "expected zero notify_vbucket_update error");
+    return SUCCESS;
+}
+
 static enum test_result test_workload_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     check(h1->get_stats(h, testHarness.create_cookie(), "workload",
                         strlen("workload"), add_stats) == ENGINE_SUCCESS,
@@ -6162,6 +6873,65 @@ static enum test_result test_all_keys_api(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     return SUCCESS;
 }
 
+static enum test_result test_all_keys_api_paging(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    for (int i = 0; i < 100; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "key_%03d", i);
+        item *itm;
+        check(store(h, h1, NULL, OPERATION_SET, key, key, &itm, 0, 0) ==
+              ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, itm);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // The page (252 bytes) holds 28 of the 40 keys asked for and is
+    // flagged as truncated, the second request continues from the last
+    // key of the first page and gets all of the 20 keys it asks for.
+    uint8_t extlen = 4;
+    uint16_t keylen = 7;
+    const char *startKeys[] = { "key_010", "key_037" };
+    const uint32_t counts[] = { 40, 20 };
+    const size_t numKeys[] = { 28, 20 };
+    const size_t startNums[] = { 10, 37 };
+    for (size_t page = 0; page < 2; ++page) {
+        uint32_t count = htonl(counts[page]);
+        protocol_binary_request_header *pkt =
+            createPacket(CMD_GET_KEYS, 0, 0, (char*)&count, extlen,
+                         startKeys[page], keylen, NULL, 0, 0x00);
+        check(h1->unknown_command(h, NULL, pkt, add_response) ==
+              ENGINE_SUCCESS, "Failed to get all_keys");
+        free(pkt);
+
+        check(last_bodylen == numKeys[page] * (sizeof(uint16_t) + keylen),
+              "all_keys response doesn't hold the expected keys");
+        if (page == 0) {
+            check(last_extlen == sizeof(uint32_t) &&
+                  (last_ext_flags & GET_KEYS_PAGE_TRUNCATED),
+                  "Expected the full page to be flagged as truncated");
+        } else {
+            check(last_extlen == 0,
+                  "Expected a complete page to carry no flags");
+        }
+        size_t offset = 0;
+        for (size_t i = 0; i < numKeys[page]; ++i) {
+            uint16_t len;
+            memcpy(&len, last_body + offset, sizeof(uint16_t));
+            check(ntohs(len) == keylen,
+                  "Key length mismatch in all_keys response");
+            char key[16];
+            snprintf(key, sizeof(key), "key_%03d",
+                     static_cast<int>(startNums[page] + i));
+            offset += sizeof(uint16_t);
+            check(memcmp(last_body + offset, key, keylen) == 0,
+                  "Key mismatch in all_keys response");
+            offset += keylen;
+        }
+    }
+
+    return SUCCESS;
+}
+
 static enum test_result test_curr_items(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *i = NULL;
 
@@ -6921,6 +7691,56 @@ static enum test_result test_upr_persistence_seqno(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+extern "C" {
+    static void persist_wait_thread(void *arg) {
+        struct handle_pair *hp = static_cast<handle_pair *>(arg);
+
+        check(seqnoPersistence(hp->h, hp->h1, 0, 100) == ENGINE_SUCCESS,
+              "Expected success for seqno persistence request");
+    }
+}
+
+static enum test_result test_persist_wait_lanes(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    stop_persistence(h, h1);
+    for (int j = 0; j < 100; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "somevalue", &i, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+
+    cb_thread_t th;
+    struct handle_pair hp = {h, h1};
+    int ret = cb_create_thread(&th, persist_wait_thread, &hp, 0);
+    cb_assert(ret == 0);
+    wait_for_stat_to_be(h, h1, "ep_chk_persistence_remains", 1);
+    start_persistence(h, h1);
+    ret = cb_join_thread(th);
+    cb_assert(ret == 0);
+
+    // Without a fast lane the regular round serves the waiter
+    bool fastLane = strstr(testHarness.get_current_testcase()->cfg,
+                           "flusher_fast_lane_max_items=0") == NULL;
+    std::string served(fastLane ? "persist_wait_fast_" : "persist_wait_bulk_");
+    std::string other(fastLane ? "persist_wait_bulk_" : "persist_wait_fast_");
+    vals.clear();
+    check(h1->get_stats(h, NULL, "timings", 7, add_stats) == ENGINE_SUCCESS,
+          "Failed to get timings");
+    bool found = false;
+    std::map<std::string, std::string>::iterator it = vals.begin();
+    for (; it != vals.end(); ++it) {
+        check(it->first.compare(0, other.size(), other) != 0,
+              "Didn't expect the wait in the other lane's histogram");
+        found = found || it->first.compare(0, served.size(), served) == 0;
+    }
+    check(found, "Expected the wait to be timed");
+    return SUCCESS;
+}
+
 extern "C" {
     static void wait_for_persistence_thread(void *arg) {
         struct handle_pair *hp = static_cast<handle_pair *>(arg);
@@ -9789,7 +10609,8 @@ static enum test_result prepare(engine_test_t *test) {
         if (dbname.find("/non/") == dbname.npos) {
             mkdir(dbname.c_str(), 0777);
         }
-    } else {
+    } else if (strstr(test->cfg, "backend=memory") == NULL &&
+               strstr(test->cfg, "backend=bitcask") == NULL) {
         // unknow backend!
         using namespace std;
 
@@ -9854,16 +10675,28 @@ public:
             ss << "flushall_enabled=true;";
         }
 
+        // Test cases written for another backend name it in their config.
+        bool memory = cfg != 0 && strstr(cfg, "backend=memory") != NULL;
+        bool bitcask = cfg != 0 && strstr(cfg, "backend=bitcask") != NULL;
         if (skip) {
             nm.append(" (skipped)");
             ret->tfun = skipped_test_function;
+        } else if (memory) {
+            nm.append(" (memory)");
+        } else if (bitcask) {
+            nm.append(" (bitcask)");
         } else {
             nm.append(" (couchstore)");
         }
 
-        ss << "backend=couchdb;couch_response_timeout=3000";
+        if (!memory && !bitcask) {
+            ss << "backend=couchdb;couch_response_timeout=3000";
+        }
         ret->name = strdup(nm.c_str());
         std::string config = ss.str();
+        if (!config.empty() && config[config.length() - 1] == ';') {
+            config.erase(config.length() - 1);
+        }
         if (config.length() == 0) {
             ret->cfg = 0;
         } else {
@@ -9980,6 +10813,18 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("get/delete with missing db file", test_get_delete_missing_file,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("db handle cache", test_handle_cache,
+                 test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("block cache", test_block_cache, test_setup, teardown,
+                 "couch_block_cache_size=1048576", prepare, cleanup),
+        TestCase("block cache (direct io)", test_block_cache, test_setup,
+                 teardown, "couch_block_cache_size=1048576;couch_direct_io=true",
+                 prepare, cleanup),
+        TestCase("scan read-ahead", test_scan_readahead, test_setup,
+                 teardown, "couch_scan_readahead_size=65536", prepare,
+                 cleanup),
+        TestCase("scan without read-ahead", test_scan_readahead, test_setup,
+                 teardown, "couch_scan_readahead_size=0", prepare, cleanup),
         TestCase("retain rowid over a soft delete", test_bug2509,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("vbucket deletion doesn't affect new data", test_bug7023,
@@ -10054,6 +10899,13 @@ engine_test_t* get_tests(void) {
         // Stats tests
         TestCase("item stats", test_item_stats, test_setup, teardown, NULL,
                  prepare, cleanup),
+        TestCase("item stats (docinfo preread)", test_item_stats, test_setup,
+                 teardown, "couch_docinfo_preread=true", prepare, cleanup),
+        TestCase("unpersisted delete stats", test_delete_unpersisted_stats,
+                 test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("unpersisted delete stats (docinfo preread)",
+                 test_delete_unpersisted_stats, test_setup, teardown,
+                 "couch_docinfo_preread=true", prepare, cleanup),
         TestCase("stats", test_stats, test_setup, teardown, NULL,
                  prepare, cleanup),
         TestCase("io stats", test_io_stats, test_setup, teardown,
@@ -10064,6 +10916,20 @@ engine_test_t* get_tests(void) {
                  NULL, prepare, cleanup),
         TestCase("bg meta stats", test_bg_meta_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("bg fetch classes", test_bg_fetch_classes, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("bg fetch prefetch", test_bg_fetch_prefetch, test_setup,
+                 teardown, "bg_fetch_prefetch=true", prepare, cleanup),
+        TestCase("bg fetch of several vbuckets", test_bg_fetch_vbuckets,
+                 test_setup, teardown, "max_num_shards=1", prepare, cleanup),
+        TestCase("bg fetch of several vbuckets (4 fetchers)",
+                 test_bg_fetch_vbuckets, test_setup, teardown,
+                 "max_num_shards=1;bg_fetch_queue_depth=4", prepare, cleanup),
+        TestCase("bg stats (synchronous io)", test_bg_stats, test_setup,
+                 teardown, "couch_io_queue_depth=0", prepare, cleanup),
+        TestCase("bg meta stats (synchronous io)", test_bg_meta_stats,
+                 test_setup, teardown, "couch_io_queue_depth=0",
+                 prepare, cleanup),
         TestCase("mem stats", test_mem_stats, test_setup, teardown,
                  "chk_remover_stime=1;chk_period=60", prepare, cleanup),
         TestCase("stats key", test_key_stats, test_setup, teardown,
@@ -10074,6 +10940,19 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("warmup stats", test_warmup_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("warmup stats", test_warmup_stats, test_setup,
+                 teardown, "backend=bitcask", prepare, cleanup),
+        TestCase("warmup of several vbuckets at once", test_warmup_vbuckets,
+                 test_setup, teardown,
+                 "max_num_shards=1;warmup_concurrency=4",
+                 prepare, cleanup),
+        TestCase("progressive warmup", test_warmup_progressive,
+                 test_setup, teardown,
+                 "warmup_progressive=true;max_num_shards=1",
+                 prepare, cleanup),
+        TestCase("warmup from hash table snapshot", test_warmup_snapshot,
+                 test_setup, teardown, "warmup_snapshot=true",
+                 prepare, cleanup),
         TestCase("seqno stats", test_stats_seqno,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("diskinfo stats", test_stats_diskinfo,
@@ -10084,6 +10963,9 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("mccouch notifier stat", test_notifier_stats, test_setup,
                  teardown, "max_num_workers=4", prepare, cleanup),
+        TestCase("mccouch async notifier", test_notifier_async, test_setup,
+                 teardown, "max_num_workers=4;couch_notify_async=true",
+                 prepare, cleanup),
         TestCase("ep workload stats", test_workload_stats,
                  test_setup, teardown, "max_num_shards=5", prepare, cleanup),
         TestCase("test set/get cluster config", test_cluster_config,
@@ -10097,6 +10979,19 @@ engine_test_t* get_tests(void) {
                  test_all_keys_api,
                  test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("test ALL_KEYS api paging",
+                 test_all_keys_api_paging,
+                 test_setup, teardown,
+                 "all_keys_page_size=252", prepare, cleanup),
+        TestCase("test ALL_KEYS api",
+                 test_all_keys_api,
+                 test_setup, teardown,
+                 "backend=bitcask", prepare, cleanup),
+        TestCase("test ALL_KEYS api paging",
+                 test_all_keys_api_paging,
+                 test_setup, teardown,
+                 "all_keys_page_size=252;backend=bitcask", prepare,
+                 cleanup),
         TestCase("ep worker stats", test_worker_stats,
                  test_setup, teardown,
                  "max_num_workers=4;max_threads=8", prepare, cleanup),
@@ -10180,6 +11075,8 @@ engine_test_t* get_tests(void) {
         // restart tests
         TestCase("test restart", test_restart, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("test restart", test_restart, test_setup,
+                 teardown, "backend=bitcask", prepare, cleanup),
         TestCase("test restart with session stats", test_restart_session_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("set+get+restart+hit (bin)", test_restart_bin_val,
@@ -10188,6 +11085,31 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("flush multiv+restart", test_flush_multiv_restart,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("pipelined flusher+restart", test_flusher_pipeline,
+                 test_setup, teardown, "flusher_pipeline_enabled=true",
+                 prepare, cleanup),
+        TestCase("pipelined flusher flush multiv+restart",
+                 test_flush_multiv_restart, test_setup, teardown,
+                 "flusher_pipeline_enabled=true", prepare, cleanup),
+        TestCase("pipelined flusher vbucket delete+restart",
+                 test_flusher_pipeline_vb_delete, test_setup, teardown,
+                 "flusher_pipeline_enabled=true;max_num_shards=1;"
+                 "flusher_max_batch_items=10", prepare, cleanup),
+        TestCase("flusher batch limit", test_flusher_batch_limit,
+                 test_setup, teardown, "flusher_max_batch_items=10",
+                 prepare, cleanup),
+        TestCase("flusher batch limit+restart", test_flusher_pipeline,
+                 test_setup, teardown,
+                 "flusher_max_batch_items=10;flusher_latency_target=100",
+                 prepare, cleanup),
+        TestCase("group commit+restart", test_flusher_pipeline,
+                 test_setup, teardown, "group_commit_window=50",
+                 prepare, cleanup),
+        TestCase("group commit stats", test_group_commit_stats,
+                 test_setup, teardown, "group_commit_window=50",
+                 prepare, cleanup),
+        TestCase("flusher backoff+restart", test_flusher_backoff,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test kill -9 bucket", test_kill9_bucket,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test shutdown with force", test_flush_shutdown_force,
@@ -10311,8 +11233,23 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test vbucket create", test_vbucket_create,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("test auto compaction", test_auto_compaction, test_setup,
+                 teardown, "compaction_frag_threshold=50;"
+                 "compaction_min_file_size=0;compaction_stime=1;"
+                 "compaction_io_rate=4194304", prepare, cleanup),
         TestCase("test vbucket compact", test_vbucket_compact,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("test flush during compaction+restart",
+                 test_compaction_concurrent_flush, test_setup, teardown,
+                 "max_num_shards=1;compaction_io_rate=20000",
+                 prepare, cleanup),
+        TestCase("test vbucket compact", test_vbucket_compact,
+                 test_setup, teardown, "backend=memory", prepare, cleanup),
+        TestCase("test compaction trims the undo log",
+                 test_compaction_trims_undo_log, test_setup, teardown,
+                 "backend=memory", prepare, cleanup),
+        TestCase("test vbucket compact", test_vbucket_compact,
+                 test_setup, teardown, "backend=bitcask", prepare, cleanup),
         TestCase("test async vbucket destroy", test_async_vbucket_destroy,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test sync vbucket destroy", test_sync_vbucket_destroy,
@@ -10372,6 +11309,24 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown,
                  "chk_max_items=500;max_checkpoints=5;item_num_based_new_chk=true",
                  prepare, cleanup),
+        TestCase("checkpoint: wait for persistence (pipelined flusher)",
+                 test_checkpoint_persistence,
+                 test_setup, teardown,
+                 "chk_max_items=500;max_checkpoints=5;item_num_based_new_chk=true;"
+                 "flusher_pipeline_enabled=true",
+                 prepare, cleanup),
+        TestCase("checkpoint: wait for persistence (batch limit)",
+                 test_checkpoint_persistence,
+                 test_setup, teardown,
+                 "chk_max_items=500;max_checkpoints=5;item_num_based_new_chk=true;"
+                 "flusher_max_batch_items=100",
+                 prepare, cleanup),
+        TestCase("checkpoint: wait for persistence (group commit)",
+                 test_checkpoint_persistence,
+                 test_setup, teardown,
+                 "chk_max_items=500;max_checkpoints=5;item_num_based_new_chk=true;"
+                 "group_commit_window=50",
+                 prepare, cleanup),
         TestCase("test wait for persist vb del", test_wait_for_persist_vb_del,
                  test_setup, teardown, NULL, prepare, cleanup),
 
@@ -10507,6 +11462,22 @@ engine_test_t* get_tests(void) {
         TestCase("test partial rollback on consumer",
                 test_partialrollback_for_consumer, test_setup, teardown,
                 "upr_enable_flow_control=true", prepare, cleanup),
+        TestCase("test full rollback on consumer", test_fullrollback_for_consumer,
+                test_setup, teardown,
+                "upr_enable_flow_control=true;backend=memory", prepare,
+                cleanup),
+        TestCase("test partial rollback on consumer",
+                test_partialrollback_for_consumer, test_setup, teardown,
+                "upr_enable_flow_control=true;backend=memory", prepare,
+                cleanup),
+        TestCase("test full rollback on consumer", test_fullrollback_for_consumer,
+                test_setup, teardown,
+                "upr_enable_flow_control=true;backend=bitcask", prepare,
+                cleanup),
+        TestCase("test partial rollback on consumer",
+                test_partialrollback_for_consumer, test_setup, teardown,
+                "upr_enable_flow_control=true;backend=bitcask", prepare,
+                cleanup),
         TestCase("test change upr buffer log size", test_upr_buffer_log_size,
                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test get failover log", test_upr_get_failover_log,
@@ -10539,6 +11510,12 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("upr persistence seqno", test_upr_persistence_seqno, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("persistence wait in the fast lane", test_persist_wait_lanes,
+                 test_setup, teardown, "flusher_fast_lane_max_items=10",
+                 prepare, cleanup),
+        TestCase("persistence wait in the regular round",
+                 test_persist_wait_lanes, test_setup, teardown,
+                 "flusher_fast_lane_max_items=0", prepare, cleanup),
 
         // full eviction tests
         TestCase("test set with item_eviction",
@@ -0,0 +1,167 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "access_log.h"
+#undef NDEBUG
+
+#define TMP_LOG_FILE "/tmp/alog_test.log"
+
+static std::vector<std::string> makeKeys(const char *prefix, int n) {
+    std::vector<std::string> keys;
+    for (int i = n - 1; i >= 0; --i) {
+        char key[64];
+        snprintf(key, sizeof(key), "%s%05d", prefix, i);
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+static void writeLog(size_t blockSize) {
+    AccessLogWriter writer(TMP_LOG_FILE, blockSize);
+    writer.open();
+    cb_assert(writer.isOpen());
+
+    std::vector<std::string> keys = makeKeys("key-a-", 1000);
+    keys.push_back("key-a-00042");
+    writer.addVBucket(3, 0, keys);
+    keys = makeKeys("other-", 10);
+    writer.addVBucket(7, 0, keys);
+    keys = makeKeys("cold-", 5);
+    writer.addVBucket(7, 2, keys);
+    keys.clear();
+    writer.addVBucket(9, 0, keys);
+
+    cb_assert(writer.getNumKeys() == 1015);
+    cb_assert(writer.commit());
+}
+
+static void testReadBack() {
+    writeLog(512);
+    cb_assert(AccessLogReader::isAccessLog(TMP_LOG_FILE));
+
+    AccessLogReader reader(TMP_LOG_FILE);
+    cb_assert(reader.open());
+    cb_assert(reader.getSections().size() == 4);
+    cb_assert(reader.getSection(5, 0) == NULL);
+    cb_assert(reader.getSection(3, 2) == NULL);
+
+    const AccessLogSection *section = reader.getSection(3, 0);
+    cb_assert(section != NULL);
+    cb_assert(section->numKeys == 1000);
+
+    const AccessLogSection *cold = reader.getSection(7, 2);
+    cb_assert(cold != NULL);
+    cb_assert(cold->nru == 2);
+    cb_assert(cold->numKeys == 5);
+
+    AccessLogReader::Cursor cursor(reader, *section);
+    std::string key, prev;
+    size_t n = 0;
+    while (cursor.next(key)) {
+        cb_assert(n == 0 || prev < key);
+        prev = key;
+        ++n;
+    }
+    cb_assert(!cursor.isCorrupt());
+    cb_assert(n == 1000);
+    cb_assert(prev == "key-a-00999");
+
+    AccessLogReader::Cursor coldCursor(reader, *cold);
+    cb_assert(coldCursor.next(key));
+    cb_assert(key == "cold-00000");
+
+    AccessLogReader::Cursor empty(reader, *reader.getSection(9, 0));
+    cb_assert(!empty.next(key));
+    cb_assert(!empty.isCorrupt());
+}
+
+static void testDamagedBlock() {
+    writeLog(512);
+    FILE *fp = fopen(TMP_LOG_FILE, "r+b");
+    cb_assert(fp != NULL);
+    // a byte of the second block of the first section
+    cb_assert(fseek(fp, 600, SEEK_SET) == 0);
+    int c = fgetc(fp);
+    cb_assert(fseek(fp, 600, SEEK_SET) == 0);
+    fputc(c ^ 0xff, fp);
+    fclose(fp);
+
+    AccessLogReader reader(TMP_LOG_FILE);
+    cb_assert(reader.open());
+    AccessLogReader::Cursor cursor(reader, *reader.getSection(3, 0));
+    std::string key;
+    size_t n = 0;
+    while (cursor.next(key)) {
+        ++n;
+    }
+    cb_assert(cursor.isCorrupt());
+    cb_assert(n > 0 && n < 1000);
+
+    // The other sections are still sound
+    AccessLogReader::Cursor other(reader, *reader.getSection(7, 0));
+    n = 0;
+    while (other.next(key)) {
+        ++n;
+    }
+    cb_assert(!other.isCorrupt());
+    cb_assert(n == 10);
+}
+
+static void testTruncated() {
+    writeLog(4096);
+    FILE *fp = fopen(TMP_LOG_FILE, "rb");
+    cb_assert(fp != NULL);
+    cb_assert(fseek(fp, 0, SEEK_END) == 0);
+    long size = ftell(fp);
+    fclose(fp);
+    cb_assert(truncate(TMP_LOG_FILE, size - 1) == 0);
+
+    AccessLogReader reader(TMP_LOG_FILE);
+    cb_assert(AccessLogReader::isAccessLog(TMP_LOG_FILE));
+    cb_assert(!reader.open());
+}
+
+static void testNotAnAccessLog() {
+    FILE *fp = fopen(TMP_LOG_FILE, "wb");
+    cb_assert(fp != NULL);
+    const char data[] = "\0\0\0\1\0\0\020\0";
+    fwrite(data, sizeof(data), 1, fp);
+    fclose(fp);
+    cb_assert(!AccessLogReader::isAccessLog(TMP_LOG_FILE));
+    remove(TMP_LOG_FILE);
+    cb_assert(!AccessLogReader::isAccessLog(TMP_LOG_FILE));
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    testReadBack();
+    testDamagedBlock();
+    testTruncated();
+    testNotAnAccessLog();
+
+    remove(TMP_LOG_FILE);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+
+#include "bgfetch_scheduler.h"
+#include "configuration.h"
+#undef NDEBUG
+
+static const hrtime_t ONE_MSEC(1000000);
+
+static void setDeadlines(Configuration &config, size_t msec) {
+    config.setBgFetchDeadlineFrontend(msec);
+    config.setBgFetchDeadlineGetMeta(msec);
+    config.setBgFetchDeadlineBackfill(msec);
+    config.setBgFetchDeadlineStats(msec);
+}
+
+static void queueReads(BgFetchScheduler &scheduler,
+                       std::deque<bg_fetch_class_t> &queue,
+                       bg_fetch_class_t cls, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        scheduler.enqueue(cls);
+        queue.push_back(cls);
+    }
+}
+
+/*
+ * A backlog of backfill and stats reads queued ahead of the client reads
+ * only gets the share of the reads its weights give it.
+ */
+static void testBacklogGetsItsWeight() {
+    EPStats stats;
+    Configuration config;
+    // keep the deadlines out of the way
+    setDeadlines(config, 60000);
+    BgFetchScheduler scheduler(stats, config);
+
+    std::deque<bg_fetch_class_t> queue;
+    queueReads(scheduler, queue, BG_FETCH_STATS, 1000);
+    queueReads(scheduler, queue, BG_FETCH_BACKFILL, 1000);
+    queueReads(scheduler, queue, BG_FETCH_FRONTEND, 32);
+
+    // Serve the queue in order, a read held back goes to the end of it
+    size_t served[BG_FETCH_NUM_CLASSES] = { 0 };
+    while (served[BG_FETCH_FRONTEND] < 32) {
+        bg_fetch_class_t cls = queue.front();
+        queue.pop_front();
+        if (scheduler.admit(cls, gethrtime())) {
+            ++served[cls];
+        } else {
+            queue.push_back(cls);
+        }
+    }
+
+    // 32 client reads at a weight of 16 leave room for 2 rounds of the
+    // backfill (weight 2) and stats (weight 1) reads, plus the read each
+    // of them got in before the client reads were queued
+    cb_assert(served[BG_FETCH_BACKFILL] <= 32 * 2 / 16 + 1);
+    cb_assert(served[BG_FETCH_STATS] <= 32 * 1 / 16 + 1);
+    cb_assert(stats.bgClassDeferred[BG_FETCH_STATS].load() > 0);
+    cb_assert(stats.bgClassDeferred[BG_FETCH_BACKFILL].load() > 0);
+    cb_assert(stats.bgClassOverdue[BG_FETCH_FRONTEND].load() == 0);
+    cb_assert(stats.bgClassWaiting[BG_FETCH_FRONTEND].load() == 0);
+}
+
+/*
+ * A client read is held back no longer than its deadline, whatever the
+ * weights of the classes with reads waiting.
+ */
+static void testFrontendDeadline() {
+    EPStats stats;
+    Configuration config;
+    setDeadlines(config, 60000);
+    config.setBgFetchWeightFrontend(1);
+    config.setBgFetchWeightBackfill(1024);
+    config.setBgFetchDeadlineFrontend(5);
+    BgFetchScheduler scheduler(stats, config);
+
+    scheduler.enqueue(BG_FETCH_BACKFILL);
+    scheduler.enqueue(BG_FETCH_FRONTEND);
+    scheduler.enqueue(BG_FETCH_FRONTEND);
+
+    // The first client read takes the share of the class, the second one
+    // has to wait for the backfill read
+    hrtime_t now = gethrtime();
+    cb_assert(scheduler.admit(BG_FETCH_FRONTEND, now));
+    cb_assert(!scheduler.admit(BG_FETCH_FRONTEND, now));
+    cb_assert(stats.bgClassDeferred[BG_FETCH_FRONTEND].load() == 1);
+
+    // ...unless it has been waiting for longer than 5 msec
+    cb_assert(scheduler.admit(BG_FETCH_FRONTEND, now - 6 * ONE_MSEC));
+    cb_assert(stats.bgClassOverdue[BG_FETCH_FRONTEND].load() == 1);
+    cb_assert(stats.bgClassWaiting[BG_FETCH_FRONTEND].load() == 0);
+    cb_assert(stats.bgClassWaiting[BG_FETCH_BACKFILL].load() == 1);
+}
+
+/*
+ * A backlogged class past its own deadline gets in ahead of the others.
+ */
+static void testBacklogDeadline() {
+    EPStats stats;
+    Configuration config;
+    setDeadlines(config, 60000);
+    config.setBgFetchDeadlineStats(500);
+    BgFetchScheduler scheduler(stats, config);
+
+    scheduler.enqueue(BG_FETCH_FRONTEND);
+    scheduler.enqueue(BG_FETCH_STATS);
+    scheduler.enqueue(BG_FETCH_STATS);
+    hrtime_t now = gethrtime();
+    cb_assert(scheduler.admit(BG_FETCH_STATS, now));
+    cb_assert(!scheduler.admit(BG_FETCH_STATS, now));
+    cb_assert(scheduler.admit(BG_FETCH_STATS, now - 501 * ONE_MSEC));
+    cb_assert(stats.bgClassOverdue[BG_FETCH_STATS].load() == 1);
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+
+    testBacklogGetsItsWeight();
+    testFrontendDeadline();
+    testBacklogDeadline();
+    return 0;
+}
@@ -0,0 +1,517 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <platform/dirutils.h>
+
+#include "assert.h"
+#include "bitcask-kvstore/bitcask-vbucket.h"
+#include "configuration.h"
+#include "couch-kvstore/couch-fs-stats.h"
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+static const std::string dbdir("bitcask-test");
+
+static BitcaskDb *openDb(size_t segmentSize) {
+    Configuration config;
+    config.setDbname(dbdir);
+    config.setMaxVbuckets((size_t)4);
+    config.setBitcaskSegmentSize(segmentSize);
+    return BitcaskDb::acquire(config);
+}
+
+static std::string makeKey(const char *prefix, int i) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s%03d", prefix, i);
+    return key;
+}
+
+static void store(BitcaskVBucket &vb, uint64_t &seqno,
+                  const std::vector<std::string> &keys,
+                  const std::string &value, bool deleted = false) {
+    std::vector<BitcaskMutation *> batch;
+    std::vector<std::string>::const_iterator it = keys.begin();
+    for (; it != keys.end(); ++it) {
+        Item itm(*it, 0, 0, value.data(), value.size(), NULL, 0, 0,
+                 ++seqno, vb.getId());
+        batch.push_back(new BitcaskMutation(itm, deleted));
+    }
+    cb_assert(vb.write(batch, true));
+    std::vector<BitcaskMutation *>::iterator bit = batch.begin();
+    for (; bit != batch.end(); ++bit) {
+        delete *bit;
+    }
+}
+
+static void store(BitcaskVBucket &vb, uint64_t &seqno,
+                  const std::string &key, const std::string &value,
+                  bool deleted = false) {
+    store(vb, seqno, std::vector<std::string>(1, key), value, deleted);
+}
+
+static bool get(BitcaskVBucket &vb, const std::string &key,
+                std::string &value) {
+    BitcaskKeyDirEntry entry;
+    BitcaskSegmentPtr segment;
+    if (!vb.lookup(key, entry, segment) || entry.deleted) {
+        return false;
+    }
+    std::string buf;
+    BitcaskRecord rec;
+    cb_assert(vb.read(segment, entry, buf, rec));
+    cb_assert(rec.getKey(buf.data()) == key);
+    Item *itm = rec.toItem(buf.data(), vb.getId(), false);
+    value.assign(itm->getData(), itm->getNBytes());
+    delete itm;
+    return true;
+}
+
+static void checkValue(BitcaskVBucket &vb, const std::string &key,
+                       const std::string &expected) {
+    std::string value;
+    cb_assert(get(vb, key, value));
+    cb_assert(value == expected);
+}
+
+static void checkMissing(BitcaskVBucket &vb, const std::string &key) {
+    std::string value;
+    cb_assert(!get(vb, key, value));
+}
+
+/* the segment files of vbucket 0, by id */
+static std::map<uint32_t, std::string> segmentFiles() {
+    std::map<uint32_t, std::string> files;
+    std::vector<std::string> found =
+        CouchbaseDirectoryUtilities::findFilesContaining(dbdir, ".bitcask.");
+    std::vector<std::string>::iterator it = found.begin();
+    for (; it != found.end(); ++it) {
+        std::string name = it->substr(it->rfind('/') + 1);
+        if (name.compare(0, 10, "0.bitcask.") != 0) {
+            continue;
+        }
+        std::string id = name.substr(10);
+        if (!id.empty() && id.find_first_not_of("0123456789") ==
+            std::string::npos) {
+            files[strtoul(id.c_str(), NULL, 10)] = *it;
+        }
+    }
+    return files;
+}
+
+static std::string readFile(const std::string &path) {
+    std::string data;
+    FILE *fp = fopen(path.c_str(), "rb");
+    cb_assert(fp);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, n);
+    }
+    fclose(fp);
+    return data;
+}
+
+static void writeFile(const std::string &path, const std::string &data,
+                      bool append = false) {
+    FILE *fp = fopen(path.c_str(), append ? "ab" : "wb");
+    cb_assert(fp);
+    cb_assert(fwrite(data.data(), 1, data.size(), fp) == data.size());
+    fclose(fp);
+}
+
+static size_t fileSize(const std::string &path) {
+    struct stat st;
+    cb_assert(stat(path.c_str(), &st) == 0);
+    return st.st_size;
+}
+
+static bool fileExists(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static void initCompaction(compaction_ctx &ctx) {
+    ctx.purge_before_ts = std::numeric_limits<uint64_t>::max();
+    ctx.purge_before_seq = 0;
+    ctx.drop_deletes = 1;
+    ctx.max_purged_seq = 0;
+    ctx.curr_time = 0;
+}
+
+static void testReload() {
+    uint64_t seqno = 0;
+    BitcaskDb *db = openDb(1024 * 1024);
+    BitcaskVBucket &vb = db->getVBucket(0);
+    cb_assert(!vb.exists());
+
+    std::vector<std::string> keys;
+    for (int i = 0; i < 10; ++i) {
+        keys.push_back(makeKey("key", i));
+    }
+    store(vb, seqno, keys, "v1");
+    store(vb, seqno, keys[0], "v2");
+    store(vb, seqno, keys[1], "", true);
+    cb_assert(vb.saveState(vbucket_state(vbucket_state_active, 3, 0, 0)));
+    BitcaskDb::release(db);
+
+    db = openDb(1024 * 1024);
+    BitcaskVBucket &reloaded = db->getVBucket(0);
+    vbucket_state vbstate;
+    cb_assert(reloaded.getState(vbstate));
+    cb_assert(vbstate.state == vbucket_state_active);
+    cb_assert(vbstate.checkpointId == 3);
+    cb_assert(vbstate.highSeqno == 12);
+    cb_assert(vbstate.maxDeletedSeqno == 12);
+    cb_assert(reloaded.getNumItems() == 9);
+    cb_assert(reloaded.getNumDeletes() == 1);
+    checkValue(reloaded, keys[0], "v2");
+    checkMissing(reloaded, keys[1]);
+    for (int i = 2; i < 10; ++i) {
+        checkValue(reloaded, keys[i], "v1");
+    }
+    cb_assert(!db->getVBucket(1).exists());
+    BitcaskDb::release(db);
+}
+
+static void testTornTail() {
+    uint64_t seqno = 0;
+    BitcaskDb *db = openDb(1024 * 1024);
+    BitcaskVBucket &vb = db->getVBucket(0);
+    std::vector<std::string> keys;
+    for (int i = 0; i < 10; ++i) {
+        keys.push_back(makeKey("key", i));
+    }
+    store(vb, seqno, keys, "committed");
+    BitcaskDb::release(db);
+
+    // A whole record that never got its commit record, followed by the
+    // first half of another one.
+    std::map<uint32_t, std::string> files = segmentFiles();
+    cb_assert(files.size() == 1);
+    std::string path = files.begin()->second;
+    size_t committed = fileSize(path);
+    std::string torn;
+    Item first(std::string("torn"), 0, 0, "lost", 4, NULL, 0, 0,
+               seqno + 1, 0);
+    BitcaskRecord::encode(first, false, torn);
+    Item second(keys[0], 0, 0, "lost", 4, NULL, 0, 0, seqno + 2, 0);
+    std::string half;
+    BitcaskRecord::encode(second, false, half);
+    torn.append(half.substr(0, half.size() / 2));
+    writeFile(path, torn, true);
+
+    db = openDb(1024 * 1024);
+    BitcaskVBucket &reloaded = db->getVBucket(0);
+    cb_assert(reloaded.getHighSeqno() == seqno);
+    cb_assert(reloaded.getNumItems() == 10);
+    checkMissing(reloaded, "torn");
+    for (int i = 0; i < 10; ++i) {
+        checkValue(reloaded, keys[i], "committed");
+    }
+    cb_assert(fileSize(path) == committed);
+
+    // Writes carry on behind the truncated tail.
+    store(reloaded, seqno, keys[0], "after");
+    BitcaskDb::release(db);
+
+    db = openDb(1024 * 1024);
+    BitcaskVBucket &again = db->getVBucket(0);
+    checkValue(again, keys[0], "after");
+    checkValue(again, keys[1], "committed");
+    checkMissing(again, "torn");
+    BitcaskDb::release(db);
+}
+
+/* small enough for every batch of fillForMerge() to start a segment */
+static const size_t SMALL_SEGMENT = 100;
+
+static void fillForMerge(BitcaskVBucket &vb, uint64_t &seqno) {
+    store(vb, seqno, "dead", "v1");
+    store(vb, seqno, "live", "v1");
+    store(vb, seqno, "dead", "", true);
+    store(vb, seqno, "live", "v2");
+    store(vb, seqno, "other", "v1");
+}
+
+static void checkMerged(BitcaskVBucket &vb) {
+    checkMissing(vb, "dead");
+    checkValue(vb, "live", "v2");
+    checkValue(vb, "other", "v1");
+    cb_assert(vb.getNumItems() == 2);
+}
+
+static void testMerge() {
+    uint64_t seqno = 0;
+    BitcaskDb *db = openDb(SMALL_SEGMENT);
+    BitcaskVBucket &vb = db->getVBucket(0);
+    cb_assert(vb.saveState(vbucket_state(vbucket_state_active, 0, 0, 0)));
+    fillForMerge(vb, seqno);
+    cb_assert(vb.getNumSegments() == 5);
+
+    IoThrottle throttle(0);
+    compaction_ctx ctx;
+    initCompaction(ctx);
+    cb_assert(vb.merge(&ctx, throttle));
+    checkMerged(vb);
+    cb_assert(vb.getNumDeletes() == 0);
+    cb_assert(vb.getNumSegments() < 5);
+    cb_assert(ctx.max_purged_seq == 3);
+    cb_assert(vb.getHighSeqno() == seqno);
+    BitcaskDb::release(db);
+
+    db = openDb(SMALL_SEGMENT);
+    BitcaskVBucket &reloaded = db->getVBucket(0);
+    checkMerged(reloaded);
+    vbucket_state vbstate;
+    cb_assert(reloaded.getState(vbstate));
+    cb_assert(vbstate.purgeSeqno == 3);
+    cb_assert(reloaded.getHighSeqno() == seqno);
+    store(reloaded, seqno, "other", "v2");
+    BitcaskDb::release(db);
+
+    db = openDb(SMALL_SEGMENT);
+    checkValue(db->getVBucket(0), "other", "v2");
+    BitcaskDb::release(db);
+}
+
+/**
+ * A merge that crashed at any point, from before renaming its segments in
+ * place to after removing some of the old ones, leaves the same data.
+ */
+static void testMergeCrash() {
+    for (size_t removed = 0; removed <= 5; ++removed) {
+        CouchbaseDirectoryUtilities::rmrf(dbdir);
+        uint64_t seqno = 0;
+        BitcaskDb *db = openDb(SMALL_SEGMENT);
+        BitcaskVBucket &vb = db->getVBucket(0);
+        fillForMerge(vb, seqno);
+        std::map<uint32_t, std::string> old = segmentFiles();
+        cb_assert(old.size() == 5);
+        std::map<uint32_t, std::string> contents;
+        std::map<uint32_t, std::string>::iterator it = old.begin();
+        for (; it != old.end(); ++it) {
+            contents[it->first] = readFile(it->second);
+        }
+
+        IoThrottle throttle(0);
+        compaction_ctx ctx;
+        initCompaction(ctx);
+        cb_assert(vb.merge(&ctx, throttle));
+        std::map<uint32_t, std::string> merged = segmentFiles();
+        BitcaskDb::release(db);
+
+        // Bring back the old segments the merge hadn't removed yet, the
+        // oldest ones go first. A merge that never finished leaves its
+        // segments under temporary names.
+        size_t n = 0;
+        for (it = old.begin(); it != old.end(); ++it, ++n) {
+            if (n >= removed) {
+                writeFile(it->second, contents[it->first]);
+            }
+        }
+        std::string leftover = merged.rbegin()->second + "0.merge";
+        writeFile(leftover, "garbage");
+
+        db = openDb(SMALL_SEGMENT);
+        BitcaskVBucket &reloaded = db->getVBucket(0);
+        checkMerged(reloaded);
+        cb_assert(reloaded.getHighSeqno() == seqno);
+        cb_assert(!fileExists(leftover));
+        BitcaskDb::release(db);
+    }
+}
+
+struct merge_args {
+    BitcaskVBucket *vb;
+    IoThrottle *throttle;
+    bool ok;
+};
+
+extern "C" {
+    static void merge_thread(void *arg) {
+        merge_args *args = static_cast<merge_args *>(arg);
+        compaction_ctx ctx;
+        initCompaction(ctx);
+        args->ok = args->vb->merge(&ctx, *args->throttle);
+    }
+}
+
+static void testWriteDuringMerge() {
+    uint64_t seqno = 0;
+    BitcaskDb *db = openDb(64 * 1024);
+    BitcaskVBucket &vb = db->getVBucket(0);
+    std::string value(1024, 'x');
+    std::vector<std::string> keys;
+    for (int i = 0; i < 400; ++i) {
+        keys.push_back(makeKey("key", i));
+    }
+    store(vb, seqno, keys, value);
+    store(vb, seqno, keys[2], "", true);
+
+    // Slow enough for the writes below to land while it runs.
+    IoThrottle throttle(1024 * 1024);
+    merge_args args = { &vb, &throttle, false };
+    cb_thread_t tid;
+    cb_assert(cb_create_thread(&tid, merge_thread, &args, 0) == 0);
+    usleep(100000);
+    store(vb, seqno, keys[0], "new");
+    store(vb, seqno, keys[1], "", true);
+    store(vb, seqno, "added", "new");
+    cb_assert(cb_join_thread(tid) == 0);
+    cb_assert(args.ok);
+
+    checkValue(vb, keys[0], "new");
+    checkMissing(vb, keys[1]);
+    checkMissing(vb, keys[2]);
+    checkValue(vb, keys[3], value);
+    checkValue(vb, "added", "new");
+    cb_assert(vb.getNumItems() == 399);
+    BitcaskDb::release(db);
+
+    db = openDb(64 * 1024);
+    BitcaskVBucket &reloaded = db->getVBucket(0);
+    checkValue(reloaded, keys[0], "new");
+    checkMissing(reloaded, keys[1]);
+    checkMissing(reloaded, keys[2]);
+    checkValue(reloaded, keys[399], value);
+    checkValue(reloaded, "added", "new");
+    cb_assert(reloaded.getNumItems() == 399);
+    cb_assert(reloaded.getHighSeqno() == seqno);
+    BitcaskDb::release(db);
+}
+
+/* what dumpDeleted() and dump() get from the vbucket */
+static void testCollect() {
+    uint64_t seqno = 0;
+    BitcaskDb *db = openDb(1024 * 1024);
+    BitcaskVBucket &vb = db->getVBucket(0);
+    std::vector<std::string> keys;
+    for (int i = 0; i < 10; ++i) {
+        keys.push_back(makeKey("key", i));
+    }
+    store(vb, seqno, keys, "v1");
+    for (int i = 9; i >= 5; --i) {
+        store(vb, seqno, keys[i], "", true);
+    }
+
+    std::vector<BitcaskScanEntry> entries;
+    BitcaskSegmentMap segments;
+    vb.collect(0, std::numeric_limits<uint64_t>::max(), true, false,
+               entries, segments);
+    cb_assert(entries.size() == 5);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        cb_assert(entries[i].key == keys[9 - i]);
+        cb_assert(entries[i].entry.deleted);
+        cb_assert(entries[i].entry.seqno == 11 + i);
+        cb_assert(segments.count(entries[i].entry.segment) == 1);
+    }
+
+    entries.clear();
+    vb.collect(13, 14, true, false, entries, segments);
+    cb_assert(entries.size() == 2);
+    cb_assert(entries[0].key == keys[7]);
+    cb_assert(entries[1].key == keys[6]);
+
+    entries.clear();
+    vb.collect(0, std::numeric_limits<uint64_t>::max(), false, true,
+               entries, segments);
+    cb_assert(entries.size() == 5);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        cb_assert(entries[i].key == keys[i]);
+        cb_assert(!entries[i].entry.deleted);
+    }
+    BitcaskDb::release(db);
+}
+
+/* what getAllKeys() gets from the vbucket */
+static void testGetKeys() {
+    uint64_t seqno = 0;
+    BitcaskDb *db = openDb(1024 * 1024);
+    BitcaskVBucket &vb = db->getVBucket(0);
+    std::vector<std::string> keys;
+    for (int i = 9; i >= 0; --i) {
+        keys.push_back(makeKey("key", i));
+    }
+    store(vb, seqno, keys, "v1");
+    store(vb, seqno, makeKey("key", 3), "", true);
+
+    std::vector<std::string> found;
+    vb.getKeys(makeKey("key", 2), 3, found);
+    cb_assert(found.size() == 3);
+    cb_assert(found[0] == makeKey("key", 2));
+    cb_assert(found[1] == makeKey("key", 4));
+    cb_assert(found[2] == makeKey("key", 5));
+
+    found.clear();
+    vb.getKeys("", 100, found);
+    cb_assert(found.size() == 9);
+    for (size_t i = 1; i < found.size(); ++i) {
+        cb_assert(found[i - 1] < found[i]);
+    }
+    cb_assert(std::find(found.begin(), found.end(), makeKey("key", 3)) ==
+              found.end());
+
+    found.clear();
+    vb.getKeys("z", 100, found);
+    cb_assert(found.empty());
+    BitcaskDb::release(db);
+}
+
+typedef void (*test_func)();
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+
+    test_func tests[] = {
+        testReload,
+        testTornTail,
+        testMerge,
+        testMergeCrash,
+        testWriteDuringMerge,
+        testCollect,
+        testGetKeys
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        CouchbaseDirectoryUtilities::rmrf(dbdir);
+        tests[i]();
+    }
+    CouchbaseDirectoryUtilities::rmrf(dbdir);
+    return 0;
+}
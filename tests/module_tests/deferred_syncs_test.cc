@@ -0,0 +1,93 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <platform/dirutils.h>
+
+#include "couch-kvstore/couch-fs-stats.h"
+#undef NDEBUG
+
+static const std::string dbdir("deferred-syncs-test");
+
+static void writeFile(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "w");
+    cb_assert(fp);
+    cb_assert(fputs("somevalue", fp) >= 0);
+    cb_assert(fclose(fp) == 0);
+}
+
+// A file that fails to sync is reported every time until it syncs, and
+// the others aren't synced again.
+static void testFailedSyncReported(CouchIoRing &ring) {
+    CouchstoreStats stats;
+    DeferredSyncs syncs(ring);
+    std::string good = dbdir + "/0.couch.1";
+    std::string bad = dbdir + "/1.couch.1";
+    writeFile(good);
+    // Opening a symlink to itself fails with ELOOP
+    cb_assert(symlink("1.couch.1", bad.c_str()) == 0);
+
+    syncs.add(good);
+    syncs.add(bad);
+    // Compacted away since the write, nothing to sync
+    syncs.add(dbdir + "/2.couch.1");
+
+    size_t synced = 0;
+    std::vector<std::string> failed;
+    cb_assert(!syncs.syncAll(stats, synced, failed));
+    cb_assert(synced == 1);
+    cb_assert(failed.size() == 1 && failed[0] == bad);
+
+    cb_assert(!syncs.syncAll(stats, synced, failed));
+    cb_assert(synced == 0);
+    cb_assert(failed.size() == 1 && failed[0] == bad);
+
+    cb_assert(unlink(bad.c_str()) == 0);
+    writeFile(bad);
+    cb_assert(syncs.syncAll(stats, synced, failed));
+    cb_assert(synced == 1);
+    cb_assert(failed.empty());
+
+    cb_assert(syncs.syncAll(stats, synced, failed));
+    cb_assert(synced == 0);
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+
+    // Synchronous fsyncs, and through an io_uring where there is one
+    size_t depths[] = { 0, 8 };
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+        CouchbaseDirectoryUtilities::rmrf(dbdir);
+        cb_assert(mkdir(dbdir.c_str(), 0777) == 0);
+        CouchIoRing ring(depths[i]);
+        testFailedSyncReported(ring);
+    }
+    CouchbaseDirectoryUtilities::rmrf(dbdir);
+    return 0;
+}
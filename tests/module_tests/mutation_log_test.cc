@@ -20,6 +20,7 @@
 #include <signal.h>
 
 #include <algorithm>
+#include <iostream>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -113,10 +114,11 @@ static void testSyncSet() {
     cb_assert(ml.getFlushConfig() == FLUSH_COMMIT_1);
 }
 
-static void loaderFun(void *arg, uint16_t vb,
+static bool loaderFun(void *arg, uint16_t vb,
                       const std::string &k, uint64_t rowid) {
     std::map<std::string, uint64_t> *maps = reinterpret_cast<std::map<std::string, uint64_t> *>(arg);
     maps[vb][k] = rowid;
+    return true;
 }
 
 static void testLogging() {
@@ -470,6 +472,142 @@ static void testLoggingShortRead() {
     remove(TMP_LOG_FILE);
 }
 
+#define NUM_VBUCKETS 8
+
+static void writeLargeLog(size_t numItems) {
+    remove(TMP_LOG_FILE);
+    MutationLog ml(TMP_LOG_FILE);
+    ml.open();
+    for (size_t i = 0; i < numItems; ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "key-%lu", static_cast<unsigned long>(i));
+        uint16_t vb = i % NUM_VBUCKETS;
+        ml.newItem(vb, key, i);
+        if (i % 7 == 0) {
+            ml.delItem(vb, key);
+        }
+        if (i % 1000 == 999) {
+            ml.commit1();
+            ml.commit2();
+        }
+        if (i == numItems / 2) {
+            ml.deleteAll(5);
+        }
+    }
+    // A few left uncommitted
+    ml.newItem(2, "leftover", 1);
+    ml.delItem(3, "key-3");
+    ml.flush();
+}
+
+struct LoadResult {
+    bool clean;
+    std::vector<size_t> itemsSeen;
+    std::map<std::string, uint64_t> maps[NUM_VBUCKETS];
+    std::vector<mutation_log_uncommitted_t> leftovers;
+};
+
+static void loadLargeLog(size_t threads, LoadResult &rv) {
+    MutationLog ml(TMP_LOG_FILE);
+    ml.open();
+    MutationLogHarvester h(ml);
+    for (uint16_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        h.setVBucket(vb);
+    }
+    rv.clean = h.load(threads);
+    rv.itemsSeen.assign(h.getItemsSeen(),
+                        h.getItemsSeen() + MUTATION_LOG_TYPES);
+    h.apply(&rv.maps, loaderFun);
+    h.getUncommitted(rv.leftovers);
+    std::sort(rv.leftovers.begin(), rv.leftovers.end(), leftover_compare);
+}
+
+static void testParallelLoad() {
+    writeLargeLog(20000);
+
+    LoadResult sequential;
+    loadLargeLog(1, sequential);
+    LoadResult parallel;
+    loadLargeLog(4, parallel);
+
+    cb_assert(!sequential.clean);
+    cb_assert(parallel.clean == sequential.clean);
+    cb_assert(parallel.itemsSeen == sequential.itemsSeen);
+    cb_assert(sequential.maps[1].size() > 0);
+    cb_assert(sequential.maps[5].size() > 0);
+    for (int vb = 0; vb < NUM_VBUCKETS; ++vb) {
+        cb_assert(parallel.maps[vb] == sequential.maps[vb]);
+    }
+    cb_assert(sequential.leftovers.size() == 2);
+    cb_assert(parallel.leftovers.size() == sequential.leftovers.size());
+    for (size_t i = 0; i < sequential.leftovers.size(); ++i) {
+        cb_assert(parallel.leftovers[i].vbucket ==
+                  sequential.leftovers[i].vbucket);
+        cb_assert(parallel.leftovers[i].key == sequential.leftovers[i].key);
+        cb_assert(parallel.leftovers[i].type == sequential.leftovers[i].type);
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
+static void testParallelLoadBadCRC() {
+    writeLargeLog(20000);
+
+    // Break a block in the middle of the log
+    int file = open(TMP_LOG_FILE, O_RDWR, 0666);
+    cb_assert(lseek(file, 4096 * 50 + 100, SEEK_SET) == 4096 * 50 + 100);
+    uint8_t b;
+    cb_assert(read(file, &b, sizeof(b)) == 1);
+    cb_assert(lseek(file, 4096 * 50 + 100, SEEK_SET) == 4096 * 50 + 100);
+    b = ~b;
+    cb_assert(write(file, &b, sizeof(b)) == 1);
+    close(file);
+
+    std::vector<size_t> seen[2];
+    size_t threads[2] = { 1, 4 };
+    for (int i = 0; i < 2; ++i) {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        MutationLogHarvester h(ml);
+        h.setVBucket(1);
+        try {
+            h.load(threads[i]);
+            abort();
+        } catch(MutationLog::CRCReadException &e) {
+            // expected
+        }
+        seen[i].assign(h.getItemsSeen(),
+                       h.getItemsSeen() + MUTATION_LOG_TYPES);
+    }
+    // Both stopped at the broken block
+    cb_assert(seen[0][ML_NEW] > 0);
+    cb_assert(seen[1] == seen[0]);
+
+    remove(TMP_LOG_FILE);
+}
+
+static void benchmarkParallelLoad() {
+    const size_t numItems = 500000;
+    writeLargeLog(numItems);
+
+    size_t threads[3] = { 1, 2, 4 };
+    for (int i = 0; i < 3; ++i) {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        MutationLogHarvester h(ml);
+        for (uint16_t vb = 0; vb < NUM_VBUCKETS; ++vb) {
+            h.setVBucket(vb);
+        }
+        hrtime_t start = gethrtime();
+        h.load(threads[i]);
+        std::cout << "Loaded a log of " << numItems << " items with "
+                  << threads[i] << " thread(s) in "
+                  << hrtime2text(gethrtime() - start) << std::endl;
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
 static void testYUNOOPEN() {
     int file = open(TMP_LOG_FILE, O_CREAT|O_RDWR, 0);
     cb_assert(file >= 0);
@@ -527,6 +665,9 @@ int main(int, char **) {
     testLoggingDirty();
     testLoggingBadCRC();
     testLoggingShortRead();
+    testParallelLoad();
+    testParallelLoadBadCRC();
+    benchmarkParallelLoad();
     testYUNOOPEN();
 
     remove(TMP_LOG_FILE);
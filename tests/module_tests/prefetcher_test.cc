@@ -0,0 +1,124 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+#include "prefetcher.h"
+#undef NDEBUG
+
+static int cookie1, cookie2;
+
+static void testPairsNeedToRepeat() {
+    CoAccessTracker tracker(100, 1);
+    std::vector<vb_key_t> peers;
+
+    tracker.accessed(&cookie1, 0, "a");
+    tracker.accessed(&cookie1, 0, "b");
+    tracker.getPeers(0, "a", 4, peers);
+    cb_assert(peers.empty());
+
+    tracker.accessed(&cookie1, 0, "a");
+    tracker.getPeers(0, "a", 4, peers);
+    cb_assert(peers.size() == 1);
+    cb_assert(peers[0] == vb_key_t(0, "b"));
+
+    peers.clear();
+    tracker.getPeers(0, "b", 4, peers);
+    cb_assert(peers.size() == 1);
+    cb_assert(peers[0] == vb_key_t(0, "a"));
+}
+
+static void testConnectionsDontMix() {
+    CoAccessTracker tracker(100, 1);
+    std::vector<vb_key_t> peers;
+
+    for (int i = 0; i < 4; ++i) {
+        tracker.accessed(&cookie1, 0, "a");
+        tracker.accessed(&cookie2, 1, "x");
+    }
+    tracker.getPeers(0, "a", 4, peers);
+    cb_assert(peers.empty());
+}
+
+static void testMostFrequentFirst() {
+    CoAccessTracker tracker(100, 1);
+    std::vector<vb_key_t> peers;
+
+    for (int i = 0; i < 3; ++i) {
+        tracker.accessed(&cookie1, 0, "a");
+        tracker.accessed(&cookie1, 0, "b");
+        tracker.accessed(&cookie2, 0, "a");
+        tracker.accessed(&cookie2, 2, "c");
+        tracker.accessed(&cookie2, 2, "c");
+    }
+    tracker.accessed(&cookie1, 2, "c");
+    tracker.accessed(&cookie1, 0, "a");
+
+    tracker.getPeers(0, "a", 1, peers);
+    cb_assert(peers.size() == 1);
+    cb_assert(peers[0] == vb_key_t(2, "c"));
+}
+
+static void testBoundedKeys() {
+    CoAccessTracker tracker(10, 1);
+    for (int i = 0; i < 100; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", i);
+        tracker.accessed(&cookie1, 0, key);
+    }
+    cb_assert(tracker.getNumKeys() <= 10);
+}
+
+static void testLeastRecentlyUsedDropped() {
+    // Room for two keys of vbucket 0
+    CoAccessTracker tracker(2 * CoAccessTracker::NUM_PARTITIONS, 1);
+    std::vector<vb_key_t> peers;
+
+    for (int i = 0; i < 2; ++i) {
+        tracker.accessed(&cookie1, 0, "a");
+        tracker.accessed(&cookie1, 0, "b");
+    }
+
+    // "a" is read again with "c", which pushes out "b" and not the older
+    // but more recently used "a"
+    tracker.accessed(&cookie2, 0, "a");
+    tracker.accessed(&cookie2, 0, "c");
+    cb_assert(tracker.getNumKeys() == 2);
+
+    tracker.getPeers(0, "a", 4, peers);
+    cb_assert(peers.size() == 1);
+    cb_assert(peers[0] == vb_key_t(0, "b"));
+
+    peers.clear();
+    tracker.getPeers(0, "b", 4, peers);
+    cb_assert(peers.empty());
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    testPairsNeedToRepeat();
+    testConnectionsDontMix();
+    testMostFrequentFirst();
+    testBoundedKeys();
+    testLeastRecentlyUsedDropped();
+
+    return 0;
+}
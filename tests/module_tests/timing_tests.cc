@@ -162,6 +162,50 @@ static size_t env_int(const char *k, size_t rv) {
     return rv;
 }
 
+extern "C" {
+    static bool add_response(const void *key, uint16_t keylen,
+                             const void *ext, uint8_t extlen,
+                             const void *body, uint32_t bodylen,
+                             uint8_t datatype, uint16_t status,
+                             uint64_t cas, const void *cookie) {
+        (void)key; (void)keylen; (void)ext; (void)extlen;
+        (void)body; (void)bodylen; (void)datatype; (void)cas; (void)cookie;
+        last_status = static_cast<protocol_binary_response_status>(status);
+        return true;
+    }
+}
+
+static protocol_binary_response_status sendPacket(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1,
+                                                  uint8_t opcode, uint16_t vb,
+                                                  const char *ext,
+                                                  uint8_t extlen,
+                                                  const char *key) {
+    size_t keylen = key ? strlen(key) : 0;
+    size_t headerlen = sizeof(protocol_binary_request_header);
+    char *raw = static_cast<char *>(calloc(1, headerlen + extlen + keylen));
+    cb_assert(raw);
+    protocol_binary_request_header *req =
+        reinterpret_cast<protocol_binary_request_header *>(raw);
+    req->request.magic = PROTOCOL_BINARY_REQ;
+    req->request.opcode = opcode;
+    req->request.keylen = htons(static_cast<uint16_t>(keylen));
+    req->request.extlen = extlen;
+    req->request.vbucket = htons(vb);
+    req->request.bodylen = htonl(static_cast<uint32_t>(extlen + keylen));
+    if (extlen > 0) {
+        memcpy(raw + headerlen, ext, extlen);
+    }
+    if (keylen > 0) {
+        memcpy(raw + headerlen + extlen, key, keylen);
+    }
+
+    check(h1->unknown_command(h, NULL, req, add_response) == ENGINE_SUCCESS,
+          "Failed to send a packet.");
+    free(raw);
+    return last_status;
+}
+
 extern "C" {
 static test_result test_persistence(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     size_t total = env_int("TEST_TOTAL_KEYS", 100000);
@@ -197,6 +241,215 @@ static test_result test_persistence(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 }
 }
 
+/**
+ * Overwrite the same keys for several passes and delete every Nth of them
+ * on the last pass, the write-heavy profile the backends are compared on.
+ * Registered once per backend.
+ */
+extern "C" {
+static test_result test_write_heavy(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    size_t total = env_int("TEST_TOTAL_KEYS", 100000);
+    size_t size = env_int("TEST_VAL_SIZE", 256);
+    size_t passes = env_int("TEST_WRITE_PASSES", 5);
+    size_t delEvery = env_int("TEST_DELETE_EVERY", 10);
+    cb_assert(passes > 0 && delEvery > 0);
+
+    char key[24];
+    char *data;
+    data = static_cast<char *>(malloc(sizeof(char) * size));
+    cb_assert(data);
+
+    hrtime_t start = gethrtime();
+    size_t ops = 0;
+    for (size_t p = 0; p < passes; ++p) {
+        for (size_t i = 0; i < (sizeof(char) * size); ++i) {
+            data[i] = 0xff & rand();
+        }
+
+        for (size_t i = 0; i < total; ++i) {
+            item *it = NULL;
+            snprintf(key, sizeof(key), "k%d", static_cast<int>(i));
+
+            check(storeCasVb11(h, h1, NULL, OPERATION_SET, key, data,
+                               size, 9713, &it, 0, 0) == ENGINE_SUCCESS,
+                  "store failure");
+            h1->release(h, NULL, it);
+            ++ops;
+
+            if (p == passes - 1 && i % delEvery == 0) {
+                uint64_t cas = 0;
+                check(h1->remove(h, NULL, key, strlen(key), &cas, 0) ==
+                      ENGINE_SUCCESS, "delete failure");
+                ++ops;
+            }
+        }
+    }
+    free(data);
+    wait_for_flusher_to_settle(h, h1);
+    hrtime_t elapsed = (gethrtime() - start) / 1000000;
+
+    std::cout << get_int_stat(h, h1, "ep_total_persisted") << " persisted "
+              << "of " << ops << " ops at " << size << " in " << elapsed
+              << "ms (" << (elapsed ? (ops * 1000 / elapsed) : ops)
+              << " ops/s) - "
+              << get_int_stat(h, h1, "ep_flush_duration_total")
+              << ", " << get_int_stat(h, h1, "ep_commit_time_total")
+              << std::endl;
+
+    /* every key of the key space has been written or deleted by this
+     * run, so the count does not depend on what the db held before */
+    verify_curr_items(h, h1, total - (total + delEvery - 1) / delEvery,
+                      "overwriting and deleting");
+
+    return SUCCESS;
+}
+}
+
+/**
+ * Write a set of keys spread over several vbuckets as fast as they are
+ * taken, then time how long the disk write queue takes to drain. Registered
+ * with and without the pipelined flusher to compare the two.
+ */
+extern "C" {
+static test_result test_drain(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    size_t total = env_int("TEST_TOTAL_KEYS", 100000);
+    size_t size = env_int("TEST_VAL_SIZE", 256);
+    size_t numVbs = env_int("TEST_VBUCKETS", 16);
+    cb_assert(numVbs > 0);
+
+    for (size_t vb = 1; vb < numVbs; ++vb) {
+        uint32_t state = htonl(vbucket_state_active);
+        check(sendPacket(h, h1, PROTOCOL_BINARY_CMD_SET_VBUCKET,
+                         static_cast<uint16_t>(vb),
+                         reinterpret_cast<const char *>(&state),
+                         sizeof(state), NULL) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS, "Failed to set vbucket state");
+    }
+
+    char key[24];
+    char *data;
+    data = static_cast<char *>(malloc(sizeof(char) * size));
+    cb_assert(data);
+    for (size_t i = 0; i < (sizeof(char) * size); ++i) {
+        data[i] = 0xff & rand();
+    }
+
+    int persisted = get_int_stat(h, h1, "ep_total_persisted");
+    hrtime_t start = gethrtime();
+    for (size_t i = 0; i < total; ++i) {
+        item *it = NULL;
+        snprintf(key, sizeof(key), "k%d", static_cast<int>(i));
+        check(storeCasVb11(h, h1, NULL, OPERATION_SET, key, data, size,
+                           9713, &it, 0, static_cast<uint16_t>(i % numVbs)) ==
+              ENGINE_SUCCESS, "store failure");
+        h1->release(h, NULL, it);
+    }
+    free(data);
+    hrtime_t written = gethrtime();
+    wait_for_flusher_to_settle(h, h1);
+    hrtime_t end = gethrtime();
+
+    size_t flushed = get_int_stat(h, h1, "ep_total_persisted") - persisted;
+    hrtime_t elapsed = (end - start) / 1000000;
+    std::cout << flushed << " items persisted at " << size << " in "
+              << elapsed << "ms ("
+              << (elapsed ? (flushed * 1000 / elapsed) : flushed)
+              << " items/s), queue drained " << (end - written) / 1000000
+              << "ms after the last write - "
+              << get_int_stat(h, h1, "ep_flusher_batches_staged")
+              << " batches staged" << std::endl;
+
+    return SUCCESS;
+}
+}
+
+/**
+ * Evict a set of keys spread over several vbuckets and read them back in
+ * random order without waiting on each get, so that the bg fetchers of the
+ * shard have as many reads to do at once as there are keys. Registered once
+ * per bg_fetch_queue_depth to compare how the reads scale with the number
+ * of fetchers.
+ */
+extern "C" {
+static test_result test_random_reads(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    size_t total = env_int("TEST_TOTAL_KEYS", 100000);
+    size_t size = env_int("TEST_VAL_SIZE", 256);
+    size_t numVbs = env_int("TEST_VBUCKETS", 16);
+    cb_assert(numVbs > 0);
+
+    for (size_t vb = 1; vb < numVbs; ++vb) {
+        uint32_t state = htonl(vbucket_state_active);
+        check(sendPacket(h, h1, PROTOCOL_BINARY_CMD_SET_VBUCKET,
+                         static_cast<uint16_t>(vb),
+                         reinterpret_cast<const char *>(&state),
+                         sizeof(state), NULL) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS, "Failed to set vbucket state");
+    }
+
+    char key[24];
+    char *data;
+    data = static_cast<char *>(malloc(sizeof(char) * size));
+    cb_assert(data);
+    for (size_t i = 0; i < (sizeof(char) * size); ++i) {
+        data[i] = 0xff & rand();
+    }
+
+    for (size_t i = 0; i < total; ++i) {
+        item *it = NULL;
+        snprintf(key, sizeof(key), "k%d", static_cast<int>(i));
+        check(storeCasVb11(h, h1, NULL, OPERATION_SET, key, data, size,
+                           9713, &it, 0, static_cast<uint16_t>(i % numVbs)) ==
+              ENGINE_SUCCESS, "store failure");
+        h1->release(h, NULL, it);
+    }
+    free(data);
+    wait_for_flusher_to_settle(h, h1);
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < total; ++i) {
+        snprintf(key, sizeof(key), "k%d", static_cast<int>(i));
+        check(sendPacket(h, h1, PROTOCOL_BINARY_CMD_EVICT_KEY,
+                         static_cast<uint16_t>(i % numVbs), NULL, 0, key) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS, "Failed to evict a key");
+        order.push_back(i);
+    }
+    std::random_shuffle(order.begin(), order.end());
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.set_ewouldblock_handling(cookie, false);
+    int fetched = get_int_stat(h, h1, "ep_bg_fetched");
+
+    hrtime_t start = gethrtime();
+    std::vector<size_t>::iterator it;
+    for (it = order.begin(); it != order.end(); ++it) {
+        item *itm = NULL;
+        snprintf(key, sizeof(key), "k%d", static_cast<int>(*it));
+        ENGINE_ERROR_CODE rv = h1->get(h, cookie, &itm, key, strlen(key),
+                                       static_cast<uint16_t>(*it % numVbs));
+        check(rv == ENGINE_EWOULDBLOCK || rv == ENGINE_SUCCESS,
+              "get failure");
+        if (rv == ENGINE_SUCCESS) {
+            h1->release(h, NULL, itm);
+        }
+    }
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_bg_fetched") <
+           fetched + static_cast<int>(total)) {
+        decayingSleep(&sleepTime);
+    }
+    hrtime_t elapsed = (gethrtime() - start) / 1000000;
+    testHarness.destroy_cookie(cookie);
+
+    std::cout << total << " random reads at " << size << " in " << elapsed
+              << "ms (" << (elapsed ? (total * 1000 / elapsed) : total)
+              << " ops/s) - "
+              << get_int_stat(h, h1, "ep_bg_load_avg") << "us avg load"
+              << std::endl;
+
+    return SUCCESS;
+}
+}
+
 extern "C" MEMCACHED_PUBLIC_API
 bool setup_suite(struct test_harness *th) {
     testHarness = *th;
@@ -209,6 +462,22 @@ engine_test_t* get_tests(void) {
     static engine_test_t tests[]  = {
         {"test persistence", test_persistence, NULL, teardown, NULL,
          NULL, NULL},
+        {"test write heavy couchstore", test_write_heavy, NULL, teardown,
+         "backend=couchdb;dbname=/tmp/test", NULL, NULL},
+        {"test write heavy bitcask", test_write_heavy, NULL, teardown,
+         "backend=bitcask;dbname=/tmp/test_bitcask", NULL, NULL},
+        {"test drain", test_drain, NULL, teardown,
+         "flusher_pipeline_enabled=false", NULL, NULL},
+        {"test drain, pipelined flusher", test_drain, NULL, teardown,
+         "flusher_pipeline_enabled=true", NULL, NULL},
+        {"test random reads, 1 bg fetcher", test_random_reads, NULL,
+         teardown, "max_num_shards=1;bg_fetch_queue_depth=1", NULL, NULL},
+        {"test random reads, 2 bg fetchers", test_random_reads, NULL,
+         teardown, "max_num_shards=1;bg_fetch_queue_depth=2", NULL, NULL},
+        {"test random reads, 4 bg fetchers", test_random_reads, NULL,
+         teardown, "max_num_shards=1;bg_fetch_queue_depth=4", NULL, NULL},
+        {"test random reads, 8 bg fetchers", test_random_reads, NULL,
+         teardown, "max_num_shards=1;bg_fetch_queue_depth=8", NULL, NULL},
         {NULL, NULL, NULL, NULL, NULL, NULL, NULL}
     };
     return tests;